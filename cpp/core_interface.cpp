@@ -1,57 +1,121 @@
 #include "core_interface.h"
-#include <QTimer>
 #include <QDebug>
 
 // FlashOperation implementation
 FlashOperation::FlashOperation(const QString& imagePath, const QString& devicePath, QObject* parent)
-    : QObject(parent), m_operation(nullptr), m_wasRunning(false)
+    : QObject(parent), m_operation(nullptr), m_snapshot{}, m_lastSequence(~0ULL), m_wasRunning(false)
 {
     QByteArray imagePathBytes = imagePath.toUtf8();
     QByteArray devicePathBytes = devicePath.toUtf8();
     
     m_operation = flux_start_flash(imagePathBytes.constData(), devicePathBytes.constData());
+    startEvents();
+}
+
+FlashOperation::FlashOperation(const QString& imagePath, const QString& devicePath, const CFlashOptions& options, QObject* parent)
+    : QObject(parent), m_operation(nullptr), m_snapshot{}, m_lastSequence(~0ULL), m_wasRunning(false)
+{
+    QByteArray imagePathBytes = imagePath.toUtf8();
+    QByteArray devicePathBytes = devicePath.toUtf8();
+    
+    m_operation = flux_start_flash_with_options(imagePathBytes.constData(), devicePathBytes.constData(), &options);
+    startEvents();
+}
+
+FlashOperation::FlashOperation(const QString& imagePath, const QString& devicePath, const CFlashOptions& options, bool resume, QObject* parent)
+    : QObject(parent), m_operation(nullptr), m_snapshot{}, m_lastSequence(~0ULL), m_wasRunning(false)
+{
+    QByteArray imagePathBytes = imagePath.toUtf8();
+    QByteArray devicePathBytes = devicePath.toUtf8();
     
+    if (resume) {
+        m_operation = flux_resume_flash(imagePathBytes.constData(), devicePathBytes.constData(), &options);
+    } else {
+        m_operation = flux_start_flash_with_options(imagePathBytes.constData(), devicePathBytes.constData(), &options);
+    }
+    startEvents();
+}
+
+void FlashOperation::startEvents() {
     if (m_operation) {
         m_wasRunning = true;
-        m_timer = new QTimer(this);
-        connect(m_timer, &QTimer::timeout, this, &FlashOperation::checkStatus);
-        m_timer->start(100); // Check every 100ms
+        flux_get_snapshot(m_operation, &m_snapshot);
+        m_status = QString::fromUtf8(m_snapshot.status);
+        flux_set_progress_callback(m_operation, &FlashOperation::onCoreEvent, this);
     }
 }
 
+void FlashOperation::onCoreEvent(float, void* userData) {
+    QMetaObject::invokeMethod(static_cast<FlashOperation*>(userData), &FlashOperation::checkStatus, Qt::QueuedConnection);
+}
+
 FlashOperation::~FlashOperation() {
     if (m_operation) {
+        // Also clears the callback, so no event arrives for a deleted object
         flux_free_operation(m_operation);
     }
 }
 
 float FlashOperation::getProgress() const {
-    if (!m_operation) return 0.0f;
-    return flux_get_progress(m_operation);
+    return m_snapshot.progress;
 }
 
 float FlashOperation::getVerifyProgress() const {
-    if (!m_operation) return 0.0f;
-    return flux_get_verify_progress(m_operation);
+    return m_snapshot.verify_progress;
 }
 
 QString FlashOperation::getStatus() const {
-    if (!m_operation) return QString();
-    char* status = flux_get_status(m_operation);
-    if (!status) return QString();
-    QString result = QString::fromUtf8(status);
-    flux_free_string(status);
-    return result;
+    return m_status;
 }
 
 quint64 FlashOperation::getBytesWritten() const {
-    if (!m_operation) return 0;
-    return flux_get_bytes_written(m_operation);
+    return m_snapshot.bytes_written;
+}
+
+quint64 FlashOperation::getBytesSkipped() const {
+    return m_snapshot.bytes_skipped;
+}
+
+quint64 FlashOperation::getBytesDurable() const {
+    return m_snapshot.bytes_durable;
+}
+
+quint64 FlashOperation::getVerifySpeed() const {
+    return m_snapshot.verify_speed;
+}
+
+float FlashOperation::getVerifyConfidence() const {
+    if (!m_operation) return 1.0f;
+    return flux_get_verify_confidence(m_operation);
+}
+
+quint64 FlashOperation::getBytesDownloaded() const {
+    return m_snapshot.bytes_downloaded;
+}
+
+// Both range lists are read the same way: count, then fill
+static QVector<CByteRange> readRanges(const CFlashOperation* operation,
+                                      uintptr_t (*get)(const CFlashOperation*, CByteRange*, uintptr_t)) {
+    QVector<CByteRange> ranges;
+    if (!operation) return ranges;
+    ranges.resize(get(operation, nullptr, 0));
+    if (!ranges.isEmpty()) {
+        size_t count = get(operation, ranges.data(), ranges.size());
+        ranges.resize(qMin<size_t>(count, ranges.size()));
+    }
+    return ranges;
+}
+
+QVector<CByteRange> FlashOperation::getRepaired() const {
+    return readRanges(m_operation, flux_get_repaired);
+}
+
+QVector<CByteRange> FlashOperation::getMismatches() const {
+    return readRanges(m_operation, flux_get_mismatches);
 }
 
 bool FlashOperation::isRunning() const {
-    if (!m_operation) return false;
-    return flux_is_running(m_operation);
+    return m_snapshot.is_running;
 }
 
 QString FlashOperation::getError() const {
@@ -64,28 +128,76 @@ QString FlashOperation::getError() const {
 }
 
 bool FlashOperation::hasError() const {
-    return !getError().isEmpty();
+    return m_snapshot.has_error;
+}
+
+void FlashOperation::cancel() {
+    if (m_operation) flux_cancel(m_operation);
+}
+
+void FlashOperation::pause() {
+    if (m_operation) flux_pause(m_operation);
+}
+
+void FlashOperation::resume() {
+    if (m_operation) flux_resume(m_operation);
+}
+
+bool FlashOperation::isPaused() const {
+    return m_snapshot.is_paused;
+}
+
+void FlashOperation::setRateLimit(quint64 bytesPerSec) {
+    if (m_operation) flux_set_rate_limit(m_operation, bytesPerSec);
+}
+
+bool FlashOperation::getIoProfile(CDeviceProfile& profile) const {
+    if (!m_operation) return false;
+    return flux_get_io_profile(m_operation, &profile);
+}
+
+bool FlashOperation::getMetrics(CFlashMetrics& metrics) const {
+    if (!m_operation) return false;
+    return flux_get_metrics(m_operation, &metrics);
+}
+
+QVector<quint64> FlashOperation::getThroughput() const {
+    QVector<quint64> seconds;
+    if (!m_operation) return seconds;
+    seconds.resize(flux_get_throughput(m_operation, nullptr, 0));
+    if (!seconds.isEmpty()) {
+        size_t count = flux_get_throughput(m_operation, reinterpret_cast<uint64_t*>(seconds.data()), seconds.size());
+        seconds.resize(qMin<size_t>(count, seconds.size()));
+    }
+    return seconds;
 }
 
 void FlashOperation::checkStatus() {
-    if (!m_operation) return;
+    bool wasPaused = m_snapshot.is_paused;
+    if (!m_operation || !flux_get_snapshot(m_operation, &m_snapshot)) return;
     
-    emit progressChanged(getProgress());
-    emit statusChanged(getStatus());
+    // Several queued wakeups can find the same snapshot
+    if (m_snapshot.sequence == m_lastSequence) return;
+    m_lastSequence = m_snapshot.sequence;
     
-    bool running = isRunning();
+    emit progressChanged(m_snapshot.progress);
+    QString status = QString::fromUtf8(m_snapshot.status);
+    if (status != m_status) {
+        m_status = status;
+        emit statusChanged(m_status);
+    }
+    if (m_snapshot.is_paused != wasPaused) {
+        emit pausedChanged(m_snapshot.is_paused);
+    }
     
-    if (m_wasRunning && !running) {
-        m_timer->stop();
-        
-        if (hasError()) {
+    if (m_wasRunning && !m_snapshot.is_running) {
+        m_wasRunning = false;
+        if (m_snapshot.has_error) {
             emit error(getError());
         } else {
             emit completed();
         }
     }
-    
-    m_wasRunning = running;
 }
 
 // CoreInterface implementation
@@ -143,10 +255,92 @@ QVector<UsbDeviceInfo> CoreInterface::listDevices() {
     return devices;
 }
 
+QVector<CachedImageInfo> CoreInterface::listCachedImages() {
+    QVector<CachedImageInfo> images;
+    
+    CCachedImageList* list = flux_list_cached_images();
+    if (!list) return images;
+    
+    for (size_t i = 0; i < list->count; ++i) {
+        CCachedImage& cimage = list->images[i];
+        
+        CachedImageInfo image;
+        image.sourcePath = QString::fromUtf8(cimage.source_path);
+        image.storedPath = QString::fromUtf8(cimage.stored_path);
+        image.name = QString::fromUtf8(cimage.name);
+        image.imageSize = cimage.image_size;
+        image.lastUsed = cimage.last_used;
+        images.append(image);
+    }
+    
+    flux_free_cached_images(list);
+    return images;
+}
+
 FlashOperation* CoreInterface::startFlash(const QString& imagePath, const QString& devicePath) {
     return new FlashOperation(imagePath, devicePath);
 }
 
+FlashOperation* CoreInterface::startFlash(const QString& imagePath, const QString& devicePath, const CFlashOptions& options) {
+    return new FlashOperation(imagePath, devicePath, options);
+}
+
+FlashOperation* CoreInterface::resumeFlash(const QString& imagePath, const QString& devicePath, const CFlashOptions& options) {
+    return new FlashOperation(imagePath, devicePath, options, true);
+}
+
+CFlashOptions CoreInterface::defaultOptions() {
+    CFlashOptions options;
+    flux_default_options(&options);
+    return options;
+}
+
+quint64 CoreInterface::resumeOffset(const QString& imagePath, const QString& devicePath) {
+    QByteArray image = imagePath.toUtf8();
+    QByteArray device = devicePath.toUtf8();
+    return flux_get_resume_offset(image.constData(), device.constData());
+}
+
+quint64 CoreInterface::imageSize(const QString& imagePath) {
+    QByteArray path = imagePath.toUtf8();
+    return flux_get_image_size(path.constData());
+}
+
+QString CoreInterface::findBmap(const QString& imagePath) {
+    QByteArray path = imagePath.toUtf8();
+    char* bmap = flux_find_bmap(path.constData());
+    if (!bmap) return QString();
+    QString result = QString::fromUtf8(bmap);
+    flux_free_string(bmap);
+    return result;
+}
+
+quint64 CoreInterface::bmapMappedSize(const QString& bmapPath) {
+    QByteArray path = bmapPath.toUtf8();
+    return flux_get_bmap_mapped_size(path.constData());
+}
+
+QString CoreInterface::expectedHash(const QString& imagePath) {
+    QByteArray path = imagePath.toUtf8();
+    char* description = flux_describe_expected_hash(path.constData());
+    if (!description) return QString();
+    QString result = QString::fromUtf8(description);
+    flux_free_string(description);
+    return result;
+}
+
+QString CoreInterface::hashName(uint32_t algorithm) {
+    char* name = flux_hash_name(algorithm);
+    if (!name) return QString();
+    QString result = QString::fromUtf8(name);
+    flux_free_string(name);
+    return result;
+}
+
+quint64 CoreInterface::benchmarkHash(uint32_t algorithm, quint64 bytes) {
+    return flux_benchmark_hash(algorithm, bytes);
+}
+
 QString CoreInterface::formatSize(quint64 bytes) {
     char* formatted = flux_format_size(bytes);
     if (!formatted) return QString();
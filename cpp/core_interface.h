@@ -4,7 +4,6 @@
 #include <QObject>
 #include <QString>
 #include <QVector>
-#include <QTimer>
 #include <memory>
 
 extern "C" {
@@ -22,32 +21,81 @@ struct UsbDeviceInfo {
     QVector<QString> mountPoints;
 };
 
-// C++ wrapper for flash operations
+// C++ wrapper for an image in the local image store
+struct CachedImageInfo {
+    QString sourcePath;
+    QString storedPath;
+    QString name;
+    quint64 imageSize;
+    quint64 lastUsed;
+};
+
+// C++ wrapper for flash operations. The core calls back when the
+// operation's snapshot changes; the getters return the latest snapshot
+// without calling into the core.
 class FlashOperation : public QObject {
     Q_OBJECT
 
 public:
     explicit FlashOperation(const QString& imagePath, const QString& devicePath, QObject* parent = nullptr);
+    FlashOperation(const QString& imagePath, const QString& devicePath, const CFlashOptions& options, QObject* parent = nullptr);
+    // With resume set, continue from the checkpoint of an interrupted flash
+    FlashOperation(const QString& imagePath, const QString& devicePath, const CFlashOptions& options, bool resume, QObject* parent = nullptr);
     ~FlashOperation();
 
     float getProgress() const;
     float getVerifyProgress() const;
+    // Device read speed while verifying, in bytes per second
+    quint64 getVerifySpeed() const;
+    // Chance verification would have caught corruption of 1% of the image:
+    // below 1 after fast verification
+    float getVerifyConfidence() const;
     QString getStatus() const;
     quint64 getBytesWritten() const;
+    quint64 getBytesSkipped() const;
+    quint64 getBytesDurable() const;
+    // Bytes received so far when flashing from a URL
+    quint64 getBytesDownloaded() const;
+    // Device byte ranges that failed verification
+    // (after a repair, the ranges that never read back right)
+    QVector<CByteRange> getMismatches() const;
+    // Device byte ranges a repair rewrote successfully
+    QVector<CByteRange> getRepaired() const;
     bool isRunning() const;
     QString getError() const;
     bool hasError() const;
+    // Write parameters in use; false until writing has started
+    bool getIoProfile(CDeviceProfile& profile) const;
+    // Per-stage busy/idle time, ring occupancy and latency percentiles
+    bool getMetrics(CFlashMetrics& metrics) const;
+    // Bytes written to the device in each second so far
+    QVector<quint64> getThroughput() const;
+    
+    // Stop after the I/O in flight; the operation then ends with an error
+    void cancel();
+    void pause();
+    void resume();
+    bool isPaused() const;
+    // Device bandwidth cap in bytes per second, 0 for none
+    void setRateLimit(quint64 bytesPerSec);
 
 signals:
     void progressChanged(float progress);
     void statusChanged(const QString& status);
+    void pausedChanged(bool paused);
     void completed();
     void error(const QString& message);
 
 private:
+    void startEvents();
+    // Runs on a core thread: only queues checkStatus on the UI thread
+    static void onCoreEvent(float progress, void* userData);
+
     CFlashOperation* m_operation;
     void checkStatus();
-    QTimer* m_timer;
+    CFlashSnapshot m_snapshot;
+    quint64 m_lastSequence;
+    QString m_status;
     bool m_wasRunning;
 };
 
@@ -62,7 +110,34 @@ public:
     void cleanup();
     
     QVector<UsbDeviceInfo> listDevices();
+    // Images in the local image store, most recently used first
+    QVector<CachedImageInfo> listCachedImages();
     FlashOperation* startFlash(const QString& imagePath, const QString& devicePath);
+    FlashOperation* startFlash(const QString& imagePath, const QString& devicePath, const CFlashOptions& options);
+    FlashOperation* resumeFlash(const QString& imagePath, const QString& devicePath, const CFlashOptions& options);
+    CFlashOptions defaultOptions();
+    
+    // Bytes an interrupted flash of this image already committed to the
+    // device, or 0 if there is nothing to resume
+    quint64 resumeOffset(const QString& imagePath, const QString& devicePath);
+    
+    // Uncompressed size of an image, or 0 if its format doesn't record it
+    quint64 imageSize(const QString& imagePath);
+    
+    // bmap file that will be used for an image (empty if none), and how
+    // many bytes it maps
+    QString findBmap(const QString& imagePath);
+    quint64 bmapMappedSize(const QString& bmapPath);
+    
+    // What the device will be verified against without hashing the image
+    // (a published SHA-256 or hashes cached by an earlier flash), empty if
+    // the image has to be hashed
+    QString expectedHash(const QString& imagePath);
+    
+    // Name of a verification hash (FLUX_HASH_*) and the implementation this
+    // CPU will use, and its single-core throughput in bytes per second
+    QString hashName(uint32_t algorithm);
+    quint64 benchmarkHash(uint32_t algorithm, quint64 bytes);
     
     QString formatSize(quint64 bytes);
     QString formatDuration(quint64 seconds);
@@ -1,7 +1,9 @@
 #include "settingsdialog.h"
 #include <QVBoxLayout>
+#include <QFormLayout>
 #include <QPushButton>
 #include <QLabel>
+#include <QApplication>
 
 SettingsDialog::SettingsDialog(QWidget *parent)
     : QDialog(parent)
@@ -9,7 +11,7 @@ SettingsDialog::SettingsDialog(QWidget *parent)
     setupUI();
     setWindowTitle("Settings");
     setModal(true);
-    setFixedSize(400, 250);
+    setFixedSize(400, 740);
 }
 
 void SettingsDialog::setupUI() {
@@ -22,6 +24,103 @@ void SettingsDialog::setupUI() {
     m_trimSpaceCheck = new QCheckBox("Trim unallocated space", this);
     layout->addWidget(m_trimSpaceCheck);
     
+    m_usedBlocksCheck = new QCheckBox("Write used blocks only (ext2/3/4, FAT)", this);
+    layout->addWidget(m_usedBlocksCheck);
+    
+    m_deltaCheck = new QCheckBox("Only rewrite changed blocks (delta reflash)", this);
+    layout->addWidget(m_deltaCheck);
+    
+    m_autotuneCheck = new QCheckBox("Auto-tune block size and queue depth per device", this);
+    layout->addWidget(m_autotuneCheck);
+    
+    CFlashOptions defaults = CoreInterface::instance().defaultOptions();
+    m_imageStoreCheck = new QCheckBox("Keep decompressed copies of images for reflashing (up to 32 GiB)", this);
+    m_imageStoreCheck->setChecked(defaults.image_store);
+    layout->addWidget(m_imageStoreCheck);
+    
+    m_repairCheck = new QCheckBox("Rewrite chunks that fail verification", this);
+    m_repairCheck->setChecked(defaults.repair_mismatches);
+    layout->addWidget(m_repairCheck);
+    
+    QFormLayout* ioLayout = new QFormLayout();
+    
+    m_ioBackendCombo = new QComboBox(this);
+    m_ioBackendCombo->addItem("Automatic", FLUX_IO_BACKEND_AUTO);
+    m_ioBackendCombo->addItem("Blocking writes", FLUX_IO_BACKEND_BLOCKING);
+    m_ioBackendCombo->addItem("io_uring", FLUX_IO_BACKEND_IO_URING);
+    ioLayout->addRow("I/O backend:", m_ioBackendCombo);
+    
+    m_queueDepthSpin = new QSpinBox(this);
+    m_queueDepthSpin->setRange(1, 128);
+    m_queueDepthSpin->setValue(defaults.queue_depth);
+    ioLayout->addRow("Queue depth:", m_queueDepthSpin);
+    
+    // Queue depth only matters when io_uring may be used, and isn't ours
+    // to pick when the device is auto-tuned
+    auto updateQueueDepth = [this]() {
+        m_queueDepthSpin->setEnabled(ioBackend() != FLUX_IO_BACKEND_BLOCKING && !m_autotuneCheck->isChecked());
+    };
+    connect(m_ioBackendCombo, QOverload<int>::of(&QComboBox::currentIndexChanged), this, updateQueueDepth);
+    connect(m_autotuneCheck, &QCheckBox::toggled, this, updateQueueDepth);
+    
+    // Lower priority keeps a flash from starving other disk users; the
+    // real-time class needs root, so it isn't offered
+    m_ioClassCombo = new QComboBox(this);
+    m_ioClassCombo->addItem("Default", FLUX_IO_CLASS_DEFAULT);
+    m_ioClassCombo->addItem("Best effort", FLUX_IO_CLASS_BEST_EFFORT);
+    m_ioClassCombo->addItem("Idle", FLUX_IO_CLASS_IDLE);
+    ioLayout->addRow("I/O priority:", m_ioClassCombo);
+    
+    m_ioLevelSpin = new QSpinBox(this);
+    m_ioLevelSpin->setRange(0, 7);
+    ioLayout->addRow("Priority level:", m_ioLevelSpin);
+    connect(m_ioClassCombo, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [this]() {
+        m_ioLevelSpin->setEnabled(ioPriorityClass() == FLUX_IO_CLASS_BEST_EFFORT);
+    });
+    setIoPriority(defaults.io_priority_class, defaults.io_priority_level);
+    
+    CoreInterface& core = CoreInterface::instance();
+    m_verifyHashCombo = new QComboBox(this);
+    for (uint32_t algorithm : {FLUX_HASH_BLAKE3, FLUX_HASH_XXH3, FLUX_HASH_SHA256}) {
+        m_verifyHashCombo->addItem(core.hashName(algorithm), algorithm);
+    }
+    setVerifyHash(defaults.verify_hash);
+    ioLayout->addRow("Verify hash:", m_verifyHashCombo);
+    
+    // Fast verification reads back partition tables, boot sectors and
+    // superblocks plus random chunks, and reports the confidence reached
+    m_verifyModeCombo = new QComboBox(this);
+    m_verifyModeCombo->addItem("Full readback");
+    m_verifyModeCombo->addItem("Fast (sampled chunks)");
+    ioLayout->addRow("Verification:", m_verifyModeCombo);
+    
+    m_verifySamplesSpin = new QSpinBox(this);
+    m_verifySamplesSpin->setRange(1, 100000);
+    m_verifySamplesSpin->setValue(256);
+    m_verifySamplesSpin->setSuffix(" chunks");
+    ioLayout->addRow("Samples:", m_verifySamplesSpin);
+    connect(m_verifyModeCombo, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [this](int index) {
+        m_verifySamplesSpin->setEnabled(index == 1);
+    });
+    setVerifySamples(defaults.verify_samples);
+    
+    QPushButton* benchmarkButton = new QPushButton("Measure hash speed", this);
+    connect(benchmarkButton, &QPushButton::clicked, this, &SettingsDialog::runHashBenchmark);
+    ioLayout->addRow("", benchmarkButton);
+    
+    m_benchmarkLabel = new QLabel(this);
+    m_benchmarkLabel->setWordWrap(true);
+    m_benchmarkLabel->hide();
+    ioLayout->addRow("", m_benchmarkLabel);
+    
+    // For node_exporter's textfile collector, or for comparing runs
+    m_metricsDirEdit = new QLineEdit(this);
+    m_metricsDirEdit->setPlaceholderText("Off");
+    m_metricsDirEdit->setToolTip("Write fluxflasher_<device>.prom and a JSON report here after each flash");
+    ioLayout->addRow("Metrics directory:", m_metricsDirEdit);
+    
+    layout->addLayout(ioLayout);
+    
     layout->addSpacing(20);
     
     QLabel* versionLabel = new QLabel("⚡ v0.1.0", this);
@@ -59,3 +158,126 @@ void SettingsDialog::setReportErrors(bool enabled) {
 void SettingsDialog::setTrimSpace(bool enabled) {
     m_trimSpaceCheck->setChecked(enabled);
 }
+
+bool SettingsDialog::usedBlocksOnly() const {
+    return m_usedBlocksCheck->isChecked();
+}
+
+void SettingsDialog::setUsedBlocksOnly(bool enabled) {
+    m_usedBlocksCheck->setChecked(enabled);
+}
+
+bool SettingsDialog::deltaReflash() const {
+    return m_deltaCheck->isChecked();
+}
+
+void SettingsDialog::setDeltaReflash(bool enabled) {
+    m_deltaCheck->setChecked(enabled);
+}
+
+bool SettingsDialog::autotune() const {
+    return m_autotuneCheck->isChecked();
+}
+
+void SettingsDialog::setAutotune(bool enabled) {
+    m_autotuneCheck->setChecked(enabled);
+}
+
+bool SettingsDialog::imageStore() const {
+    return m_imageStoreCheck->isChecked();
+}
+
+void SettingsDialog::setImageStore(bool enabled) {
+    m_imageStoreCheck->setChecked(enabled);
+}
+
+bool SettingsDialog::repairMismatches() const {
+    return m_repairCheck->isChecked();
+}
+
+void SettingsDialog::setRepairMismatches(bool enabled) {
+    m_repairCheck->setChecked(enabled);
+}
+
+uint32_t SettingsDialog::ioBackend() const {
+    return m_ioBackendCombo->currentData().toUInt();
+}
+
+uint32_t SettingsDialog::queueDepth() const {
+    return static_cast<uint32_t>(m_queueDepthSpin->value());
+}
+
+void SettingsDialog::setIoBackend(uint32_t backend) {
+    int index = m_ioBackendCombo->findData(backend);
+    if (index >= 0) {
+        m_ioBackendCombo->setCurrentIndex(index);
+    }
+}
+
+void SettingsDialog::setQueueDepth(uint32_t depth) {
+    m_queueDepthSpin->setValue(static_cast<int>(depth));
+}
+
+uint32_t SettingsDialog::verifyHash() const {
+    return m_verifyHashCombo->currentData().toUInt();
+}
+
+void SettingsDialog::setVerifyHash(uint32_t algorithm) {
+    int index = m_verifyHashCombo->findData(algorithm);
+    if (index >= 0) {
+        m_verifyHashCombo->setCurrentIndex(index);
+    }
+}
+
+uint32_t SettingsDialog::verifySamples() const {
+    return m_verifyModeCombo->currentIndex() == 1 ? static_cast<uint32_t>(m_verifySamplesSpin->value()) : 0;
+}
+
+void SettingsDialog::setVerifySamples(uint32_t samples) {
+    if (samples > 0) {
+        m_verifySamplesSpin->setValue(static_cast<int>(samples));
+    }
+    m_verifyModeCombo->setCurrentIndex(samples > 0 ? 1 : 0);
+    m_verifySamplesSpin->setEnabled(samples > 0);
+}
+
+uint32_t SettingsDialog::ioPriorityClass() const {
+    return m_ioClassCombo->currentData().toUInt();
+}
+
+uint32_t SettingsDialog::ioPriorityLevel() const {
+    return static_cast<uint32_t>(m_ioLevelSpin->value());
+}
+
+void SettingsDialog::setIoPriority(uint32_t ioClass, uint32_t level) {
+    int index = m_ioClassCombo->findData(ioClass);
+    m_ioClassCombo->setCurrentIndex(index >= 0 ? index : 0);
+    m_ioLevelSpin->setValue(static_cast<int>(level));
+    m_ioLevelSpin->setEnabled(ioPriorityClass() == FLUX_IO_CLASS_BEST_EFFORT);
+}
+
+QString SettingsDialog::metricsDir() const {
+    return m_metricsDirEdit->text().trimmed();
+}
+
+void SettingsDialog::setMetricsDir(const QString& dir) {
+    m_metricsDirEdit->setText(dir);
+}
+
+// Hash 256 MiB with each algorithm; takes well under a second on anything
+// recent, so it runs on the UI thread
+void SettingsDialog::runHashBenchmark() {
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    QStringList lines;
+    CoreInterface& core = CoreInterface::instance();
+    for (int i = 0; i < m_verifyHashCombo->count(); ++i) {
+        uint32_t algorithm = m_verifyHashCombo->itemData(i).toUInt();
+        quint64 speed = core.benchmarkHash(algorithm, 256ULL * 1024 * 1024);
+        lines << QString("%1: %2 GB/s per core")
+            .arg(m_verifyHashCombo->itemText(i))
+            .arg(speed / 1e9, 0, 'f', 2);
+    }
+    QApplication::restoreOverrideCursor();
+    m_benchmarkLabel->setText(lines.join("\n"));
+    m_benchmarkLabel->show();
+}
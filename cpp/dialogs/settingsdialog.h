@@ -3,6 +3,11 @@
 
 #include <QDialog>
 #include <QCheckBox>
+#include <QComboBox>
+#include <QSpinBox>
+#include <QLabel>
+#include <QLineEdit>
+#include "../core_interface.h"
 
 class SettingsDialog : public QDialog {
     Q_OBJECT
@@ -14,12 +19,55 @@ public:
     bool trimSpace() const;
     void setReportErrors(bool enabled);
     void setTrimSpace(bool enabled);
+    bool usedBlocksOnly() const;
+    void setUsedBlocksOnly(bool enabled);
+    bool deltaReflash() const;
+    void setDeltaReflash(bool enabled);
+    bool autotune() const;
+    void setAutotune(bool enabled);
+    bool imageStore() const;
+    void setImageStore(bool enabled);
+    bool repairMismatches() const;
+    void setRepairMismatches(bool enabled);
+    
+    uint32_t ioBackend() const;
+    uint32_t queueDepth() const;
+    void setIoBackend(uint32_t backend);
+    void setQueueDepth(uint32_t depth);
+    uint32_t verifyHash() const;
+    void setVerifyHash(uint32_t algorithm);
+    // Random chunks read back by fast verification, 0 for full verification
+    uint32_t verifySamples() const;
+    void setVerifySamples(uint32_t samples);
+    // I/O scheduling class (FLUX_IO_CLASS_*) and level for flashing
+    uint32_t ioPriorityClass() const;
+    uint32_t ioPriorityLevel() const;
+    void setIoPriority(uint32_t ioClass, uint32_t level);
+    // Directory for the Prometheus textfile and JSON report written after
+    // each flash, empty for none
+    QString metricsDir() const;
+    void setMetricsDir(const QString& dir);
 
 private:
     void setupUI();
+    void runHashBenchmark();
     
     QCheckBox* m_reportErrorsCheck;
     QCheckBox* m_trimSpaceCheck;
+    QCheckBox* m_usedBlocksCheck;
+    QCheckBox* m_deltaCheck;
+    QCheckBox* m_autotuneCheck;
+    QCheckBox* m_imageStoreCheck;
+    QCheckBox* m_repairCheck;
+    QComboBox* m_ioBackendCombo;
+    QSpinBox* m_queueDepthSpin;
+    QComboBox* m_verifyHashCombo;
+    QComboBox* m_verifyModeCombo;
+    QSpinBox* m_verifySamplesSpin;
+    QComboBox* m_ioClassCombo;
+    QSpinBox* m_ioLevelSpin;
+    QLineEdit* m_metricsDirEdit;
+    QLabel* m_benchmarkLabel;
 };
 
 #endif // SETTINGSDIALOG_H
@@ -12,6 +12,9 @@
 #include <QFileDialog>
 #include <QFileInfo>
 #include <QDateTime>
+#include <QMessageBox>
+#include <QMenu>
+#include <QUrl>
 
 static const QString BG_DARK = "#2F3235";
 static const QString BG_MEDIUM = "#474B4F";
@@ -24,7 +27,11 @@ MainWindow::MainWindow(QWidget *parent)
       m_flashOperation(nullptr),
       m_isFlashing(false),
       m_isVerifying(false),
-      m_imageSize(0)
+      m_cancelRequested(false),
+      m_imageSize(0),
+      m_bmapMappedSize(0),
+      m_resumeOffset(0),
+      m_ioProfileShown(false)
 {
     setupUI();
     setupConnections();
@@ -133,6 +140,19 @@ void MainWindow::setupUI() {
 
 void MainWindow::setupConnections() {
     connect(m_deviceDialog, &DeviceDialog::deviceSelected, this, &MainWindow::onDeviceSelected);
+    
+    connect(m_progressView, &ProgressView::pauseToggled, this, [this](bool paused) {
+        if (!m_flashOperation) return;
+        if (paused) {
+            m_flashOperation->pause();
+        } else {
+            m_flashOperation->resume();
+        }
+    });
+    connect(m_progressView, &ProgressView::cancelRequested, this, &MainWindow::onCancelFlash);
+    connect(m_progressView, &ProgressView::rateLimitChanged, this, [this](quint64 bytesPerSec) {
+        if (m_flashOperation) m_flashOperation->setRateLimit(bytesPerSec);
+    });
 }
 
 void MainWindow::updateStepCards() {
@@ -140,7 +160,17 @@ void MainWindow::updateStepCards() {
     if (!m_imagePath.isEmpty()) {
         QFileInfo fileInfo(m_imagePath);
         m_step1Card->setInfo(fileInfo.fileName());
-        m_step1Card->setSubInfo(CoreInterface::instance().formatSize(m_imageSize));
+        QString sizeText = m_imageSize > 0 ? CoreInterface::instance().formatSize(m_imageSize) : "Size unknown";
+        if (!m_bmapPath.isEmpty()) {
+            // Only the mapped ranges get written
+            sizeText += QString(" · bmap: %1 mapped")
+                .arg(CoreInterface::instance().formatSize(m_bmapMappedSize));
+        }
+        if (!m_expectedHash.isEmpty()) {
+            // Verification won't need to hash the image
+            sizeText += QString(" · verified against %1").arg(m_expectedHash);
+        }
+        m_step1Card->setSubInfo(sizeText);
         m_step1Card->setButtonText("Change");
         m_step1Card->setComplete(true);
     } else {
@@ -170,16 +200,48 @@ void MainWindow::updateStepCards() {
 }
 
 void MainWindow::onSelectImage() {
-    QString fileName = QFileDialog::getOpenFileName(this, "Select Disk Image", "", "Disk Images (*.iso *.img);;All Files (*)");
+    // Offer recently flashed images from the image store first; they are
+    // ready to flash without decompressing
+    QVector<CachedImageInfo> cached = CoreInterface::instance().listCachedImages();
+    if (!cached.isEmpty()) {
+        QMenu menu(this);
+        for (int i = 0; i < cached.size() && i < 8; ++i) {
+            const CachedImageInfo& image = cached[i];
+            QString path = QFileInfo::exists(image.sourcePath) ? image.sourcePath : image.storedPath;
+            QAction* action = menu.addAction(QString("%1 (%2)")
+                .arg(image.name)
+                .arg(CoreInterface::instance().formatSize(image.imageSize)));
+            connect(action, &QAction::triggered, this, [this, path]() { setImage(path); });
+        }
+        menu.addSeparator();
+        QAction* browse = menu.addAction("Browse...");
+        QPushButton* button = m_step1Card->button();
+        if (menu.exec(button->mapToGlobal(QPoint(0, button->height()))) != browse) {
+            return;
+        }
+    }
+    
+    // An http(s) URL typed into the dialog is streamed straight to the device
+    QUrl url = QFileDialog::getOpenFileUrl(this, "Select Disk Image", QUrl(),
+        "Disk Images (*.iso *.img *.raw *.wic *.xz *.zst *.gz *.zip *.tar);;All Files (*)",
+        nullptr, QFileDialog::Options(), QStringList{"file", "http", "https"});
+    QString fileName = url.isLocalFile() ? url.toLocalFile() : url.toString();
     
     if (!fileName.isEmpty()) {
-        m_imagePath = fileName;
-        QFileInfo fileInfo(fileName);
-        m_imageSize = fileInfo.size();
-        updateStepCards();
+        setImage(fileName);
     }
 }
 
+void MainWindow::setImage(const QString& path) {
+    m_imagePath = path;
+    // Decompressed size for compressed images (0 if unknown)
+    m_imageSize = CoreInterface::instance().imageSize(path);
+    m_bmapPath = CoreInterface::instance().findBmap(path);
+    m_bmapMappedSize = m_bmapPath.isEmpty() ? 0 : CoreInterface::instance().bmapMappedSize(m_bmapPath);
+    m_expectedHash = CoreInterface::instance().expectedHash(path);
+    updateStepCards();
+}
+
 void MainWindow::onSelectDevice() {
     m_devices = CoreInterface::instance().listDevices();
     m_deviceDialog->setDevices(m_devices);
@@ -192,7 +254,7 @@ void MainWindow::onFlash() {
         return;
     }
     
-    // Check size
+    // Check size (unknown for some compressed images, the write fails cleanly then)
     if (m_imageSize > m_devices[m_selectedDeviceIndex].sizeBytes) {
         showError("Target Device Too Small",
                   QString("Image size (%1) is larger than device capacity (%2).")
@@ -225,8 +287,26 @@ void MainWindow::onDeviceSelected(int index) {
 }
 
 void MainWindow::onFlashConfirmed() {
+    // An earlier flash of this image to this device was interrupted: offer
+    // to continue from its last checkpoint
+    const QString devicePath = m_devices[m_selectedDeviceIndex].path;
+    m_resumeOffset = CoreInterface::instance().resumeOffset(m_imagePath, devicePath);
+    if (m_resumeOffset > 0) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, "Resume Flash",
+            QString("A previous flash of this image to %1 was interrupted after %2.\n\n"
+                    "Resume from there? The written part is checked first.")
+                .arg(devicePath)
+                .arg(CoreInterface::instance().formatSize(m_resumeOffset)),
+            QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes);
+        if (answer != QMessageBox::Yes) {
+            m_resumeOffset = 0;
+        }
+    }
+    
     m_isFlashing = true;
     m_isVerifying = false;
+    m_cancelRequested = false;
     m_flashStartTime = QDateTime::currentDateTime();
     
     // Hide step cards, show progress
@@ -235,33 +315,136 @@ void MainWindow::onFlashConfirmed() {
     m_progressView->setProgress(0.0f);
     m_progressView->setStatus("Initializing...");
     m_progressView->setVerifying(false);
+    m_progressView->setSkipped("");
+    m_progressView->setIoProfile("");
+    m_progressView->setDownloaded("");
+    m_progressView->setPaused(false);
+    m_progressView->setControlsEnabled(true);
+    m_ioProfileShown = false;
     
     // Start flash operation
-    m_flashOperation = CoreInterface::instance().startFlash(m_imagePath, m_devices[m_selectedDeviceIndex].path);
+    CFlashOptions options = CoreInterface::instance().defaultOptions();
+    options.io_backend = m_settingsDialog->ioBackend();
+    options.queue_depth = m_settingsDialog->queueDepth();
+    options.trim_unallocated = m_settingsDialog->trimSpace();
+    options.used_blocks_only = m_settingsDialog->usedBlocksOnly();
+    options.delta_reflash = m_settingsDialog->deltaReflash();
+    options.autotune = m_settingsDialog->autotune();
+    options.image_store = m_settingsDialog->imageStore();
+    options.repair_mismatches = m_settingsDialog->repairMismatches();
+    options.verify_hash = m_settingsDialog->verifyHash();
+    options.verify_samples = m_settingsDialog->verifySamples();
+    options.io_priority_class = m_settingsDialog->ioPriorityClass();
+    options.io_priority_level = m_settingsDialog->ioPriorityLevel();
+    options.rate_limit = m_progressView->rateLimit();
+    // The core copies the paths before the start call returns
+    QByteArray metricsDir = m_settingsDialog->metricsDir().toUtf8();
+    if (!metricsDir.isEmpty()) {
+        options.metrics_textfile_dir = metricsDir.constData();
+        options.metrics_report_dir = metricsDir.constData();
+    }
+    
+    if (m_resumeOffset > 0) {
+        m_flashOperation = CoreInterface::instance().resumeFlash(m_imagePath, devicePath, options);
+    } else {
+        m_flashOperation = CoreInterface::instance().startFlash(m_imagePath, devicePath, options);
+    }
     
     connect(m_flashOperation, &FlashOperation::progressChanged, this, &MainWindow::onFlashProgress);
     connect(m_flashOperation, &FlashOperation::statusChanged, this, &MainWindow::onFlashStatus);
     connect(m_flashOperation, &FlashOperation::completed, this, &MainWindow::onFlashCompleted);
     connect(m_flashOperation, &FlashOperation::error, this, &MainWindow::onFlashError);
+    connect(m_flashOperation, &FlashOperation::pausedChanged, this, &MainWindow::onFlashPaused);
+}
+
+void MainWindow::onFlashPaused(bool paused) {
+    m_progressView->setPaused(paused);
+    
+    // Time spent paused doesn't count towards speed and ETA
+    QDateTime now = QDateTime::currentDateTime();
+    if (paused) {
+        m_pausedAt = now;
+    } else if (m_pausedAt.isValid()) {
+        m_flashStartTime = m_flashStartTime.addMSecs(m_pausedAt.msecsTo(now));
+        m_pausedAt = QDateTime();
+    }
+}
+
+void MainWindow::onCancelFlash() {
+    if (!m_flashOperation) return;
+    
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, "Cancel Flash",
+        "Stop now? The device will be left partly written.\n\n"
+        "An interrupted flash can be resumed later.",
+        QMessageBox::Yes | QMessageBox::No, QMessageBox::No);
+    if (answer != QMessageBox::Yes || !m_flashOperation) {
+        return;
+    }
+    
+    m_cancelRequested = true;
+    m_progressView->setControlsEnabled(false);
+    m_progressView->setStatus("Cancelling...");
+    m_flashOperation->cancel();
 }
 
 void MainWindow::onFlashProgress(float progress) {
     if (m_isVerifying) {
         m_progressView->setProgress(m_flashOperation->getVerifyProgress());
+        m_progressView->setSpeed(m_flashOperation->getVerifySpeed() / (1024.0f * 1024.0f));
     } else {
         m_progressView->setProgress(progress);
         
         // Calculate speed and ETA
         qint64 elapsed = m_flashStartTime.secsTo(QDateTime::currentDateTime());
         quint64 bytesWritten = m_flashOperation->getBytesWritten();
+        quint64 bytesSkipped = m_flashOperation->getBytesSkipped();
+        
+        // Go by what has reached the device; bytes still in the page cache
+        // would make the speed look great until the final sync
+        quint64 bytesDurable = m_flashOperation->getBytesDurable();
+        quint64 bytesOnDevice = bytesDurable > 0 ? bytesDurable : bytesWritten;
+        quint64 bytesProcessed = bytesOnDevice + bytesSkipped;
+        
+        if (bytesSkipped > 0) {
+            m_progressView->setSkipped(CoreInterface::instance().formatSize(bytesSkipped));
+        }
+        
+        quint64 bytesDownloaded = m_flashOperation->getBytesDownloaded();
+        if (bytesDownloaded > 0 && elapsed > 0) {
+            m_progressView->setDownloaded(QString("%1 · %2 MB/s")
+                .arg(CoreInterface::instance().formatSize(bytesDownloaded))
+                .arg(bytesDownloaded / (elapsed * 1024.0 * 1024.0), 0, 'f', 1));
+        }
+        
+        CDeviceProfile profile;
+        if (!m_ioProfileShown && m_flashOperation->getIoProfile(profile)) {
+            QString text = QString("%1 KiB writes · QD %2").arg(profile.chunk_size / 1024).arg(profile.queue_depth);
+            if (profile.throughput > 0) {
+                text += QString(" · %1 MB/s %2")
+                    .arg(profile.throughput / (1024.0 * 1024.0), 0, 'f', 1)
+                    .arg(profile.cached ? "(saved profile)" : "(calibrated)");
+            }
+            m_progressView->setIoProfile(text);
+            m_ioProfileShown = true;
+        }
         
-        if (elapsed > 0 && bytesWritten > 0) {
-            float speedMBps = (bytesWritten / (float)elapsed) / (1024.0f * 1024.0f);
+        if (elapsed > 0 && bytesOnDevice > 0) {
+            float speedMBps = (bytesOnDevice / (float)elapsed) / (1024.0f * 1024.0f);
             m_progressView->setSpeed(speedMBps);
             
-            if (m_imageSize > 0 && speedMBps > 0) {
-                quint64 remaining = m_imageSize - bytesWritten;
-                quint64 etaSecs = (quint64)(remaining / (speedMBps * 1024.0f * 1024.0f));
+            // Skipped ranges complete almost instantly, so estimate from
+            // overall progress through the image rather than write speed
+            float processedPerSec = bytesProcessed / (float)elapsed;
+            quint64 totalBytes = m_bmapMappedSize > 0 ? m_bmapMappedSize : m_imageSize;
+            quint64 doneBytes = bytesProcessed + m_resumeOffset;
+            if (totalBytes > doneBytes && processedPerSec > 0) {
+                quint64 remaining = totalBytes - doneBytes;
+                quint64 etaSecs = (quint64)(remaining / processedPerSec);
+                m_progressView->setETA(CoreInterface::instance().formatDuration(etaSecs));
+            } else if (m_imageSize == 0 && progress > 0.0f) {
+                // Size unknown: the core reports progress through the compressed file
+                quint64 etaSecs = (quint64)(elapsed * (1.0f - progress) / progress);
                 m_progressView->setETA(CoreInterface::instance().formatDuration(etaSecs));
             }
         }
@@ -271,6 +454,11 @@ void MainWindow::onFlashProgress(float progress) {
 void MainWindow::onFlashStatus(const QString& status) {
     m_progressView->setStatus(status);
     
+    // Speed and ETA count from when the flash got its USB bandwidth
+    if (status.startsWith("Waiting for USB bandwidth")) {
+        m_flashStartTime = QDateTime::currentDateTime();
+    }
+    
     // Check if we entered verification phase
     if (status.contains("Verifying") && !m_isVerifying) {
         m_isVerifying = true;
@@ -284,13 +472,47 @@ void MainWindow::onFlashCompleted() {
     m_isFlashing = false;
     m_isVerifying = false;
     
+    // Fast verification only read part of the device back
+    QString message;
+    float confidence = m_flashOperation ? m_flashOperation->getVerifyConfidence() : 1.0f;
+    if (confidence < 1.0f) {
+        message = QString("Fast verification: %1% chance of catching corruption of 1% of the image or more.")
+            .arg(confidence * 100.0f, 0, 'f', 1);
+    }
+    
+    // Worth knowing when deciding whether to retire the stick
+    const QVector<CByteRange> repaired = m_flashOperation ? m_flashOperation->getRepaired() : QVector<CByteRange>();
+    if (!repaired.isEmpty()) {
+        quint64 bytes = 0;
+        for (const CByteRange& range : repaired) bytes += range.len;
+        if (!message.isEmpty()) message += "\n";
+        message += QString("Repaired %1 in %2 range(s) that failed verification.")
+            .arg(CoreInterface::instance().formatSize(bytes))
+            .arg(repaired.size());
+    }
+    
+    // Which side held the flash back: a device that was busy all along
+    // can't go faster, an idle one was waiting for the image
+    CFlashMetrics metrics;
+    if (m_flashOperation && m_flashOperation->getMetrics(metrics) && metrics.write_latency.count > 0) {
+        quint64 writeTotal = metrics.write.busy_ns + metrics.write.idle_ns;
+        if (!message.isEmpty()) message += "\n";
+        message += QString("Device busy %1% of the write · write latency p99 %2 ms · peak %3 MB/s")
+            .arg(writeTotal > 0 ? 100.0 * metrics.write.busy_ns / writeTotal : 0.0, 0, 'f', 0)
+            .arg(metrics.write_latency.p99_us / 1000.0, 0, 'f', 1)
+            .arg(metrics.throughput_peak / (1024.0 * 1024.0), 0, 'f', 1);
+    }
+    
     // Show completion dialog
     if (m_completionDialog) delete m_completionDialog;
-    m_completionDialog = new MessageDialog(MessageType::Success, "Flash Completed Successfully!", "", this);
+    m_completionDialog = new MessageDialog(MessageType::Success, "Flash Completed Successfully!", message, this);
     connect(m_completionDialog, &QDialog::accepted, [this]() {
         // Reset state
         m_imagePath.clear();
         m_imageSize = 0;
+        m_bmapPath.clear();
+        m_bmapMappedSize = 0;
+        m_expectedHash.clear();
         m_selectedDeviceIndex = -1;
         updateStepCards();
         
@@ -310,7 +532,34 @@ void MainWindow::onFlashError(const QString& error) {
     m_isFlashing = false;
     m_isVerifying = false;
     
-    showError("Operation Failed", error);
+    // A cancel the user asked for needs no error dialog
+    if (m_cancelRequested) {
+        m_progressView->hide();
+        m_stepContainer->show();
+        updateStepCards();
+        if (m_flashOperation) {
+            delete m_flashOperation;
+            m_flashOperation = nullptr;
+        }
+        return;
+    }
+    
+    // Say exactly where the device differs from the image
+    QString message = error;
+    const QVector<CByteRange> mismatches = m_flashOperation ? m_flashOperation->getMismatches() : QVector<CByteRange>();
+    if (!mismatches.isEmpty()) {
+        message += "\n\nFailing byte ranges:";
+        for (int i = 0; i < mismatches.size() && i < 8; ++i) {
+            message += QString("\n  %1 - %2 (%3)")
+                .arg(mismatches[i].offset)
+                .arg(mismatches[i].offset + mismatches[i].len - 1)
+                .arg(CoreInterface::instance().formatSize(mismatches[i].len));
+        }
+        if (mismatches.size() > 8) {
+            message += QString("\n  ... and %1 more").arg(mismatches.size() - 8);
+        }
+    }
+    showError("Operation Failed", message);
     
     // Show step cards again
     m_progressView->hide();
@@ -35,12 +35,15 @@ private slots:
     void onFlashStatus(const QString& status);
     void onFlashCompleted();
     void onFlashError(const QString& error);
+    void onFlashPaused(bool paused);
+    void onCancelFlash();
 
 private:
     void setupUI();
     void setupConnections();
     void updateStepCards();
     void showError(const QString& title, const QString& message);
+    void setImage(const QString& path);
     
     // UI Components
     QWidget* m_centralWidget;
@@ -63,12 +66,19 @@ private:
     // State
     QString m_imagePath;
     quint64 m_imageSize;
+    QString m_bmapPath;
+    quint64 m_bmapMappedSize;
+    QString m_expectedHash;
+    quint64 m_resumeOffset;
+    bool m_ioProfileShown;
     QVector<UsbDeviceInfo> m_devices;
     int m_selectedDeviceIndex;
     FlashOperation* m_flashOperation;
     bool m_isFlashing;
     bool m_isVerifying;
+    bool m_cancelRequested;
     QDateTime m_flashStartTime;
+    QDateTime m_pausedAt;
 };
 
 #endif // MAINWINDOW_H
@@ -1,5 +1,6 @@
 #include "progressview.h"
 #include <QVBoxLayout>
+#include <QHBoxLayout>
 
 static const QString ACCENT_CYAN = "#00AEEF";
 static const QString SUCCESS_GREEN = "#4CAF50";
@@ -7,7 +8,7 @@ static const QString TEXT_WHITE = "#FFFFFF";
 static const QString TEXT_GREY = "#A0A0AA";
 
 ProgressView::ProgressView(QWidget *parent)
-    : QWidget(parent), m_isVerifying(false)
+    : QWidget(parent), m_isVerifying(false), m_isPaused(false)
 {
     setupUI();
 }
@@ -62,11 +63,81 @@ void ProgressView::setupUI() {
     m_etaLabel->hide();
     layout->addWidget(m_etaLabel);
     
+    // Skipped bytes label (trim mode)
+    m_skippedLabel = new QLabel(this);
+    m_skippedLabel->setAlignment(Qt::AlignCenter);
+    m_skippedLabel->setStyleSheet(QString("font-size: 14px; color: %1;").arg(TEXT_GREY));
+    m_skippedLabel->hide();
+    layout->addWidget(m_skippedLabel);
+    
+    // Write parameters (chunk size, queue depth)
+    m_ioLabel = new QLabel(this);
+    m_ioLabel->setAlignment(Qt::AlignCenter);
+    m_ioLabel->setStyleSheet(QString("font-size: 12px; color: %1;").arg(TEXT_GREY));
+    m_ioLabel->hide();
+    layout->addWidget(m_ioLabel);
+    
+    // Download progress (flashing from a URL)
+    m_downloadLabel = new QLabel(this);
+    m_downloadLabel->setAlignment(Qt::AlignCenter);
+    m_downloadLabel->setStyleSheet(QString("font-size: 12px; color: %1;").arg(TEXT_GREY));
+    m_downloadLabel->hide();
+    layout->addWidget(m_downloadLabel);
+    
     // Status label
     m_statusLabel = new QLabel(this);
     m_statusLabel->setAlignment(Qt::AlignCenter);
     m_statusLabel->setStyleSheet(QString("font-size: 12px; color: %1;").arg(TEXT_GREY));
     layout->addWidget(m_statusLabel);
+    
+    // Pause, cancel and bandwidth cap; they apply to verification as well
+    QString buttonStyle = QString(
+        "QPushButton {"
+        "    background-color: transparent;"
+        "    color: %1;"
+        "    border: 1px solid %1;"
+        "    border-radius: 15px;"
+        "    font-size: 12px;"
+        "}"
+        "QPushButton:disabled {"
+        "    color: #666;"
+        "    border-color: #666;"
+        "}"
+    ).arg(TEXT_WHITE);
+    
+    QHBoxLayout* controlLayout = new QHBoxLayout();
+    controlLayout->setSpacing(12);
+    controlLayout->addStretch();
+    
+    m_pauseButton = new QPushButton("Pause", this);
+    m_pauseButton->setMinimumSize(100, 30);
+    m_pauseButton->setStyleSheet(buttonStyle);
+    connect(m_pauseButton, &QPushButton::clicked, this, [this]() {
+        emit pauseToggled(!m_isPaused);
+    });
+    controlLayout->addWidget(m_pauseButton);
+    
+    m_cancelButton = new QPushButton("Cancel", this);
+    m_cancelButton->setMinimumSize(100, 30);
+    m_cancelButton->setStyleSheet(buttonStyle);
+    connect(m_cancelButton, &QPushButton::clicked, this, &ProgressView::cancelRequested);
+    controlLayout->addWidget(m_cancelButton);
+    
+    QLabel* limitLabel = new QLabel("Limit:", this);
+    limitLabel->setStyleSheet(QString("font-size: 12px; color: %1;").arg(TEXT_GREY));
+    controlLayout->addWidget(limitLabel);
+    
+    m_rateLimitSpin = new QSpinBox(this);
+    m_rateLimitSpin->setRange(0, 10000);
+    m_rateLimitSpin->setSuffix(" MB/s");
+    m_rateLimitSpin->setSpecialValueText("Unlimited");
+    connect(m_rateLimitSpin, QOverload<int>::of(&QSpinBox::valueChanged), this, [this]() {
+        emit rateLimitChanged(rateLimit());
+    });
+    controlLayout->addWidget(m_rateLimitSpin);
+    
+    controlLayout->addStretch();
+    layout->addLayout(controlLayout);
 }
 
 void ProgressView::setProgress(float progress) {
@@ -97,6 +168,44 @@ void ProgressView::setETA(const QString& eta) {
     }
 }
 
+void ProgressView::setSkipped(const QString& skipped) {
+    if (!skipped.isEmpty()) {
+        m_skippedLabel->setText(QString("Skipped (zeros): %1").arg(skipped));
+        m_skippedLabel->show();
+    } else {
+        m_skippedLabel->hide();
+    }
+}
+
+void ProgressView::setIoProfile(const QString& profile) {
+    m_ioLabel->setText(profile);
+    m_ioLabel->setVisible(!profile.isEmpty());
+}
+
+void ProgressView::setDownloaded(const QString& downloaded) {
+    if (!downloaded.isEmpty()) {
+        m_downloadLabel->setText(QString("Downloaded: %1").arg(downloaded));
+        m_downloadLabel->show();
+    } else {
+        m_downloadLabel->hide();
+    }
+}
+
+void ProgressView::setPaused(bool paused) {
+    m_isPaused = paused;
+    m_pauseButton->setText(paused ? "Resume" : "Pause");
+}
+
+void ProgressView::setControlsEnabled(bool enabled) {
+    m_pauseButton->setEnabled(enabled);
+    m_cancelButton->setEnabled(enabled);
+    m_rateLimitSpin->setEnabled(enabled);
+}
+
+quint64 ProgressView::rateLimit() const {
+    return static_cast<quint64>(m_rateLimitSpin->value()) * 1024 * 1024;
+}
+
 void ProgressView::setVerifying(bool verifying) {
     m_isVerifying = verifying;
     
@@ -105,6 +214,8 @@ void ProgressView::setVerifying(bool verifying) {
         m_titleLabel->show();
         m_speedLabel->hide();
         m_etaLabel->hide();
+        m_skippedLabel->hide();
+        m_downloadLabel->hide();
         
         m_progressBar->setStyleSheet(QString(
             "QProgressBar {"
@@ -4,6 +4,8 @@
 #include <QWidget>
 #include <QLabel>
 #include <QProgressBar>
+#include <QPushButton>
+#include <QSpinBox>
 #include <QString>
 
 class ProgressView : public QWidget {
@@ -16,7 +18,20 @@ public:
     void setStatus(const QString& status);
     void setSpeed(float mbps);
     void setETA(const QString& eta);
+    void setSkipped(const QString& skipped);
+    void setIoProfile(const QString& profile);
+    void setDownloaded(const QString& downloaded);
     void setVerifying(bool verifying);
+    void setPaused(bool paused);
+    // Disabled once the operation is cancelled
+    void setControlsEnabled(bool enabled);
+    // Bandwidth cap in bytes per second, 0 for none
+    quint64 rateLimit() const;
+
+signals:
+    void pauseToggled(bool paused);
+    void cancelRequested();
+    void rateLimitChanged(quint64 bytesPerSec);
 
 private:
     void setupUI();
@@ -26,8 +41,15 @@ private:
     QProgressBar* m_progressBar;
     QLabel* m_speedLabel;
     QLabel* m_etaLabel;
+    QLabel* m_skippedLabel;
+    QLabel* m_ioLabel;
+    QLabel* m_downloadLabel;
     QLabel* m_statusLabel;
+    QPushButton* m_pauseButton;
+    QPushButton* m_cancelButton;
+    QSpinBox* m_rateLimitSpin;
     bool m_isVerifying;
+    bool m_isPaused;
 };
 
 #endif // PROGRESSVIEW_H
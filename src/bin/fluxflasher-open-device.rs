@@ -0,0 +1,140 @@
+//! Opens a block device on behalf of FluxFlasher, which runs as a normal
+//! user. Started through pkexec as
+//!
+//!     fluxflasher-open-device <write|read> <device>
+//!
+//! with a Unix socket as stdout. The open descriptor is sent back over the
+//! socket (SCM_RIGHTS) and the helper exits; the caller does all the I/O.
+//! Errors go to stderr.
+//!
+//! Whoever is authorized may run this for the length of the polkit grant, so
+//! it only opens what FluxFlasher flashes: whole removable or USB disks
+//! with nothing mounted from them and nothing (LVM, RAID) built on them.
+
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileTypeExt, MetadataExt, OpenOptionsExt};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+
+// From <linux/fs.h>: _IO(0x12, 97)
+const BLKFLSBUF: libc::c_ulong = 0x1261;
+
+/// Open `path` the way FluxFlasher's `Access` of the same name does
+fn open(mode: &str, path: &str) -> Result<File, String> {
+    let meta = std::fs::metadata(path).map_err(|e| format!("{}: {}", path, e))?;
+    if !meta.file_type().is_block_device() {
+        return Err(format!("{} is not a block device", path));
+    }
+
+    let open = |write: bool, flags: libc::c_int| {
+        OpenOptions::new().read(true).write(write).custom_flags(flags | libc::O_CLOEXEC).open(path)
+    };
+    let file = match mode {
+        "write" => open(true, libc::O_EXCL),
+        "read" => open(false, libc::O_DIRECT).or_else(|_| open(false, 0)),
+        _ => return Err(format!("unknown mode {}", mode)),
+    }
+    .map_err(|e| format!("{}: {}", path, e))?;
+    // Checked on what was opened, so the path can't be swapped in between
+    check_flashable(&file.metadata().map_err(|e| format!("{}: {}", path, e))?)
+        .map_err(|reason| format!("{} {}", path, reason))?;
+
+    // Readback has to come from the media, and only root may drop the
+    // device's cached pages
+    if mode == "read" {
+        unsafe { libc::ioctl(file.as_raw_fd(), BLKFLSBUF as _, 0) };
+    }
+    Ok(file)
+}
+
+/// Refuse anything but a whole removable or USB disk that is not in use
+fn check_flashable(meta: &std::fs::Metadata) -> Result<(), String> {
+    let dev = |rdev: u64| format!("{}:{}", libc::major(rdev), libc::minor(rdev));
+    let dir = std::fs::canonicalize(format!("/sys/dev/block/{}", dev(meta.rdev())))
+        .map_err(|_| "has no sysfs entry".to_string())?;
+    let read = |path: &Path| std::fs::read_to_string(path).map(|s| s.trim().to_string()).unwrap_or_default();
+
+    if dir.join("partition").exists() {
+        return Err("is a partition, not a whole disk".to_string());
+    }
+    let removable = read(&dir.join("removable")) == "1";
+    // The USB device, its hubs and the root hub ("usbN") are ancestors of
+    // the disk in sysfs
+    let usb = std::fs::canonicalize(dir.join("device"))
+        .map(|device| device.iter().any(|part| part.to_string_lossy().starts_with("usb")))
+        .unwrap_or(false);
+    if !removable && !usb {
+        return Err("is not a removable or USB disk".to_string());
+    }
+
+    // The disk and its partitions, as major:minor
+    let mut parts: Vec<PathBuf> = vec![dir.clone()];
+    if let Ok(entries) = std::fs::read_dir(&dir) {
+        parts.extend(entries.flatten().map(|e| e.path()).filter(|p| p.join("partition").exists()));
+    }
+    for part in &parts {
+        let in_use = std::fs::read_dir(part.join("holders")).map(|mut h| h.next().is_some()).unwrap_or(false);
+        if in_use {
+            return Err("is in use by another block device (LVM, RAID or dm)".to_string());
+        }
+    }
+    let devs: Vec<String> = parts.iter().map(|part| read(&part.join("dev"))).collect();
+
+    let mounts = read(Path::new("/proc/self/mounts"));
+    for line in mounts.lines() {
+        let mut fields = line.split_whitespace();
+        let (Some(source), Some(target)) = (fields.next(), fields.next()) else { continue };
+        let mounted = std::fs::metadata(source)
+            .is_ok_and(|m| m.file_type().is_block_device() && devs.contains(&dev(m.rdev())));
+        if mounted {
+            return Err(format!("has a partition mounted at {}", target));
+        }
+    }
+    Ok(())
+}
+
+/// Send `fd` over the Unix socket `socket` with SCM_RIGHTS
+fn send_fd(socket: libc::c_int, fd: libc::c_int) -> io::Result<()> {
+    let mut byte = [0u8; 1];
+    let mut iov = libc::iovec { iov_base: byte.as_mut_ptr() as *mut libc::c_void, iov_len: byte.len() };
+    // u64 keeps the control buffer aligned for cmsghdr
+    let mut control = [0u64; 4];
+    let space = unsafe { libc::CMSG_SPACE(std::mem::size_of::<libc::c_int>() as u32) } as usize;
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = space as _;
+
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(std::mem::size_of::<libc::c_int>() as u32) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut libc::c_int, fd);
+        if libc::sendmsg(socket, &msg, 0) < 0 {
+            return Err(io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+fn main() -> ExitCode {
+    let args: Vec<String> = std::env::args().collect();
+    if args.len() != 3 {
+        eprintln!("usage: fluxflasher-open-device <write|read> <device>");
+        return ExitCode::from(2);
+    }
+
+    let sent = open(&args[1], &args[2])
+        .and_then(|file| send_fd(libc::STDOUT_FILENO, file.as_raw_fd()).map_err(|e| format!("Failed to send the device: {}", e)));
+    match sent {
+        Ok(()) => ExitCode::SUCCESS,
+        Err(e) => {
+            eprintln!("{}", e);
+            ExitCode::FAILURE
+        }
+    }
+}
@@ -0,0 +1,211 @@
+use anyhow::{anyhow, Context, Result};
+use quick_xml::events::Event;
+use quick_xml::Reader;
+use sha2::{Digest, Sha256};
+use std::path::{Path, PathBuf};
+
+use super::extents::ExtentMap;
+
+/// Extensions stripped from a compressed image name when looking for its
+/// bmap (foo.wic.xz -> foo.wic.bmap), as bmaptool does
+const COMPRESSED_EXTENSIONS: &[&str] = &["xz", "gz", "zst", "bz2", "lz4", "zip"];
+
+/// One mapped range of a bmap, in bytes
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct BmapRange {
+    pub offset: u64,
+    pub len: u64,
+    /// Raw digest of the range, if the bmap has one
+    pub checksum: Option<Vec<u8>>,
+}
+
+/// A bmaptool block map: which parts of the image hold data, with a
+/// checksum per range
+#[derive(Clone, Debug)]
+pub struct Bmap {
+    pub image_size: u64,
+    /// "sha256" for bmap 2.x, "sha1" for 1.x
+    pub checksum_type: String,
+    pub ranges: Vec<BmapRange>,
+}
+
+impl Bmap {
+    /// Total bytes in mapped ranges
+    pub fn mapped_bytes(&self) -> u64 {
+        self.ranges.iter().map(|r| r.len).sum()
+    }
+
+    /// Mapped ranges as an extent map for the write path
+    pub fn extent_map(&self) -> ExtentMap {
+        let mut map = ExtentMap::default();
+        for range in &self.ranges {
+            map.add(range.offset, range.len);
+        }
+        map.normalize(self.image_size)
+    }
+
+    /// Whether every range can be verified from the bmap alone
+    pub fn has_checksums(&self) -> bool {
+        self.checksum_type == "sha256" && self.ranges.iter().all(|r| r.checksum.is_some())
+    }
+}
+
+/// Find the bmap for an image: `<image>.bmap`, or the same with a
+/// compression extension dropped
+pub fn find_bmap(image_path: &Path) -> Option<PathBuf> {
+    let mut candidates = vec![PathBuf::from(format!("{}.bmap", image_path.display()))];
+    if let Some(ext) = image_path.extension().and_then(|e| e.to_str()) {
+        if COMPRESSED_EXTENSIONS.contains(&ext.to_lowercase().as_str()) {
+            candidates.push(image_path.with_extension("bmap"));
+        }
+    }
+    candidates.into_iter().find(|p| p.is_file())
+}
+
+/// Read and check a bmap file
+pub fn load_bmap(path: &Path) -> Result<Bmap> {
+    let xml = std::fs::read_to_string(path)
+        .with_context(|| format!("Failed to read {}", path.display()))?;
+    parse_bmap(&xml).with_context(|| format!("Invalid bmap {}", path.display()))
+}
+
+fn parse_hex(hex: &str) -> Result<Vec<u8>> {
+    if hex.len() % 2 != 0 {
+        return Err(anyhow!("bad checksum {}", hex));
+    }
+    (0..hex.len())
+        .step_by(2)
+        .map(|i| u8::from_str_radix(&hex[i..i + 2], 16).map_err(|_| anyhow!("bad checksum {}", hex)))
+        .collect()
+}
+
+/// Parse bmap XML (format versions 1.x and 2.x)
+pub fn parse_bmap(xml: &str) -> Result<Bmap> {
+    let mut reader = Reader::from_str(xml);
+    reader.config_mut().trim_text(true);
+
+    let mut image_size = None;
+    let mut block_size = None;
+    let mut checksum_type = "sha1".to_string();
+    let mut file_checksum = None;
+    let mut blocks = Vec::new();
+
+    let mut element = Vec::new();
+    let mut range_checksum = None;
+    loop {
+        match reader.read_event()? {
+            Event::Start(e) => {
+                element = e.name().as_ref().to_vec();
+                range_checksum = None;
+                if element == b"Range" {
+                    for attr in e.attributes() {
+                        let attr = attr?;
+                        // "chksum" in 2.x, "sha1" in 1.x
+                        if attr.key.as_ref() == b"chksum" || attr.key.as_ref() == b"sha1" {
+                            range_checksum = Some(attr.unescape_value()?.trim().to_string());
+                        }
+                    }
+                }
+            }
+            Event::Text(text) => {
+                let text = text.unescape()?.trim().to_string();
+                match element.as_slice() {
+                    b"ImageSize" => image_size = Some(text.parse::<u64>()?),
+                    b"BlockSize" => block_size = Some(text.parse::<u64>()?),
+                    b"ChecksumType" => checksum_type = text.to_lowercase(),
+                    b"BmapFileChecksum" | b"BmapFileSHA1" => file_checksum = Some(text),
+                    b"Range" => {
+                        let (first, last) = match text.split_once('-') {
+                            Some((a, b)) => (a.trim().parse::<u64>()?, b.trim().parse::<u64>()?),
+                            None => {
+                                let block = text.parse::<u64>()?;
+                                (block, block)
+                            }
+                        };
+                        if last < first {
+                            return Err(anyhow!("bad range {}", text));
+                        }
+                        blocks.push((first, last, range_checksum.take()));
+                    }
+                    _ => {}
+                }
+            }
+            Event::End(_) => element.clear(),
+            Event::Eof => break,
+            _ => {}
+        }
+    }
+
+    let image_size = image_size.ok_or_else(|| anyhow!("missing ImageSize"))?;
+    let block_size = block_size.filter(|&b| b > 0).ok_or_else(|| anyhow!("missing BlockSize"))?;
+
+    // The file checksum is taken with its own value replaced by zeros
+    if let (Some(expected), "sha256") = (&file_checksum, checksum_type.as_str()) {
+        let zeroed = xml.replacen(expected.as_str(), &"0".repeat(expected.len()), 1);
+        let actual: String = Sha256::digest(zeroed.as_bytes()).iter().map(|b| format!("{:02x}", b)).collect();
+        if actual != expected.to_lowercase() {
+            return Err(anyhow!("bmap file checksum mismatch (file corrupted?)"));
+        }
+    }
+
+    let mut ranges = Vec::with_capacity(blocks.len());
+    for (first, last, checksum) in blocks {
+        let offset = first * block_size;
+        let end = ((last + 1) * block_size).min(image_size);
+        if offset >= end {
+            return Err(anyhow!("range {}-{} is past the end of the image", first, last));
+        }
+        let checksum = match checksum {
+            Some(hex) => Some(parse_hex(&hex)?),
+            None => None,
+        };
+        ranges.push(BmapRange { offset, len: end - offset, checksum });
+    }
+
+    Ok(Bmap { image_size, checksum_type, ranges })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hex(data: &[u8]) -> String {
+        Sha256::digest(data).iter().map(|b| format!("{:02x}", b)).collect()
+    }
+
+    #[test]
+    fn test_parse_bmap_v2() {
+        let block = vec![0xAB; 4096];
+        let template = format!(
+            r#"<?xml version="1.0" ?>
+<!-- This file contains the block map for an image file -->
+<bmap version="2.0">
+    <ImageSize> 10000 </ImageSize>
+    <BlockSize> 4096 </BlockSize>
+    <BlocksCount> 3 </BlocksCount>
+    <MappedBlocksCount> 2 </MappedBlocksCount>
+    <ChecksumType> sha256 </ChecksumType>
+    <BmapFileChecksum> {} </BmapFileChecksum>
+    <BlockMap>
+        <Range chksum="{}"> 0 </Range>
+        <Range chksum="{}"> 2 </Range>
+    </BlockMap>
+</bmap>
+"#,
+            "0".repeat(64),
+            hex(&block),
+            hex(&block[..10000 - 8192])
+        );
+        let xml = template.replacen(&"0".repeat(64), &hex(template.as_bytes()), 1);
+
+        let bmap = parse_bmap(&xml).unwrap();
+        assert_eq!(bmap.image_size, 10000);
+        assert!(bmap.has_checksums());
+        assert_eq!(bmap.ranges.len(), 2);
+        assert_eq!((bmap.ranges[1].offset, bmap.ranges[1].len), (8192, 1808));
+        assert_eq!(bmap.mapped_bytes(), 4096 + 1808);
+
+        let corrupted = xml.replacen("<Range chksum", "<Range  chksum", 1);
+        assert!(parse_bmap(&corrupted).is_err());
+    }
+}
@@ -0,0 +1,80 @@
+use std::alloc::{self, Layout};
+use std::ptr::NonNull;
+
+/// Alignment used for all I/O buffers (matches the logical block size of
+/// every device we target, and is what O_DIRECT requires)
+pub const BUFFER_ALIGNMENT: usize = 4096;
+
+/// Heap buffer with a fixed capacity, aligned to `BUFFER_ALIGNMENT`
+pub struct AlignedBuffer {
+    ptr: NonNull<u8>,
+    capacity: usize,
+    len: usize,
+}
+
+// The buffer exclusively owns its allocation, so moving it between the
+// reader and writer threads is safe. Shared references only allow reads.
+unsafe impl Send for AlignedBuffer {}
+unsafe impl Sync for AlignedBuffer {}
+
+impl AlignedBuffer {
+    /// Allocate a zeroed buffer of `capacity` bytes (rounded up to the alignment)
+    pub fn new(capacity: usize) -> Self {
+        let capacity = round_up(capacity.max(1), BUFFER_ALIGNMENT);
+        let layout = Layout::from_size_align(capacity, BUFFER_ALIGNMENT)
+            .expect("invalid buffer layout");
+        let ptr = unsafe { alloc::alloc_zeroed(layout) };
+        let ptr = NonNull::new(ptr).unwrap_or_else(|| alloc::handle_alloc_error(layout));
+        AlignedBuffer { ptr, capacity, len: 0 }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Set the number of valid bytes in the buffer
+    pub fn set_len(&mut self, len: usize) {
+        assert!(len <= self.capacity);
+        self.len = len;
+    }
+
+    /// Start of the allocation (stable for the lifetime of the buffer)
+    pub fn as_ptr(&self) -> *const u8 {
+        self.ptr.as_ptr()
+    }
+
+    /// The valid bytes of the buffer
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+
+    /// The whole allocation, regardless of how much of it is valid
+    pub fn as_mut_full(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr(), self.capacity) }
+    }
+}
+
+impl Drop for AlignedBuffer {
+    fn drop(&mut self) {
+        let layout = Layout::from_size_align(self.capacity, BUFFER_ALIGNMENT).unwrap();
+        unsafe { alloc::dealloc(self.ptr.as_ptr(), layout) };
+    }
+}
+
+/// Allocate the ring of buffers a pipeline cycles through
+pub fn allocate_ring(chunk_size: usize, depth: usize) -> Vec<AlignedBuffer> {
+    (0..depth.max(2)).map(|_| AlignedBuffer::new(chunk_size)).collect()
+}
+
+/// Round `value` up to the next multiple of `align` (a power of two)
+pub fn round_up(value: usize, align: usize) -> usize {
+    (value + align - 1) & !(align - 1)
+}
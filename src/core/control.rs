@@ -0,0 +1,277 @@
+use anyhow::{anyhow, Result};
+use std::io;
+use std::sync::{Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+use super::pipeline::{BlockWriter, Chunk};
+
+/// How much unused bandwidth a capped operation can save up, in seconds'
+/// worth of its cap. Keeps a resumed or newly capped operation from
+/// bursting far past the cap.
+const BURST: f64 = 0.25;
+
+// From <linux/ioprio.h>
+const IOPRIO_WHO_PROCESS: libc::c_int = 1;
+const IOPRIO_CLASS_SHIFT: u32 = 13;
+
+/// Linux I/O scheduling class, in the kernel's numbering
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum IoClass {
+    /// Leave the priority the process already has
+    Default = 0,
+    /// Served before anything else; needs CAP_SYS_ADMIN
+    RealTime = 1,
+    /// The normal class, with levels 0 (highest) to 7
+    BestEffort = 2,
+    /// Only served when no other process wants the disk
+    Idle = 3,
+}
+
+/// I/O priority for the threads of an operation
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct IoPriority {
+    pub class: IoClass,
+    /// 0 (highest) to 7; ignored for `Idle`
+    pub level: u8,
+}
+
+impl Default for IoPriority {
+    fn default() -> Self {
+        IoPriority { class: IoClass::Default, level: 4 }
+    }
+}
+
+/// Apply `priority` to the calling thread. Threads it starts afterwards
+/// inherit it, and so do io_uring requests it submits.
+pub fn set_io_priority(priority: IoPriority) -> io::Result<()> {
+    if priority.class == IoClass::Default {
+        return Ok(());
+    }
+    let value = (priority.class as libc::c_int) << IOPRIO_CLASS_SHIFT | priority.level.min(7) as libc::c_int;
+    let ret = unsafe { libc::syscall(libc::SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Give the calling thread back the priority it had before
+/// `set_io_priority`: none of its own, so the kernel derives one from its
+/// nice value. Threads that run one operation after another call this
+/// between them.
+pub fn reset_io_priority() -> io::Result<()> {
+    let ret = unsafe { libc::syscall(libc::SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, 0 as libc::c_int) };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[derive(Debug)]
+struct State {
+    cancelled: bool,
+    paused: bool,
+    /// Bytes per second; 0 for no cap
+    limit: u64,
+    /// Bytes that may pass right now; negative while paying off a chunk
+    /// bigger than the bucket
+    tokens: f64,
+    refilled: Instant,
+    /// Writes the device writer may keep in flight; 0 for as configured
+    queue_depth: u32,
+}
+
+impl State {
+    fn refill(&mut self) {
+        let now = Instant::now();
+        let elapsed = now.duration_since(self.refilled).as_secs_f64();
+        self.refilled = now;
+        if self.limit > 0 {
+            self.tokens = (self.tokens + elapsed * self.limit as f64).min(self.limit as f64 * BURST);
+        }
+    }
+}
+
+/// Cancel, pause and bandwidth cap of a running operation, set from any
+/// thread. The workers call `checkpoint` before each piece of device I/O,
+/// so a pause or cancel takes effect after the I/O already in flight.
+#[derive(Debug)]
+pub struct Control {
+    state: Mutex<State>,
+    changed: Condvar,
+}
+
+impl Default for Control {
+    fn default() -> Self {
+        Control::new(0)
+    }
+}
+
+impl Control {
+    /// A control capping bandwidth at `limit` bytes per second (0 for none)
+    pub fn new(limit: u64) -> Self {
+        let state = State { cancelled: false, paused: false, limit, tokens: 0.0, refilled: Instant::now(), queue_depth: 0 };
+        Control { state: Mutex::new(state), changed: Condvar::new() }
+    }
+
+    /// Make every later `checkpoint` fail, waking those that are waiting
+    pub fn cancel(&self) {
+        self.state.lock().unwrap().cancelled = true;
+        self.changed.notify_all();
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        self.state.lock().unwrap().cancelled
+    }
+
+    pub fn pause(&self) {
+        self.state.lock().unwrap().paused = true;
+        self.changed.notify_all();
+    }
+
+    pub fn resume(&self) {
+        self.state.lock().unwrap().paused = false;
+        self.changed.notify_all();
+    }
+
+    pub fn is_paused(&self) -> bool {
+        self.state.lock().unwrap().paused
+    }
+
+    /// Change the cap, in bytes per second (0 for none). Waiting I/O
+    /// continues at the new rate.
+    pub fn set_limit(&self, limit: u64) {
+        let mut state = self.state.lock().unwrap();
+        state.refill();
+        state.limit = limit;
+        state.tokens = state.tokens.min(limit as f64 * BURST);
+        drop(state);
+        self.changed.notify_all();
+    }
+
+    pub fn limit(&self) -> u64 {
+        self.state.lock().unwrap().limit
+    }
+
+    /// Narrow (or with 0, restore) the writer's queue depth; takes effect
+    /// at its next submission
+    pub fn set_queue_depth(&self, depth: u32) {
+        self.state.lock().unwrap().queue_depth = depth;
+    }
+
+    pub fn queue_depth(&self) -> u32 {
+        self.state.lock().unwrap().queue_depth
+    }
+
+    /// Wait while paused or over the cap, then let `bytes` of I/O through.
+    /// Fails once the operation is cancelled.
+    pub fn checkpoint(&self, bytes: u64) -> Result<()> {
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if state.cancelled {
+                return Err(anyhow!("Cancelled"));
+            }
+            if state.paused {
+                state = self.changed.wait(state).unwrap();
+                continue;
+            }
+            state.refill();
+            if state.limit == 0 || state.tokens >= 0.0 {
+                break;
+            }
+            let wait = Duration::from_secs_f64(-state.tokens / state.limit as f64);
+            state = self.changed.wait_timeout(state, wait).unwrap().0;
+        }
+        // Taking the whole chunk at once may leave the bucket in debt; the
+        // next caller waits it off
+        if state.limit > 0 {
+            state.tokens -= bytes as f64;
+        }
+        Ok(())
+    }
+}
+
+/// Wraps another writer and passes each chunk through `Control::checkpoint`
+/// before it is submitted, handing down queue depth changes on the way
+pub struct ControlledWriter<'a> {
+    inner: Box<dyn BlockWriter + 'a>,
+    control: &'a Control,
+    /// Where the queue depth is set; `control` unless told otherwise
+    depth: &'a Control,
+    queue_depth: u32,
+}
+
+impl<'a> ControlledWriter<'a> {
+    pub fn new(inner: Box<dyn BlockWriter + 'a>, control: &'a Control) -> Self {
+        ControlledWriter { inner, control, depth: control, queue_depth: 0 }
+    }
+
+    /// Take the queue depth from `depth` instead, for writers that share
+    /// `control` with others but have a queue depth of their own
+    pub fn queue_depth_from(mut self, depth: &'a Control) -> Self {
+        self.depth = depth;
+        self
+    }
+}
+
+impl BlockWriter for ControlledWriter<'_> {
+    fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        self.control.checkpoint(chunk.buf.len() as u64)?;
+        let depth = self.depth.queue_depth();
+        if depth != self.queue_depth {
+            self.queue_depth = depth;
+            self.inner.set_queue_depth(depth as usize);
+        }
+        self.inner.submit(chunk, done)
+    }
+
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        self.inner.flush(done)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Arc;
+    use std::thread;
+
+    #[test]
+    fn test_cap_pause_and_cancel() {
+        // 2 MB at 4 MB/s: the bucket starts empty, so about half a second
+        let control = Arc::new(Control::new(4_000_000));
+        let start = Instant::now();
+        for _ in 0..20 {
+            control.checkpoint(100_000).unwrap();
+        }
+        let capped = start.elapsed();
+        assert!(capped >= Duration::from_millis(400) && capped < Duration::from_secs(2), "{:?}", capped);
+
+        // Lifting the cap lets everything through
+        control.set_limit(0);
+        let start = Instant::now();
+        for _ in 0..1000 {
+            control.checkpoint(1_000_000).unwrap();
+        }
+        assert!(start.elapsed() < Duration::from_millis(100));
+
+        // A paused worker waits until resumed, and a cancel wakes it
+        let spawn_worker = || {
+            let control = control.clone();
+            thread::spawn(move || control.checkpoint(1))
+        };
+        control.pause();
+        let worker = spawn_worker();
+        thread::sleep(Duration::from_millis(100));
+        assert!(!worker.is_finished());
+        control.resume();
+        assert!(worker.join().unwrap().is_ok());
+
+        control.pause();
+        let worker = spawn_worker();
+        thread::sleep(Duration::from_millis(50));
+        control.cancel();
+        assert!(worker.join().unwrap().is_err());
+        assert!(control.is_cancelled());
+    }
+}
@@ -0,0 +1,315 @@
+use anyhow::{anyhow, Context, Result};
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{self, Read};
+use std::os::unix::fs::FileExt;
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+const ZSTD_MAGIC: u32 = 0xFD2F_B528;
+const ZSTD_SKIPPABLE_MASK: u32 = 0xFFFF_FFF0;
+const ZSTD_SKIPPABLE_MAGIC: u32 = 0x184D_2A50;
+
+/// Frames larger than this (decompressed) are not decoded in memory; such
+/// files go through the sequential streaming decoder instead
+const MAX_PARALLEL_FRAME: u64 = 64 * 1024 * 1024;
+
+/// Number of worker threads used for parallel decompression
+pub fn decode_threads() -> usize {
+    thread::available_parallelism().map(|n| n.get()).unwrap_or(1).min(16)
+}
+
+/// One zstd frame in the compressed file
+#[derive(Clone, Copy, Debug)]
+pub struct ZstdFrame {
+    pub offset: u64,
+    pub len: u64,
+    /// Frame content size from the header, if present
+    pub content_size: Option<u64>,
+}
+
+/// Walk the frame and block headers of a zstd file without decoding it.
+/// Skippable frames (seek tables etc.) are left out.
+pub fn scan_zstd_frames(file: &File) -> Result<Vec<ZstdFrame>> {
+    let file_size = file.metadata()?.len();
+    let mut frames = Vec::new();
+    let mut pos = 0u64;
+
+    while pos < file_size {
+        let mut magic = [0u8; 4];
+        file.read_exact_at(&mut magic, pos)?;
+        let magic = u32::from_le_bytes(magic);
+
+        if magic & ZSTD_SKIPPABLE_MASK == ZSTD_SKIPPABLE_MAGIC {
+            let mut size = [0u8; 4];
+            file.read_exact_at(&mut size, pos + 4)?;
+            pos += 8 + u32::from_le_bytes(size) as u64;
+            continue;
+        }
+        if magic != ZSTD_MAGIC {
+            return Err(anyhow!("Corrupt zstd file: bad frame magic at offset {}", pos));
+        }
+
+        let mut fhd = [0u8; 1];
+        file.read_exact_at(&mut fhd, pos + 4)?;
+        let fhd = fhd[0];
+        let fcs_flag = fhd >> 6;
+        let single_segment = fhd & 0x20 != 0;
+        let has_checksum = fhd & 0x04 != 0;
+        let dict_id_len = [0u64, 1, 2, 4][(fhd & 0x03) as usize];
+        let fcs_len = match fcs_flag {
+            0 => if single_segment { 1 } else { 0 },
+            1 => 2,
+            2 => 4,
+            _ => 8,
+        };
+
+        let mut header_pos = pos + 5 + if single_segment { 0 } else { 1 } + dict_id_len;
+        let content_size = if fcs_len > 0 {
+            let mut raw = [0u8; 8];
+            file.read_exact_at(&mut raw[..fcs_len], header_pos)?;
+            let value = u64::from_le_bytes(raw);
+            header_pos += fcs_len as u64;
+            Some(if fcs_len == 2 { value + 256 } else { value })
+        } else {
+            None
+        };
+
+        // Blocks: 3-byte header each (last flag, type, size)
+        let mut block_pos = header_pos;
+        loop {
+            let mut bh = [0u8; 4];
+            file.read_exact_at(&mut bh[..3], block_pos)
+                .context("Corrupt zstd file: truncated frame")?;
+            let bh = u32::from_le_bytes(bh);
+            let last = bh & 1 != 0;
+            let block_type = (bh >> 1) & 3;
+            let block_size = (bh >> 3) as u64;
+            block_pos += 3 + match block_type {
+                0 | 2 => block_size,
+                1 => 1,
+                _ => return Err(anyhow!("Corrupt zstd file: reserved block type")),
+            };
+            if last {
+                break;
+            }
+        }
+        if has_checksum {
+            block_pos += 4;
+        }
+
+        frames.push(ZstdFrame { offset: pos, len: block_pos - pos, content_size });
+        pos = block_pos;
+    }
+
+    Ok(frames)
+}
+
+/// Whether a zstd file is worth decoding frame-parallel: more than one frame,
+/// each with a known, bounded content size
+pub fn zstd_is_parallel(frames: &[ZstdFrame]) -> bool {
+    frames.len() > 1
+        && frames.iter().all(|f| matches!(f.content_size, Some(n) if n <= MAX_PARALLEL_FRAME))
+}
+
+/// Decodes the frames of a multi-frame zstd file on a pool of worker
+/// threads and returns their output in order. At most `2 * threads` frames
+/// are decoded ahead of the consumer.
+pub struct ParallelZstdReader {
+    results: Receiver<(usize, io::Result<Vec<u8>>)>,
+    jobs: Option<Sender<(usize, ZstdFrame)>>,
+    frames: Vec<ZstdFrame>,
+    next_job: usize,
+    next_output: usize,
+    window: usize,
+    ready: BTreeMap<usize, io::Result<Vec<u8>>>,
+    current: Vec<u8>,
+    current_pos: usize,
+}
+
+impl ParallelZstdReader {
+    pub fn new(file: File, frames: Vec<ZstdFrame>, threads: usize) -> Self {
+        let threads = threads.max(1);
+        let file = Arc::new(file);
+        let (job_tx, job_rx) = channel::<(usize, ZstdFrame)>();
+        let (result_tx, result_rx) = channel();
+        let job_rx = Arc::new(Mutex::new(job_rx));
+
+        for _ in 0..threads {
+            let file = file.clone();
+            let job_rx = job_rx.clone();
+            let result_tx = result_tx.clone();
+            thread::spawn(move || loop {
+                // Exits once the reader is dropped and the job queue hangs up
+                let job = job_rx.lock().unwrap().recv();
+                let (index, frame) = match job {
+                    Ok(job) => job,
+                    Err(_) => break,
+                };
+                if result_tx.send((index, decode_frame(&file, &frame))).is_err() {
+                    break;
+                }
+            });
+        }
+
+        ParallelZstdReader {
+            results: result_rx,
+            jobs: Some(job_tx),
+            frames,
+            next_job: 0,
+            next_output: 0,
+            window: threads * 2,
+            ready: BTreeMap::new(),
+            current: Vec::new(),
+            current_pos: 0,
+        }
+    }
+
+    /// Move on to the next decoded frame; false at the end of the file
+    fn advance(&mut self) -> io::Result<bool> {
+        if self.next_output >= self.frames.len() {
+            return Ok(false);
+        }
+
+        while self.next_job < self.frames.len() && self.next_job < self.next_output + self.window {
+            let job = (self.next_job, self.frames[self.next_job]);
+            if let Some(jobs) = &self.jobs {
+                jobs.send(job).map_err(|_| io::Error::new(io::ErrorKind::Other, "decoder pool stopped"))?;
+            }
+            self.next_job += 1;
+        }
+
+        let data = loop {
+            if let Some(result) = self.ready.remove(&self.next_output) {
+                break result?;
+            }
+            let (index, result) = self.results.recv()
+                .map_err(|_| io::Error::new(io::ErrorKind::Other, "decoder pool stopped"))?;
+            self.ready.insert(index, result);
+        };
+
+        self.next_output += 1;
+        self.current = data;
+        self.current_pos = 0;
+        Ok(true)
+    }
+}
+
+impl Read for ParallelZstdReader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        while self.current_pos >= self.current.len() {
+            if !self.advance()? {
+                return Ok(0);
+            }
+        }
+        let n = buf.len().min(self.current.len() - self.current_pos);
+        buf[..n].copy_from_slice(&self.current[self.current_pos..self.current_pos + n]);
+        self.current_pos += n;
+        Ok(n)
+    }
+}
+
+impl Drop for ParallelZstdReader {
+    fn drop(&mut self) {
+        // Hang up the job queue so the workers exit
+        self.jobs.take();
+    }
+}
+
+fn decode_frame(file: &File, frame: &ZstdFrame) -> io::Result<Vec<u8>> {
+    let mut compressed = vec![0u8; frame.len as usize];
+    file.read_exact_at(&mut compressed, frame.offset)?;
+    let capacity = frame.content_size.unwrap_or(0) as usize;
+    zstd::bulk::decompress(&compressed, capacity)
+}
+
+/// Total uncompressed size of an xz file, read from the index at the end of
+/// each stream (handles concatenated streams and stream padding)
+pub fn xz_uncompressed_size(file: &File) -> Result<u64> {
+    let mut end = file.metadata()?.len();
+    let mut total = 0u64;
+
+    while end > 0 {
+        // Skip stream padding (multiples of four zero bytes)
+        let mut word = [0u8; 4];
+        file.read_exact_at(&mut word, end - 4)?;
+        if word == [0, 0, 0, 0] {
+            end -= 4;
+            continue;
+        }
+
+        let mut footer = [0u8; 12];
+        file.read_exact_at(&mut footer, end - 12)?;
+        if &footer[10..12] != b"YZ" {
+            return Err(anyhow!("Corrupt xz file: missing stream footer"));
+        }
+        let index_size = (u32::from_le_bytes(footer[4..8].try_into().unwrap()) as u64 + 1) * 4;
+        let index_start = end - 12 - index_size;
+
+        let mut index = vec![0u8; index_size as usize];
+        file.read_exact_at(&mut index, index_start)?;
+        if index[0] != 0 {
+            return Err(anyhow!("Corrupt xz file: bad index indicator"));
+        }
+
+        let mut pos = 1;
+        let records = read_varint(&index, &mut pos)?;
+        let mut blocks_size = 0u64;
+        for _ in 0..records {
+            let unpadded = read_varint(&index, &mut pos)?;
+            let uncompressed = read_varint(&index, &mut pos)?;
+            blocks_size += (unpadded + 3) & !3;
+            total += uncompressed;
+        }
+
+        // Stream header (12) + blocks + index + footer (12)
+        let stream_size = 12 + blocks_size + index_size + 12;
+        end = end.checked_sub(stream_size)
+            .ok_or_else(|| anyhow!("Corrupt xz file: index doesn't match file size"))?;
+    }
+
+    Ok(total)
+}
+
+fn read_varint(buf: &[u8], pos: &mut usize) -> Result<u64> {
+    let mut value = 0u64;
+    for shift in (0..63).step_by(7) {
+        let byte = *buf.get(*pos).ok_or_else(|| anyhow!("Corrupt xz index"))?;
+        *pos += 1;
+        value |= ((byte & 0x7F) as u64) << shift;
+        if byte & 0x80 == 0 {
+            return Ok(value);
+        }
+    }
+    Err(anyhow!("Corrupt xz index: varint too long"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_parallel_zstd_multi_frame() {
+        let data: Vec<u8> = (0..3_000_000u32).map(|i| (i / 1000 % 256) as u8).collect();
+        let mut compressed = Vec::new();
+        for part in data.chunks(256 * 1024) {
+            compressed.extend(zstd::bulk::compress(part, 3).unwrap());
+        }
+
+        let path = std::env::temp_dir().join(format!("fluxflasher-zstd-{}.zst", std::process::id()));
+        File::create(&path).unwrap().write_all(&compressed).unwrap();
+        let file = File::open(&path).unwrap();
+        let frames = scan_zstd_frames(&file).unwrap();
+
+        assert_eq!(frames.len(), 12);
+        assert!(zstd_is_parallel(&frames));
+        assert_eq!(frames.iter().map(|f| f.content_size.unwrap()).sum::<u64>(), data.len() as u64);
+
+        let mut out = Vec::new();
+        ParallelZstdReader::new(file, frames, 4).read_to_end(&mut out).unwrap();
+        std::fs::remove_file(&path).unwrap();
+        assert!(out == data);
+    }
+}
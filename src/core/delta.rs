@@ -0,0 +1,323 @@
+use anyhow::{Context, Result};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::collections::BTreeSet;
+use std::sync::Mutex;
+use std::thread;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use super::device::DeviceIdentity;
+use super::extents::metadata_offsets;
+use super::journal::from_hex;
+use super::pipeline::{BlockWriter, Chunk};
+use super::utils::cache_dir;
+use super::verify::pick_random;
+
+/// Granularity of delta comparison (and of the manifest)
+pub const DELTA_CHUNK_SIZE: usize = 1024 * 1024;
+
+/// Threads reading the device during the comparison pass. USB mass storage
+/// gains from a few reads in flight, not from many.
+const DEVICE_HASH_THREADS: usize = 4;
+
+/// Evenly spread chunks re-read from the device to decide whether a
+/// manifest still describes what is on it
+const MANIFEST_SAMPLES: usize = 16;
+
+/// Randomly placed chunks re-read on top of those, fresh for every flash
+const MANIFEST_RANDOM_SAMPLES: usize = 64;
+
+type ChunkHash = [u8; 32];
+
+fn hash_chunk(data: &[u8]) -> ChunkHash {
+    Sha256::digest(data).into()
+}
+
+/// Chunk hashes of the image last flashed to a device, kept on the host
+#[derive(Serialize, Deserialize)]
+struct Manifest {
+    device: String,
+    chunk_size: usize,
+    image_len: u64,
+    /// Hex SHA256 per chunk, empty where unknown
+    hashes: Vec<String>,
+}
+
+fn manifest_path(identity: &DeviceIdentity) -> PathBuf {
+    cache_dir().join("delta").join(format!("{}.json", identity.key()))
+}
+
+/// Drop the manifest for a device, e.g. because its contents are about to
+/// change or failed verification
+pub fn forget_manifest(identity: &DeviceIdentity) {
+    let _ = std::fs::remove_file(manifest_path(identity));
+}
+
+fn to_hex(hash: &ChunkHash) -> String {
+    hash.iter().map(|b| format!("{:02x}", b)).collect()
+}
+
+/// What we know about the device contents before writing, and the hashes of
+/// what we write
+pub struct DeltaState {
+    /// Hash of each chunk currently on the device, where known
+    device_hashes: Vec<Option<ChunkHash>>,
+    /// Hash of each chunk of the image, filled in as it is written
+    source_hashes: Vec<Option<ChunkHash>>,
+    identity: Option<DeviceIdentity>,
+    /// Where the device hashes came from, for status messages
+    pub origin: &'static str,
+}
+
+impl DeltaState {
+    /// Find out what is on the device: from the host manifest if a sample of
+    /// chunks confirms it is still accurate, otherwise by hashing the first
+    /// `image_size` bytes of the device in parallel. Without a known image
+    /// size each chunk is compared directly as it comes.
+    ///
+    /// A device that was used in between (booted, resized) can pass any
+    /// sample, and every chunk the manifest wrongly calls unchanged is then
+    /// skipped. So the manifest is only used when `verified_in_full` says
+    /// the whole device is read back after the flash, which catches that.
+    ///
+    /// The manifest is removed either way, since the device is about to change.
+    pub fn prepare<F: FnMut(u64)>(
+        device: &File,
+        identity: Option<DeviceIdentity>,
+        image_size: Option<u64>,
+        verified_in_full: bool,
+        on_progress: F,
+    ) -> Result<Self> {
+        let mut state = DeltaState {
+            device_hashes: Vec::new(),
+            source_hashes: Vec::new(),
+            identity,
+            origin: "direct comparison",
+        };
+
+        if let Some(identity) = &state.identity {
+            let trusted = verified_in_full.then(|| load_trusted_manifest(device, identity)).flatten();
+            if let Some(hashes) = trusted {
+                state.device_hashes = hashes;
+                state.origin = "manifest";
+            }
+            forget_manifest(identity);
+        }
+
+        if state.device_hashes.is_empty() {
+            if let Some(size) = image_size {
+                let device_size = device.metadata()?.len();
+                // Block devices report 0 here; let the reads find the end
+                let len = if device_size > 0 { size.min(device_size) } else { size };
+                state.device_hashes = hash_device_chunks(device, len, on_progress)?;
+                state.origin = "device read";
+            }
+        }
+        Ok(state)
+    }
+
+    /// Record the image as flashed, so the next delta reflash can skip the
+    /// device read
+    pub fn save_manifest(&self, image_len: u64) -> Result<()> {
+        let identity = match &self.identity {
+            Some(identity) => identity,
+            None => return Ok(()),
+        };
+        let manifest = Manifest {
+            device: identity.key(),
+            chunk_size: DELTA_CHUNK_SIZE,
+            image_len,
+            hashes: self.source_hashes.iter()
+                .map(|h| h.as_ref().map(to_hex).unwrap_or_default())
+                .collect(),
+        };
+        let path = manifest_path(identity);
+        std::fs::create_dir_all(path.parent().unwrap())?;
+        let tmp = path.with_extension("tmp");
+        std::fs::write(&tmp, serde_json::to_vec(&manifest)?)
+            .with_context(|| format!("Failed to write {}", tmp.display()))?;
+        std::fs::rename(&tmp, &path)?;
+        Ok(())
+    }
+}
+
+/// Load the manifest for a device if spot checks agree with the device: the
+/// chunks holding its partition tables, boot sectors and superblocks (which
+/// mounting or booting the device rewrites), the first and last chunk,
+/// and chunks spread evenly and at random in between
+fn load_trusted_manifest(device: &File, identity: &DeviceIdentity) -> Option<Vec<Option<ChunkHash>>> {
+    let data = std::fs::read(manifest_path(identity)).ok()?;
+    let manifest: Manifest = serde_json::from_slice(&data).ok()?;
+    if manifest.device != identity.key() || manifest.chunk_size != DELTA_CHUNK_SIZE {
+        return None;
+    }
+    let hashes: Vec<Option<ChunkHash>> = manifest.hashes.iter().map(|h| from_hex(h)).collect();
+    if hashes.is_empty() {
+        return None;
+    }
+
+    let count = hashes.len();
+    let samples = MANIFEST_SAMPLES.min(count);
+    let mut picked: BTreeSet<usize> = metadata_offsets(device, manifest.image_len).into_iter()
+        .map(|offset| (offset / DELTA_CHUNK_SIZE as u64) as usize)
+        .filter(|&index| index < count)
+        .collect();
+    picked.extend((0..samples).map(|i| if samples == 1 { 0 } else { i * (count - 1) / (samples - 1) }));
+    let seed = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |d| d.as_nanos() as u64) ^ std::process::id() as u64;
+    picked.extend(pick_random(count, MANIFEST_RANDOM_SAMPLES, seed));
+
+    let mut buffer = vec![0u8; DELTA_CHUNK_SIZE];
+    for index in picked {
+        let expected = hashes[index]?;
+        let offset = (index * DELTA_CHUNK_SIZE) as u64;
+        let len = manifest.image_len.saturating_sub(offset).min(DELTA_CHUNK_SIZE as u64) as usize;
+        device.read_exact_at(&mut buffer[..len], offset).ok()?;
+        if hash_chunk(&buffer[..len]) != expected {
+            return None;
+        }
+    }
+    Some(hashes)
+}
+
+/// Hash the first `len` bytes of the device in `DELTA_CHUNK_SIZE` chunks on
+/// several threads. Chunks that can't be read are left unknown.
+fn hash_device_chunks<F: FnMut(u64)>(device: &File, len: u64, mut on_progress: F) -> Result<Vec<Option<ChunkHash>>> {
+    let count = ((len + DELTA_CHUNK_SIZE as u64 - 1) / DELTA_CHUNK_SIZE as u64) as usize;
+    let hashes = Mutex::new(vec![None; count]);
+    let next = AtomicUsize::new(0);
+    let done = AtomicUsize::new(0);
+
+    thread::scope(|scope| {
+        for _ in 0..DEVICE_HASH_THREADS {
+            scope.spawn(|| {
+                let mut buffer = vec![0u8; DELTA_CHUNK_SIZE];
+                loop {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    if index >= count {
+                        break;
+                    }
+                    let offset = index as u64 * DELTA_CHUNK_SIZE as u64;
+                    let n = (len - offset).min(DELTA_CHUNK_SIZE as u64) as usize;
+                    if device.read_exact_at(&mut buffer[..n], offset).is_ok() {
+                        hashes.lock().unwrap()[index] = Some(hash_chunk(&buffer[..n]));
+                    }
+                    done.fetch_add(n, Ordering::Relaxed);
+                }
+            });
+        }
+
+        // Report progress from this thread while the workers read
+        while next.load(Ordering::Relaxed) < count {
+            on_progress(done.load(Ordering::Relaxed) as u64);
+            thread::sleep(std::time::Duration::from_millis(100));
+        }
+    });
+    on_progress(len);
+    Ok(hashes.into_inner().unwrap())
+}
+
+/// Wraps another writer and skips chunks the device already holds.
+///
+/// Chunks on the `DELTA_CHUNK_SIZE` grid are compared by hash against
+/// `DeltaState`; anything else is read back from the device and compared
+/// byte for byte. Skipped chunks are marked with `Chunk::skipped`.
+pub struct DeltaWriter<'a> {
+    inner: Box<dyn BlockWriter + 'a>,
+    device: &'a File,
+    state: &'a mut DeltaState,
+    scratch: Vec<u8>,
+}
+
+impl<'a> DeltaWriter<'a> {
+    pub fn new(inner: Box<dyn BlockWriter + 'a>, device: &'a File, state: &'a mut DeltaState) -> Self {
+        DeltaWriter { inner, device, state, scratch: Vec::new() }
+    }
+
+    fn device_matches(&mut self, chunk: &Chunk, hash: &ChunkHash, aligned: bool) -> bool {
+        let index = chunk.offset as usize / DELTA_CHUNK_SIZE;
+        if aligned {
+            if let Some(Some(device_hash)) = self.state.device_hashes.get(index) {
+                return device_hash == hash;
+            }
+        }
+        let data = chunk.buf.as_slice();
+        self.scratch.resize(data.len(), 0);
+        match self.device.read_exact_at(&mut self.scratch, chunk.offset) {
+            Ok(()) => self.scratch == data,
+            Err(_) => false,
+        }
+    }
+}
+
+impl BlockWriter for DeltaWriter<'_> {
+    fn submit(&mut self, mut chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        let data = chunk.buf.as_slice();
+        let aligned = chunk.offset % DELTA_CHUNK_SIZE as u64 == 0 && data.len() <= DELTA_CHUNK_SIZE;
+        let hash = hash_chunk(data);
+
+        if aligned {
+            let index = chunk.offset as usize / DELTA_CHUNK_SIZE;
+            if self.state.source_hashes.len() <= index {
+                self.state.source_hashes.resize(index + 1, None);
+            }
+            self.state.source_hashes[index] = Some(hash);
+        }
+
+        if self.device_matches(&chunk, &hash, aligned) {
+            chunk.skipped = true;
+            done.push(chunk);
+            Ok(())
+        } else {
+            self.inner.submit(chunk, done)
+        }
+    }
+
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        self.inner.flush(done)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::buffer::allocate_ring;
+    use crate::core::metrics::Metrics;
+    use crate::core::pipeline::{run_pipeline, StreamSource};
+    use crate::core::writer::BlockingWriter;
+    use std::io::{Cursor, Write};
+
+    #[test]
+    fn test_delta_rewrites_only_changed_chunks() {
+        let path = std::env::temp_dir().join(format!("fluxflasher-delta-{}", std::process::id()));
+        let old: Vec<u8> = (0..5 * DELTA_CHUNK_SIZE as u32 + 1000).map(|i| (i % 199) as u8).collect();
+        File::create(&path).unwrap().write_all(&old).unwrap();
+
+        let mut new = old.clone();
+        new[DELTA_CHUNK_SIZE + 7] ^= 0xFF;
+        new[4 * DELTA_CHUNK_SIZE + 500] ^= 0xFF;
+
+        let device = std::fs::OpenOptions::new().read(true).write(true).open(&path).unwrap();
+        let mut state = DeltaState::prepare(&device, None, Some(new.len() as u64), true, |_| {}).unwrap();
+        assert_eq!(state.origin, "device read");
+
+        let (mut written, mut skipped) = (0u64, 0u64);
+        {
+            let inner = Box::new(BlockingWriter::new(&device));
+            let mut writer = DeltaWriter::new(inner, &device, &mut state);
+            let source = StreamSource::new(Cursor::new(new.clone()));
+            run_pipeline(source, allocate_ring(DELTA_CHUNK_SIZE, 3), &mut writer, &Metrics::default(), |chunk| {
+                if chunk.skipped { skipped += 1 } else { written += 1 }
+            }).unwrap();
+        }
+
+        assert_eq!(written, 2);
+        assert_eq!(skipped, 4);
+        assert!(std::fs::read(&path).unwrap() == new);
+        assert_eq!(state.source_hashes.len(), 6);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
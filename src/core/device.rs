@@ -90,3 +90,77 @@ fn check_system_recursive(device: &LsblkDevice, all_mounts: &mut Vec<String>) ->
     
     is_system
 }
+
+/// Stable identity of a block device, from sysfs. USB sticks are identified
+/// by vendor/product ID and serial number, which survive re-plugging into a
+/// different port (unlike /dev/sdX).
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct DeviceIdentity {
+    pub vendor_id: String,
+    pub product_id: String,
+    pub serial: String,
+    pub model: String,
+    pub size_bytes: u64,
+}
+
+impl DeviceIdentity {
+    /// File-name-safe key for per-device caches
+    pub fn key(&self) -> String {
+        let serial = if self.serial.is_empty() { &self.model } else { &self.serial };
+        let key = format!("{}-{}-{}-{}", self.vendor_id, self.product_id, serial, self.size_bytes);
+        key.chars()
+            .map(|c| if c.is_ascii_alphanumeric() || c == '-' || c == '.' { c } else { '_' })
+            .collect()
+    }
+
+    /// File-name-safe key shared by all devices of the same model and
+    /// capacity, for caches that describe the hardware rather than its contents
+    pub fn model_key(&self) -> String {
+        let key = format!("{}-{}-{}-{}", self.vendor_id, self.product_id, self.model, self.size_bytes);
+        key.chars()
+            .map(|c| if c.is_ascii_alphanumeric() || c == '-' || c == '.' { c } else { '_' })
+            .collect()
+    }
+
+    /// Whether sysfs told us enough to recognise the model again
+    pub fn has_model(&self) -> bool {
+        !self.vendor_id.is_empty() || !self.model.is_empty()
+    }
+}
+
+/// Look up the identity of `device_path` (e.g. /dev/sdb) in sysfs
+pub fn device_identity(device_path: &str) -> Result<DeviceIdentity> {
+    let real = std::fs::canonicalize(device_path)
+        .with_context(|| format!("Failed to resolve {}", device_path))?;
+    let name = real.file_name()
+        .and_then(|n| n.to_str())
+        .ok_or_else(|| anyhow::anyhow!("Not a block device: {}", device_path))?;
+    let sysfs = std::path::Path::new("/sys/class/block").join(name);
+
+    let read = |path: &std::path::Path| {
+        std::fs::read_to_string(path).map(|s| s.trim().to_string()).unwrap_or_default()
+    };
+    let sectors: u64 = read(&sysfs.join("size")).parse()
+        .with_context(|| format!("No sysfs entry for {}", device_path))?;
+    let model = read(&sysfs.join("device/model"));
+
+    // The USB device node is an ancestor of the SCSI device in sysfs
+    let mut identity = DeviceIdentity {
+        vendor_id: String::new(),
+        product_id: String::new(),
+        serial: String::new(),
+        model,
+        size_bytes: sectors * 512,
+    };
+    if let Ok(device_dir) = std::fs::canonicalize(sysfs.join("device")) {
+        for dir in device_dir.ancestors() {
+            if dir.join("idVendor").exists() {
+                identity.vendor_id = read(&dir.join("idVendor"));
+                identity.product_id = read(&dir.join("idProduct"));
+                identity.serial = read(&dir.join("serial"));
+                break;
+            }
+        }
+    }
+    Ok(identity)
+}
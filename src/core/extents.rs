@@ -0,0 +1,675 @@
+use anyhow::{anyhow, Context, Result};
+use std::fs::File;
+use std::io::{self, Read};
+use std::os::unix::fs::FileExt;
+
+use super::buffer::AlignedBuffer;
+use super::pipeline::ChunkSource;
+
+const SECTOR_SIZE: u64 = 512;
+
+/// Extents are widened to this alignment so every write stays block aligned
+const EXTENT_ALIGNMENT: u64 = 4096;
+
+/// Allocated extents separated by less than this are merged: writing a few
+/// unused blocks is cheaper than splitting the write
+const MIN_GAP: u64 = 256 * 1024;
+
+/// A byte range of the image
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Extent {
+    pub offset: u64,
+    pub len: u64,
+}
+
+impl Extent {
+    pub fn end(&self) -> u64 {
+        self.offset + self.len
+    }
+}
+
+/// Sorted, non-overlapping set of byte ranges of an image
+#[derive(Clone, Debug, Default)]
+pub struct ExtentMap {
+    extents: Vec<Extent>,
+}
+
+impl ExtentMap {
+    /// Add a range (in any order; call `normalize` when done)
+    pub fn add(&mut self, offset: u64, len: u64) {
+        if len > 0 {
+            self.extents.push(Extent { offset, len });
+        }
+    }
+
+    /// Align, sort, clamp to `image_size` and merge ranges closer than `MIN_GAP`
+    pub fn normalize(mut self, image_size: u64) -> Self {
+        for e in &mut self.extents {
+            let start = e.offset / EXTENT_ALIGNMENT * EXTENT_ALIGNMENT;
+            let end = (e.end() + EXTENT_ALIGNMENT - 1) / EXTENT_ALIGNMENT * EXTENT_ALIGNMENT;
+            *e = Extent { offset: start, len: end.min(image_size).saturating_sub(start) };
+        }
+        self.extents.retain(|e| e.len > 0);
+        self.extents.sort_by_key(|e| e.offset);
+
+        let mut merged: Vec<Extent> = Vec::with_capacity(self.extents.len());
+        for e in self.extents {
+            match merged.last_mut() {
+                Some(last) if e.offset <= last.end() + MIN_GAP => {
+                    let end = last.end().max(e.end()).min(image_size);
+                    last.len = end - last.offset;
+                }
+                _ => merged.push(e),
+            }
+        }
+        ExtentMap { extents: merged }
+    }
+
+    pub fn extents(&self) -> &[Extent] {
+        &self.extents
+    }
+
+    /// Number of bytes covered by the map
+    pub fn total_bytes(&self) -> u64 {
+        self.extents.iter().map(|e| e.len).sum()
+    }
+
+    /// End of the last range, the image's length when the map covers its tail
+    pub fn end(&self) -> u64 {
+        self.extents.last().map_or(0, |e| e.end())
+    }
+
+    /// The part of the map at or after `offset`, for resuming a flash
+    pub fn starting_at(&self, offset: u64) -> ExtentMap {
+        let extents = self.extents.iter()
+            .filter(|e| e.end() > offset)
+            .map(|e| {
+                let start = e.offset.max(offset);
+                Extent { offset: start, len: e.end() - start }
+            })
+            .collect();
+        ExtentMap { extents }
+    }
+}
+
+/// Reads only the ranges in an extent map, never crossing an extent
+/// boundary within one chunk
+pub struct ExtentSource {
+    file: File,
+    extents: Vec<Extent>,
+    index: usize,
+    pos: u64,
+}
+
+impl ExtentSource {
+    pub fn new(file: File, map: &ExtentMap) -> Self {
+        ExtentSource { file, extents: map.extents().to_vec(), index: 0, pos: 0 }
+    }
+}
+
+impl ChunkSource for ExtentSource {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        while let Some(extent) = self.extents.get(self.index) {
+            if self.pos >= extent.len {
+                self.index += 1;
+                self.pos = 0;
+                continue;
+            }
+
+            let n = (buf.capacity() as u64).min(extent.len - self.pos) as usize;
+            let offset = extent.offset + self.pos;
+            self.file
+                .read_exact_at(&mut buf.as_mut_full()[..n], offset)
+                .with_context(|| format!("Failed to read source image at offset {}", offset))?;
+            buf.set_len(n);
+            self.pos += n as u64;
+            return Ok(Some(offset));
+        }
+        Ok(None)
+    }
+}
+
+/// Reads only the ranges in an extent map from a sequential stream (such as
+/// a decompressor), discarding the data between them
+pub struct StreamExtentSource<R> {
+    reader: R,
+    extents: Vec<Extent>,
+    index: usize,
+    /// Position in the stream
+    pos: u64,
+}
+
+impl<R: Read + Send> StreamExtentSource<R> {
+    pub fn new(reader: R, map: &ExtentMap) -> Self {
+        StreamExtentSource { reader, extents: map.extents().to_vec(), index: 0, pos: 0 }
+    }
+}
+
+impl<R: Read + Send> ChunkSource for StreamExtentSource<R> {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        while let Some(extent) = self.extents.get(self.index) {
+            if self.pos >= extent.end() {
+                self.index += 1;
+                continue;
+            }
+
+            if self.pos < extent.offset {
+                let gap = extent.offset - self.pos;
+                let skipped = io::copy(&mut (&mut self.reader).take(gap), &mut io::sink())
+                    .context("Failed to read source image")?;
+                if skipped < gap {
+                    return Err(anyhow!("Source image ends before offset {}", extent.offset));
+                }
+                self.pos = extent.offset;
+            }
+
+            let n = (buf.capacity() as u64).min(extent.end() - self.pos) as usize;
+            self.reader
+                .read_exact(&mut buf.as_mut_full()[..n])
+                .with_context(|| format!("Failed to read source image at offset {}", self.pos))?;
+            buf.set_len(n);
+            let offset = self.pos;
+            self.pos += n as u64;
+            return Ok(Some(offset));
+        }
+        Ok(None)
+    }
+}
+
+/// Build the map of image ranges that hold data: partition tables, anything
+/// outside a partition (bootloaders often live there), and for ext2/3/4 and
+/// FAT12/16/32 partitions only their metadata and allocated blocks. Other
+/// partitions are included whole.
+///
+/// Returns the map and a short description of what was recognised.
+pub fn map_allocated_extents(image: &File, image_size: u64) -> Result<(ExtentMap, String)> {
+    let mut map = ExtentMap::default();
+    let (table, partitions) = match parse_partition_table(image, image_size)? {
+        Some((table, partitions)) => (table, partitions),
+        // No partition table: the image may be a bare filesystem
+        None => ("none", vec![Extent { offset: 0, len: image_size }]),
+    };
+
+    // Everything not inside a partition is kept as-is
+    let mut sorted = partitions.clone();
+    sorted.sort_by_key(|p| p.offset);
+    let mut cursor = 0;
+    for p in &sorted {
+        if p.offset > cursor {
+            map.add(cursor, p.offset - cursor);
+        }
+        cursor = cursor.max(p.end());
+    }
+    if cursor < image_size {
+        map.add(cursor, image_size - cursor);
+    }
+
+    let mut found = Vec::new();
+    for p in &partitions {
+        let fs = match_filesystem(image, *p, &mut map);
+        match fs {
+            Ok(Some(name)) => found.push(name.to_string()),
+            Ok(None) => {
+                map.add(p.offset, p.len);
+                found.push("other".to_string());
+            }
+            Err(_) => {
+                map.add(p.offset, p.len);
+                found.push("unreadable".to_string());
+            }
+        }
+    }
+
+    let description = format!("partition table: {}, filesystems: {}", table, found.join(", "));
+    Ok((map.normalize(image_size), description))
+}
+
+/// Add the used ranges of the filesystem in `part` to `map`, or return
+/// `None` without touching the map if it isn't a filesystem we understand
+fn match_filesystem(image: &File, part: Extent, map: &mut ExtentMap) -> Result<Option<&'static str>> {
+    let mut partial = ExtentMap::default();
+    let name = if let Some(name) = fat_allocated(image, part, &mut partial)? {
+        name
+    } else if let Some(name) = ext_allocated(image, part, &mut partial)? {
+        name
+    } else {
+        return Ok(None);
+    };
+    map.extents.extend(partial.extents);
+    Ok(Some(name))
+}
+
+fn read_at(file: &File, offset: u64, len: usize) -> Result<Vec<u8>> {
+    let mut buf = vec![0u8; len];
+    file.read_exact_at(&mut buf, offset)
+        .with_context(|| format!("Failed to read image at offset {}", offset))?;
+    Ok(buf)
+}
+
+/// Anything the partition table can be read from: an image file, or a
+/// device already opened for readback
+pub trait ReadAt {
+    /// `len` bytes at `offset`
+    fn read_bytes(&self, offset: u64, len: usize) -> Result<Vec<u8>>;
+}
+
+impl ReadAt for File {
+    fn read_bytes(&self, offset: u64, len: usize) -> Result<Vec<u8>> {
+        read_at(self, offset, len)
+    }
+}
+
+fn le16(b: &[u8], off: usize) -> u64 {
+    u16::from_le_bytes([b[off], b[off + 1]]) as u64
+}
+
+fn le32(b: &[u8], off: usize) -> u64 {
+    u32::from_le_bytes(b[off..off + 4].try_into().unwrap()) as u64
+}
+
+fn le64(b: &[u8], off: usize) -> u64 {
+    u64::from_le_bytes(b[off..off + 8].try_into().unwrap())
+}
+
+/// Offset of the ISO 9660 volume descriptors
+const ISO_VOLUME_DESCRIPTORS: u64 = 32 * 1024;
+
+/// Offsets of what a copy of the image is unusable without: the partition
+/// table (MBR, primary and backup GPT), ISO 9660 volume descriptors, and each
+/// partition's boot sector and ext superblock
+pub fn metadata_offsets<R: ReadAt + ?Sized>(image: &R, image_size: u64) -> Vec<u64> {
+    let mut offsets = vec![
+        0,
+        ISO_VOLUME_DESCRIPTORS,
+        image_size.saturating_sub(33 * SECTOR_SIZE),
+        image_size.saturating_sub(SECTOR_SIZE),
+    ];
+    if let Ok(Some((_, partitions))) = parse_partition_table(image, image_size) {
+        for p in partitions {
+            offsets.push(p.offset);
+            offsets.push(p.offset + 1024);
+        }
+    }
+    offsets.retain(|&offset| offset < image_size);
+    offsets.sort_unstable();
+    offsets.dedup();
+    offsets
+}
+
+/// Parse an MBR or GPT partition table. Returns `None` if the image has none.
+fn parse_partition_table<R: ReadAt + ?Sized>(image: &R, image_size: u64) -> Result<Option<(&'static str, Vec<Extent>)>> {
+    if image_size < 2 * SECTOR_SIZE {
+        return Ok(None);
+    }
+    let mbr = image.read_bytes(0, SECTOR_SIZE as usize)?;
+    if mbr[510..512] != [0x55, 0xAA] || looks_like_boot_sector(&mbr) {
+        return Ok(None);
+    }
+
+    let mut partitions = Vec::new();
+    let mut is_gpt = false;
+    for i in 0..4 {
+        let e = &mbr[446 + 16 * i..446 + 16 * (i + 1)];
+        let (status, ptype) = (e[0], e[4]);
+        let start = le32(e, 8) * SECTOR_SIZE;
+        let len = le32(e, 12) * SECTOR_SIZE;
+        if ptype == 0 || len == 0 {
+            continue;
+        }
+        // Garbage in the table area means this isn't really an MBR
+        if (status != 0x00 && status != 0x80) || start >= image_size {
+            return Ok(None);
+        }
+        if ptype == 0xEE {
+            is_gpt = true;
+        } else {
+            // Extended partitions (0x05/0x0F/0x85) are kept whole, which
+            // covers their logical partitions too
+            partitions.push(Extent { offset: start, len: len.min(image_size.saturating_sub(start)) });
+        }
+    }
+
+    if !is_gpt {
+        return Ok(if partitions.is_empty() { None } else { Some(("mbr", partitions)) });
+    }
+
+    let header = image.read_bytes(SECTOR_SIZE, SECTOR_SIZE as usize)?;
+    if &header[0..8] != b"EFI PART" {
+        return Err(anyhow!("Protective MBR without a GPT header"));
+    }
+    let entries_lba = le64(&header, 72);
+    let entry_count = le32(&header, 80) as usize;
+    let entry_size = le32(&header, 84) as usize;
+    if entry_size < 128 || entry_count > 1024 {
+        return Err(anyhow!("Unsupported GPT layout"));
+    }
+
+    let entries = image.read_bytes(entries_lba * SECTOR_SIZE, entry_count * entry_size)?;
+    let mut partitions = Vec::new();
+    for e in entries.chunks_exact(entry_size) {
+        if e[0..16].iter().all(|&b| b == 0) {
+            continue;
+        }
+        let first = le64(e, 32) * SECTOR_SIZE;
+        let last = (le64(e, 40) + 1) * SECTOR_SIZE;
+        if last > first && first < image_size {
+            partitions.push(Extent { offset: first, len: last.min(image_size) - first });
+        }
+    }
+    Ok(Some(("gpt", partitions)))
+}
+
+/// A FAT/NTFS/exFAT boot sector also ends in 55 AA; don't mistake it for an MBR
+fn looks_like_boot_sector(sector: &[u8]) -> bool {
+    let jump = sector[0] == 0xEB || sector[0] == 0xE9;
+    let bytes_per_sector = le16(sector, 11);
+    jump && matches!(bytes_per_sector, 512 | 1024 | 2048 | 4096)
+}
+
+/// Fixed-size bitset over filesystem blocks/clusters
+struct BlockSet {
+    words: Vec<u64>,
+    len: u64,
+}
+
+impl BlockSet {
+    fn new(len: u64) -> Self {
+        BlockSet { words: vec![0; ((len + 63) / 64) as usize], len }
+    }
+
+    fn set(&mut self, i: u64) {
+        if i < self.len {
+            self.words[(i / 64) as usize] |= 1 << (i % 64);
+        }
+    }
+
+    fn set_range(&mut self, start: u64, count: u64) {
+        for i in start..(start + count).min(self.len) {
+            self.set(i);
+        }
+    }
+
+    fn get(&self, i: u64) -> bool {
+        self.words[(i / 64) as usize] & (1 << (i % 64)) != 0
+    }
+
+    /// Runs of set bits as (start, count)
+    fn runs(&self) -> Vec<(u64, u64)> {
+        let mut runs = Vec::new();
+        let mut i = 0;
+        while i < self.len {
+            if self.words[(i / 64) as usize] == 0 {
+                i = (i / 64 + 1) * 64;
+                continue;
+            }
+            if self.get(i) {
+                let start = i;
+                while i < self.len && self.get(i) {
+                    i += 1;
+                }
+                runs.push((start, i - start));
+            } else {
+                i += 1;
+            }
+        }
+        runs
+    }
+}
+
+/// Add the metadata and allocated clusters of a FAT12/16/32 volume
+fn fat_allocated(image: &File, part: Extent, map: &mut ExtentMap) -> Result<Option<&'static str>> {
+    if part.len < SECTOR_SIZE {
+        return Ok(None);
+    }
+    let bs = read_at(image, part.offset, SECTOR_SIZE as usize)?;
+    let bytes_per_sector = le16(&bs, 11);
+    let sectors_per_cluster = bs[13] as u64;
+    let reserved = le16(&bs, 14);
+    let fat_count = bs[16] as u64;
+    let root_entries = le16(&bs, 17);
+    let fat_size = if le16(&bs, 22) != 0 { le16(&bs, 22) } else { le32(&bs, 36) };
+    let total = if le16(&bs, 19) != 0 { le16(&bs, 19) } else { le32(&bs, 32) };
+
+    let valid = bs[510..512] == [0x55, 0xAA]
+        && matches!(bytes_per_sector, 512 | 1024 | 2048 | 4096)
+        && sectors_per_cluster.is_power_of_two()
+        && reserved > 0
+        && (1..=2).contains(&fat_count)
+        && fat_size > 0
+        && &bs[3..7] != b"NTFS"
+        && &bs[3..8] != b"EXFAT";
+    if !valid {
+        return Ok(None);
+    }
+
+    let root_dir_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+    let data_start = reserved + fat_count * fat_size + root_dir_sectors;
+    if data_start >= total || total * bytes_per_sector > part.len {
+        return Err(anyhow!("FAT geometry doesn't fit the partition"));
+    }
+    let clusters = (total - data_start) / sectors_per_cluster;
+    let (name, kind) = match clusters {
+        c if c < 4085 => ("fat12", 12),
+        c if c < 65525 => ("fat16", 16),
+        _ => ("fat32", 32),
+    };
+
+    // Boot sector, reserved sectors, FATs and (FAT12/16) root directory
+    map.add(part.offset, data_start * bytes_per_sector);
+
+    let fat = read_at(image, part.offset + reserved * bytes_per_sector, (fat_size * bytes_per_sector) as usize)?;
+    let mut used = BlockSet::new(clusters);
+    for c in 0..clusters {
+        let n = c + 2;
+        let entry = match kind {
+            12 => {
+                let off = (n + n / 2) as usize;
+                if off + 1 >= fat.len() { break; }
+                let v = le16(&fat, off);
+                if n & 1 == 1 { v >> 4 } else { v & 0xFFF }
+            }
+            16 => {
+                if (n * 2 + 1) as usize >= fat.len() { break; }
+                le16(&fat, (n * 2) as usize)
+            }
+            _ => {
+                if (n * 4 + 3) as usize >= fat.len() { break; }
+                le32(&fat, (n * 4) as usize) & 0x0FFF_FFFF
+            }
+        };
+        if entry != 0 {
+            used.set(c);
+        }
+    }
+
+    let cluster_bytes = sectors_per_cluster * bytes_per_sector;
+    let data_offset = part.offset + data_start * bytes_per_sector;
+    for (start, count) in used.runs() {
+        map.add(data_offset + start * cluster_bytes, count * cluster_bytes);
+    }
+    Ok(Some(name))
+}
+
+// ext2/3/4 feature flags we need to know about
+const EXT_COMPAT_RESIZE_INODE: u64 = 0x10;
+const EXT_COMPAT_SPARSE_SUPER2: u64 = 0x200;
+const EXT_INCOMPAT_META_BG: u64 = 0x10;
+const EXT_INCOMPAT_64BIT: u64 = 0x80;
+const EXT_RO_COMPAT_SPARSE_SUPER: u64 = 0x1;
+const EXT_BG_BLOCK_UNINIT: u64 = 0x2;
+
+/// Add the metadata and allocated blocks of an ext2/3/4 filesystem
+fn ext_allocated(image: &File, part: Extent, map: &mut ExtentMap) -> Result<Option<&'static str>> {
+    if part.len < 2048 {
+        return Ok(None);
+    }
+    let sb = read_at(image, part.offset + 1024, 1024)?;
+    if le16(&sb, 56) != 0xEF53 {
+        return Ok(None);
+    }
+
+    let compat = le32(&sb, 92);
+    let incompat = le32(&sb, 96);
+    let ro_compat = le32(&sb, 100);
+    if incompat & EXT_INCOMPAT_META_BG != 0 || compat & EXT_COMPAT_SPARSE_SUPER2 != 0 {
+        return Err(anyhow!("Unsupported ext layout (meta_bg/sparse_super2)"));
+    }
+
+    let is_64bit = incompat & EXT_INCOMPAT_64BIT != 0;
+    let block_size = 1024u64 << le32(&sb, 24);
+    let first_data_block = le32(&sb, 20);
+    let blocks_per_group = le32(&sb, 32);
+    let inodes_per_group = le32(&sb, 40);
+    let blocks = le32(&sb, 4) | if is_64bit { le32(&sb, 0x150) << 32 } else { 0 };
+    let inode_size = if le32(&sb, 76) >= 1 { le16(&sb, 88) } else { 128 };
+    let desc_size = if is_64bit { le16(&sb, 254).max(32) } else { 32 };
+    let reserved_gdt = if compat & EXT_COMPAT_RESIZE_INODE != 0 { le16(&sb, 206) } else { 0 };
+    let sparse_super = ro_compat & EXT_RO_COMPAT_SPARSE_SUPER != 0;
+
+    if block_size > 65536 || blocks_per_group == 0 || blocks * block_size > part.len {
+        return Err(anyhow!("ext geometry doesn't fit the partition"));
+    }
+
+    let groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    let gdt_blocks = (groups * desc_size + block_size - 1) / block_size;
+    let inode_table_blocks = (inodes_per_group * inode_size + block_size - 1) / block_size;
+    let gdt = read_at(image, part.offset + (first_data_block + 1) * block_size, (gdt_blocks * block_size) as usize)?;
+
+    let has_backup = |g: u64| {
+        let power_of = |mut n: u64, base: u64| {
+            while n > 1 && n % base == 0 { n /= base; }
+            n == 1
+        };
+        !sparse_super || g <= 1 || power_of(g, 3) || power_of(g, 5) || power_of(g, 7)
+    };
+
+    let mut used = BlockSet::new(blocks);
+    // Boot block(s) and the primary superblock
+    used.set_range(0, first_data_block + 1);
+
+    for g in 0..groups {
+        let d = &gdt[(g * desc_size) as usize..((g + 1) * desc_size) as usize];
+        let hi = |off: usize| if is_64bit && desc_size >= 64 { le32(d, off) << 32 } else { 0 };
+        let block_bitmap = le32(d, 0) | hi(0x20);
+        let inode_bitmap = le32(d, 4) | hi(0x24);
+        let inode_table = le32(d, 8) | hi(0x28);
+        let flags = le16(d, 18);
+
+        let group_start = first_data_block + g * blocks_per_group;
+        let group_blocks = blocks_per_group.min(blocks - group_start);
+
+        // Metadata, whether or not the group's bitmap is initialised
+        if has_backup(g) {
+            used.set_range(group_start, 1 + gdt_blocks + reserved_gdt);
+        }
+        used.set(block_bitmap);
+        used.set(inode_bitmap);
+        used.set_range(inode_table, inode_table_blocks);
+
+        if flags & EXT_BG_BLOCK_UNINIT == 0 {
+            let bitmap = read_at(image, part.offset + block_bitmap * block_size, block_size as usize)?;
+            for i in 0..group_blocks {
+                if bitmap[(i / 8) as usize] & (1 << (i % 8)) != 0 {
+                    used.set(group_start + i);
+                }
+            }
+        }
+    }
+
+    for (start, count) in used.runs() {
+        map.add(part.offset + start * block_size, count * block_size);
+    }
+    Ok(Some("ext"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_stream_extent_source_skips_gaps() {
+        let data: Vec<u8> = (0..3_000_000u32).map(|i| (i % 251) as u8).collect();
+        let mut map = ExtentMap::default();
+        map.add(4096, 8192);
+        map.add(2_000_000, 600_000);
+        let map = map.normalize(data.len() as u64);
+
+        let mut source = StreamExtentSource::new(std::io::Cursor::new(data.clone()), &map);
+        let mut buf = AlignedBuffer::new(256 * 1024);
+        let mut seen = 0;
+        while let Some(offset) = source.next_chunk(&mut buf).unwrap() {
+            let start = offset as usize;
+            assert!(buf.as_slice() == &data[start..start + buf.len()]);
+            seen += buf.len() as u64;
+        }
+        assert_eq!(seen, map.total_bytes());
+    }
+
+    #[test]
+    fn test_normalize_aligns_and_merges() {
+        let mut map = ExtentMap::default();
+        map.add(10_000_000, 100);
+        map.add(1, 10);
+        map.add(8192, 4096);
+        map.add(20_000_000, 5_000_000);
+        let map = map.normalize(22_000_000);
+
+        assert_eq!(map.extents(), &[
+            Extent { offset: 0, len: 12288 },
+            Extent { offset: 9_998_336, len: 4096 },
+            Extent { offset: 19_996_672, len: 2_003_328 },
+        ]);
+    }
+
+    /// Minimal FAT16 volume inside an MBR partition, with clusters 2-3 and 100 in use
+    #[test]
+    fn test_mbr_fat16_only_maps_used_clusters() {
+        let part_offset = 1024 * 1024u64;
+        let total_sectors = 40_000u64;
+        let image_size = part_offset + total_sectors * 512;
+        let mut image = vec![0u8; image_size as usize];
+
+        // MBR with one FAT16 partition
+        image[446 + 4] = 0x06;
+        image[446 + 8..446 + 12].copy_from_slice(&((part_offset / 512) as u32).to_le_bytes());
+        image[446 + 12..446 + 16].copy_from_slice(&(total_sectors as u32).to_le_bytes());
+        image[510] = 0x55;
+        image[511] = 0xAA;
+
+        // Boot sector: 512 B/sector, 1 sector/cluster, 4 reserved, 2 FATs of 160 sectors, 512 root entries
+        let bs = &mut image[part_offset as usize..part_offset as usize + 512];
+        bs[0] = 0xEB;
+        bs[3..11].copy_from_slice(b"MSDOS5.0");
+        bs[11..13].copy_from_slice(&512u16.to_le_bytes());
+        bs[13] = 1;
+        bs[14..16].copy_from_slice(&4u16.to_le_bytes());
+        bs[16] = 2;
+        bs[17..19].copy_from_slice(&512u16.to_le_bytes());
+        bs[19..21].copy_from_slice(&(total_sectors as u16).to_le_bytes());
+        bs[22..24].copy_from_slice(&160u16.to_le_bytes());
+        bs[510] = 0x55;
+        bs[511] = 0xAA;
+
+        let fat = part_offset as usize + 4 * 512;
+        for (cluster, value) in [(2usize, 3u16), (3, 0xFFFF), (100, 0xFFFF)] {
+            image[fat + cluster * 2..fat + cluster * 2 + 2].copy_from_slice(&value.to_le_bytes());
+        }
+
+        let path = std::env::temp_dir().join(format!("fluxflasher-extents-{}.img", std::process::id()));
+        File::create(&path).unwrap().write_all(&image).unwrap();
+        let file = File::open(&path).unwrap();
+        let (map, description) = map_allocated_extents(&file, image_size).unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        assert_eq!(description, "partition table: mbr, filesystems: fat16");
+        // Data starts after 4 reserved + 320 FAT + 32 root dir sectors
+        let data = part_offset + 356 * 512;
+        let extents = map.extents();
+        assert_eq!(extents[0].offset, 0);
+        assert!(extents[0].end() >= data + 2 * 512, "metadata and first clusters missing");
+        let last = extents.last().unwrap();
+        assert!(last.offset <= data + 98 * 512 && last.end() >= data + 99 * 512);
+        assert!(map.total_bytes() < image_size / 4);
+    }
+}
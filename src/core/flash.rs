@@ -1,19 +1,454 @@
 use anyhow::{Context, Result};
-use std::io::{BufRead, BufReader};
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
 use std::path::PathBuf;
-use std::process::{Command, Stdio};
+use std::process::Command;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::sync_channel;
 use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::Instant;
 
-/// Flash an image to a device with progress tracking
+use super::buffer::allocate_ring;
+use super::control::{Control, ControlledWriter};
+use super::delta::{DeltaState, DeltaWriter};
+use super::device::device_identity;
+use super::extents::{ExtentMap, ExtentSource, StreamExtentSource};
+use super::hash::HashAlgorithm;
+use super::http::is_url;
+use super::image::{open_image, open_url_image, Compression};
+use super::journal::{chunk_hash, Journal, JournalWriter};
+use super::kcopy::{is_unsupported, CopyMethod, KernelCopy};
+use super::metrics::Metrics;
+use super::options::FlashOptions;
+use super::pipeline::{run_pipeline, BlockWriter, Chunk, ChunkSource, StreamSource};
+use super::privileged::{open_device, Access};
+use super::snapshot::Watched;
+use super::store::Store;
+use super::verify::{ChunkDigests, ChunkHasher, DigestSource};
+use super::tune::{device_alignment, device_profile, DeviceProfile};
+use super::writeback::{Writeback, WritebackWriter};
+use super::writer::{chunk_size_for, open_writer, ring_depth_for};
+
+/// What a flash wrote
+pub struct Flashed {
+    pub image_size: u64,
+    /// Leaf hashes of the image data written, if the flash read all of it
+    pub digest: Option<ChunkDigests>,
+}
+
+/// Where a flash reports what it is doing, and what steers it while it runs
+pub struct FlashContext {
+    pub progress: Arc<Watched<f32>>,
+    pub status: Arc<Watched<String>>,
+    /// Bytes handed to the kernel
+    pub bytes_written: Arc<Watched<u64>>,
+    /// Bytes that didn't have to be written (trim, delta)
+    pub bytes_skipped: Arc<Watched<u64>>,
+    /// Bytes known to be on the device
+    pub bytes_durable: Arc<Watched<u64>>,
+    /// Bytes received, when the image is a URL
+    pub bytes_downloaded: Arc<AtomicU64>,
+    /// Chunk size and queue depth actually used
+    pub io_profile: Arc<Mutex<Option<DeviceProfile>>>,
+    pub control: Arc<Control>,
+    pub metrics: Arc<Metrics>,
+}
+
+/// Flash an image to a device with progress tracking. Compressed images and
+/// archives are decompressed on the fly. With `extents`, only those ranges of
+/// the image are written.
+///
+/// Progress is checkpointed to an on-host journal as it becomes durable; with
+/// `options.resume` an interrupted flash of the same image continues from
+/// the last checkpoint.
+///
+/// `image_path` may be an http(s) URL: the image is then downloaded,
+/// decompressed and written in one pass, and `bytes_downloaded` counts bytes
+/// received. Streamed images have no journal, since there is no local file to
+/// resume from.
+///
+/// With `options.image_store`, a compressed image is also written to the
+/// local image store as it is decompressed, so the next flash of it can read
+/// the stored copy (see `Store::resolve`).
+///
+/// With `options.autotune`, chunk size and queue depth come from the
+/// device's profile (calibrating it first if its model is new). The
+/// parameters actually used are published through `io_profile`.
+///
+/// `bytes_written` counts bytes handed to the kernel, `bytes_durable` bytes
+/// known to be on the device. With `options.bounded_writeback` the two stay
+/// close together and progress follows the durable count; otherwise nothing
+/// is known to be durable until the final sync.
+///
+/// Device I/O goes through `control`: the flash waits while it is paused
+/// or over its bandwidth cap, and fails with the journal kept (so it can be
+/// resumed) once it is cancelled.
+///
+/// The reader, writer and hasher record where their time went in
+/// `metrics`.
+///
+/// Returns the number of image bytes streamed to the device and, unless
+/// part of the image was skipped by resuming, the leaf hashes
+/// (`ChunkDigests`, in `options.verify_hash`) of the image data read (of the
+/// extents only, with `extents`), so that verification doesn't have to read
+/// the image again.
 pub fn flash_image(
-    image_path: &PathBuf, 
-    device_path: &str, 
-    progress: Arc<Mutex<f32>>, 
-    status: Arc<Mutex<String>>, 
-    bytes_written: Arc<Mutex<u64>>,
-    mount_points: &[String]
-) -> Result<()> {
+    image_path: &PathBuf,
+    device_path: &str,
+    mount_points: &[String],
+    options: &FlashOptions,
+    extents: Option<&ExtentMap>,
+    context: &FlashContext,
+) -> Result<Flashed> {
+    let FlashContext {
+        progress,
+        status,
+        bytes_written,
+        bytes_skipped,
+        bytes_durable,
+        bytes_downloaded,
+        io_profile,
+        control,
+        metrics,
+    } = context;
+
     // 1. Unmount all partitions
+    unmount_partitions(mount_points, status)?;
+
+    // 2. Open and lock the device, then stream the image into it
+    *status.lock().unwrap() = "Starting write process...".to_string();
+    let consumed = Arc::new(AtomicU64::new(0));
+    let remote = image_path.to_str().filter(|p| is_url(p));
+    let (mut image, info) = match remote {
+        Some(url) => {
+            *status.lock().unwrap() = "Connecting...".to_string();
+            open_url_image(url, consumed.clone(), bytes_downloaded.clone())
+        }
+        None => open_image(image_path, consumed.clone()),
+    }
+    .with_context(|| format!("Failed to open image {}", image_path.display()))?;
+    // Bytes to stream, for progress; with `extents` that is less than the
+    // image's full length, which is what the device has to hold
+    let image_size = match extents {
+        Some(map) => Some(map.total_bytes()),
+        None => info.image_size,
+    };
+    let image_len = info.image_size.or_else(|| extents.map(|map| map.end()));
+
+    let device = open_device_exclusive(device_path)?;
+
+    // Tune chunk size and queue depth for this model; if calibration fails
+    // the defaults still work
+    let mut tuned = options.clone();
+    let mut measured = None;
+    if options.autotune {
+        *status.lock().unwrap() = "Calibrating device...".to_string();
+        let profile = device_profile(device_path, &device, |percent| {
+            *status.lock().unwrap() = format!("Calibrating device ({}%)...", percent);
+        });
+        if let Ok(profile) = profile {
+            profile.apply(&mut tuned);
+            measured = Some(profile);
+        }
+    }
+    let options = &tuned;
+    control.checkpoint(0)?;
+
+    // Pick up where an interrupted flash left off, if its journal still
+    // matches the device; otherwise start a fresh journal
+    let mode = if extents.is_some() { "extents" } else { "full" };
+    let previous = if options.resume { Journal::load(image_path, device_path, Some(mode)) } else { None };
+    let mut journal = match previous {
+        _ if remote.is_some() => None,
+        Some(journal) => {
+            *status.lock().unwrap() = "Checking previously written data...".to_string();
+            if journal.check_committed(&device) {
+                Some(journal)
+            } else {
+                *status.lock().unwrap() = "Previous data changed, starting over...".to_string();
+                Some(Journal::create(image_path, device_path, mode)?)
+            }
+        }
+        None => Some(Journal::create(image_path, device_path, mode)?),
+    };
+    control.checkpoint(0)?;
+    let resume_from = journal.as_ref().map_or(0, |j| j.committed);
+    let remaining = extents.map(|map| map.starting_at(resume_from));
+
+    // Keep the decompressed image for next time; only a complete pass from
+    // the start of the image gives a complete copy
+    if options.image_store && remote.is_none() && !info.is_raw() && extents.is_none() && resume_from == 0 {
+        image = match Store::open().fill(image, image_path, info.image_size) {
+            Ok(fill) => Box::new(fill),
+            Err(image) => image,
+        };
+    }
+    let already = match (extents, &remaining) {
+        (Some(map), Some(rest)) => map.total_bytes() - rest.total_bytes(),
+        _ => resume_from,
+    };
+
+    let chunk_size = chunk_size_for(options);
+    *io_profile.lock().unwrap() = Some(DeviceProfile {
+        chunk_size,
+        queue_depth: options.queue_depth,
+        alignment: measured.as_ref().map_or_else(|| device_alignment(device_path), |p| p.alignment),
+        throughput: measured.as_ref().map_or(0, |p| p.throughput),
+        cached: measured.as_ref().map_or(false, |p| p.cached),
+    });
+
+    // Notes on how the image is written, for the status line
+    let mut notes = String::new();
+    if measured.is_some() {
+        notes += &format!(", {} KiB chunks", chunk_size / 1024);
+    }
+    if resume_from > 0 {
+        notes += &format!(", resuming at {}", super::utils::format_size(resume_from));
+    }
+    if remote.is_some() {
+        notes += ", streaming";
+    }
+
+    let mut processed = already;
+    let mut written = 0u64;
+    let mut account = |len: u64, skipped: bool| {
+        // Chunks can complete out of order, so count bytes rather than offsets
+        if skipped {
+            *bytes_skipped.lock().unwrap() += len;
+        } else {
+            *bytes_written.lock().unwrap() += len;
+            written += len;
+        }
+        processed += len;
+        // Written bytes only count once they are on the device
+        let on_device = if options.bounded_writeback {
+            processed - written + *bytes_durable.lock().unwrap()
+        } else {
+            processed
+        };
+        // Without an uncompressed size, go by how much of the file was read
+        let fraction = match image_size {
+            Some(size) => on_device as f32 / size.max(1) as f32,
+            None if info.file_size > 0 => consumed.load(Ordering::Relaxed) as f32 / info.file_size as f32,
+            // A download of unknown length
+            None => 0.0,
+        };
+        *progress.lock().unwrap() = fraction.min(0.99);
+    };
+
+    // Raw images that need no transformation are copied inside the kernel
+    let mut copied = None;
+    if let Some(journal) = journal.as_mut().filter(|_| options.zero_copy && info.is_raw() && !options.trim && !options.delta) {
+        let ranges: Vec<(u64, u64)> = match &remaining {
+            Some(map) => map.extents().iter().map(|e| (e.offset, e.len)).collect(),
+            None => vec![(resume_from, info.file_size.saturating_sub(resume_from))],
+        };
+        let mut writeback = options.bounded_writeback.then(|| Writeback::new(&device, bytes_durable.clone()));
+        copied = copy_in_kernel(
+            image_path, &device, &ranges, chunk_size, journal, writeback.as_mut(), options.hash_source.then_some(options.verify_hash), control,
+            metrics,
+            |method| *status.lock().unwrap() = format!("Writing image (zero-copy, {}{})...", method, notes),
+            |len| account(len, false),
+        )?;
+    }
+
+    // In delta mode, find out what the device already holds first
+    let mut delta = if options.delta {
+        *status.lock().unwrap() = "Comparing with device contents...".to_string();
+        let identity = device_identity(device_path).ok();
+        // Full verification catches a manifest that no longer fits the device
+        let verified_in_full = options.verify_samples == 0;
+        let state = DeltaState::prepare(&device, identity, image_len, verified_in_full, |done| {
+            let percent = done * 100 / image_len.unwrap_or(1).max(1);
+            *status.lock().unwrap() = format!("Comparing with device contents ({}%)...", percent);
+        })?;
+        control.checkpoint(0)?;
+        Some(state)
+    } else {
+        None
+    };
+
+    let (total, digest) = match copied {
+        Some((total, digest)) => (total, digest.filter(|_| resume_from == 0)),
+        None => {
+            let buffers = allocate_ring(chunk_size, ring_depth_for(options, chunk_size));
+            let (writer, backend) = open_writer(&device, &buffers, options)?;
+            let writer: Box<dyn BlockWriter> = Box::new(ControlledWriter::new(writer, control));
+            let writer: Box<dyn BlockWriter> = if options.bounded_writeback {
+                Box::new(WritebackWriter::new(writer, &device, bytes_durable.clone()))
+            } else {
+                writer
+            };
+            let (writer, backend) = match delta.as_mut() {
+                Some(state) => {
+                    let desc = format!("{}, changed blocks only ({})", backend, state.origin);
+                    (Box::new(DeltaWriter::new(writer, &device, state)) as Box<dyn BlockWriter>, desc)
+                }
+                None => (writer, backend),
+            };
+            let mut writer: Box<dyn BlockWriter> = match journal.as_mut() {
+                Some(journal) => Box::new(JournalWriter::new(writer, &device, journal)),
+                None => writer,
+            };
+
+            *status.lock().unwrap() = match info.compression {
+                Compression::None => format!("Writing image ({}{})...", backend, notes),
+                _ => format!("Decompressing and writing image ({}{})...", backend, notes),
+            };
+            let on_done = |chunk: &Chunk| account(chunk.buf.len() as u64, chunk.skipped);
+            // The source is hashed as it is read, for verification; a resumed
+            // flash only sees the whole image if it had to read the prefix
+            let mut prefix = options.hash_source.then(|| ChunkHasher::measured(options.verify_hash, metrics.clone()));
+            let mut whole = resume_from == 0;
+            let source: Box<dyn ChunkSource> = match &remaining {
+                Some(map) if info.is_raw() => Box::new(ExtentSource::new(File::open(image_path)?, map)),
+                Some(map) => Box::new(StreamExtentSource::new(image, map)),
+                None if info.is_raw() => {
+                    let mut raw = File::open(image_path)?;
+                    raw.seek(SeekFrom::Start(resume_from))?;
+                    Box::new(StreamSource::new(raw).at_offset(resume_from))
+                }
+                None => {
+                    // Compressed streams can't seek; decompress and hash the prefix
+                    let mut skip = (&mut image).take(resume_from);
+                    let skipped = match prefix.as_mut() {
+                        Some(prefix) => std::io::copy(&mut skip, prefix)?,
+                        None => std::io::copy(&mut skip, &mut std::io::sink())?,
+                    };
+                    if skipped < resume_from {
+                        return Err(anyhow::anyhow!("Image is shorter than the checkpoint"));
+                    }
+                    whole = true;
+                    Box::new(StreamSource::new(image).at_offset(resume_from))
+                }
+            };
+            match prefix {
+                Some(prefix) => {
+                    let mut source = DigestSource::new(source, prefix);
+                    let total = run_pipeline(&mut source, buffers, &mut *writer, metrics, on_done)?;
+                    (total, whole.then(|| source.finish()))
+                }
+                None => (run_pipeline(source, buffers, &mut *writer, metrics, on_done)?, None),
+            }
+        }
+    };
+    let total = already + total;
+
+    // 3. Make sure everything actually reached the device
+    *status.lock().unwrap() = "Syncing device...".to_string();
+    device.sync_all().context("Failed to sync device")?;
+    *bytes_durable.lock().unwrap() = *bytes_written.lock().unwrap();
+    if let Some(journal) = &journal {
+        journal.remove();
+    }
+
+    // Best effort: without a manifest the next delta reflash reads the device
+    if let Some(state) = &delta {
+        let _ = state.save_manifest(image_len.unwrap_or(total));
+    }
+
+    *progress.lock().unwrap() = 1.0;
+    Ok(Flashed { image_size: total, digest })
+}
+
+/// Copy raw image ranges to the device inside the kernel, committing each
+/// chunk to the journal and to writeback as it lands. The journal hashes are
+/// taken on a second thread that reads the chunks back from the page cache,
+/// so hashing costs no extra I/O and doesn't hold up the copy.
+///
+/// With an `algorithm`, the same chunks are hashed into verification leaves
+/// on the way. Each chunk passes `control` before it is copied, and its
+/// copy is timed into `metrics` as a write.
+///
+/// Returns the bytes copied and their leaf hashes, or `None` if the kernel
+/// refuses before anything was copied, so the caller can fall back to the
+/// pipeline.
+fn copy_in_kernel<S: FnMut(CopyMethod), F: FnMut(u64)>(
+    image_path: &PathBuf,
+    device: &File,
+    ranges: &[(u64, u64)],
+    chunk_size: usize,
+    journal: &mut Journal,
+    mut writeback: Option<&mut Writeback>,
+    algorithm: Option<HashAlgorithm>,
+    control: &Control,
+    metrics: &Arc<Metrics>,
+    mut on_start: S,
+    mut on_chunk: F,
+) -> Result<Option<(u64, Option<ChunkDigests>)>> {
+    let image = File::open(image_path)?;
+    let mut copier = KernelCopy::new(&image, device);
+    let (tx, rx) = sync_channel::<(u64, u64)>(16);
+
+    thread::scope(|scope| {
+        let image = &image;
+        let hasher = scope.spawn(move || -> Result<Option<ChunkDigests>> {
+            let mut buffer = vec![0u8; chunk_size];
+            let mut digest = algorithm.map(|algorithm| ChunkHasher::measured(algorithm, metrics.clone()));
+            for (offset, len) in rx {
+                let data = &mut buffer[..len as usize];
+                image.read_exact_at(data, offset)?;
+                if let Some(digest) = digest.as_mut() {
+                    digest.update_at(offset, data);
+                }
+                journal.commit(device, offset, len, chunk_hash(data))?;
+            }
+            Ok(digest.map(ChunkHasher::finish))
+        });
+
+        let mut copy = || -> Result<Option<u64>> {
+            let mut total = 0u64;
+            for &(start, len) in ranges {
+                let end = start + len;
+                let mut offset = start;
+                while offset < end {
+                    let n = (end - offset).min(chunk_size as u64);
+                    control.checkpoint(n)?;
+                    let writing = Instant::now();
+                    match copier.copy(offset, n) {
+                        Err(e) if total == 0 && is_unsupported(&e) => return Ok(None),
+                        Err(e) => {
+                            return Err(e).with_context(|| format!("Failed to copy to device at offset {}", offset))
+                        }
+                        Ok(()) => {}
+                    }
+                    metrics.write_latency.record(writing.elapsed());
+                    metrics.write.busy(writing);
+                    metrics.wrote(n);
+                    if total == 0 {
+                        on_start(copier.method());
+                    }
+                    if let Some(writeback) = writeback.as_mut() {
+                        writeback.completed(offset, offset + n)?;
+                    }
+                    // The hasher only stops early on an error, reported below
+                    if tx.send((offset, n)).is_err() {
+                        return Ok(Some(total));
+                    }
+                    on_chunk(n);
+                    total += n;
+                    offset += n;
+                }
+            }
+            if let Some(writeback) = writeback.as_mut() {
+                writeback.finish()?;
+            }
+            Ok(Some(total))
+        };
+        let copied = copy();
+        drop(tx);
+        let hashed = hasher.join().unwrap();
+        let copied = copied?;
+        let digest = hashed?;
+        Ok(copied.map(|total| (total, digest)))
+    })
+}
+
+/// Unmount every mount point of the target device (through pkexec)
+pub fn unmount_partitions(mount_points: &[String], status: &Watched<String>) -> Result<()> {
     if !mount_points.is_empty() {
         *status.lock().unwrap() = "Unmounting partitions...".to_string();
         for mp in mount_points {
@@ -22,52 +457,30 @@ pub fn flash_image(
                 .arg(mp)
                 .status()
                 .context("Failed to execute umount")?;
-            
+
             if !umount_status.success() {
                  return Err(anyhow::anyhow!("Failed to unmount {}", mp));
             }
         }
     }
+    Ok(())
+}
 
-    // 2. Flash with flock and progress
-    *status.lock().unwrap() = "Starting write process...".to_string();
-    let image_size = std::fs::metadata(image_path)?.len();
-    
-    let mut child = Command::new("pkexec")
-        .arg("flock")
-        .arg(device_path)
-        .arg("dd")
-        .arg(format!("if={}", image_path.display()))
-        .arg(format!("of={}", device_path))
-        .arg("bs=4M")
-        .arg("conv=fsync")
-        .arg("status=progress")
-        .stdout(Stdio::null())
-        .stderr(Stdio::piped())
-        .spawn()
-        .context("Failed to start dd")?;
-
-    let stderr = child.stderr.take().ok_or_else(|| anyhow::anyhow!("Failed to capture stderr"))?;
-    let reader = BufReader::new(stderr);
-    
-    for line in reader.lines() {
-        if let Ok(line) = line {
-            // dd status=progress format: "20971520 bytes (21 MB, 20 MiB) copied, ..."
-            if let Some(bytes_str) = line.split_whitespace().next() {
-                if let Ok(bytes) = bytes_str.parse::<u64>() {
-                     *bytes_written.lock().unwrap() = bytes;
-                     *progress.lock().unwrap() = (bytes as f32 / image_size as f32).min(0.99);
-                }
-            }
-        }
-    }
+/// Open a block device for reading and writing and take an exclusive flock on it.
+///
+/// The lock is the same one `flock(1)` and udev use, so udev won't probe the
+/// device while we're writing it. It is released when the file is closed.
+/// A device the user may not open is opened by the privileged helper; the
+/// lock is taken on the descriptor it hands back all the same.
+pub fn open_device_exclusive(device_path: &str) -> Result<File> {
+    let device = open_device(device_path, Access::Write)
+        .with_context(|| format!("Failed to open {} for writing", device_path))?;
 
-    let exit_status = child.wait()?;
-    if !exit_status.success() {
-        return Err(anyhow::anyhow!("Flash process failed (exit code {:?})", exit_status.code()));
+    let ret = unsafe { libc::flock(device.as_raw_fd(), libc::LOCK_EX | libc::LOCK_NB) };
+    if ret != 0 {
+        return Err(std::io::Error::last_os_error())
+            .with_context(|| format!("Failed to lock {} (is it in use?)", device_path));
     }
 
-    *progress.lock().unwrap() = 1.0;
-    *bytes_written.lock().unwrap() = image_size;
-    Ok(())
+    Ok(device)
 }
@@ -0,0 +1,141 @@
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::time::Instant;
+
+/// Digest used to compare image and device leaves during verification
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum HashAlgorithm {
+    /// SHA-256; uses the SHA-NI or ARMv8 crypto instructions when the CPU
+    /// has them
+    Sha256,
+    /// BLAKE3, vectorized with whatever SIMD the CPU has
+    Blake3,
+    /// XXH3-128: not cryptographic, but enough to catch corruption
+    Xxh3,
+}
+
+impl HashAlgorithm {
+    /// Hash of `data`. Shorter digests are zero-padded to 32 bytes.
+    pub fn digest(self, data: &[u8]) -> [u8; 32] {
+        match self {
+            HashAlgorithm::Sha256 => Sha256::digest(data).into(),
+            HashAlgorithm::Blake3 => *blake3::hash(data).as_bytes(),
+            HashAlgorithm::Xxh3 => {
+                let mut out = [0u8; 32];
+                out[..16].copy_from_slice(&xxhash_rust::xxh3::xxh3_128(data).to_le_bytes());
+                out
+            }
+        }
+    }
+
+    /// Hash of two digests, for the inner nodes of a Merkle tree
+    pub fn combine(self, left: &[u8; 32], right: &[u8; 32]) -> [u8; 32] {
+        let mut pair = [0u8; 64];
+        pair[..32].copy_from_slice(left);
+        pair[32..].copy_from_slice(right);
+        self.digest(&pair)
+    }
+
+    pub fn name(self) -> &'static str {
+        match self {
+            HashAlgorithm::Sha256 => "SHA-256",
+            HashAlgorithm::Blake3 => "BLAKE3",
+            HashAlgorithm::Xxh3 => "XXH3-128",
+        }
+    }
+
+    /// The implementation that will run on this CPU
+    pub fn implementation(self) -> &'static str {
+        match self {
+            HashAlgorithm::Sha256 => sha256_implementation(),
+            HashAlgorithm::Blake3 | HashAlgorithm::Xxh3 => simd_implementation(),
+        }
+    }
+}
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn sha256_implementation() -> &'static str {
+    if is_x86_feature_detected!("sha") && is_x86_feature_detected!("sse4.1") {
+        "SHA-NI"
+    } else {
+        "software"
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+fn sha256_implementation() -> &'static str {
+    if std::arch::is_aarch64_feature_detected!("sha2") {
+        "ARMv8 crypto"
+    } else {
+        "software"
+    }
+}
+
+#[cfg(not(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64")))]
+fn sha256_implementation() -> &'static str {
+    "software"
+}
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn simd_implementation() -> &'static str {
+    if is_x86_feature_detected!("avx512f") {
+        "AVX-512"
+    } else if is_x86_feature_detected!("avx2") {
+        "AVX2"
+    } else {
+        "SSE"
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+fn simd_implementation() -> &'static str {
+    "NEON"
+}
+
+#[cfg(not(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64")))]
+fn simd_implementation() -> &'static str {
+    "portable"
+}
+
+/// Bytes hashed per benchmark round, the size of a verification leaf
+const BENCHMARK_BUFFER: usize = 4 * 1024 * 1024;
+
+/// Single-core throughput of `algorithm` in bytes per second, measured by
+/// hashing `total` bytes. Verification hashes leaves on every core, so it
+/// can go that many times faster.
+pub fn benchmark(algorithm: HashAlgorithm, total: u64) -> u64 {
+    let buffer: Vec<u8> = (0..BENCHMARK_BUFFER as u32).map(|i| (i.wrapping_mul(2654435761) >> 24) as u8).collect();
+    let rounds = (total / BENCHMARK_BUFFER as u64).max(1);
+
+    // One untimed round so the first one doesn't pay for page faults
+    let mut sink = algorithm.digest(&buffer)[0];
+    let start = Instant::now();
+    for _ in 0..rounds {
+        sink ^= algorithm.digest(&buffer)[0];
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    std::hint::black_box(sink);
+    ((rounds * BENCHMARK_BUFFER as u64) as f64 / elapsed.max(1e-9)) as u64
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_algorithms_disagree_and_benchmark() {
+        let data: Vec<u8> = (0..100_000u32).map(|i| (i % 253) as u8).collect();
+        let all = [HashAlgorithm::Sha256, HashAlgorithm::Blake3, HashAlgorithm::Xxh3];
+        let digests: Vec<[u8; 32]> = all.iter().map(|a| a.digest(&data)).collect();
+        assert_eq!(digests[0], <[u8; 32]>::from(Sha256::digest(&data)));
+        assert_ne!(digests[0], digests[1]);
+        assert_ne!(digests[1], digests[2]);
+        assert_eq!(&digests[2][16..], &[0u8; 16]);
+
+        for algorithm in all {
+            assert_eq!(algorithm.digest(&data), algorithm.digest(&data));
+            assert!(benchmark(algorithm, 8 * 1024 * 1024) > 0);
+        }
+    }
+}
@@ -0,0 +1,185 @@
+use anyhow::{anyhow, Result};
+use serde::{Deserialize, Serialize};
+use std::fs;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+
+use super::hash::HashAlgorithm;
+use super::journal::{from_hex, hex};
+use super::utils::cache_dir;
+use super::verify::ChunkDigests;
+
+/// Names of checksum lists looked for next to an image
+const CHECKSUM_LISTS: [&str; 3] = ["SHA256SUMS", "sha256sums", "sha256sums.txt"];
+
+/// What identifies the contents of an image file without reading it. If
+/// any of it changes, hashes saved for the file are stale.
+#[derive(Clone, Debug, PartialEq, Eq, Serialize, Deserialize)]
+struct FileIdentity {
+    dev: u64,
+    ino: u64,
+    size: u64,
+    mtime: (i64, i64),
+    ctime: (i64, i64),
+}
+
+impl FileIdentity {
+    fn of(path: &Path) -> Option<Self> {
+        let meta = fs::metadata(path).ok()?;
+        Some(FileIdentity {
+            dev: meta.dev(),
+            ino: meta.ino(),
+            size: meta.size(),
+            mtime: (meta.mtime(), meta.mtime_nsec()),
+            ctime: (meta.ctime(), meta.ctime_nsec()),
+        })
+    }
+}
+
+/// Leaf hashes of a whole image with one algorithm
+#[derive(Serialize, Deserialize)]
+struct CachedLeaves {
+    algorithm: HashAlgorithm,
+    image_size: u64,
+    leaves: Vec<String>,
+}
+
+#[derive(Serialize, Deserialize)]
+struct Sidecar {
+    identity: FileIdentity,
+    digests: Vec<CachedLeaves>,
+}
+
+/// Hashes of image files computed by earlier flashes, so an unchanged
+/// image isn't hashed again
+#[derive(Clone, Debug)]
+pub struct HashCache {
+    dir: PathBuf,
+}
+
+impl HashCache {
+    pub fn open() -> Self {
+        HashCache::at(cache_dir().join("hashes"))
+    }
+
+    pub fn at(dir: PathBuf) -> Self {
+        HashCache { dir }
+    }
+
+    /// One sidecar per file; a changed file replaces its old entry
+    fn sidecar_path(&self, identity: &FileIdentity) -> PathBuf {
+        self.dir.join(format!("{}-{}.json", identity.dev, identity.ino))
+    }
+
+    fn load(&self, identity: &FileIdentity) -> Option<Sidecar> {
+        let text = fs::read_to_string(self.sidecar_path(identity)).ok()?;
+        serde_json::from_str::<Sidecar>(&text).ok().filter(|sidecar| sidecar.identity == *identity)
+    }
+
+    /// Saved leaf hashes of the whole image at `path`, preferring
+    /// `algorithm`, if the file hasn't changed since
+    pub fn lookup(&self, path: &Path, algorithm: HashAlgorithm) -> Option<ChunkDigests> {
+        let sidecar = self.load(&FileIdentity::of(path)?)?;
+        let mut entries: Vec<&CachedLeaves> = sidecar.digests.iter().collect();
+        entries.sort_by_key(|entry| entry.algorithm != algorithm);
+        entries.into_iter().find_map(|entry| {
+            let hashes = entry.leaves.iter().map(|h| from_hex(h)).collect::<Option<Vec<_>>>()?;
+            ChunkDigests::whole(entry.algorithm, entry.image_size, hashes)
+        })
+    }
+
+    /// Save the leaf hashes of the whole image at `path`, replacing any
+    /// saved with the same algorithm
+    pub fn save(&self, path: &Path, image_size: u64, digests: &ChunkDigests) -> Result<()> {
+        if !digests.is_whole(image_size) {
+            return Err(anyhow!("Only hashes of a whole image are cached"));
+        }
+        let identity = FileIdentity::of(path).ok_or_else(|| anyhow!("Can't stat {}", path.display()))?;
+        let mut sidecar = self.load(&identity).unwrap_or(Sidecar { identity: identity.clone(), digests: Vec::new() });
+        sidecar.digests.retain(|entry| entry.algorithm != digests.algorithm());
+        sidecar.digests.push(CachedLeaves {
+            algorithm: digests.algorithm(),
+            image_size,
+            leaves: digests.leaves().iter().map(|leaf| hex(&leaf.hash)).collect(),
+        });
+
+        fs::create_dir_all(&self.dir)?;
+        let path = self.sidecar_path(&identity);
+        let tmp = path.with_extension("tmp");
+        fs::write(&tmp, serde_json::to_vec(&sidecar)?)?;
+        fs::rename(&tmp, &path)?;
+        Ok(())
+    }
+}
+
+/// SHA-256 of the image file published next to it, as `<image>.sha256` or a
+/// line of a `SHA256SUMS` list. Returns the digest and the file it came
+/// from. These come with the image, so they are trusted as given.
+pub fn published_sha256(path: &Path) -> Option<(Vec<u8>, String)> {
+    let name = path.file_name()?.to_string_lossy().into_owned();
+    let dir = path.parent().unwrap_or(Path::new("."));
+
+    let own = dir.join(format!("{}.sha256", name));
+    if let Some(digest) = fs::read_to_string(&own).ok().and_then(|text| find_digest(&text, &name, true)) {
+        return Some((digest, format!("{}.sha256", name)));
+    }
+    CHECKSUM_LISTS.iter().find_map(|list| {
+        let text = fs::read_to_string(dir.join(list)).ok()?;
+        Some((find_digest(&text, &name, false)?, list.to_string()))
+    })
+}
+
+/// The digest for `name` in coreutils `sha256sum` output. A file of its own
+/// may also hold just the bare digest.
+fn find_digest(text: &str, name: &str, own_file: bool) -> Option<Vec<u8>> {
+    text.lines().find_map(|line| {
+        let mut fields = line.split_whitespace();
+        let digest = from_hex(&fields.next()?.to_ascii_lowercase())?;
+        match fields.next() {
+            // "*name" marks binary mode; lists may use relative paths
+            Some(file) => {
+                let file = file.trim_start_matches('*');
+                (file == name || file.ends_with(&format!("/{}", name))).then(|| digest.to_vec())
+            }
+            None => own_file.then(|| digest.to_vec()),
+        }
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::verify::leaf_layout;
+
+    #[test]
+    fn test_cached_hashes_and_published_sums() {
+        let dir = std::env::temp_dir().join(format!("fluxflasher-hashcache-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        let image = dir.join("disk.img");
+        fs::write(&image, vec![7u8; 5000]).unwrap();
+
+        let cache = HashCache::at(dir.join("cache"));
+        let hashes = vec![HashAlgorithm::Xxh3.digest(&[7u8; 5000])];
+        let digests = ChunkDigests::whole(HashAlgorithm::Xxh3, 5000, hashes).unwrap();
+        cache.save(&image, 5000, &digests).unwrap();
+        let found = cache.lookup(&image, HashAlgorithm::Blake3).unwrap();
+        assert_eq!(found.algorithm(), HashAlgorithm::Xxh3);
+        assert!(found.matches(&leaf_layout([(0, 5000)])));
+
+        // Changing the file invalidates its hashes
+        fs::write(&image, vec![8u8; 5001]).unwrap();
+        let stale = cache.lookup(&image, HashAlgorithm::Xxh3).is_none();
+
+        let sum = hex(&[0xab; 32]);
+        fs::write(dir.join("SHA256SUMS"), format!("{}  other.img\n{} *disk.img\n", hex(&[1; 32]), sum)).unwrap();
+        let listed = published_sha256(&image);
+        fs::write(dir.join("disk.img.sha256"), format!("{}\n", hex(&[0xcd; 32]))).unwrap();
+        let own = published_sha256(&image);
+        let _ = fs::remove_dir_all(&dir);
+
+        assert!(stale);
+        assert_eq!(listed, Some((vec![0xab; 32], "SHA256SUMS".to_string())));
+        assert_eq!(own, Some((vec![0xcd; 32], "disk.img.sha256".to_string())));
+    }
+}
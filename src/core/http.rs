@@ -0,0 +1,413 @@
+use anyhow::{anyhow, Context, Result};
+use reqwest::blocking::{Client, Response};
+use reqwest::header::{HeaderName, HeaderValue, CONTENT_RANGE, ETAG, IF_RANGE, LAST_MODIFIED, RANGE};
+use reqwest::StatusCode;
+use std::collections::BTreeMap;
+use std::io::{self, Read};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+/// Bytes fetched by one range request
+const SEGMENT_SIZE: u64 = 8 * 1024 * 1024;
+
+/// Range requests in flight at once; enough to fill the bandwidth-delay
+/// product of a LAN or nearby artifact server
+const PARALLEL_FETCHES: usize = 4;
+
+/// Segments fetched ahead of the reader, bounding memory use
+const READ_AHEAD_SEGMENTS: u64 = 8;
+
+/// Attempts per segment before giving up
+const MAX_ATTEMPTS: u32 = 5;
+
+/// Whether an image path is actually an http(s) URL
+pub fn is_url(path: &str) -> bool {
+    let lower = path.to_ascii_lowercase();
+    lower.starts_with("http://") || lower.starts_with("https://")
+}
+
+/// Open a URL for streaming. If the server supports range requests, the
+/// body is fetched as several parallel ranges that are retried
+/// independently; otherwise it is read as a single response.
+///
+/// Every range request carries `If-Range` with the ETag (or Last-Modified
+/// date) the first response had, so a file replaced on the server while it
+/// downloads fails the download instead of splicing two versions into one
+/// stream. A server that gives neither is read as a single response.
+///
+/// `downloaded` counts bytes received from the network, which runs ahead of
+/// what has been read. Returns the reader and the length, if known.
+pub fn open_url(url: &str, downloaded: Arc<AtomicU64>) -> Result<(Box<dyn Read + Send>, Option<u64>)> {
+    let client = Client::builder()
+        .connect_timeout(Duration::from_secs(15))
+        .timeout(None)
+        .build()?;
+
+    // A one-byte range tells us both the length and whether ranges work
+    let probe = client.get(url).header(RANGE, "bytes=0-0").send()
+        .with_context(|| format!("Failed to connect to {}", url))?;
+    let status = probe.status();
+    if !status.is_success() {
+        return Err(anyhow!("{} returned {}", url, status));
+    }
+
+    let total = probe.headers().get(CONTENT_RANGE)
+        .and_then(|v| v.to_str().ok())
+        .and_then(|v| v.rsplit('/').next())
+        .and_then(|v| v.trim().parse::<u64>().ok());
+    match (status, total, Validator::of(&probe)) {
+        (StatusCode::PARTIAL_CONTENT, Some(total), Some(validator)) => {
+            drop(probe);
+            let reader = RangeReader::new(client, url.to_string(), total, validator, downloaded);
+            Ok((Box::new(reader), Some(total)))
+        }
+        (StatusCode::PARTIAL_CONTENT, _, _) => {
+            // Ranges can't be tied to one version of the file
+            drop(probe);
+            let whole = client.get(url).send().with_context(|| format!("Failed to connect to {}", url))?;
+            if !whole.status().is_success() {
+                return Err(anyhow!("{} returned {}", url, whole.status()));
+            }
+            let len = whole.content_length();
+            Ok((Box::new(CountingResponse { inner: whole, count: downloaded }), len))
+        }
+        _ => {
+            // No ranges: the probe response is the whole body
+            let len = probe.content_length();
+            Ok((Box::new(CountingResponse { inner: probe, count: downloaded }), len))
+        }
+    }
+}
+
+/// The version of a resource a response came from: its ETag if it is
+/// strong, otherwise its Last-Modified date. Weak ETags can't be used in
+/// `If-Range`.
+#[derive(Clone)]
+struct Validator {
+    header: HeaderName,
+    value: HeaderValue,
+}
+
+impl Validator {
+    fn of(response: &Response) -> Option<Self> {
+        let headers = response.headers();
+        let strong = headers.get(ETAG).filter(|etag| !etag.as_bytes().starts_with(b"W/"));
+        match (strong, headers.get(LAST_MODIFIED)) {
+            (Some(etag), _) => Some(Validator { header: ETAG, value: etag.clone() }),
+            (None, Some(date)) => Some(Validator { header: LAST_MODIFIED, value: date.clone() }),
+            (None, None) => None,
+        }
+    }
+
+    /// Whether `response` says it comes from a different version. One that
+    /// doesn't repeat the header was served under `If-Range`, so it matched.
+    fn changed(&self, response: &Response) -> bool {
+        response.headers().get(&self.header).is_some_and(|value| *value != self.value)
+    }
+}
+
+/// First byte, last byte and total length from a `Content-Range` header
+fn content_range(response: &Response) -> Option<(u64, u64, u64)> {
+    let value = response.headers().get(CONTENT_RANGE)?.to_str().ok()?;
+    let (range, total) = value.strip_prefix("bytes ")?.split_once('/')?;
+    let (first, last) = range.split_once('-')?;
+    Some((first.trim().parse().ok()?, last.trim().parse().ok()?, total.trim().parse().ok()?))
+}
+
+/// Counts bytes received on a plain response
+struct CountingResponse {
+    inner: Response,
+    count: Arc<AtomicU64>,
+}
+
+impl Read for CountingResponse {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        self.count.fetch_add(n as u64, Ordering::Relaxed);
+        Ok(n)
+    }
+}
+
+/// Segments shared between the fetch workers and the reader
+struct Segments {
+    /// Fetched segments waiting to be read, by index
+    ready: BTreeMap<u64, Vec<u8>>,
+    /// Next segment to hand to a worker
+    next_fetch: u64,
+    /// Next segment the reader needs
+    next_read: u64,
+    error: Option<String>,
+    closed: bool,
+}
+
+struct Shared {
+    segments: Mutex<Segments>,
+    changed: Condvar,
+}
+
+/// Reads a URL front to back while workers fetch the segments ahead of it
+/// with range requests
+struct RangeReader {
+    shared: Arc<Shared>,
+    count: u64,
+    current: Vec<u8>,
+    pos: usize,
+    workers: Vec<thread::JoinHandle<()>>,
+}
+
+impl RangeReader {
+    fn new(client: Client, url: String, total: u64, validator: Validator, downloaded: Arc<AtomicU64>) -> Self {
+        let count = (total + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        let shared = Arc::new(Shared {
+            segments: Mutex::new(Segments {
+                ready: BTreeMap::new(),
+                next_fetch: 0,
+                next_read: 0,
+                error: None,
+                closed: false,
+            }),
+            changed: Condvar::new(),
+        });
+
+        let workers = (0..PARALLEL_FETCHES.min(count.max(1) as usize))
+            .map(|_| {
+                let (client, url, shared) = (client.clone(), url.clone(), shared.clone());
+                let (validator, downloaded) = (validator.clone(), downloaded.clone());
+                thread::spawn(move || fetch_worker(&client, &url, total, count, &validator, &shared, &downloaded))
+            })
+            .collect();
+
+        RangeReader { shared, count, current: Vec::new(), pos: 0, workers }
+    }
+}
+
+fn fetch_worker(client: &Client, url: &str, total: u64, count: u64, validator: &Validator, shared: &Shared, downloaded: &AtomicU64) {
+    loop {
+        let index = {
+            let mut segments = shared.segments.lock().unwrap();
+            while !segments.closed
+                && segments.error.is_none()
+                && segments.next_fetch < count
+                && segments.next_fetch >= segments.next_read + READ_AHEAD_SEGMENTS
+            {
+                segments = shared.changed.wait(segments).unwrap();
+            }
+            if segments.closed || segments.error.is_some() || segments.next_fetch >= count {
+                return;
+            }
+            segments.next_fetch += 1;
+            segments.next_fetch - 1
+        };
+
+        let start = index * SEGMENT_SIZE;
+        let end = (start + SEGMENT_SIZE).min(total);
+        let result = fetch_range(client, url, start, end, total, validator, downloaded);
+
+        let mut segments = shared.segments.lock().unwrap();
+        match result {
+            Ok(data) => {
+                segments.ready.insert(index, data);
+            }
+            Err(e) => segments.error = Some(format!("{:#}", e)),
+        }
+        shared.changed.notify_all();
+    }
+}
+
+/// Fetch [start, end) of the version `validator` names, resuming from
+/// where an interrupted attempt stopped. A different version on the server
+/// fails at once rather than being retried.
+fn fetch_range(
+    client: &Client,
+    url: &str,
+    start: u64,
+    end: u64,
+    total: u64,
+    validator: &Validator,
+    downloaded: &AtomicU64,
+) -> Result<Vec<u8>> {
+    let mut data = Vec::with_capacity((end - start) as usize);
+    let mut attempt = 0;
+    loop {
+        let offset = start + data.len() as u64;
+        let mut changed = None;
+        let result = (|| -> Result<()> {
+            let mut response = client.get(url)
+                .header(RANGE, format!("bytes={}-{}", offset, end - 1))
+                .header(IF_RANGE, validator.value.clone())
+                .send()?;
+            // If-Range answers a different version with the whole of it
+            if response.status() == StatusCode::OK || validator.changed(&response) {
+                changed = Some("the file changed on the server during the download");
+                return Ok(());
+            }
+            if response.status() != StatusCode::PARTIAL_CONTENT {
+                return Err(anyhow!("range request returned {}", response.status()));
+            }
+            match content_range(&response) {
+                Some((first, last, length)) if first == offset && last == end - 1 && length == total => {}
+                Some((_, _, length)) if length != total => {
+                    changed = Some("the file changed size on the server during the download");
+                    return Ok(());
+                }
+                _ => return Err(anyhow!("server sent a different range than requested")),
+            }
+            let mut buf = vec![0u8; 256 * 1024];
+            loop {
+                let n = response.read(&mut buf)?;
+                if n == 0 {
+                    break;
+                }
+                let n = n.min((end - start) as usize - data.len());
+                data.extend_from_slice(&buf[..n]);
+                downloaded.fetch_add(n as u64, Ordering::Relaxed);
+            }
+            Ok(())
+        })();
+
+        if let Some(reason) = changed {
+            return Err(anyhow!("Download of bytes {}-{} failed: {}", start, end - 1, reason));
+        }
+        if data.len() as u64 == end - start {
+            return Ok(data);
+        }
+        attempt += 1;
+        if attempt >= MAX_ATTEMPTS {
+            let reason = result.err().map_or("connection closed early".to_string(), |e| format!("{:#}", e));
+            return Err(anyhow!("Download of bytes {}-{} failed: {}", start, end - 1, reason));
+        }
+        thread::sleep(Duration::from_millis(250 << attempt));
+    }
+}
+
+impl Read for RangeReader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if self.pos == self.current.len() {
+            let mut segments = self.shared.segments.lock().unwrap();
+            if segments.next_read >= self.count {
+                return Ok(0);
+            }
+            loop {
+                let next = segments.next_read;
+                if let Some(data) = segments.ready.remove(&next) {
+                    self.current = data;
+                    self.pos = 0;
+                    segments.next_read += 1;
+                    self.shared.changed.notify_all();
+                    break;
+                }
+                if let Some(e) = &segments.error {
+                    return Err(io::Error::new(io::ErrorKind::Other, e.clone()));
+                }
+                segments = self.shared.changed.wait(segments).unwrap();
+            }
+        }
+        let n = buf.len().min(self.current.len() - self.pos);
+        buf[..n].copy_from_slice(&self.current[self.pos..self.pos + n]);
+        self.pos += n;
+        Ok(n)
+    }
+}
+
+impl Drop for RangeReader {
+    fn drop(&mut self) {
+        self.shared.segments.lock().unwrap().closed = true;
+        self.shared.changed.notify_all();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::{BufRead, BufReader, Write};
+    use std::net::TcpListener;
+    use std::sync::atomic::{AtomicBool, AtomicUsize};
+
+    /// Minimal HTTP/1.1 server with range and If-Range support that drops
+    /// the first ranged response for segment 1 halfway through. The file
+    /// gets a new ETag from request number `changes_at` (counting from 0)
+    /// on; `requests` counts the requests accepted so far.
+    fn serve(data: Arc<Vec<u8>>, changes_at: Arc<AtomicUsize>, requests: Arc<AtomicUsize>) -> String {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        let dropped = Arc::new(AtomicBool::new(false));
+        thread::spawn(move || {
+            for stream in listener.incoming() {
+                let number = requests.fetch_add(1, Ordering::SeqCst);
+                let etag = if number < changes_at.load(Ordering::SeqCst) { "\"v1\"" } else { "\"v2\"" };
+                let (data, dropped) = (data.clone(), dropped.clone());
+                thread::spawn(move || {
+                    let mut stream = stream.unwrap();
+                    let mut reader = BufReader::new(stream.try_clone().unwrap());
+                    let (mut range, mut if_range) = (None, None);
+                    loop {
+                        let mut line = String::new();
+                        if reader.read_line(&mut line).unwrap() == 0 || line == "\r\n" {
+                            break;
+                        }
+                        let lower = line.to_ascii_lowercase();
+                        if let Some(value) = lower.strip_prefix("range: bytes=") {
+                            let (a, b) = value.trim().split_once('-').unwrap();
+                            range = Some((a.parse::<usize>().unwrap(), b.parse::<usize>().unwrap()));
+                        }
+                        if lower.starts_with("if-range:") {
+                            if_range = Some(line["if-range:".len()..].trim().to_string());
+                        }
+                    }
+                    let (a, b) = range.unwrap();
+                    let header = if if_range.is_some_and(|tag| tag != etag) {
+                        format!(
+                            "HTTP/1.1 200 OK\r\nContent-Length: {}\r\nETag: {}\r\nConnection: close\r\n\r\n",
+                            data.len(), etag
+                        )
+                    } else {
+                        format!(
+                            "HTTP/1.1 206 Partial Content\r\nContent-Length: {}\r\nContent-Range: bytes {}-{}/{}\r\nETag: {}\r\nConnection: close\r\n\r\n",
+                            b - a + 1, a, b, data.len(), etag
+                        )
+                    };
+                    stream.write_all(header.as_bytes()).unwrap();
+                    if header.starts_with("HTTP/1.1 200") {
+                        let _ = stream.write_all(&data);
+                        return;
+                    }
+                    let body = &data[a..=b];
+                    if a == SEGMENT_SIZE as usize && !dropped.swap(true, Ordering::SeqCst) {
+                        let _ = stream.write_all(&body[..body.len() / 2]);
+                        return;
+                    }
+                    let _ = stream.write_all(body);
+                });
+            }
+        });
+        format!("http://{}/image.img", addr)
+    }
+
+    #[test]
+    fn test_parallel_range_download_with_retry() {
+        let data: Arc<Vec<u8>> = Arc::new((0..3 * SEGMENT_SIZE as u32 + 5000).map(|i| (i % 239) as u8).collect());
+        let (changes_at, requests) = (Arc::new(AtomicUsize::new(usize::MAX)), Arc::new(AtomicUsize::new(0)));
+        let url = serve(data.clone(), changes_at.clone(), requests.clone());
+        assert!(is_url(&url));
+
+        let downloaded = Arc::new(AtomicU64::new(0));
+        let (mut reader, len) = open_url(&url, downloaded.clone()).unwrap();
+        assert_eq!(len, Some(data.len() as u64));
+
+        let mut out = Vec::new();
+        reader.read_to_end(&mut out).unwrap();
+        assert!(out == *data);
+        assert!(downloaded.load(Ordering::Relaxed) >= data.len() as u64);
+
+        // A new version replaces the file right after the probe
+        changes_at.store(requests.load(Ordering::SeqCst) + 1, Ordering::SeqCst);
+        let (mut reader, _) = open_url(&url, Arc::new(AtomicU64::new(0))).unwrap();
+        let err = reader.read_to_end(&mut Vec::new()).unwrap_err();
+        assert!(err.to_string().contains("changed on the server"));
+    }
+}
@@ -0,0 +1,630 @@
+use anyhow::{anyhow, Context, Result};
+use flate2::read::{DeflateDecoder, MultiGzDecoder};
+use liblzma::read::XzDecoder;
+use liblzma::stream::MtStreamBuilder;
+use std::fs::File;
+use std::io::{self, Read, Seek, SeekFrom};
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use super::decompress::{
+    decode_threads, scan_zstd_frames, xz_uncompressed_size, zstd_is_parallel, ParallelZstdReader,
+};
+use super::http::{is_url, open_url};
+
+/// Memory the multi-threaded xz decoder may use before it falls back to
+/// decoding on a single thread
+const XZ_MEMLIMIT_THREADING: u64 = 1024 * 1024 * 1024;
+
+/// Extensions that mark the disk image inside an archive
+const IMAGE_EXTENSIONS: &[&str] = &[".img", ".iso", ".wic", ".raw", ".bin", ".hddimg", ".sdcard"];
+
+/// Compression (or container) of an image file, detected from its magic bytes
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Compression {
+    None,
+    Gzip,
+    Xz,
+    Zstd,
+    Zip,
+}
+
+/// What we know about an image before flashing it
+#[derive(Clone, Debug)]
+pub struct ImageInfo {
+    pub compression: Compression,
+    /// The disk image is inside a tar archive
+    pub in_tar: bool,
+    /// Size of the file on disk
+    pub file_size: u64,
+    /// Size of the disk image once decompressed/extracted, if the format
+    /// records it (xz index, zstd frame headers, zip directory, tar header)
+    pub image_size: Option<u64>,
+    /// Streamed from an http(s) URL; `file_size` is the Content-Length
+    pub remote: bool,
+}
+
+impl ImageInfo {
+    /// Plain raw image that can be read at random offsets
+    pub fn is_raw(&self) -> bool {
+        self.compression == Compression::None && !self.in_tar && !self.remote
+    }
+}
+
+fn detect_compression(file: &File) -> Result<Compression> {
+    let mut magic = [0u8; 6];
+    let n = file.read_at(&mut magic, 0)?;
+    Ok(compression_from_magic(&magic[..n]))
+}
+
+fn compression_from_magic(magic: &[u8]) -> Compression {
+    if magic.starts_with(&[0xFD, b'7', b'z', b'X', b'Z', 0x00]) {
+        Compression::Xz
+    } else if magic.starts_with(&[0x28, 0xB5, 0x2F, 0xFD]) {
+        Compression::Zstd
+    } else if magic.starts_with(&[0x1F, 0x8B]) {
+        Compression::Gzip
+    } else if magic.starts_with(b"PK\x03\x04") {
+        Compression::Zip
+    } else {
+        Compression::None
+    }
+}
+
+/// Identify an image's format and, where the format allows it without
+/// decompressing, its uncompressed size
+pub fn probe_image(path: &Path) -> Result<ImageInfo> {
+    let file = File::open(path).with_context(|| format!("Failed to open image {}", path.display()))?;
+    let file_size = file.metadata()?.len();
+    let compression = detect_compression(&file)?;
+
+    let (image_size, in_tar) = match compression {
+        Compression::None => {
+            if is_tar_header(&read_prefix(&file)?) {
+                (tar_image_size(&file)?, true)
+            } else {
+                (Some(file_size), false)
+            }
+        }
+        Compression::Xz => (xz_uncompressed_size(&file).ok(), peek_is_tar(path, compression)?),
+        Compression::Zstd => {
+            let size = scan_zstd_frames(&file)
+                .ok()
+                .and_then(|frames| frames.iter().map(|f| f.content_size).sum::<Option<u64>>());
+            (size, peek_is_tar(path, compression)?)
+        }
+        // ISIZE in the gzip trailer is the size modulo 4 GiB, useless for
+        // disk images
+        Compression::Gzip => (None, peek_is_tar(path, compression)?),
+        Compression::Zip => (Some(find_zip_image(&file)?.uncompressed_size), false),
+    };
+
+    // Inside a compressed tar the entry size is only known once we get there
+    let image_size = if in_tar && compression != Compression::None { None } else { image_size };
+    Ok(ImageInfo { compression, in_tar, file_size, image_size, remote: false })
+}
+
+/// Open an image for streaming: decompresses and unpacks archives on the fly.
+///
+/// `consumed` counts bytes read from the file on disk, which gives progress
+/// when the uncompressed size isn't known.
+///
+/// `path` may also be an http(s) URL, see `open_url_image`.
+pub fn open_image(path: &Path, consumed: Arc<AtomicU64>) -> Result<(Box<dyn Read + Send>, ImageInfo)> {
+    if let Some(url) = path.to_str().filter(|p| is_url(p)) {
+        return open_url_image(url, consumed, Arc::new(AtomicU64::new(0)));
+    }
+
+    let info = probe_image(path)?;
+    let file = File::open(path)?;
+
+    let reader: Box<dyn Read + Send> = match info.compression {
+        Compression::None | Compression::Gzip | Compression::Xz => {
+            stream_decoder(info.compression, CountingReader { inner: file, count: consumed })?
+        }
+        Compression::Zstd => {
+            let frames = scan_zstd_frames(&file)?;
+            if zstd_is_parallel(&frames) {
+                // Workers read frames themselves; count them as they're handed out
+                consumed.store(0, Ordering::Relaxed);
+                let reader = ParallelZstdReader::new(file, frames.clone(), decode_threads());
+                Box::new(FrameProgressReader { inner: reader, frames, produced: 0, next: 0, consumed })
+            } else {
+                stream_decoder(info.compression, CountingReader { inner: file, count: consumed })?
+            }
+        }
+        Compression::Zip => {
+            let entry = find_zip_image(&file)?;
+            let mut file = file;
+            file.seek(SeekFrom::Start(entry.data_offset))?;
+            let data = CountingReader { inner: file, count: consumed }.take(entry.compressed_size);
+            match entry.method {
+                0 => Box::new(data),
+                8 => Box::new(DeflateDecoder::new(data)),
+                m => return Err(anyhow!("Unsupported zip compression method {}", m)),
+            }
+        }
+    };
+
+    if info.in_tar {
+        let (entry, size) = TarImageReader::open(reader)?;
+        let info = ImageInfo { image_size: Some(size), ..info };
+        return Ok((Box::new(entry), info));
+    }
+    Ok((reader, info))
+}
+
+/// Open an image at an http(s) URL for streaming. The download, decompression
+/// and the device writes all overlap; nothing is stored on disk.
+///
+/// The format is detected from the first bytes of the body rather than
+/// probed up front, so the uncompressed size is only known for raw images
+/// (from the Content-Length) and tar archives (from the entry header). Zip
+/// archives keep their directory at the end and can't be streamed.
+///
+/// `consumed` counts body bytes taken by the decoder, `downloaded` bytes
+/// received from the network, which may run ahead of it.
+pub fn open_url_image(
+    url: &str,
+    consumed: Arc<AtomicU64>,
+    downloaded: Arc<AtomicU64>,
+) -> Result<(Box<dyn Read + Send>, ImageInfo)> {
+    let (body, length) = open_url(url, downloaded)?;
+    let mut body = CountingReader { inner: body, count: consumed };
+
+    let magic = read_up_to(&mut body, 6)?;
+    let compression = compression_from_magic(&magic);
+    if compression == Compression::Zip {
+        return Err(anyhow!("Zip archives can't be flashed from a URL; download the file first"));
+    }
+    let mut reader = stream_decoder(compression, io::Cursor::new(magic).chain(body))?;
+
+    // Put the peeked header back in front of the stream either way
+    let header = read_up_to(&mut reader, 512)?;
+    let in_tar = is_tar_header(&header);
+    let reader: Box<dyn Read + Send> = Box::new(io::Cursor::new(header).chain(reader));
+
+    let info = ImageInfo {
+        compression,
+        in_tar,
+        file_size: length.unwrap_or(0),
+        image_size: if compression == Compression::None && !in_tar { length } else { None },
+        remote: true,
+    };
+    if in_tar {
+        let (entry, size) = TarImageReader::open(reader)?;
+        let info = ImageInfo { image_size: Some(size), ..info };
+        return Ok((Box::new(entry), info));
+    }
+    Ok((reader, info))
+}
+
+/// Decoder for a sequentially read stream (zip needs random access and the
+/// parallel zstd reader a file, so neither is handled here)
+fn stream_decoder<R: Read + Send + 'static>(compression: Compression, reader: R) -> Result<Box<dyn Read + Send>> {
+    Ok(match compression {
+        Compression::None => Box::new(reader),
+        Compression::Gzip => Box::new(MultiGzDecoder::new(reader)),
+        Compression::Xz => {
+            match MtStreamBuilder::new()
+                .threads(decode_threads() as u32)
+                .memlimit_threading(XZ_MEMLIMIT_THREADING)
+                .flags(liblzma::stream::CONCATENATED)
+                .decoder()
+            {
+                Ok(stream) => Box::new(XzDecoder::new_stream(reader, stream)),
+                Err(_) => Box::new(XzDecoder::new_multi_decoder(reader)),
+            }
+        }
+        Compression::Zstd => Box::new(zstd::stream::read::Decoder::new(reader)?),
+        Compression::Zip => return Err(anyhow!("Zip archives must be opened from a file")),
+    })
+}
+
+/// Read up to `len` bytes, fewer only at the end of the stream
+fn read_up_to<R: Read>(reader: &mut R, len: usize) -> Result<Vec<u8>> {
+    let mut data = Vec::with_capacity(len);
+    reader.by_ref().take(len as u64).read_to_end(&mut data)?;
+    Ok(data)
+}
+
+/// Counts bytes read through it
+struct CountingReader<R> {
+    inner: R,
+    count: Arc<AtomicU64>,
+}
+
+impl<R: Read> Read for CountingReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        self.count.fetch_add(n as u64, Ordering::Relaxed);
+        Ok(n)
+    }
+}
+
+/// Reports compressed-file progress for the parallel zstd reader, one frame
+/// at a time as its output is consumed
+struct FrameProgressReader {
+    inner: ParallelZstdReader,
+    frames: Vec<super::decompress::ZstdFrame>,
+    produced: u64,
+    next: usize,
+    consumed: Arc<AtomicU64>,
+}
+
+impl Read for FrameProgressReader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        self.produced += n as u64;
+        while let Some(frame) = self.frames.get(self.next) {
+            let frame_size = frame.content_size.unwrap_or(0);
+            if self.produced < frame_size {
+                break;
+            }
+            self.produced -= frame_size;
+            self.consumed.fetch_add(frame.len, Ordering::Relaxed);
+            self.next += 1;
+        }
+        Ok(n)
+    }
+}
+
+fn read_prefix(file: &File) -> Result<Vec<u8>> {
+    let mut prefix = vec![0u8; 512];
+    let n = file.read_at(&mut prefix, 0)?;
+    prefix.truncate(n);
+    Ok(prefix)
+}
+
+/// Decompress just enough of the file to see whether it holds a tar archive
+fn peek_is_tar(path: &Path, compression: Compression) -> Result<bool> {
+    let file = File::open(path)?;
+    let mut reader: Box<dyn Read> = match compression {
+        Compression::Gzip => Box::new(MultiGzDecoder::new(file)),
+        Compression::Xz => Box::new(XzDecoder::new_multi_decoder(file)),
+        Compression::Zstd => Box::new(zstd::stream::read::Decoder::new(file)?),
+        _ => return Ok(false),
+    };
+    let mut header = Vec::with_capacity(512);
+    reader.by_ref().take(512).read_to_end(&mut header)?;
+    Ok(is_tar_header(&header))
+}
+
+fn is_tar_header(block: &[u8]) -> bool {
+    block.len() >= 512 && &block[257..262] == b"ustar"
+}
+
+/// A regular-file entry from a tar header block
+struct TarEntry {
+    name: String,
+    size: u64,
+    is_file: bool,
+}
+
+fn parse_tar_header(block: &[u8], long_name: Option<String>, pax_size: Option<u64>) -> Result<TarEntry> {
+    let field = |range: std::ops::Range<usize>| {
+        let raw = &block[range];
+        let end = raw.iter().position(|&b| b == 0).unwrap_or(raw.len());
+        String::from_utf8_lossy(&raw[..end]).into_owned()
+    };
+
+    let size = if block[124] & 0x80 != 0 {
+        // GNU base-256 encoding for sizes over 8 GiB
+        block[125..136].iter().fold(0u64, |acc, &b| (acc << 8) | b as u64)
+    } else {
+        let octal = field(124..136);
+        u64::from_str_radix(octal.trim(), 8).unwrap_or(0)
+    };
+
+    let mut name = field(0..100);
+    let prefix = field(345..500);
+    if !prefix.is_empty() {
+        name = format!("{}/{}", prefix, name);
+    }
+
+    Ok(TarEntry {
+        name: long_name.unwrap_or(name),
+        size: pax_size.unwrap_or(size),
+        is_file: block[156] == b'0' || block[156] == 0,
+    })
+}
+
+/// Pull `size` and `path` out of a pax extended header
+fn parse_pax(data: &[u8]) -> (Option<u64>, Option<String>) {
+    let text = String::from_utf8_lossy(data);
+    let (mut size, mut path) = (None, None);
+    for record in text.lines() {
+        if let Some((_, kv)) = record.split_once(' ') {
+            if let Some(v) = kv.strip_prefix("size=") {
+                size = v.parse().ok();
+            } else if let Some(v) = kv.strip_prefix("path=") {
+                path = Some(v.to_string());
+            }
+        }
+    }
+    (size, path)
+}
+
+fn is_image_name(name: &str) -> bool {
+    let lower = name.to_lowercase();
+    IMAGE_EXTENSIONS.iter().any(|ext| lower.ends_with(ext))
+}
+
+/// Streams the first disk image found in a tar archive, skipping any other
+/// entries in front of it
+struct TarImageReader<R> {
+    inner: io::Take<R>,
+}
+
+impl<R: Read> TarImageReader<R> {
+    fn open(mut inner: R) -> Result<(Self, u64)> {
+        let mut block = [0u8; 512];
+        let (mut long_name, mut pax_size) = (None, None);
+
+        loop {
+            inner.read_exact(&mut block).context("Tar archive has no disk image")?;
+            if block.iter().all(|&b| b == 0) {
+                return Err(anyhow!("Tar archive has no disk image"));
+            }
+            let entry = parse_tar_header(&block, long_name.take(), pax_size.take())?;
+            let padded = (entry.size + 511) & !511;
+
+            match block[156] {
+                b'L' | b'x' => {
+                    let mut data = vec![0u8; padded as usize];
+                    inner.read_exact(&mut data)?;
+                    data.truncate(entry.size as usize);
+                    if block[156] == b'L' {
+                        long_name = Some(String::from_utf8_lossy(&data).trim_end_matches('\0').to_string());
+                    } else {
+                        let (size, path) = parse_pax(&data);
+                        pax_size = size;
+                        long_name = path;
+                    }
+                }
+                _ if entry.is_file && is_image_name(&entry.name) => {
+                    return Ok((TarImageReader { inner: inner.take(entry.size) }, entry.size));
+                }
+                _ => {
+                    io::copy(&mut inner.by_ref().take(padded), &mut io::sink())?;
+                }
+            }
+        }
+    }
+}
+
+impl<R: Read> Read for TarImageReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        self.inner.read(buf)
+    }
+}
+
+/// Size of the disk image in an uncompressed tar, found by hopping over headers
+fn tar_image_size(file: &File) -> Result<Option<u64>> {
+    let file_size = file.metadata()?.len();
+    let mut pos = 0u64;
+    let mut block = [0u8; 512];
+    let (mut long_name, mut pax_size) = (None, None);
+
+    while pos + 512 <= file_size {
+        file.read_exact_at(&mut block, pos)?;
+        if block.iter().all(|&b| b == 0) {
+            break;
+        }
+        let entry = parse_tar_header(&block, long_name.take(), pax_size.take())?;
+        let padded = (entry.size + 511) & !511;
+
+        if block[156] == b'L' || block[156] == b'x' {
+            let mut data = vec![0u8; entry.size as usize];
+            file.read_exact_at(&mut data, pos + 512)?;
+            if block[156] == b'L' {
+                long_name = Some(String::from_utf8_lossy(&data).trim_end_matches('\0').to_string());
+            } else {
+                let (size, path) = parse_pax(&data);
+                pax_size = size;
+                long_name = path;
+            }
+        } else if entry.is_file && is_image_name(&entry.name) {
+            return Ok(Some(entry.size));
+        }
+        pos += 512 + padded;
+    }
+    Ok(None)
+}
+
+/// Location of the disk image inside a zip archive
+struct ZipEntry {
+    method: u16,
+    data_offset: u64,
+    compressed_size: u64,
+    uncompressed_size: u64,
+}
+
+/// Find the disk image in a zip archive from its central directory
+/// (Zip64 aware). Falls back to the largest entry if no name matches.
+fn find_zip_image(file: &File) -> Result<ZipEntry> {
+    let file_size = file.metadata()?.len();
+
+    // End of central directory record: within the last 64 KiB + 22 bytes
+    let tail_len = file_size.min(65_557);
+    let mut tail = vec![0u8; tail_len as usize];
+    file.read_exact_at(&mut tail, file_size - tail_len)?;
+    let eocd = tail.windows(4).rposition(|w| w == b"PK\x05\x06")
+        .ok_or_else(|| anyhow!("Corrupt zip: no end of central directory"))?;
+    let eocd_pos = file_size - tail_len + eocd as u64;
+    let e = &tail[eocd..];
+    let mut entries = u16::from_le_bytes([e[10], e[11]]) as u64;
+    let mut cd_offset = u32::from_le_bytes(e[16..20].try_into().unwrap()) as u64;
+
+    // Zip64 end of central directory locator sits right before the EOCD
+    if eocd_pos >= 20 {
+        let mut locator = [0u8; 20];
+        file.read_exact_at(&mut locator, eocd_pos - 20)?;
+        if &locator[0..4] == b"PK\x06\x07" {
+            let zip64_pos = u64::from_le_bytes(locator[8..16].try_into().unwrap());
+            let mut record = [0u8; 56];
+            file.read_exact_at(&mut record, zip64_pos)?;
+            entries = u64::from_le_bytes(record[32..40].try_into().unwrap());
+            cd_offset = u64::from_le_bytes(record[48..56].try_into().unwrap());
+        }
+    }
+
+    let mut best: Option<(bool, ZipEntry)> = None;
+    let mut pos = cd_offset;
+    for _ in 0..entries {
+        let mut h = [0u8; 46];
+        file.read_exact_at(&mut h, pos)?;
+        if &h[0..4] != b"PK\x01\x02" {
+            return Err(anyhow!("Corrupt zip: bad central directory entry"));
+        }
+        let method = u16::from_le_bytes([h[10], h[11]]);
+        let mut compressed = u32::from_le_bytes(h[20..24].try_into().unwrap()) as u64;
+        let mut uncompressed = u32::from_le_bytes(h[24..28].try_into().unwrap()) as u64;
+        let name_len = u16::from_le_bytes([h[28], h[29]]) as usize;
+        let extra_len = u16::from_le_bytes([h[30], h[31]]) as usize;
+        let comment_len = u16::from_le_bytes([h[32], h[33]]) as usize;
+        let mut local_offset = u32::from_le_bytes(h[42..46].try_into().unwrap()) as u64;
+
+        let mut var = vec![0u8; name_len + extra_len];
+        file.read_exact_at(&mut var, pos + 46)?;
+        let name = String::from_utf8_lossy(&var[..name_len]).into_owned();
+
+        // Zip64 extended information: only the fields that overflowed are present
+        let mut extra = &var[name_len..];
+        while extra.len() >= 4 {
+            let id = u16::from_le_bytes([extra[0], extra[1]]);
+            let len = (u16::from_le_bytes([extra[2], extra[3]]) as usize).min(extra.len() - 4);
+            if id == 0x0001 {
+                let mut fields = extra[4..4 + len].chunks_exact(8)
+                    .map(|c| u64::from_le_bytes(c.try_into().unwrap()));
+                if uncompressed == 0xFFFF_FFFF { uncompressed = fields.next().unwrap_or(uncompressed); }
+                if compressed == 0xFFFF_FFFF { compressed = fields.next().unwrap_or(compressed); }
+                if local_offset == 0xFFFF_FFFF { local_offset = fields.next().unwrap_or(local_offset); }
+            }
+            extra = &extra[4 + len..];
+        }
+        pos += 46 + (name_len + extra_len + comment_len) as u64;
+
+        if name.ends_with('/') {
+            continue;
+        }
+        let named = is_image_name(&name);
+        let better = match &best {
+            None => true,
+            Some((best_named, best)) => {
+                (named && !best_named) || (named == *best_named && uncompressed > best.uncompressed_size)
+            }
+        };
+        if better {
+            best = Some((named, ZipEntry { method, data_offset: local_offset, compressed_size: compressed, uncompressed_size: uncompressed }));
+        }
+    }
+
+    let (_, mut entry) = best.ok_or_else(|| anyhow!("Zip archive is empty"))?;
+
+    // The data follows the local header, whose name/extra lengths can differ
+    let mut local = [0u8; 30];
+    file.read_exact_at(&mut local, entry.data_offset)?;
+    if &local[0..4] != b"PK\x03\x04" {
+        return Err(anyhow!("Corrupt zip: bad local header"));
+    }
+    let name_len = u16::from_le_bytes([local[26], local[27]]) as u64;
+    let extra_len = u16::from_le_bytes([local[28], local[29]]) as u64;
+    entry.data_offset += 30 + name_len + extra_len;
+    Ok(entry)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    fn read_all(reader: &mut dyn Read) -> io::Result<Vec<u8>> {
+        let mut out = Vec::new();
+        reader.read_to_end(&mut out)?;
+        Ok(out)
+    }
+
+    fn tar_header(name: &str, size: u64) -> [u8; 512] {
+        let mut h = [0u8; 512];
+        h[..name.len()].copy_from_slice(name.as_bytes());
+        h[124..135].copy_from_slice(format!("{:011o}", size).as_bytes());
+        h[156] = b'0';
+        h[257..263].copy_from_slice(b"ustar\0");
+        h
+    }
+
+    #[test]
+    fn test_tar_gz_streams_the_image_entry() {
+        let image: Vec<u8> = (0..70_000u32).map(|i| (i % 253) as u8).collect();
+        let mut tar = Vec::new();
+        tar.extend_from_slice(&tar_header("README", 5));
+        tar.extend_from_slice(b"hello");
+        tar.resize(1024, 0);
+        tar.extend_from_slice(&tar_header("disk.img", image.len() as u64));
+        tar.extend_from_slice(&image);
+        tar.resize(tar.len() + 1024 + (512 - image.len() % 512), 0);
+
+        let mut gz = flate2::write::GzEncoder::new(Vec::new(), flate2::Compression::fast());
+        gz.write_all(&tar).unwrap();
+        let gz = gz.finish().unwrap();
+
+        let path = std::env::temp_dir().join(format!("fluxflasher-image-{}.tar.gz", std::process::id()));
+        File::create(&path).unwrap().write_all(&gz).unwrap();
+
+        let info = probe_image(&path).unwrap();
+        assert_eq!(info.compression, Compression::Gzip);
+        assert!(info.in_tar);
+
+        let consumed = Arc::new(AtomicU64::new(0));
+        let (mut reader, info) = open_image(&path, consumed.clone()).unwrap();
+        let out = read_all(&mut reader).unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        assert_eq!(info.image_size, Some(image.len() as u64));
+        assert!(out == image);
+        assert!(consumed.load(Ordering::Relaxed) > 0);
+    }
+
+    #[test]
+    fn test_zip_stored_entry() {
+        let image = vec![7u8; 5000];
+        let name = b"disk.img";
+        let mut zip = Vec::new();
+        // Local header
+        zip.extend_from_slice(b"PK\x03\x04");
+        zip.extend_from_slice(&[0u8; 22]);
+        zip.extend_from_slice(&(name.len() as u16).to_le_bytes());
+        zip.extend_from_slice(&0u16.to_le_bytes());
+        zip.extend_from_slice(name);
+        zip.extend_from_slice(&image);
+        // Central directory
+        let cd_offset = zip.len() as u32;
+        let mut cd = vec![0u8; 46];
+        cd[0..4].copy_from_slice(b"PK\x01\x02");
+        cd[20..24].copy_from_slice(&(image.len() as u32).to_le_bytes());
+        cd[24..28].copy_from_slice(&(image.len() as u32).to_le_bytes());
+        cd[28..30].copy_from_slice(&(name.len() as u16).to_le_bytes());
+        zip.extend_from_slice(&cd);
+        zip.extend_from_slice(name);
+        let cd_len = zip.len() as u32 - cd_offset;
+        let mut eocd = vec![0u8; 22];
+        eocd[0..4].copy_from_slice(b"PK\x05\x06");
+        eocd[10..12].copy_from_slice(&1u16.to_le_bytes());
+        eocd[12..16].copy_from_slice(&cd_len.to_le_bytes());
+        eocd[16..20].copy_from_slice(&cd_offset.to_le_bytes());
+        zip.extend_from_slice(&eocd);
+
+        let path = std::env::temp_dir().join(format!("fluxflasher-image-{}.zip", std::process::id()));
+        File::create(&path).unwrap().write_all(&zip).unwrap();
+        let (mut reader, info) = open_image(&path, Arc::new(AtomicU64::new(0))).unwrap();
+        let out = read_all(&mut reader).unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        assert_eq!(info.compression, Compression::Zip);
+        assert_eq!(info.image_size, Some(5000));
+        assert!(out == image);
+    }
+}
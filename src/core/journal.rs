@@ -0,0 +1,329 @@
+use anyhow::{Context, Result};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::Write;
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::{Path, PathBuf};
+
+use super::device::device_identity;
+use super::pipeline::{BlockWriter, Chunk};
+use super::utils::cache_dir;
+
+/// Bytes committed between checkpoints. Each checkpoint costs a device
+/// flush, so this trades resume granularity against write throughput.
+const CHECKPOINT_INTERVAL: u64 = 256 * 1024 * 1024;
+
+/// Committed chunks re-read from the device before resuming
+const RESUME_SAMPLES: usize = 16;
+
+/// One committed chunk of the image
+#[derive(Clone, Serialize, Deserialize)]
+struct JournalChunk {
+    offset: u64,
+    len: u64,
+    /// Hex SHA256 of the data written
+    hash: String,
+}
+
+/// On-host record of how far a flash got, so an interrupted flash can
+/// continue where it stopped. Everything below `committed` has been flushed
+/// to the device.
+///
+/// Only the first and last chunk of every checkpoint interval are kept for
+/// the resume spot check, so saving stays cheap however small the chunks
+/// are.
+#[derive(Serialize, Deserialize)]
+pub struct Journal {
+    image_path: String,
+    image_size: u64,
+    image_mtime: i64,
+    image_mtime_nsec: i64,
+    device: String,
+    /// "full" or "extents": a journal only applies to the same kind of flash
+    mode: String,
+    pub committed: u64,
+    chunks: Vec<JournalChunk>,
+    /// Chunks committed since the journal was last saved
+    #[serde(skip)]
+    pending: Vec<JournalChunk>,
+    /// Bytes committed since the journal was last saved
+    #[serde(skip)]
+    since_checkpoint: u64,
+    #[serde(skip)]
+    checkpoint_interval: u64,
+    /// Directory the journal is kept in
+    #[serde(skip)]
+    dir: PathBuf,
+}
+
+/// Stable key for the device: its USB identity, or the path if sysfs
+/// doesn't know it
+fn device_key(device_path: &str) -> String {
+    match device_identity(device_path) {
+        Ok(identity) => identity.key(),
+        Err(_) => device_path.replace('/', "_"),
+    }
+}
+
+/// Where journals are kept by default
+fn journal_dir() -> PathBuf {
+    cache_dir().join("journal")
+}
+
+fn journal_path(dir: &Path, device: &str) -> PathBuf {
+    dir.join(format!("{}.json", device))
+}
+
+/// Replace `path` with `data` so that after a crash it holds either the old
+/// or the new contents, and the new ones once this returns
+fn write_durable(path: &Path, data: &[u8]) -> Result<()> {
+    let dir = path.parent().unwrap();
+    std::fs::create_dir_all(dir)?;
+    let tmp = path.with_extension("tmp");
+    let mut file = File::create(&tmp).with_context(|| format!("Failed to write {}", tmp.display()))?;
+    file.write_all(data).with_context(|| format!("Failed to write {}", tmp.display()))?;
+    file.sync_all()?;
+    std::fs::rename(&tmp, path)?;
+    File::open(dir)?.sync_all()?;
+    Ok(())
+}
+
+/// Lowercase hex of a hash
+pub fn hex(hash: &[u8]) -> String {
+    hash.iter().map(|b| format!("{:02x}", b)).collect()
+}
+
+/// Parse the hex of a 32-byte hash
+pub fn from_hex(hex: &str) -> Option<[u8; 32]> {
+    if hex.len() != 64 || !hex.is_ascii() {
+        return None;
+    }
+    let mut hash = [0u8; 32];
+    for (i, byte) in hash.iter_mut().enumerate() {
+        *byte = u8::from_str_radix(&hex[i * 2..i * 2 + 2], 16).ok()?;
+    }
+    Some(hash)
+}
+
+/// Hash of a chunk as recorded in the journal
+pub fn chunk_hash(data: &[u8]) -> String {
+    hex(&Sha256::digest(data))
+}
+
+impl Journal {
+    /// Start a fresh journal, replacing any previous one for the device
+    pub fn create(image_path: &Path, device_path: &str, mode: &str) -> Result<Self> {
+        Journal::create_in(journal_dir(), image_path, device_path, mode)
+    }
+
+    /// Like `create`, keeping the journal in `dir`
+    pub fn create_in(dir: PathBuf, image_path: &Path, device_path: &str, mode: &str) -> Result<Self> {
+        let meta = std::fs::metadata(image_path)?;
+        let journal = Journal {
+            image_path: std::fs::canonicalize(image_path)?.display().to_string(),
+            image_size: meta.len(),
+            image_mtime: meta.mtime(),
+            image_mtime_nsec: meta.mtime_nsec(),
+            device: device_key(device_path),
+            mode: mode.to_string(),
+            committed: 0,
+            chunks: Vec::new(),
+            pending: Vec::new(),
+            since_checkpoint: 0,
+            checkpoint_interval: CHECKPOINT_INTERVAL,
+            dir,
+        };
+        journal.save()?;
+        Ok(journal)
+    }
+
+    /// Load the journal for this image and device, if there is one and the
+    /// image hasn't changed since
+    pub fn load(image_path: &Path, device_path: &str, mode: Option<&str>) -> Option<Self> {
+        Journal::load_from(journal_dir(), image_path, device_path, mode)
+    }
+
+    /// Like `load`, from a journal kept in `dir`
+    pub fn load_from(dir: PathBuf, image_path: &Path, device_path: &str, mode: Option<&str>) -> Option<Self> {
+        let device = device_key(device_path);
+        let data = std::fs::read(journal_path(&dir, &device)).ok()?;
+        let mut journal: Journal = serde_json::from_slice(&data).ok()?;
+        journal.checkpoint_interval = CHECKPOINT_INTERVAL;
+        journal.dir = dir;
+
+        let meta = std::fs::metadata(image_path).ok()?;
+        let canonical = std::fs::canonicalize(image_path).ok()?.display().to_string();
+        let matches = journal.device == device
+            && journal.image_path == canonical
+            && journal.image_size == meta.len()
+            && journal.image_mtime == meta.mtime()
+            && journal.image_mtime_nsec == meta.mtime_nsec()
+            && mode.map_or(true, |m| m == journal.mode);
+        if matches && journal.committed > 0 { Some(journal) } else { None }
+    }
+
+    /// Spot-check the committed range: re-read a sample of the kept chunks
+    /// (always including the last) and compare their hashes
+    pub fn check_committed(&self, device: &File) -> bool {
+        let count = self.chunks.len();
+        if count == 0 {
+            return false;
+        }
+        let samples = RESUME_SAMPLES.min(count);
+        let mut buffer = Vec::new();
+        for i in 0..samples {
+            let index = if samples == 1 { count - 1 } else { i * (count - 1) / (samples - 1) };
+            let chunk = &self.chunks[index];
+            buffer.resize(chunk.len as usize, 0);
+            if device.read_exact_at(&mut buffer, chunk.offset).is_err() {
+                return false;
+            }
+            if chunk_hash(&buffer) != chunk.hash {
+                return false;
+            }
+        }
+        true
+    }
+
+    /// Record that the chunk at `offset` has been written, and checkpoint if
+    /// enough has accumulated. Chunks must be committed in order. `hash` is
+    /// the hex SHA256 of the chunk.
+    pub fn commit(&mut self, device: &File, offset: u64, len: u64, hash: String) -> Result<()> {
+        self.pending.push(JournalChunk { offset, len, hash });
+        self.since_checkpoint += len;
+
+        if self.since_checkpoint >= self.checkpoint_interval {
+            // Only completed writes are covered, which is all the journal claims
+            device.sync_data().context("Failed to flush device")?;
+            self.committed = offset + len;
+            let mut interval = std::mem::take(&mut self.pending);
+            let last = interval.pop();
+            interval.truncate(1);
+            self.chunks.extend(interval.into_iter().chain(last));
+            self.save()?;
+            self.since_checkpoint = 0;
+        }
+        Ok(())
+    }
+
+    /// Write the journal atomically and durably
+    pub fn save(&self) -> Result<()> {
+        write_durable(&journal_path(&self.dir, &self.device), &serde_json::to_vec(self)?)
+    }
+
+    /// Drop the journal once the flash has completed
+    pub fn remove(&self) {
+        let _ = std::fs::remove_file(journal_path(&self.dir, &self.device));
+    }
+}
+
+/// Bytes already committed for this image and device (0 if there is no
+/// usable journal), without touching the device
+pub fn resume_offset(image_path: &Path, device_path: &str) -> u64 {
+    Journal::load(image_path, device_path, None).map_or(0, |j| j.committed)
+}
+
+/// Wraps another writer and checkpoints the journal as writes complete.
+///
+/// Chunks are tracked in submission order and committed to the journal as
+/// soon as every chunk before them has completed too.
+pub struct JournalWriter<'a> {
+    inner: Box<dyn BlockWriter + 'a>,
+    device: &'a File,
+    journal: &'a mut Journal,
+    /// Submitted chunks in order: (offset, len, hash, completed)
+    inflight: VecDeque<(u64, u64, String, bool)>,
+}
+
+impl<'a> JournalWriter<'a> {
+    pub fn new(inner: Box<dyn BlockWriter + 'a>, device: &'a File, journal: &'a mut Journal) -> Self {
+        JournalWriter {
+            inner,
+            device,
+            journal,
+            inflight: VecDeque::new(),
+        }
+    }
+
+    fn complete(&mut self, finished: &[Chunk]) -> Result<()> {
+        for chunk in finished {
+            if let Some(entry) = self.inflight.iter_mut().find(|e| e.0 == chunk.offset && !e.3) {
+                entry.3 = true;
+            }
+        }
+
+        while let Some(entry) = self.inflight.front() {
+            if !entry.3 {
+                break;
+            }
+            let (offset, len, hash, _) = self.inflight.pop_front().unwrap();
+            self.journal.commit(self.device, offset, len, hash)?;
+        }
+        Ok(())
+    }
+}
+
+impl BlockWriter for JournalWriter<'_> {
+    fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        let hash = chunk_hash(chunk.buf.as_slice());
+        self.inflight.push_back((chunk.offset, chunk.buf.len() as u64, hash, false));
+
+        let before = done.len();
+        self.inner.submit(chunk, done)?;
+        self.complete(&done[before..])
+    }
+
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        let before = done.len();
+        self.inner.flush(done)?;
+        self.complete(&done[before..])
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::buffer::allocate_ring;
+    use crate::core::metrics::Metrics;
+    use crate::core::pipeline::{run_pipeline, StreamSource};
+    use crate::core::writer::BlockingWriter;
+    use std::io::{Cursor, Write};
+
+    #[test]
+    fn test_journal_commits_and_resumes() {
+        let dir = std::env::temp_dir().join(format!("fluxflasher-journal-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let journals = dir.join("journal");
+
+        let image_path = dir.join("image.img");
+        let data: Vec<u8> = (0..10 * 1024 * 1024u32 / 4).flat_map(|i| i.to_le_bytes()).collect();
+        File::create(&image_path).unwrap().write_all(&data).unwrap();
+        let device_path = dir.join("device").display().to_string();
+        let device = std::fs::OpenOptions::new().read(true).write(true).create(true).open(&device_path).unwrap();
+
+        let mut journal = Journal::create_in(journals.clone(), &image_path, &device_path, "full").unwrap();
+        journal.checkpoint_interval = 4 * 1024 * 1024;
+        {
+            let inner = Box::new(BlockingWriter::new(&device));
+            let mut writer = JournalWriter::new(inner, &device, &mut journal);
+            let source = StreamSource::new(Cursor::new(data.clone()));
+            run_pipeline(source, allocate_ring(1024 * 1024, 4), &mut writer, &Metrics::default(), |_| {}).unwrap();
+        }
+
+        // Two checkpoints of 4 MiB were saved, keeping the first and last
+        // chunk of each; the 2 MiB tail wasn't
+        let loaded = Journal::load_from(journals.clone(), &image_path, &device_path, Some("full")).unwrap();
+        assert_eq!(loaded.committed, 8 * 1024 * 1024);
+        assert_eq!(loaded.chunks.iter().map(|c| c.offset / (1024 * 1024)).collect::<Vec<_>>(), vec![0, 3, 4, 7]);
+        assert!(loaded.check_committed(&device));
+        assert!(Journal::load_from(journals.clone(), &image_path, &device_path, Some("extents")).is_none());
+
+        // Damage the committed range and the spot check notices
+        device.write_all_at(&[0xFF; 16], loaded.committed - 16).unwrap();
+        assert!(!loaded.check_committed(&device));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,205 @@
+use std::fs::File;
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::ptr;
+
+/// Pipe capacity requested for splice; the kernel may grant less
+const PIPE_SIZE: libc::c_int = 1024 * 1024;
+
+/// How bytes get from the image to the device without passing through
+/// userspace
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum CopyMethod {
+    /// copy_file_range: a single call, works when both ends are regular
+    /// files (block devices are refused)
+    CopyFileRange,
+    /// splice image -> pipe -> device: works for block devices
+    Splice,
+}
+
+impl std::fmt::Display for CopyMethod {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            CopyMethod::CopyFileRange => write!(f, "copy_file_range"),
+            CopyMethod::Splice => write!(f, "splice"),
+        }
+    }
+}
+
+/// Errors that mean "this kernel or filesystem can't do that", as opposed
+/// to an I/O failure
+pub fn is_unsupported(e: &io::Error) -> bool {
+    matches!(
+        e.raw_os_error(),
+        Some(libc::EXDEV) | Some(libc::EINVAL) | Some(libc::ENOSYS) | Some(libc::EOPNOTSUPP)
+    )
+}
+
+/// Copies ranges of a raw image to the same offsets on the device inside
+/// the kernel. Starts with copy_file_range and switches to splice if that is
+/// refused; `copy` only reports an unsupported error if neither works and
+/// nothing has been copied yet, so the caller can fall back to the userspace
+/// pipeline.
+pub struct KernelCopy<'a> {
+    image: &'a File,
+    device: &'a File,
+    method: CopyMethod,
+    /// (read end, write end, capacity)
+    pipe: Option<(OwnedFd, OwnedFd, usize)>,
+    started: bool,
+}
+
+impl<'a> KernelCopy<'a> {
+    pub fn new(image: &'a File, device: &'a File) -> Self {
+        KernelCopy { image, device, method: CopyMethod::CopyFileRange, pipe: None, started: false }
+    }
+
+    /// Start with a specific method (splice doesn't fall back further)
+    #[cfg(test)]
+    pub fn with_method(image: &'a File, device: &'a File, method: CopyMethod) -> Self {
+        KernelCopy { method, ..KernelCopy::new(image, device) }
+    }
+
+    pub fn method(&self) -> CopyMethod {
+        self.method
+    }
+
+    /// Copy `len` bytes at `offset`
+    pub fn copy(&mut self, offset: u64, len: u64) -> io::Result<()> {
+        let mut done = 0u64;
+        while done < len {
+            let result = match self.method {
+                CopyMethod::CopyFileRange => self.copy_file_range(offset + done, len - done),
+                CopyMethod::Splice => self.splice(offset + done, len - done),
+            };
+            match result {
+                Err(e) if !self.started && self.method == CopyMethod::CopyFileRange && is_unsupported(&e) => {
+                    self.method = CopyMethod::Splice;
+                }
+                Err(e) => return Err(e),
+                Ok(0) => return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "image ended early")),
+                Ok(n) => {
+                    self.started = true;
+                    done += n;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    fn copy_file_range(&mut self, offset: u64, len: u64) -> io::Result<u64> {
+        let mut off_in = offset as libc::loff_t;
+        let mut off_out = offset as libc::loff_t;
+        let n = unsafe {
+            libc::copy_file_range(
+                self.image.as_raw_fd(),
+                &mut off_in,
+                self.device.as_raw_fd(),
+                &mut off_out,
+                len as usize,
+                0,
+            )
+        };
+        if n < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(n as u64)
+    }
+
+    /// Move up to one pipeful from the image to the device
+    fn splice(&mut self, offset: u64, len: u64) -> io::Result<u64> {
+        if self.pipe.is_none() {
+            self.pipe = Some(open_pipe()?);
+        }
+        let (read_end, write_end, capacity) = self.pipe.as_ref().unwrap();
+
+        let mut off_in = offset as libc::loff_t;
+        let n = unsafe {
+            libc::splice(
+                self.image.as_raw_fd(),
+                &mut off_in,
+                write_end.as_raw_fd(),
+                ptr::null_mut(),
+                (len as usize).min(*capacity),
+                libc::SPLICE_F_MOVE | libc::SPLICE_F_MORE,
+            )
+        };
+        if n < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // Drain the pipe into the device before the next read
+        let mut off_out = offset as libc::loff_t;
+        let mut left = n as usize;
+        while left > 0 {
+            let m = unsafe {
+                libc::splice(
+                    read_end.as_raw_fd(),
+                    ptr::null_mut(),
+                    self.device.as_raw_fd(),
+                    &mut off_out,
+                    left,
+                    libc::SPLICE_F_MOVE,
+                )
+            };
+            if m < 0 {
+                // Data left in the pipe makes it useless for the next range
+                self.pipe = None;
+                return Err(io::Error::last_os_error());
+            }
+            if m == 0 {
+                self.pipe = None;
+                return Err(io::Error::new(io::ErrorKind::WriteZero, "device accepted no data"));
+            }
+            left -= m as usize;
+        }
+        Ok(n as u64)
+    }
+}
+
+fn open_pipe() -> io::Result<(OwnedFd, OwnedFd, usize)> {
+    let mut fds = [0 as libc::c_int; 2];
+    if unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    let (read_end, write_end) = unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) };
+
+    // A bigger pipe means fewer round trips; keep the default if refused
+    unsafe { libc::fcntl(write_end.as_raw_fd(), libc::F_SETPIPE_SZ, PIPE_SIZE) };
+    let capacity = unsafe { libc::fcntl(write_end.as_raw_fd(), libc::F_GETPIPE_SZ) };
+    let capacity = if capacity > 0 { capacity as usize } else { 64 * 1024 };
+    Ok((read_end, write_end, capacity))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_kernel_copy_both_methods() {
+        let dir = std::env::temp_dir();
+        let image_path = dir.join(format!("fluxflasher-kcopy-image-{}", std::process::id()));
+        let data: Vec<u8> = (0..5 * 1024 * 1024 + 777u32).map(|i| (i % 233) as u8).collect();
+        File::create(&image_path).unwrap().write_all(&data).unwrap();
+        let image = File::open(&image_path).unwrap();
+
+        for method in [CopyMethod::CopyFileRange, CopyMethod::Splice] {
+            let device_path = dir.join(format!("fluxflasher-kcopy-device-{}-{}", method, std::process::id()));
+            let device = std::fs::OpenOptions::new().read(true).write(true).create(true).open(&device_path).unwrap();
+            let mut copier = KernelCopy::with_method(&image, &device, method);
+            // Out of order, and the last range is unaligned
+            copier.copy(4 * 1024 * 1024, data.len() as u64 - 4 * 1024 * 1024).unwrap();
+            copier.copy(0, 4 * 1024 * 1024).unwrap();
+            assert!(std::fs::read(&device_path).unwrap() == data);
+            std::fs::remove_file(&device_path).unwrap();
+        }
+
+        // Copying past the end of the image is an error, not a short copy
+        let device_path = dir.join(format!("fluxflasher-kcopy-device-{}", std::process::id()));
+        let device = File::create(&device_path).unwrap();
+        assert!(KernelCopy::new(&image, &device).copy(0, data.len() as u64 + 1).is_err());
+        std::fs::remove_file(&device_path).unwrap();
+        std::fs::remove_file(&image_path).unwrap();
+    }
+}
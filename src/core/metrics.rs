@@ -0,0 +1,417 @@
+use anyhow::Result;
+use serde::Serialize;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+/// Sub-buckets per power of two: a recorded value is known to within
+/// 1/32 (about 3%)
+const SUB_BITS: u32 = 5;
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+
+/// Largest value a histogram tells apart, in microseconds (about 12 days);
+/// anything longer counts as this
+const MAX_MSB: u32 = 39;
+
+const BUCKETS: usize = SUB_BUCKETS + (MAX_MSB - SUB_BITS + 1) as usize * SUB_BUCKETS;
+
+/// Latencies in microseconds, in log-linear buckets as in HdrHistogram:
+/// exact below 32 µs, then 32 buckets per power of two. Recording is a few
+/// atomic adds, so any number of threads can record at once.
+pub struct Histogram {
+    counts: Box<[AtomicU64]>,
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+fn bucket_of(value: u64) -> usize {
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let msb = (63 - value.leading_zeros()).min(MAX_MSB);
+    let value = value.min((2 << MAX_MSB) - 1);
+    let sub = (value >> (msb - SUB_BITS)) as usize & (SUB_BUCKETS - 1);
+    SUB_BUCKETS + (msb - SUB_BITS) as usize * SUB_BUCKETS + sub
+}
+
+/// Highest value that lands in `bucket`
+fn bucket_top(bucket: usize) -> u64 {
+    if bucket < SUB_BUCKETS {
+        return bucket as u64;
+    }
+    let msb = ((bucket - SUB_BUCKETS) / SUB_BUCKETS) as u32 + SUB_BITS;
+    let sub = ((bucket - SUB_BUCKETS) % SUB_BUCKETS) as u64;
+    let width = 1u64 << (msb - SUB_BITS);
+    (1u64 << msb) + (sub + 1) * width - 1
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            counts: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Histogram {
+    pub fn record(&self, latency: Duration) {
+        let micros = latency.as_micros().min(u64::MAX as u128) as u64;
+        self.counts[bucket_of(micros)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(micros, Ordering::Relaxed);
+        self.max.fetch_max(micros, Ordering::Relaxed);
+    }
+
+    /// Smallest latency in µs that at least `quantile` of the recorded ones
+    /// don't exceed, to within the bucket width
+    pub fn quantile(&self, quantile: f64) -> u64 {
+        let count = self.count.load(Ordering::Relaxed);
+        if count == 0 {
+            return 0;
+        }
+        let target = ((quantile * count as f64).ceil() as u64).clamp(1, count);
+        let max = self.max.load(Ordering::Relaxed);
+        let mut seen = 0;
+        for (bucket, n) in self.counts.iter().enumerate() {
+            seen += n.load(Ordering::Relaxed);
+            if seen >= target {
+                return bucket_top(bucket).min(max);
+            }
+        }
+        max
+    }
+
+    pub fn summary(&self) -> LatencySummary {
+        let count = self.count.load(Ordering::Relaxed);
+        LatencySummary {
+            count,
+            mean_us: self.sum.load(Ordering::Relaxed) / count.max(1),
+            p50_us: self.quantile(0.5),
+            p90_us: self.quantile(0.9),
+            p99_us: self.quantile(0.99),
+            p999_us: self.quantile(0.999),
+            max_us: self.max.load(Ordering::Relaxed),
+            sum_us: self.sum.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Distribution of a histogram at one moment
+#[derive(Clone, Copy, Debug, Default, Serialize)]
+pub struct LatencySummary {
+    pub count: u64,
+    pub mean_us: u64,
+    pub p50_us: u64,
+    pub p90_us: u64,
+    pub p99_us: u64,
+    pub p999_us: u64,
+    pub max_us: u64,
+    pub sum_us: u64,
+}
+
+/// Time one pipeline stage spent working, and waiting on its neighbours
+#[derive(Default)]
+pub struct Stage {
+    busy_ns: AtomicU64,
+    idle_ns: AtomicU64,
+}
+
+impl Stage {
+    pub fn busy(&self, since: Instant) {
+        self.busy_ns.fetch_add(since.elapsed().as_nanos() as u64, Ordering::Relaxed);
+    }
+
+    pub fn idle(&self, since: Instant) {
+        self.idle_ns.fetch_add(since.elapsed().as_nanos() as u64, Ordering::Relaxed);
+    }
+
+    fn times(&self) -> StageTimes {
+        StageTimes {
+            busy_ns: self.busy_ns.load(Ordering::Relaxed),
+            idle_ns: self.idle_ns.load(Ordering::Relaxed),
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, Default, Serialize)]
+pub struct StageTimes {
+    pub busy_ns: u64,
+    pub idle_ns: u64,
+}
+
+/// Where the time of an operation went, recorded on the hot paths: the
+/// source reader (including decompression and downloading), the device
+/// writer, the image hasher and the verification readback. A stage that is
+/// busy most of the time while the others idle is the bottleneck.
+pub struct Metrics {
+    started: Instant,
+    pub read: Stage,
+    pub write: Stage,
+    pub hash: Stage,
+    /// Busy time summed over the parallel read streams; never idle
+    pub verify: Stage,
+    /// Filled buffers waiting for the writer, sampled as it takes each one
+    queue_samples: AtomicU64,
+    queue_total: AtomicU64,
+    queue_max: AtomicU64,
+    queue_capacity: AtomicU64,
+    /// From submitting a chunk to the writer until it hands it back
+    pub write_latency: Histogram,
+    pub verify_latency: Histogram,
+    /// Bytes written to the device in each second since the start
+    throughput: Mutex<Vec<u64>>,
+}
+
+impl Default for Metrics {
+    fn default() -> Self {
+        Metrics {
+            started: Instant::now(),
+            read: Stage::default(),
+            write: Stage::default(),
+            hash: Stage::default(),
+            verify: Stage::default(),
+            queue_samples: AtomicU64::new(0),
+            queue_total: AtomicU64::new(0),
+            queue_max: AtomicU64::new(0),
+            queue_capacity: AtomicU64::new(0),
+            write_latency: Histogram::default(),
+            verify_latency: Histogram::default(),
+            throughput: Mutex::new(Vec::new()),
+        }
+    }
+}
+
+impl std::fmt::Debug for Metrics {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_tuple("Metrics").field(&self.report()).finish()
+    }
+}
+
+impl Metrics {
+    pub fn sample_queue(&self, queued: usize, capacity: usize) {
+        self.queue_samples.fetch_add(1, Ordering::Relaxed);
+        self.queue_total.fetch_add(queued as u64, Ordering::Relaxed);
+        self.queue_max.fetch_max(queued as u64, Ordering::Relaxed);
+        self.queue_capacity.store(capacity as u64, Ordering::Relaxed);
+    }
+
+    /// Count `bytes` as written to the device now
+    pub fn wrote(&self, bytes: u64) {
+        let second = self.started.elapsed().as_secs() as usize;
+        let mut throughput = self.throughput.lock().unwrap();
+        if throughput.len() <= second {
+            throughput.resize(second + 1, 0);
+        }
+        throughput[second] += bytes;
+    }
+
+    /// Bytes written in each second so far
+    pub fn throughput(&self) -> Vec<u64> {
+        self.throughput.lock().unwrap().clone()
+    }
+
+    pub fn report(&self) -> MetricsReport {
+        let throughput = self.throughput();
+        let samples = self.queue_samples.load(Ordering::Relaxed);
+        // The current second isn't over yet
+        let whole = &throughput[..throughput.len().saturating_sub(1)];
+        MetricsReport {
+            elapsed_ns: self.started.elapsed().as_nanos() as u64,
+            read: self.read.times(),
+            write: self.write.times(),
+            hash: self.hash.times(),
+            verify: self.verify.times(),
+            queue_capacity: self.queue_capacity.load(Ordering::Relaxed),
+            queue_mean: self.queue_total.load(Ordering::Relaxed) as f64 / samples.max(1) as f64,
+            queue_max: self.queue_max.load(Ordering::Relaxed),
+            write_latency: self.write_latency.summary(),
+            verify_latency: self.verify_latency.summary(),
+            bytes_written: throughput.iter().sum(),
+            throughput_peak: whole.iter().copied().max().unwrap_or(0),
+            throughput_last: whole.last().copied().unwrap_or(0),
+        }
+    }
+}
+
+/// Everything `Metrics` recorded, summarized
+#[derive(Clone, Debug, Serialize)]
+pub struct MetricsReport {
+    pub elapsed_ns: u64,
+    pub read: StageTimes,
+    pub write: StageTimes,
+    pub hash: StageTimes,
+    pub verify: StageTimes,
+    pub queue_capacity: u64,
+    pub queue_mean: f64,
+    pub queue_max: u64,
+    pub write_latency: LatencySummary,
+    pub verify_latency: LatencySummary,
+    pub bytes_written: u64,
+    /// Bytes per second, over whole seconds
+    pub throughput_peak: u64,
+    pub throughput_last: u64,
+}
+
+/// What a finished operation was, for labelling exported metrics
+#[derive(Clone, Debug, Serialize)]
+pub struct RunInfo {
+    pub device: String,
+    pub model: String,
+    pub image: String,
+    pub success: bool,
+}
+
+/// JSON report of a finished operation
+#[derive(Serialize)]
+struct JsonReport<'a> {
+    #[serde(flatten)]
+    run: &'a RunInfo,
+    finished: u64,
+    #[serde(flatten)]
+    metrics: MetricsReport,
+    throughput: Vec<u64>,
+}
+
+fn write_atomically(path: &Path, contents: &[u8]) -> Result<()> {
+    let tmp = path.with_extension("tmp");
+    fs::write(&tmp, contents)?;
+    fs::rename(&tmp, path)?;
+    Ok(())
+}
+
+/// File-name-safe form of a device path: "/dev/sdb" becomes "sdb"
+fn device_name(device: &str) -> String {
+    device.trim_start_matches("/dev/").chars()
+        .map(|c| if c.is_ascii_alphanumeric() { c } else { '_' })
+        .collect()
+}
+
+fn label(value: &str) -> String {
+    value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', " ")
+}
+
+/// The metrics in Prometheus text format. Only the last run per device is
+/// kept, as a textfile collector expects.
+pub fn prometheus_text(metrics: &Metrics, run: &RunInfo) -> String {
+    let report = metrics.report();
+    let labels = format!("device=\"{}\",model=\"{}\"", label(&run.device), label(&run.model));
+    let finished = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs());
+    let mut out = String::new();
+
+    let _ = writeln!(out, "# HELP fluxflasher_last_run_timestamp_seconds When the last flash of the device finished");
+    let _ = writeln!(out, "# TYPE fluxflasher_last_run_timestamp_seconds gauge");
+    let _ = writeln!(out, "fluxflasher_last_run_timestamp_seconds{{{}}} {}", labels, finished);
+    let _ = writeln!(out, "# HELP fluxflasher_last_run_success Whether the last flash of the device succeeded");
+    let _ = writeln!(out, "# TYPE fluxflasher_last_run_success gauge");
+    let _ = writeln!(out, "fluxflasher_last_run_success{{{}}} {}", labels, run.success as u8);
+    let _ = writeln!(out, "# HELP fluxflasher_duration_seconds Wall time of the last flash");
+    let _ = writeln!(out, "# TYPE fluxflasher_duration_seconds gauge");
+    let _ = writeln!(out, "fluxflasher_duration_seconds{{{}}} {}", labels, report.elapsed_ns as f64 / 1e9);
+
+    let _ = writeln!(out, "# HELP fluxflasher_stage_seconds Time each stage spent working (busy) or waiting (idle)");
+    let _ = writeln!(out, "# TYPE fluxflasher_stage_seconds gauge");
+    for (stage, times) in [("read", report.read), ("write", report.write), ("hash", report.hash), ("verify", report.verify)] {
+        for (state, ns) in [("busy", times.busy_ns), ("idle", times.idle_ns)] {
+            let _ = writeln!(out, "fluxflasher_stage_seconds{{{},stage=\"{}\",state=\"{}\"}} {}", labels, stage, state, ns as f64 / 1e9);
+        }
+    }
+
+    let _ = writeln!(out, "# HELP fluxflasher_queue_occupancy Filled buffers waiting for the writer");
+    let _ = writeln!(out, "# TYPE fluxflasher_queue_occupancy gauge");
+    for (stat, value) in [("mean", report.queue_mean), ("max", report.queue_max as f64), ("capacity", report.queue_capacity as f64)] {
+        let _ = writeln!(out, "fluxflasher_queue_occupancy{{{},stat=\"{}\"}} {}", labels, stat, value);
+    }
+
+    for (name, help, summary) in [
+        ("fluxflasher_write_latency_seconds", "Time from submitting a chunk to the device until it completed", report.write_latency),
+        ("fluxflasher_verify_read_latency_seconds", "Time to read one chunk back from the device", report.verify_latency),
+    ] {
+        let _ = writeln!(out, "# HELP {} {}", name, help);
+        let _ = writeln!(out, "# TYPE {} summary", name);
+        for (quantile, us) in [("0.5", summary.p50_us), ("0.9", summary.p90_us), ("0.99", summary.p99_us), ("0.999", summary.p999_us), ("1", summary.max_us)] {
+            let _ = writeln!(out, "{}{{{},quantile=\"{}\"}} {}", name, labels, quantile, us as f64 / 1e6);
+        }
+        let _ = writeln!(out, "{}_sum{{{}}} {}", name, labels, summary.sum_us as f64 / 1e6);
+        let _ = writeln!(out, "{}_count{{{}}} {}", name, labels, summary.count);
+    }
+
+    let _ = writeln!(out, "# HELP fluxflasher_write_throughput_bytes_per_second Device write throughput");
+    let _ = writeln!(out, "# TYPE fluxflasher_write_throughput_bytes_per_second gauge");
+    let mean = report.bytes_written as f64 / (report.elapsed_ns as f64 / 1e9).max(1e-3);
+    for (stat, value) in [("mean", mean), ("peak", report.throughput_peak as f64)] {
+        let _ = writeln!(out, "fluxflasher_write_throughput_bytes_per_second{{{},stat=\"{}\"}} {}", labels, stat, value);
+    }
+    let _ = writeln!(out, "# HELP fluxflasher_bytes_written Bytes written to the device by the last flash");
+    let _ = writeln!(out, "# TYPE fluxflasher_bytes_written gauge");
+    let _ = writeln!(out, "fluxflasher_bytes_written{{{}}} {}", labels, report.bytes_written);
+    out
+}
+
+/// Write the metrics of a finished operation to `textfile_dir` (as
+/// `fluxflasher_<device>.prom`, replaced on every run) and `report_dir` (as
+/// a new `fluxflasher-<device>-<time>.json` per run), whichever are given
+pub fn export(metrics: &Metrics, run: &RunInfo, textfile_dir: Option<&Path>, report_dir: Option<&Path>) -> Result<()> {
+    let name = device_name(&run.device);
+    if let Some(dir) = textfile_dir {
+        fs::create_dir_all(dir)?;
+        write_atomically(&dir.join(format!("fluxflasher_{}.prom", name)), prometheus_text(metrics, run).as_bytes())?;
+    }
+    if let Some(dir) = report_dir {
+        let finished = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs());
+        let report = JsonReport { run, finished, metrics: metrics.report(), throughput: metrics.throughput() };
+        fs::create_dir_all(dir)?;
+        let path = dir.join(format!("fluxflasher-{}-{}.json", name, finished));
+        write_atomically(&path, &serde_json::to_vec_pretty(&report)?)?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_histogram_quantiles_and_export() {
+        for value in [0, 31, 32, 63, 64, 1000, 123_456_789, u64::MAX] {
+            let bucket = bucket_of(value);
+            assert!(bucket < BUCKETS);
+            assert!(bucket_top(bucket) >= value.min((2 << MAX_MSB) - 1));
+        }
+
+        let metrics = Metrics::default();
+        for micros in 1..=10_000u64 {
+            metrics.write_latency.record(Duration::from_micros(micros));
+        }
+        let summary = metrics.write_latency.summary();
+        assert_eq!(summary.count, 10_000);
+        assert_eq!(summary.max_us, 10_000);
+        for (got, want) in [(summary.p50_us, 5_000.0), (summary.p99_us, 9_900.0)] {
+            assert!((got as f64 - want).abs() / want < 0.04, "{} vs {}", got, want);
+        }
+
+        metrics.wrote(4096);
+        metrics.sample_queue(3, 4);
+        let run = RunInfo { device: "/dev/sdz".into(), model: "Stick \"X\"".into(), image: "a.img".into(), success: true };
+        let text = prometheus_text(&metrics, &run);
+        assert!(text.contains("fluxflasher_bytes_written{device=\"/dev/sdz\",model=\"Stick \\\"X\\\"\"} 4096"));
+        assert!(text.contains("quantile=\"0.99\""));
+
+        let dir = std::env::temp_dir().join(format!("fluxflasher-metrics-{}", std::process::id()));
+        export(&metrics, &run, Some(&dir), Some(&dir)).unwrap();
+        let prom = fs::read_to_string(dir.join("fluxflasher_sdz.prom")).unwrap();
+        let json = fs::read_dir(&dir).unwrap().filter_map(|e| e.ok())
+            .find(|e| e.file_name().to_string_lossy().ends_with(".json"))
+            .map(|e| fs::read_to_string(e.path()).unwrap())
+            .unwrap();
+        let _ = fs::remove_dir_all(&dir);
+        assert!(prom.contains("fluxflasher_queue_occupancy{device=\"/dev/sdz\",model=\"Stick \\\"X\\\"\",stat=\"max\"} 3"));
+        assert!(json.contains("\"model\": \"Stick \\\"X\\\"\"") && json.contains("\"queue_max\": 3"));
+    }
+}
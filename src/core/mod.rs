@@ -1,9 +1,51 @@
+pub mod bmap;
+pub mod buffer;
+pub mod control;
+pub mod decompress;
+pub mod delta;
 pub mod device;
+pub mod extents;
 pub mod flash;
+pub mod hash;
+pub mod hashcache;
+pub mod http;
+pub mod image;
+pub mod journal;
+pub mod kcopy;
+pub mod metrics;
+pub mod multi;
+pub mod options;
+pub mod pipeline;
+pub mod privileged;
+pub mod readback;
+pub mod repair;
+pub mod scheduler;
+pub mod snapshot;
+pub mod sparse;
+pub mod store;
+pub mod tune;
+pub mod uring;
 pub mod verify;
 pub mod utils;
+pub mod writeback;
+pub mod writer;
 
-pub use device::{UsbDevice, list_usb_devices};
-pub use flash::flash_image;
-pub use verify::verify_integrity;
+pub use bmap::{find_bmap, load_bmap};
+pub use control::{set_io_priority, Control, IoClass, IoPriority};
+pub use device::{UsbDevice, device_identity, list_usb_devices};
+pub use extents::{ExtentMap, map_allocated_extents};
+pub use flash::{flash_image, FlashContext};
+pub use hash::HashAlgorithm;
+pub use hashcache::{published_sha256, HashCache};
+pub use image::probe_image;
+pub use journal::resume_offset;
+pub use metrics::{Metrics, RunInfo};
+pub use multi::{flash_multi, MultiTarget};
+pub use options::{FlashOptions, IoBackend};
+pub use repair::repair_device;
+pub use scheduler::{Job, Scheduler};
+pub use snapshot::{Events, Snapshot, Watched};
+pub use store::Store;
+pub use tune::DeviceProfile;
+pub use verify::{verify_bmap, verify_integrity, verify_manifest, verify_sampled, verify_sha256};
 pub use utils::{format_size, format_duration};
@@ -0,0 +1,680 @@
+use anyhow::{anyhow, Result};
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender, TrySendError};
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use super::bmap::find_bmap;
+use super::buffer::{allocate_ring, AlignedBuffer};
+use super::control::{Control, ControlledWriter};
+use super::flash::{open_device_exclusive, unmount_partitions};
+use super::hash::HashAlgorithm;
+use super::http::is_url;
+use super::image::{open_image, ImageInfo};
+use super::metrics::Metrics;
+use super::options::FlashOptions;
+use super::pipeline::{fill_buffer, run_pipeline, BlockWriter, Chunk, ChunkSource, StreamSource};
+use super::repair::repair_device;
+use super::scheduler::{Job, Scheduler};
+use super::snapshot::Watched;
+use super::store::Store;
+use super::verify::{verify_integrity, verify_sampled, ChunkDigests, ChunkHasher, VerifyStats};
+use super::writeback::WritebackWriter;
+use super::writer::{chunk_size_for, open_writer, ring_depth_for};
+
+/// How far (in source bytes) a device may fall behind the fastest one before
+/// it is cut loose to read the source itself (or, where it can't, the
+/// source reader waits for it)
+const DEVICE_WINDOW_BYTES: usize = 64 * 1024 * 1024;
+
+/// A device that holds up the reader and takes no data for this long (plus
+/// what a bandwidth cap adds, see `stall_limit`) is dropped from the group
+/// so the others can carry on
+const STALL_TIMEOUT: Duration = Duration::from_secs(60);
+
+/// How often a waiting source reader looks at the pause state and the stall
+/// timeout when no device takes a chunk
+const STALL_CHECK_INTERVAL: Duration = Duration::from_secs(1);
+
+/// One device of a multi-device flash and where to report its progress
+pub struct MultiTarget {
+    pub device_path: String,
+    pub mount_points: Vec<String>,
+    pub progress: Arc<Watched<f32>>,
+    pub status: Arc<Watched<String>>,
+    pub bytes_written: Arc<Watched<u64>>,
+    pub bytes_skipped: Arc<Watched<u64>>,
+    /// Bytes known to be on the device (see `FlashContext`)
+    pub bytes_durable: Arc<Watched<u64>>,
+    pub verify_progress: Arc<Watched<f32>>,
+    /// Readback of the device after it is written
+    pub verify_stats: Arc<VerifyStats>,
+    pub is_running: Arc<Watched<bool>>,
+    pub error: Arc<Watched<Option<String>>>,
+    /// The device's own write pipeline; the shared source reader isn't
+    /// measured
+    pub metrics: Arc<Metrics>,
+}
+
+impl MultiTarget {
+    fn fail(&self, message: String) {
+        *self.status.lock().unwrap() = message.clone();
+        *self.error.lock().unwrap() = Some(message);
+        *self.is_running.lock().unwrap() = false;
+    }
+}
+
+/// A chunk of the source, shared read-only by every device writer
+struct SharedChunk {
+    offset: u64,
+    data: AlignedBuffer,
+}
+
+enum Message {
+    Data(Arc<SharedChunk>),
+    End,
+}
+
+/// Length and leaf hashes of the whole source, or why it couldn't be read
+type SourceDigest = OnceLock<std::result::Result<(u64, ChunkDigests), String>>;
+
+/// Wakes the source reader when a device takes a chunk off its queue
+#[derive(Default)]
+struct Group {
+    lock: Mutex<()>,
+    progressed: Condvar,
+}
+
+impl Group {
+    fn notify(&self) {
+        let _guard = self.lock.lock().unwrap();
+        self.progressed.notify_all();
+    }
+}
+
+/// What the source reader and one device share
+#[derive(Default)]
+struct Lane {
+    /// Chunks the device has taken off its queue
+    taken: AtomicU64,
+    /// The reader cut the device loose; it reads the source itself from
+    /// where its queue ended
+    detached: AtomicBool,
+}
+
+/// The reader's end of one device's queue
+struct Feed {
+    tx: SyncSender<Message>,
+    lane: Arc<Lane>,
+    /// `lane.taken` when the reader last looked
+    seen: u64,
+    /// Since when the queue has been full without the device taking a chunk
+    blocked: Option<Instant>,
+}
+
+impl Feed {
+    fn new(tx: SyncSender<Message>, lane: Arc<Lane>) -> Self {
+        Feed { tx, lane, seen: 0, blocked: None }
+    }
+
+    /// How long the device has held up the reader without taking anything,
+    /// given that its queue is full now
+    fn blocked_for(&mut self) -> Duration {
+        let taken = self.lane.taken.load(Ordering::Acquire);
+        if taken != self.seen {
+            self.seen = taken;
+            self.blocked = None;
+        }
+        self.blocked.get_or_insert_with(Instant::now).elapsed()
+    }
+}
+
+/// Feeds one device's pipeline from the shared source reader, or from its
+/// own read of the source once it falls too far behind
+struct ChannelSource {
+    rx: Receiver<Message>,
+    digest: Arc<SourceDigest>,
+    group: Arc<Group>,
+    lane: Arc<Lane>,
+    /// What to read once detached (see `flash_multi`)
+    own_path: Option<PathBuf>,
+    own: Option<Box<dyn ChunkSource>>,
+    /// Offset just past the last chunk received
+    next: u64,
+}
+
+impl ChunkSource for ChannelSource {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        if let Some(own) = self.own.as_mut() {
+            return own.next_chunk(buf);
+        }
+        match self.rx.recv() {
+            Ok(Message::Data(chunk)) => {
+                let len = chunk.data.len();
+                buf.as_mut_full()[..len].copy_from_slice(chunk.data.as_slice());
+                buf.set_len(len);
+                let offset = chunk.offset;
+                // Let go of the buffer before the reader looks for one to reuse
+                drop(chunk);
+                self.next = offset + len as u64;
+                self.lane.taken.fetch_add(1, Ordering::Release);
+                self.group.notify();
+                Ok(Some(offset))
+            }
+            Ok(Message::End) => Ok(None),
+            // Queued chunks all arrive before the hang-up, so the source
+            // continues right where they ended
+            Err(_) if self.lane.detached.load(Ordering::Acquire) => {
+                let path = self.own_path.as_ref().ok_or_else(|| anyhow!("Device fell behind with no source of its own"))?;
+                self.own = Some(open_own_source(path, self.next)?);
+                self.next_chunk(buf)
+            }
+            // The reader hung up on us: either the source failed or this
+            // device stalled and was dropped
+            Err(_) => match self.digest.get() {
+                Some(Err(e)) => Err(anyhow!("{}", e)),
+                _ => Err(anyhow!("Device stopped accepting data and was dropped")),
+            },
+        }
+    }
+}
+
+/// The source from `offset` on, for a device reading it by itself. A raw
+/// image is read from there; a compressed one is decompressed again and
+/// everything before `offset` thrown away.
+fn open_own_source(path: &PathBuf, offset: u64) -> Result<Box<dyn ChunkSource>> {
+    let (mut image, info) = open_image(path, Arc::new(AtomicU64::new(0)))?;
+    if info.is_raw() {
+        drop(image);
+        let mut raw = File::open(path)?;
+        raw.seek(SeekFrom::Start(offset))?;
+        return Ok(Box::new(StreamSource::new(raw).at_offset(offset)));
+    }
+    let skipped = std::io::copy(&mut (&mut image).take(offset), &mut std::io::sink())?;
+    if skipped < offset {
+        return Err(anyhow!("Image is shorter than what was already written"));
+    }
+    Ok(Box::new(StreamSource::new(image).at_offset(offset)))
+}
+
+/// Flash one image to several devices at once.
+///
+/// The source is read, decompressed and hashed once; each device gets its
+/// own writer thread fed through a bounded queue. A device whose queue is
+/// still full when a faster one has emptied its own is holding the group
+/// back: it is cut loose to read the source by itself, from the stored
+/// decompressed copy or the image file (not a download). A device that
+/// fails is detached without affecting the others, and one that stops
+/// taking data for `STALL_TIMEOUT` (longer under a bandwidth cap) is dropped. Every device is then verified
+/// against the source's leaf hashes the way a single flash is (in full or
+/// sampled, repairing what fails if asked). Results are reported per target.
+///
+/// All devices share `control`: they are fed by one reader, so pausing or
+/// cancelling applies to the whole group, and the bandwidth cap to the sum
+/// of their writes. Each device joins its USB bandwidth domain in the
+/// global `Scheduler` while it runs, so flashes started meanwhile wait for
+/// the bus and it gets its part of the bus's queue depth.
+///
+/// Every device gets the whole image: delta and used-blocks-only flashing
+/// and bmaps are not applied, which the write status notes.
+pub fn flash_multi(image_path: &PathBuf, targets: &[MultiTarget], options: &FlashOptions, control: &Control) {
+    let (options, notes) = &whole_image_options(image_path, options);
+
+    // 1. Unmount and lock every device; the ones that can't be prepared are left out
+    let devices: Vec<(usize, File)> = targets
+        .iter()
+        .enumerate()
+        .filter_map(|(index, target)| {
+            let prepared = unmount_partitions(&target.mount_points, &target.status)
+                .and_then(|_| open_device_exclusive(&target.device_path));
+            match prepared {
+                Ok(device) => Some((index, device)),
+                Err(e) => {
+                    target.fail(format!("Flash Error: {}", e));
+                    None
+                }
+            }
+        })
+        .collect();
+    if devices.is_empty() {
+        return;
+    }
+
+    // 2. Open the source once for everyone
+    let consumed = Arc::new(AtomicU64::new(0));
+    let (image, info) = match open_image(image_path, consumed.clone()) {
+        Ok(opened) => opened,
+        Err(e) => {
+            for (index, _) in &devices {
+                targets[*index].fail(format!("Flash Error: Failed to open image: {}", e));
+            }
+            return;
+        }
+    };
+
+    let chunk_size = chunk_size_for(options);
+    let window = (DEVICE_WINDOW_BYTES / chunk_size).max(2);
+    let digest: Arc<SourceDigest> = Arc::new(OnceLock::new());
+    let group = Arc::new(Group::default());
+    // Where a device that falls behind reads for itself
+    let own_path = options.image_store.then(|| Store::open().lookup(image_path)).flatten()
+        .map(|entry| entry.path)
+        .or_else(|| Some(image_path.clone()).filter(|path| !is_url(&path.to_string_lossy())));
+
+    // 3. One writer thread per device, fed by the reader on this thread
+    thread::scope(|scope| {
+        let mut feeds = Vec::with_capacity(devices.len());
+        for (index, device) in devices {
+            let (tx, rx) = sync_channel(window);
+            let lane = Arc::new(Lane::default());
+            feeds.push(Some(Feed::new(tx, lane.clone())));
+
+            let target = &targets[index];
+            let source = ChannelSource {
+                rx,
+                digest: digest.clone(),
+                group: group.clone(),
+                lane,
+                own_path: own_path.clone(),
+                own: None,
+                next: 0,
+            };
+            let (info, consumed) = (&info, &consumed);
+            scope.spawn(move || {
+                let depth = Arc::new(Control::default());
+                let _slot = Scheduler::global().join(Job {
+                    device_path: target.device_path.clone(),
+                    size: info.image_size.unwrap_or(info.file_size),
+                    queue_depth: options.queue_depth,
+                    control: depth.clone(),
+                    on_wait: Box::new(|_| {}),
+                });
+                run_device(target, image_path, device, source, options, notes, info, consumed, control, &depth);
+                *target.is_running.lock().unwrap() = false;
+            });
+        }
+
+        let detachable = own_path.is_some();
+        read_source(image, chunk_size, options.verify_hash, &mut feeds, &group, detachable, &digest, control);
+    });
+}
+
+/// `options` without what a multi flash can't do, and a note on what was
+/// left out for the write status. The shared reader sends every chunk of the
+/// source to every device, so nothing is skipped per device (delta) or per
+/// image (used blocks, bmap).
+fn whole_image_options(image_path: &PathBuf, options: &FlashOptions) -> (FlashOptions, String) {
+    let mut options = options.clone();
+    let mut ignored = Vec::new();
+    if std::mem::take(&mut options.delta) {
+        ignored.push("changed blocks only");
+    }
+    if std::mem::take(&mut options.used_blocks_only) {
+        ignored.push("used blocks only");
+    }
+    if find_bmap(image_path).is_some() {
+        ignored.push("bmap");
+    }
+    let notes = if ignored.is_empty() {
+        String::new()
+    } else {
+        format!(", whole image: {} not supported for several devices", ignored.join(", "))
+    };
+    (options, notes)
+}
+
+/// Read, hash and fan out the source to every device queue. Devices that
+/// fall behind are cut loose if `detachable`.
+fn read_source(
+    mut image: Box<dyn Read + Send>,
+    chunk_size: usize,
+    algorithm: HashAlgorithm,
+    feeds: &mut [Option<Feed>],
+    group: &Group,
+    detachable: bool,
+    digest: &SourceDigest,
+    control: &Control,
+) {
+    let mut hasher = ChunkHasher::new(algorithm);
+    let mut in_flight: VecDeque<Arc<SharedChunk>> = VecDeque::new();
+    let mut offset = 0u64;
+    let mut sent = 0u64;
+
+    loop {
+        if feeds.iter().all(Option::is_none) {
+            // Every device failed or reads for itself; nothing left to read for
+            let _ = digest.set(Err("All devices failed".to_string()));
+            return;
+        }
+        // Hold the source while paused; on cancel every device gets the error
+        if let Err(e) = control.checkpoint(0) {
+            let _ = digest.set(Err(e.to_string()));
+            return;
+        }
+
+        // Reuse the oldest buffer once every device has copied it out
+        let mut chunk = match in_flight.front() {
+            Some(oldest) if Arc::strong_count(oldest) == 1 => in_flight.pop_front().unwrap(),
+            _ => Arc::new(SharedChunk { offset: 0, data: AlignedBuffer::new(chunk_size) }),
+        };
+        let shared = Arc::get_mut(&mut chunk).expect("chunk still shared");
+
+        let n = match fill_buffer(&mut image, &mut shared.data) {
+            Ok(n) => n,
+            Err(e) => {
+                // Dropping the senders makes every device report this error
+                let _ = digest.set(Err(e.to_string()));
+                return;
+            }
+        };
+        if n == 0 {
+            break;
+        }
+        shared.offset = offset;
+        offset += n as u64;
+        hasher.update_at(shared.offset, shared.data.as_slice());
+
+        fan_out(feeds, group, sent, detachable, control, || Message::Data(chunk.clone()));
+        sent += 1;
+        in_flight.push_back(chunk);
+    }
+
+    let _ = digest.set(Ok((offset, hasher.finish())));
+    fan_out(feeds, group, sent, false, control, || Message::End);
+}
+
+/// How long a device may hold up the reader without taking a chunk. The
+/// live devices share a bandwidth cap, so under one each may have to wait
+/// as long as it takes all of them to move a window's worth.
+fn stall_limit(live: usize, control: &Control) -> Duration {
+    match control.limit() {
+        0 => STALL_TIMEOUT,
+        limit => STALL_TIMEOUT + Duration::from_secs_f64((live * DEVICE_WINDOW_BYTES) as f64 / limit as f64),
+    }
+}
+
+/// Hand a message to every live device, waiting for room in full queues.
+/// Devices that have gone away are forgotten. `sent` messages went before
+/// this one: a device that has taken them all is waiting for data, so any
+/// whose queue is still full trails it by the whole window and, if
+/// `detach`, is cut loose to read the source itself. A device whose queue
+/// stays full while it takes nothing for `stall_limit` is cut off too.
+/// Time spent paused doesn't count.
+fn fan_out<M: Fn() -> Message>(
+    feeds: &mut [Option<Feed>],
+    group: &Group,
+    sent: u64,
+    detach: bool,
+    control: &Control,
+    message: M,
+) {
+    let mut pending: Vec<usize> = (0..feeds.len()).filter(|&i| feeds[i].is_some()).collect();
+    // Held while checking the queues, so a device taking a chunk in between
+    // still wakes us
+    let mut guard = group.lock.lock().unwrap();
+
+    loop {
+        let mut still_full = Vec::new();
+        for index in pending {
+            let feed = feeds[index].as_mut().unwrap();
+            match feed.tx.try_send(message()) {
+                Ok(()) => feed.blocked = None,
+                Err(TrySendError::Disconnected(_)) => feeds[index] = None,
+                Err(TrySendError::Full(_)) => still_full.push(index),
+            }
+        }
+        pending = still_full;
+        if pending.is_empty() {
+            return;
+        }
+
+        let paused = control.is_paused();
+        let limit = stall_limit(feeds.iter().flatten().count(), control);
+        let waiting = feeds.iter().flatten().any(|feed| feed.lane.taken.load(Ordering::Acquire) >= sent);
+        for &index in &pending {
+            let feed = feeds[index].as_mut().unwrap();
+            if paused {
+                feed.blocked = None;
+            }
+            if (detach && waiting) || feed.blocked_for() >= limit {
+                feed.lane.detached.store(detach, Ordering::Release);
+                feeds[index] = None;
+            }
+        }
+        pending.retain(|&index| feeds[index].is_some());
+        if pending.is_empty() {
+            return;
+        }
+        guard = group.progressed.wait_timeout(guard, STALL_CHECK_INTERVAL).unwrap().0;
+    }
+}
+
+/// Write and verify one device, reporting into its target
+fn run_device(
+    target: &MultiTarget,
+    image_path: &PathBuf,
+    device: File,
+    source: ChannelSource,
+    options: &FlashOptions,
+    notes: &str,
+    info: &ImageInfo,
+    consumed: &AtomicU64,
+    control: &Control,
+    depth: &Control,
+) {
+    let digest = source.digest.clone();
+    let total = match write_device(target, &device, source, options, notes, info, consumed, control, depth) {
+        Ok(total) => total,
+        Err(e) => return target.fail(format!("Flash Error: {}", e)),
+    };
+    // A repair opens the device exclusively again
+    drop(device);
+
+    *target.status.lock().unwrap() = "Starting verification...".to_string();
+    match verify_device(target, image_path, total, &digest, options) {
+        Ok(()) => {
+            *target.status.lock().unwrap() = "All operations completed successfully!".to_string();
+            *target.progress.lock().unwrap() = 1.0;
+            *target.verify_progress.lock().unwrap() = 1.0;
+        }
+        Err(e) => target.fail(format!("Verification Error: {}", e)),
+    }
+}
+
+fn write_device(
+    target: &MultiTarget,
+    device: &File,
+    source: ChannelSource,
+    options: &FlashOptions,
+    notes: &str,
+    info: &ImageInfo,
+    consumed: &AtomicU64,
+    control: &Control,
+    depth: &Control,
+) -> Result<u64> {
+    let chunk_size = chunk_size_for(options);
+    let buffers = allocate_ring(chunk_size, ring_depth_for(options, chunk_size));
+    let (writer, backend) = open_writer(device, &buffers, options)?;
+    // Paced with the group, queued as deep as the device's share of its bus
+    let writer: Box<dyn BlockWriter> = Box::new(ControlledWriter::new(writer, control).queue_depth_from(depth));
+    let mut writer: Box<dyn BlockWriter> = if options.bounded_writeback {
+        Box::new(WritebackWriter::new(writer, device, target.bytes_durable.clone()))
+    } else {
+        writer
+    };
+
+    *target.status.lock().unwrap() = format!("Writing image ({}{})...", backend, notes);
+    let mut processed = 0u64;
+    let mut written = 0u64;
+    let total = run_pipeline(source, buffers, &mut *writer, &target.metrics, |chunk: &Chunk| {
+        let len = chunk.buf.len() as u64;
+        if chunk.skipped {
+            *target.bytes_skipped.lock().unwrap() += len;
+        } else {
+            *target.bytes_written.lock().unwrap() += len;
+            written += len;
+        }
+        processed += len;
+        // Written bytes only count once they are on the device
+        let on_device = if options.bounded_writeback {
+            processed - written + *target.bytes_durable.lock().unwrap()
+        } else {
+            processed
+        };
+        let fraction = match info.image_size {
+            Some(size) => on_device as f32 / size.max(1) as f32,
+            None => consumed.load(Ordering::Relaxed) as f32 / info.file_size.max(1) as f32,
+        };
+        *target.progress.lock().unwrap() = fraction.min(0.99);
+    })?;
+    drop(writer);
+
+    *target.status.lock().unwrap() = "Syncing device...".to_string();
+    device.sync_all()?;
+    *target.bytes_durable.lock().unwrap() = *target.bytes_written.lock().unwrap();
+    *target.progress.lock().unwrap() = 1.0;
+    Ok(total)
+}
+
+/// Verify the device against the leaf hashes the reader took of the source,
+/// as `options` asks, and repair it if that fails and a repair is wanted
+fn verify_device(target: &MultiTarget, image_path: &PathBuf, total: u64, digest: &SourceDigest, options: &FlashOptions) -> Result<()> {
+    let expected = match digest.get() {
+        Some(Ok((source_len, _))) if *source_len != total => {
+            return Err(anyhow!("Wrote {} bytes but the image is {} bytes", total, source_len));
+        }
+        Some(Ok((_, digests))) => Some(digests),
+        // The reader stopped early and this device finished on its own
+        // read of the source; the image is hashed again
+        _ => None,
+    };
+
+    let stats = &target.verify_stats;
+    // A repair needs every failing range, not just the first
+    stats.exhaustive.store(options.repair, Ordering::Relaxed);
+    let verified = if options.verify_samples > 0 {
+        verify_sampled(image_path, &target.device_path, target.verify_progress.clone(), target.status.clone(), stats.clone(), total, None, options.verify_hash, expected, options.verify_samples)
+            .map(|_| ())
+    } else {
+        verify_integrity(image_path, &target.device_path, target.verify_progress.clone(), target.status.clone(), stats.clone(), total, None, options.verify_hash, expected)
+            .map(|_| ())
+    };
+    match verified {
+        Err(_) if options.repair && !stats.mismatches.lock().unwrap().is_empty() => {
+            repair_device(image_path, &target.device_path, target.verify_progress.clone(), target.status.clone(), stats, total)
+        }
+        verified => verified,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::options::IoBackend;
+    use std::io::Write;
+
+    fn target(device_path: String) -> MultiTarget {
+        MultiTarget {
+            device_path,
+            mount_points: Vec::new(),
+            progress: Arc::new(Watched::new(0.0)),
+            status: Arc::new(Watched::new(String::new())),
+            bytes_written: Arc::new(Watched::new(0)),
+            bytes_skipped: Arc::new(Watched::new(0)),
+            bytes_durable: Arc::new(Watched::new(0)),
+            verify_progress: Arc::new(Watched::new(0.0)),
+            verify_stats: Arc::new(VerifyStats::default()),
+            is_running: Arc::new(Watched::new(true)),
+            error: Arc::new(Watched::new(None)),
+            metrics: Arc::new(Metrics::default()),
+        }
+    }
+
+    #[test]
+    fn test_multi_flash_survives_a_failing_device() {
+        let dir = std::env::temp_dir().join(format!("fluxflasher-multi-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let image_path = dir.join("image.img");
+        let image: Vec<u8> = (0..10_000_000u32).map(|i| (i % 241) as u8).collect();
+        File::create(&image_path).unwrap().write_all(&image).unwrap();
+
+        let good: Vec<PathBuf> = (0..3).map(|i| dir.join(format!("dev{}", i))).collect();
+        for path in &good {
+            File::create(path).unwrap();
+        }
+        let mut targets: Vec<MultiTarget> = good.iter().map(|p| target(p.display().to_string())).collect();
+        targets.insert(1, target(dir.join("missing/dev").display().to_string()));
+
+        let options = FlashOptions { backend: IoBackend::Blocking, ..FlashOptions::default() };
+        flash_multi(&image_path, &targets, &options, &Control::default());
+
+        assert!(targets[1].error.lock().unwrap().is_some());
+        for (path, t) in good.iter().zip(targets.iter().filter(|t| !t.device_path.contains("missing"))) {
+            assert_eq!(*t.error.lock().unwrap(), None);
+            assert_eq!(*t.bytes_written.lock().unwrap(), image.len() as u64);
+            assert_eq!(t.metrics.report().bytes_written, image.len() as u64);
+            assert_eq!(*t.bytes_durable.lock().unwrap(), image.len() as u64);
+            assert_eq!(t.verify_stats.device_bytes.load(Ordering::Relaxed), image.len() as u64);
+            assert!(std::fs::read(path).unwrap() == image);
+        }
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_lagging_device_reads_the_source_itself() {
+        let path = std::env::temp_dir().join(format!("fluxflasher-multi-lag-{}.img", std::process::id()));
+        let image: Vec<u8> = (0..4 * 4096u32).map(|i| (i % 251) as u8).collect();
+        File::create(&path).unwrap().write_all(&image).unwrap();
+
+        let group = Arc::new(Group::default());
+        let lanes: Vec<Arc<Lane>> = (0..2).map(|_| Arc::new(Lane::default())).collect();
+        let (mut feeds, mut sources) = (Vec::new(), Vec::new());
+        for lane in &lanes {
+            let (tx, rx) = sync_channel(2);
+            feeds.push(Some(Feed::new(tx, lane.clone())));
+            sources.push(ChannelSource {
+                rx,
+                digest: Arc::new(OnceLock::new()),
+                group: group.clone(),
+                lane: lane.clone(),
+                own_path: Some(path.clone()),
+                own: None,
+                next: 0,
+            });
+        }
+        let chunk = |i: usize| {
+            let mut data = AlignedBuffer::new(4096);
+            data.as_mut_full()[..4096].copy_from_slice(&image[i * 4096..(i + 1) * 4096]);
+            data.set_len(4096);
+            Message::Data(Arc::new(SharedChunk { offset: i as u64 * 4096, data }))
+        };
+
+        // Both queues fill; then the first device drains its queue and the
+        // second, a whole window behind, is cut loose instead of waited for
+        let control = Control::default();
+        let mut buf = AlignedBuffer::new(4096);
+        for sent in 0..2 {
+            fan_out(&mut feeds, &group, sent, true, &control, || chunk(sent as usize));
+        }
+        for _ in 0..2 {
+            sources[0].next_chunk(&mut buf).unwrap();
+        }
+        fan_out(&mut feeds, &group, 2, true, &control, || chunk(2));
+        assert!(feeds[0].is_some() && feeds[1].is_none());
+        assert!(lanes[1].detached.load(Ordering::Relaxed));
+
+        // It gets its queued chunks, then the rest from the image
+        let mut received = Vec::new();
+        while let Some(offset) = sources[1].next_chunk(&mut buf).unwrap() {
+            assert_eq!(offset, received.len() as u64);
+            received.extend_from_slice(buf.as_slice());
+        }
+        assert!(received == image);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
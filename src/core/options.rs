@@ -0,0 +1,104 @@
+use std::path::PathBuf;
+
+use super::control::IoPriority;
+use super::hash::HashAlgorithm;
+
+/// Which I/O engine writes to the device
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum IoBackend {
+    /// io_uring when the kernel supports it, blocking writes otherwise
+    Auto,
+    /// One synchronous pwrite per chunk
+    Blocking,
+    /// io_uring with registered buffers and a registered device fd
+    IoUring,
+}
+
+/// Tunables for a single flash operation
+#[derive(Clone, Debug)]
+pub struct FlashOptions {
+    pub backend: IoBackend,
+    /// Maximum number of writes in flight (io_uring only)
+    pub queue_depth: u32,
+    /// Maximum number of bytes in flight (io_uring only)
+    pub max_inflight_bytes: u64,
+    /// Skip all-zero chunks and discard those ranges instead of writing them
+    pub trim: bool,
+    /// Only write (and verify) partition tables, filesystem metadata and
+    /// allocated blocks of filesystems we can parse
+    pub used_blocks_only: bool,
+    /// Compare against what is already on the device and only rewrite the
+    /// chunks that differ
+    pub delta: bool,
+    /// Continue an interrupted flash of the same image from its checkpoint
+    /// journal, if the committed part still checks out
+    pub resume: bool,
+    /// Calibrate chunk size and queue depth for the device (or reuse the
+    /// cached profile for its model) before writing
+    pub autotune: bool,
+    /// Bytes per write; 0 picks the default for the mode
+    pub chunk_size: usize,
+    /// Push written data to the device in bounded windows as the flash goes,
+    /// instead of leaving it all to the final sync
+    pub bounded_writeback: bool,
+    /// Copy raw images to the device inside the kernel (copy_file_range or
+    /// splice) when nothing needs to look at the data
+    pub zero_copy: bool,
+    /// Keep a decompressed copy of compressed images in the local image
+    /// store, and flash from the stored copy when there is one. Off by
+    /// default: the store takes up to `STORE_BUDGET` of the user's cache.
+    pub image_store: bool,
+    /// Digest used to compare image and device when verifying
+    pub verify_hash: HashAlgorithm,
+    /// Verify only this many randomly placed chunks, plus those holding the
+    /// partition tables, boot sectors and superblocks, instead of reading
+    /// the whole image back; 0 verifies everything
+    pub verify_samples: usize,
+    /// When verification fails, rewrite just the failing ranges from the
+    /// image and read them back, rather than failing the flash
+    pub repair: bool,
+    /// Hash the image while writing it. Off when its hashes are already
+    /// known, e.g. from an earlier flash of the same file.
+    pub hash_source: bool,
+    /// I/O scheduling class and level for the operation's threads
+    pub io_priority: IoPriority,
+    /// Initial bandwidth cap in bytes per second, 0 for none; can be
+    /// changed while running through the operation's `Control`
+    pub rate_limit: u64,
+    /// When the operation ends, write its metrics here in Prometheus text
+    /// format, for node_exporter's textfile collector
+    pub metrics_textfile_dir: Option<PathBuf>,
+    /// When the operation ends, write a JSON report of its metrics here
+    pub metrics_report_dir: Option<PathBuf>,
+}
+
+pub const DEFAULT_QUEUE_DEPTH: u32 = 8;
+pub const MAX_QUEUE_DEPTH: u32 = 128;
+pub const DEFAULT_MAX_INFLIGHT_BYTES: u64 = 64 * 1024 * 1024;
+
+impl Default for FlashOptions {
+    fn default() -> Self {
+        FlashOptions {
+            backend: IoBackend::Auto,
+            queue_depth: DEFAULT_QUEUE_DEPTH,
+            max_inflight_bytes: DEFAULT_MAX_INFLIGHT_BYTES,
+            trim: false,
+            used_blocks_only: false,
+            delta: false,
+            resume: false,
+            autotune: false,
+            chunk_size: 0,
+            bounded_writeback: true,
+            zero_copy: true,
+            image_store: false,
+            verify_hash: HashAlgorithm::Blake3,
+            verify_samples: 0,
+            repair: false,
+            hash_source: true,
+            io_priority: IoPriority::default(),
+            rate_limit: 0,
+            metrics_textfile_dir: None,
+            metrics_report_dir: None,
+        }
+    }
+}
@@ -0,0 +1,264 @@
+use anyhow::{anyhow, Result};
+use std::collections::HashMap;
+use std::io::{ErrorKind, Read};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc::{channel, sync_channel};
+use std::thread;
+use std::time::Instant;
+
+use super::buffer::AlignedBuffer;
+use super::metrics::Metrics;
+
+/// Size of each buffer in the ring (same block size dd was using)
+pub const DEFAULT_CHUNK_SIZE: usize = 4 * 1024 * 1024;
+
+/// Number of buffers in the ring
+pub const DEFAULT_RING_DEPTH: usize = 4;
+
+/// A filled buffer together with its position in the source stream
+pub struct Chunk {
+    pub offset: u64,
+    pub buf: AlignedBuffer,
+    /// Set by writers that completed the chunk without writing its data
+    pub skipped: bool,
+}
+
+/// Destination of a pipeline. Implementations may complete writes
+/// asynchronously; finished chunks are handed back through `done` so their
+/// buffers can be refilled.
+pub trait BlockWriter {
+    /// Queue a chunk for writing
+    fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()>;
+
+    /// Wait until every queued chunk has been written
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()>;
+
+    /// Keep at most `depth` writes in flight from now on, up to what the
+    /// writer was opened with; 0 goes back to that. Writers without a queue
+    /// ignore this.
+    fn set_queue_depth(&mut self, _depth: usize) {}
+}
+
+/// Produces the chunks a pipeline writes, in ascending offset order
+pub trait ChunkSource: Send {
+    /// Fill `buf` with the next run of data and return its offset in the
+    /// image, or `None` when there is nothing left
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>>;
+}
+
+impl<S: ChunkSource + ?Sized> ChunkSource for Box<S> {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        (**self).next_chunk(buf)
+    }
+}
+
+impl<S: ChunkSource + ?Sized> ChunkSource for &mut S {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        (**self).next_chunk(buf)
+    }
+}
+
+/// Reads a stream front to back, one full buffer at a time
+pub struct StreamSource<R> {
+    reader: R,
+    offset: u64,
+}
+
+impl<R: Read + Send> StreamSource<R> {
+    pub fn new(reader: R) -> Self {
+        StreamSource { reader, offset: 0 }
+    }
+
+    /// Report offsets relative to `offset`, for a stream that has already
+    /// been positioned there
+    pub fn at_offset(mut self, offset: u64) -> Self {
+        self.offset = offset;
+        self
+    }
+}
+
+impl<R: Read + Send> ChunkSource for StreamSource<R> {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        let n = fill_buffer(&mut self.reader, buf)?;
+        if n == 0 {
+            return Ok(None);
+        }
+        let offset = self.offset;
+        self.offset += n as u64;
+        Ok(Some(offset))
+    }
+}
+
+/// Copy `source` into `writer` through a bounded ring of aligned buffers.
+///
+/// A reader thread fills free buffers from the source while the calling
+/// thread hands filled buffers to the writer, so source reads and device
+/// writes overlap. `on_done` is called for every chunk once the writer has
+/// finished with it. Returns the total number of bytes written.
+///
+/// `metrics` records how long the reader and the writer each worked and
+/// waited, how full the ring was, how long each written chunk took from
+/// submission to completion and the bytes written per second. Time the
+/// writer spends throttled by a `ControlledWriter` counts as busy.
+pub fn run_pipeline<S, F>(
+    mut source: S,
+    buffers: Vec<AlignedBuffer>,
+    writer: &mut dyn BlockWriter,
+    metrics: &Metrics,
+    mut on_done: F,
+) -> Result<u64>
+where
+    S: ChunkSource,
+    F: FnMut(&Chunk),
+{
+    let depth = buffers.len();
+    let (free_tx, free_rx) = channel::<AlignedBuffer>();
+    let (full_tx, full_rx) = sync_channel::<Result<Chunk>>(depth);
+    // Chunks sent by the reader and not yet taken by the writer
+    let queued = &AtomicUsize::new(0);
+
+    for buf in buffers {
+        free_tx.send(buf).unwrap();
+    }
+
+    // Moving the channel ends into the scope closure means an early return
+    // hangs them up, which unblocks the reader before the scope joins it.
+    thread::scope(move |scope| {
+        scope.spawn(move || {
+            // Stops when the writer hangs up (error) or the source runs dry
+            loop {
+                let waiting = Instant::now();
+                let Ok(mut buf) = free_rx.recv() else { break };
+                metrics.read.idle(waiting);
+                let reading = Instant::now();
+                let next = source.next_chunk(&mut buf);
+                metrics.read.busy(reading);
+                let (item, last) = match next {
+                    Ok(None) => break,
+                    Ok(Some(offset)) => (Ok(Chunk { offset, buf, skipped: false }), false),
+                    Err(e) => (Err(e), true),
+                };
+                queued.fetch_add(1, Ordering::Relaxed);
+                let waiting = Instant::now();
+                let sent = full_tx.send(item).is_ok();
+                metrics.read.idle(waiting);
+                if !sent || last {
+                    break;
+                }
+            }
+        });
+
+        let mut total = 0u64;
+        let mut done = Vec::new();
+        // When each chunk the writer holds was submitted
+        let mut submitted = HashMap::new();
+        let mut recycle = |done: &mut Vec<Chunk>, submitted: &mut HashMap<u64, Instant>, total: &mut u64| {
+            for chunk in done.drain(..) {
+                *total += chunk.buf.len() as u64;
+                let submitted = submitted.remove(&chunk.offset);
+                if let Some(start) = submitted.filter(|_| !chunk.skipped) {
+                    metrics.write_latency.record(start.elapsed());
+                    metrics.wrote(chunk.buf.len() as u64);
+                }
+                on_done(&chunk);
+                // The reader may already be gone after EOF; that's fine
+                let _ = free_tx.send(chunk.buf);
+            }
+        };
+
+        loop {
+            let waiting = Instant::now();
+            let Ok(chunk) = full_rx.recv() else { break };
+            let queue = queued.fetch_sub(1, Ordering::Relaxed);
+            let chunk = chunk?;
+            let writing = Instant::now();
+            metrics.write.idle(waiting);
+            metrics.sample_queue(queue, depth);
+            submitted.insert(chunk.offset, writing);
+            writer.submit(chunk, &mut done)?;
+            recycle(&mut done, &mut submitted, &mut total);
+            metrics.write.busy(writing);
+        }
+        let writing = Instant::now();
+        writer.flush(&mut done)?;
+        recycle(&mut done, &mut submitted, &mut total);
+        metrics.write.busy(writing);
+        Ok(total)
+    })
+}
+
+/// Read from `source` until the buffer is full or EOF, returning the byte count
+pub fn fill_buffer<R: Read>(source: &mut R, buf: &mut AlignedBuffer) -> Result<usize> {
+    let mut filled = 0;
+    let data = buf.as_mut_full();
+    while filled < data.len() {
+        match source.read(&mut data[filled..]) {
+            Ok(0) => break,
+            Ok(n) => filled += n,
+            Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+            Err(e) => return Err(anyhow!("Failed to read source image: {}", e)),
+        }
+    }
+    buf.set_len(filled);
+    Ok(filled)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::buffer::allocate_ring;
+    use std::io::Cursor;
+
+    /// Writer that completes each chunk one submission late
+    struct VecWriter {
+        out: Vec<u8>,
+        pending: Option<Chunk>,
+        fail_at: Option<u64>,
+    }
+
+    impl BlockWriter for VecWriter {
+        fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+            if Some(chunk.offset) == self.fail_at {
+                return Err(anyhow!("device went away"));
+            }
+            let start = chunk.offset as usize;
+            self.out[start..start + chunk.buf.len()].copy_from_slice(chunk.buf.as_slice());
+            done.extend(self.pending.replace(chunk));
+            Ok(())
+        }
+
+        fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+            done.extend(self.pending.take());
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_pipeline_copies_everything_in_order() {
+        let data: Vec<u8> = (0..100_003u32).map(|i| (i % 251) as u8).collect();
+        let mut writer = VecWriter { out: vec![0u8; data.len()], pending: None, fail_at: None };
+        let mut completed = 0u64;
+        let metrics = Metrics::default();
+
+        let source = StreamSource::new(Cursor::new(data.clone()));
+        let total = run_pipeline(source, allocate_ring(8192, 3), &mut writer, &metrics, |chunk| {
+            completed += chunk.buf.len() as u64;
+        }).unwrap();
+
+        assert_eq!(total, data.len() as u64);
+        assert_eq!(completed, total);
+        assert_eq!(writer.out, data);
+        let report = metrics.report();
+        assert_eq!(report.bytes_written, total);
+        assert_eq!(report.write_latency.count, 13);
+        assert!(report.queue_max >= 1 && report.queue_max <= 3);
+    }
+
+    #[test]
+    fn test_pipeline_stops_on_writer_error() {
+        let data = vec![0u8; 1 << 20];
+        let mut writer = VecWriter { out: vec![0u8; data.len()], pending: None, fail_at: Some(8192) };
+        let result = run_pipeline(StreamSource::new(Cursor::new(data)), allocate_ring(4096, 2), &mut writer, &Metrics::default(), |_| {});
+        assert!(result.is_err());
+    }
+}
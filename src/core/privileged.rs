@@ -0,0 +1,169 @@
+use anyhow::{anyhow, Context, Result};
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
+use std::path::PathBuf;
+use std::process::{Command, Stdio};
+
+/// Opens devices for a user who may not; see src/bin/fluxflasher-open-device.rs
+const HELPER: &str = "fluxflasher-open-device";
+
+/// Where packages install the helper, and where the polkit policy that lets
+/// one authorization cover a whole flash expects it
+const INSTALLED_HELPER_DIR: &str = "/usr/libexec/fluxflasher";
+
+/// What a device is opened for
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Access {
+    /// Read-write and exclusive (O_EXCL), for flashing, calibration and
+    /// repair
+    Write,
+    /// Read-only, bypassing the page cache where the device allows it
+    Read,
+}
+
+impl Access {
+    /// The helper's name for it
+    fn mode(self) -> &'static str {
+        match self {
+            Access::Write => "write",
+            Access::Read => "read",
+        }
+    }
+
+    fn open(self, device_path: &str) -> io::Result<File> {
+        let open = |write: bool, flags: libc::c_int| {
+            OpenOptions::new().read(true).write(write).custom_flags(flags | libc::O_CLOEXEC).open(device_path)
+        };
+        match self {
+            Access::Write => open(true, libc::O_EXCL),
+            Access::Read => open(false, libc::O_DIRECT).or_else(|_| open(false, 0)),
+        }
+    }
+}
+
+/// Open a device for `access`. Block devices usually belong to root, so
+/// when the user may not open it, the helper is run through pkexec to open
+/// it instead and hand the descriptor back; the device is then used exactly
+/// as if it had been opened here.
+pub fn open_device(device_path: &str, access: Access) -> Result<File> {
+    match access.open(device_path) {
+        Ok(file) => Ok(file),
+        Err(e) if e.kind() == io::ErrorKind::PermissionDenied => {
+            receive_device(helper_command(device_path, access)).context("Opening it as administrator failed")
+        }
+        Err(e) => Err(e.into()),
+    }
+}
+
+/// Whether a file was opened with O_DIRECT
+pub fn is_direct(file: &File) -> bool {
+    let flags = unsafe { libc::fcntl(file.as_raw_fd(), libc::F_GETFL) };
+    flags >= 0 && flags & libc::O_DIRECT != 0
+}
+
+/// The helper next to the running program (a build directory), or the
+/// installed one
+fn helper_path() -> PathBuf {
+    let beside = std::env::current_exe().ok().and_then(|exe| Some(exe.parent()?.join(HELPER)));
+    beside.filter(|path| path.exists()).unwrap_or_else(|| PathBuf::from(INSTALLED_HELPER_DIR).join(HELPER))
+}
+
+fn helper_command(device_path: &str, access: Access) -> Command {
+    let mut command = Command::new("pkexec");
+    command.arg(helper_path()).arg(access.mode()).arg(device_path);
+    command
+}
+
+/// Run `command` with a Unix socket as its stdout and take the descriptor
+/// it sends over it (SCM_RIGHTS). Its stderr says why when it sends none.
+fn receive_device(mut command: Command) -> Result<File> {
+    let mut fds = [0 as libc::c_int; 2];
+    if unsafe { libc::socketpair(libc::AF_UNIX, libc::SOCK_STREAM | libc::SOCK_CLOEXEC, 0, fds.as_mut_ptr()) } != 0 {
+        return Err(io::Error::last_os_error()).context("Failed to create a socket for the helper");
+    }
+    let (ours, theirs) = unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) };
+
+    let child = command
+        .stdin(Stdio::null())
+        .stdout(Stdio::from(theirs))
+        .stderr(Stdio::piped())
+        .spawn()
+        .context("Failed to run pkexec")?;
+    // Our copy of the child's end goes with the command, so the socket
+    // reads end of file once the helper exits
+    drop(command);
+    let received = receive_fd(&ours);
+    let output = child.wait_with_output()?;
+
+    match received {
+        Ok(Some(fd)) => Ok(File::from(fd)),
+        Ok(None) => {
+            let reason = String::from_utf8_lossy(&output.stderr).trim().to_string();
+            Err(match output.status.code() {
+                // pkexec: the user dismissed the dialog or wasn't authorized
+                Some(126) | Some(127) => anyhow!("not authorized"),
+                _ if !reason.is_empty() => anyhow!("{}", reason),
+                _ => anyhow!("helper exited with {}", output.status),
+            })
+        }
+        Err(e) => Err(e).context("Failed to receive the device from the helper"),
+    }
+}
+
+/// Receive one descriptor sent with SCM_RIGHTS, or `None` if the other end
+/// closed without sending one
+fn receive_fd(socket: &OwnedFd) -> io::Result<Option<OwnedFd>> {
+    let mut byte = [0u8; 1];
+    let mut iov = libc::iovec { iov_base: byte.as_mut_ptr() as *mut libc::c_void, iov_len: byte.len() };
+    // u64 keeps the control buffer aligned for cmsghdr
+    let mut control = [0u64; 4];
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = std::mem::size_of_val(&control) as _;
+
+    let n = loop {
+        let n = unsafe { libc::recvmsg(socket.as_raw_fd(), &mut msg, libc::MSG_CMSG_CLOEXEC) };
+        if n >= 0 {
+            break n;
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::Interrupted {
+            return Err(e);
+        }
+    };
+    if n == 0 {
+        return Ok(None);
+    }
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        if cmsg.is_null() || (*cmsg).cmsg_level != libc::SOL_SOCKET || (*cmsg).cmsg_type != libc::SCM_RIGHTS {
+            return Ok(None);
+        }
+        let fd = std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const libc::c_int);
+        Ok(Some(OwnedFd::from_raw_fd(fd)))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_helper_failure_is_reported() {
+        let mut command = Command::new("sh");
+        command.arg("-c").arg("echo '/dev/sdz: No such file or directory' >&2; exit 1");
+        let err = receive_device(command).unwrap_err();
+        assert!(err.to_string().contains("/dev/sdz: No such file"), "{}", err);
+
+        // A file the user can open never goes near the helper
+        let path = std::env::temp_dir().join(format!("fluxflasher_privileged_{}", std::process::id()));
+        std::fs::write(&path, [0u8; 4096]).unwrap();
+        let file = open_device(&path.to_string_lossy(), Access::Read).unwrap();
+        assert_eq!(file.metadata().unwrap().len(), 4096);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,142 @@
+use anyhow::{anyhow, Context, Result};
+use std::fs::File;
+use std::ops::Range;
+use std::os::unix::fs::{FileExt, FileTypeExt};
+use std::os::unix::io::AsRawFd;
+use std::sync::Arc;
+use std::time::Instant;
+
+use super::buffer::{AlignedBuffer, BUFFER_ALIGNMENT};
+use super::control::Control;
+use super::extents::ReadAt;
+use super::metrics::Metrics;
+use super::privileged::{is_direct, open_device, Access};
+
+// From <linux/fs.h>: _IO(0x12, 97)
+const BLKFLSBUF: libc::c_ulong = 0x1261;
+
+/// A file read at arbitrary offsets. A device opened for verification
+/// bypasses the page cache, so what was just written can't answer the
+/// reads and readback doesn't fill host memory.
+pub struct Readback {
+    file: File,
+    /// Opened with O_DIRECT: reads go out widened to `BUFFER_ALIGNMENT`
+    direct: bool,
+    /// Every read passes this first, if set
+    control: Option<Arc<Control>>,
+    /// Records the latency of every read, if set
+    metrics: Option<Arc<Metrics>>,
+}
+
+impl Readback {
+    /// Open a device for readback. Where O_DIRECT isn't supported, its
+    /// cached pages are dropped first instead (the privileged helper does
+    /// that as root when it opens the device for us).
+    pub fn device(device_path: &str) -> Result<Self> {
+        let file = open_device(device_path, Access::Read)
+            .with_context(|| format!("Failed to open {} for reading", device_path))?;
+        let readback = Readback { direct: is_direct(&file), file, control: None, metrics: None };
+        readback.drop_cache();
+        Ok(readback)
+    }
+
+    /// Plain reads through the page cache, for image files
+    pub fn cached(file: File) -> Self {
+        Readback { file, direct: false, control: None, metrics: None }
+    }
+
+    /// Pass every read through `control`, so it can be paused, capped or
+    /// cancelled
+    pub fn controlled(mut self, control: Arc<Control>) -> Self {
+        self.control = Some(control);
+        self
+    }
+
+    /// Record each read's latency and time as the verify stage of `metrics`
+    pub fn measured(mut self, metrics: Arc<Metrics>) -> Self {
+        self.metrics = Some(metrics);
+        self
+    }
+
+    /// Best effort: write back and evict the device's cached pages. The
+    /// flash has synced, so nothing is lost if this fails.
+    pub fn drop_cache(&self) {
+        let fd = self.file.as_raw_fd();
+        let is_block = self.file.metadata().map(|m| m.file_type().is_block_device()).unwrap_or(false);
+        unsafe {
+            if is_block {
+                libc::ioctl(fd, BLKFLSBUF as _, 0);
+            }
+            libc::posix_fadvise(fd, 0, 0, libc::POSIX_FADV_DONTNEED);
+        }
+    }
+
+    /// Capacity a buffer needs to read `len` bytes at any offset
+    pub fn buffer_size(&self, len: usize) -> usize {
+        if self.direct { len + 2 * BUFFER_ALIGNMENT } else { len }
+    }
+
+    /// Read `len` bytes at `offset` into `buf` and return them
+    pub fn read_at<'a>(&self, buf: &'a mut AlignedBuffer, offset: u64, len: usize) -> Result<&'a [u8]> {
+        let range = self.read_range(buf, offset, len)?;
+        Ok(&buf.as_mut_full()[range])
+    }
+
+    /// Like `read_at`, but return where in `buf` the bytes landed
+    pub fn read_range(&self, buf: &mut AlignedBuffer, offset: u64, len: usize) -> Result<Range<usize>> {
+        if let Some(control) = &self.control {
+            control.checkpoint(len as u64)?;
+        }
+        let align = if self.direct { BUFFER_ALIGNMENT as u64 } else { 1 };
+        let start = offset / align * align;
+        let end = (offset + len as u64 + align - 1) / align * align;
+        let span = &mut buf.as_mut_full()[..(end - start) as usize];
+
+        // The widened span may run past the end of the device; only the
+        // requested bytes have to be there
+        let needed = (offset - start) as usize + len;
+        let reading = Instant::now();
+        let mut got = 0;
+        while got < needed {
+            match self.file.read_at(&mut span[got..], start + got as u64) {
+                Ok(0) => return Err(anyhow!("Failed to read at offset {}: unexpected end of device", offset)),
+                Ok(n) => got += n,
+                Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
+                Err(e) => return Err(e).with_context(|| format!("Failed to read at offset {}", offset)),
+            }
+        }
+        if let Some(metrics) = &self.metrics {
+            metrics.verify_latency.record(reading.elapsed());
+            metrics.verify.busy(reading);
+        }
+        Ok((offset - start) as usize..needed)
+    }
+}
+
+impl ReadAt for Readback {
+    fn read_bytes(&self, offset: u64, len: usize) -> Result<Vec<u8>> {
+        let mut buf = AlignedBuffer::new(self.buffer_size(len));
+        Ok(self.read_at(&mut buf, offset, len)?.to_vec())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_unaligned_reads_up_to_the_end() {
+        let path = std::env::temp_dir().join(format!("fluxflasher-readback-{}.img", std::process::id()));
+        let data: Vec<u8> = (0..3 * BUFFER_ALIGNMENT as u32 + 1000).map(|i| (i % 241) as u8).collect();
+        std::fs::write(&path, &data).unwrap();
+
+        let readback = Readback::device(&path.to_string_lossy()).unwrap();
+        let mut buffer = AlignedBuffer::new(readback.buffer_size(data.len()));
+        let tail = readback.read_at(&mut buffer, 5000, data.len() - 5000).unwrap().to_vec();
+        let past_end = readback.read_at(&mut buffer, data.len() as u64 - 10, 20).is_err();
+        let _ = std::fs::remove_file(&path);
+
+        assert_eq!(tail, &data[5000..]);
+        assert!(past_end);
+    }
+}
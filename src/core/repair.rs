@@ -0,0 +1,152 @@
+use anyhow::{anyhow, Result};
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+use std::sync::atomic::AtomicU64;
+use std::sync::Arc;
+
+use super::buffer::AlignedBuffer;
+use super::extents::{ExtentMap, ExtentSource, StreamExtentSource};
+use super::flash::open_device_exclusive;
+use super::http::is_url;
+use super::image::open_image;
+use super::pipeline::ChunkSource;
+use super::readback::Readback;
+use super::snapshot::Watched;
+use super::utils::format_size;
+use super::verify::{merge_ranges, Mismatch, VerifyStats, VERIFY_CHUNK_SIZE};
+
+/// Times a chunk is rewritten and read back before its range is given up
+/// as bad media
+pub const REPAIR_ATTEMPTS: u32 = 3;
+
+/// Rewrite the ranges of the device that failed verification from the
+/// image, read each back past the page cache and retry up to
+/// `REPAIR_ATTEMPTS` times. Ranges that come back right end up in
+/// `stats.repaired`; those that never do stay in `stats.mismatches`, as
+/// likely bad media.
+///
+/// Ranges are widened to whole 4 KiB blocks. A compressed image is
+/// decompressed up to the last range, writing nothing in between. Rewrites
+/// go through `stats.control` like the readback before them.
+pub fn repair_device(
+    image_path: &PathBuf,
+    device_path: &str,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: &VerifyStats,
+    image_size: u64,
+) -> Result<()> {
+    let mut map = ExtentMap::default();
+    for m in stats.mismatches.lock().unwrap().iter() {
+        map.add(m.offset, m.len);
+    }
+    let map = map.normalize(image_size);
+    let total = map.extents().iter().map(|e| e.len).sum::<u64>().max(1);
+    *progress.lock().unwrap() = 0.0;
+
+    let (image, info) = open_image(image_path, Arc::new(AtomicU64::new(0)))?;
+    let mut source: Box<dyn ChunkSource> = if info.is_raw() && !is_url(&image_path.to_string_lossy()) {
+        drop(image);
+        Box::new(ExtentSource::new(File::open(image_path)?, &map))
+    } else {
+        Box::new(StreamExtentSource::new(image, &map))
+    };
+    let device = open_device_exclusive(device_path)?;
+    // Opened once: a device the user can't open costs an authorization each time
+    let readback = Readback::device(device_path);
+
+    let mut buffer = AlignedBuffer::new(VERIFY_CHUNK_SIZE as usize);
+    let mut check = None;
+    let (mut repaired, mut bad) = (Vec::new(), Vec::new());
+    let mut done = 0u64;
+    while let Some(offset) = source.next_chunk(&mut buffer)? {
+        let data = buffer.as_slice();
+        let len = data.len() as u64;
+        let mut attempt = 0;
+        let fixed = loop {
+            attempt += 1;
+            stats.control.checkpoint(len)?;
+            *status.lock().unwrap() = format!(
+                "Repairing: Rewriting {} at offset {} (attempt {} of {})...",
+                format_size(len), offset, attempt, REPAIR_ATTEMPTS,
+            );
+            // Write and read errors count as failed attempts: on a failing
+            // stick they are what bad media looks like
+            let written = device.write_all_at(data, offset).and_then(|_| device.sync_data()).is_ok();
+            let matches = written && readback.as_ref().is_ok_and(|readback| {
+                readback.drop_cache();
+                let check = check.get_or_insert_with(|| AlignedBuffer::new(readback.buffer_size(VERIFY_CHUNK_SIZE as usize)));
+                readback.read_at(check, offset, data.len()).is_ok_and(|back| back == data)
+            });
+            if matches || attempt == REPAIR_ATTEMPTS {
+                break matches;
+            }
+        };
+        let range = Mismatch { offset, len };
+        if fixed {
+            repaired.push(range);
+        } else {
+            bad.push(range);
+        }
+        done += len;
+        *progress.lock().unwrap() = done as f32 / total as f32;
+    }
+
+    let rewritten = repaired.iter().map(|m| m.len).sum::<u64>();
+    *stats.repaired.lock().unwrap() = merge_ranges(repaired);
+    let bad = merge_ranges(bad);
+    *stats.mismatches.lock().unwrap() = bad.clone();
+    match bad.first() {
+        None => {
+            *status.lock().unwrap() = format!("Verification Successful! (repaired {})", format_size(rewritten));
+            *progress.lock().unwrap() = 1.0;
+            Ok(())
+        }
+        Some(first) => Err(anyhow!(
+            "Verification failed: {} range(s) still differ after {} rewrites, first at bytes {}-{}; the device is likely failing",
+            bad.len(),
+            REPAIR_ATTEMPTS,
+            first.offset,
+            first.offset + first.len - 1,
+        )),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_repair_rewrites_only_failing_ranges() {
+        let dir = std::env::temp_dir();
+        let image = dir.join(format!("fluxflasher-repair-{}.img", std::process::id()));
+        let device = dir.join(format!("fluxflasher-repair-{}.dev", std::process::id()));
+        let data: Vec<u8> = (0..3 * 1024 * 1024u32).map(|i| (i % 233) as u8).collect();
+        let mut corrupted = data.clone();
+        corrupted[100_000..100_010].fill(0);
+        corrupted[2_000_000] ^= 0xff;
+        std::fs::write(&image, &data).unwrap();
+        std::fs::write(&device, &corrupted).unwrap();
+
+        let stats = VerifyStats::default();
+        *stats.mismatches.lock().unwrap() = vec![
+            Mismatch { offset: 100_000, len: 10 },
+            Mismatch { offset: 2_000_000, len: 1 },
+        ];
+        let result = repair_device(
+            &image, &device.to_string_lossy(), Arc::new(Watched::new(0.0)), Arc::new(Watched::new(String::new())),
+            &stats, data.len() as u64,
+        );
+        let healed = std::fs::read(&device).unwrap() == data;
+        let _ = std::fs::remove_file(&image);
+        let _ = std::fs::remove_file(&device);
+
+        assert!(result.is_ok());
+        assert!(healed);
+        assert!(stats.mismatches.lock().unwrap().is_empty());
+        // Widened to 4 KiB blocks
+        let repaired = stats.repaired.lock().unwrap().clone();
+        assert_eq!(repaired, vec![Mismatch { offset: 98_304, len: 4096 }, Mismatch { offset: 1_998_848, len: 4096 }]);
+    }
+}
@@ -0,0 +1,435 @@
+use std::collections::{HashMap, VecDeque};
+use std::fs;
+use std::path::Path;
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+use std::thread;
+use std::time::Duration;
+
+use super::control::{reset_io_priority, Control};
+use super::device::device_identity;
+use super::tune::load_profile;
+
+/// Writes in flight shared by all the writers of one USB bus. Each gets an
+/// equal part, up to its own configured depth, so a bus with many sticks
+/// doesn't drown in queued writes and the last stick left gets its full
+/// depth back.
+const DOMAIN_QUEUE_DEPTH: u32 = 32;
+
+/// Write speed assumed for a stick whose model hasn't been calibrated
+const DEFAULT_STICK_THROUGHPUT: u64 = 40 * 1024 * 1024;
+
+/// An idle pool thread exits after this long without work
+const IDLE_WORKER_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Where a device hangs in the USB tree, from sysfs
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Placement {
+    /// Host controller and root hub, e.g. "0000:00:14.0/usb2". Everything
+    /// on one root hub shares its bandwidth.
+    pub domain: String,
+    /// Ports from the root hub down to the device, e.g. ["2-1", "2-1.3"]
+    pub ports: Vec<String>,
+    /// Usable bytes per second of the root hub
+    pub bus_bandwidth: u64,
+    /// Usable bytes per second of the slowest link between the root hub and
+    /// the device, its own included
+    pub link_bandwidth: u64,
+}
+
+/// Bytes per second a USB link of `mbps` carries in practice: line coding
+/// takes a fifth (8b/10b; a little less from 10 Gbit/s on) and protocol
+/// overhead about a fifth of the rest
+fn usable_bandwidth(mbps: u64) -> u64 {
+    mbps * 80_000
+}
+
+/// Look up where `device_path` (e.g. /dev/sdb) is attached. `None` for
+/// devices that aren't on USB, or not block devices at all.
+pub fn usb_placement(device_path: &str) -> Option<Placement> {
+    let real = fs::canonicalize(device_path).ok()?;
+    let name = real.file_name()?.to_str()?;
+    let device_dir = fs::canonicalize(Path::new("/sys/class/block").join(name).join("device")).ok()?;
+    placement_from_sysfs(&device_dir)
+}
+
+/// Walk up from a block device's sysfs directory through the USB devices
+/// above it: the stick, any hubs, then the root hub ("usbN"), whose parent
+/// is the host controller
+fn placement_from_sysfs(device_dir: &Path) -> Option<Placement> {
+    let read = |dir: &Path, file: &str| fs::read_to_string(dir.join(file)).ok().map(|s| s.trim().to_string());
+    let mut ports = Vec::new();
+    let mut link_mbps = u64::MAX;
+    for dir in device_dir.ancestors() {
+        // USB devices and root hubs have a speed; interfaces don't
+        let Some(speed) = read(dir, "speed").and_then(|s| s.parse::<f64>().ok()) else { continue };
+        let name = dir.file_name()?.to_str()?.to_string();
+        link_mbps = link_mbps.min(speed as u64);
+        if name.starts_with("usb") {
+            let controller = dir.parent()?.file_name()?.to_str()?;
+            ports.reverse();
+            return Some(Placement {
+                domain: format!("{}/{}", controller, name),
+                ports,
+                bus_bandwidth: usable_bandwidth(speed as u64),
+                link_bandwidth: usable_bandwidth(link_mbps),
+            });
+        }
+        ports.push(name);
+    }
+    None
+}
+
+/// Where `device_path` is attached, and the bandwidth its writer is
+/// expected to take there: what its model was calibrated at (or a typical
+/// stick's), up to its link's
+fn place(device_path: &str) -> (Option<Placement>, u64) {
+    let placement = usb_placement(device_path);
+    let demand = placement.as_ref().map_or(0, |placement| {
+        let calibrated = device_identity(device_path).ok()
+            .and_then(|identity| load_profile(&identity))
+            .map(|profile| profile.throughput)
+            .filter(|&throughput| throughput > 0);
+        calibrated.unwrap_or(DEFAULT_STICK_THROUGHPUT).min(placement.link_bandwidth)
+    });
+    (placement, demand)
+}
+
+type Task = Box<dyn FnOnce() + Send>;
+
+#[derive(Default)]
+struct PoolState {
+    tasks: VecDeque<Task>,
+    idle: usize,
+}
+
+/// Threads shared by all operations. A task never waits for a free thread:
+/// one is started when none is idle, and idle ones exit after a while.
+#[derive(Default)]
+struct Pool {
+    state: Mutex<PoolState>,
+    ready: Condvar,
+}
+
+impl Pool {
+    fn execute(self: &Arc<Self>, task: Task) {
+        let mut state = self.state.lock().unwrap();
+        state.tasks.push_back(task);
+        if state.tasks.len() > state.idle {
+            let pool = self.clone();
+            thread::spawn(move || pool.work());
+        } else {
+            self.ready.notify_one();
+        }
+    }
+
+    fn work(&self) {
+        loop {
+            let mut state = self.state.lock().unwrap();
+            let task = loop {
+                if let Some(task) = state.tasks.pop_front() {
+                    break task;
+                }
+                state.idle += 1;
+                let (guard, wait) = self.ready.wait_timeout(state, IDLE_WORKER_TIMEOUT).unwrap();
+                state = guard;
+                state.idle -= 1;
+                if wait.timed_out() && state.tasks.is_empty() {
+                    return;
+                }
+            };
+            drop(state);
+            task();
+            // The next task may run a default-priority operation
+            let _ = reset_io_priority();
+        }
+    }
+}
+
+/// An operation to be scheduled
+pub struct Job {
+    pub device_path: String,
+    /// Bytes it will write; shorter jobs on a busy bus go first
+    pub size: u64,
+    /// Queue depth it was configured with
+    pub queue_depth: u32,
+    pub control: Arc<Control>,
+    /// Called with the number of operations ahead of it whenever that
+    /// changes while it waits
+    pub on_wait: Box<dyn Fn(usize) + Send>,
+}
+
+struct Waiting {
+    ticket: u64,
+    job: Job,
+    demand: u64,
+    ahead: Option<usize>,
+    run: Box<dyn FnOnce(Slot) + Send>,
+}
+
+struct Running {
+    ticket: u64,
+    demand: u64,
+    queue_depth: u32,
+    control: Arc<Control>,
+}
+
+struct Domain {
+    bandwidth: u64,
+    /// Devices off USB don't share anything
+    shared: bool,
+    running: Vec<Running>,
+    waiting: Vec<Waiting>,
+}
+
+/// Key and empty domain for a device placed at `placement`
+fn domain_for(placement: Option<Placement>, device_path: &str) -> (String, Domain) {
+    match placement {
+        Some(placement) => {
+            let domain = Domain { bandwidth: placement.bus_bandwidth, shared: true, running: Vec::new(), waiting: Vec::new() };
+            (placement.domain, domain)
+        }
+        None => {
+            let domain = Domain { bandwidth: u64::MAX, shared: false, running: Vec::new(), waiting: Vec::new() };
+            (format!("local:{}", device_path), domain)
+        }
+    }
+}
+
+#[derive(Default)]
+struct State {
+    domains: HashMap<String, Domain>,
+    next_ticket: u64,
+}
+
+/// Places operations into the USB bandwidth domains of their devices and
+/// starts them on a shared pool of threads.
+///
+/// A domain (one root hub) runs as many writers as its bandwidth carries at
+/// the speed their models were calibrated at (or a typical stick's), so
+/// they don't all slow down and throw off each other's ETAs. The rest wait,
+/// smallest image first, and the domain's queue depth budget is split
+/// between the running writers again whenever one starts or finishes.
+/// Devices that aren't on USB run right away.
+#[derive(Default)]
+pub struct Scheduler {
+    state: Mutex<State>,
+    pool: Arc<Pool>,
+}
+
+/// Held by a running operation; dropping it hands the bandwidth on
+pub struct Slot {
+    scheduler: Arc<Scheduler>,
+    domain: String,
+    ticket: u64,
+}
+
+impl Drop for Slot {
+    fn drop(&mut self) {
+        self.scheduler.finish(&self.domain, self.ticket);
+    }
+}
+
+impl Scheduler {
+    /// The scheduler all operations of the process share
+    pub fn global() -> &'static Arc<Scheduler> {
+        static GLOBAL: OnceLock<Arc<Scheduler>> = OnceLock::new();
+        GLOBAL.get_or_init(Arc::default)
+    }
+
+    /// Queue `job`, then call `run` on a pool thread once its domain has
+    /// room. A job cancelled while waiting runs right away, so it can
+    /// report that.
+    pub fn submit<F: FnOnce(Slot) + Send + 'static>(self: &Arc<Self>, job: Job, run: F) {
+        let (placement, demand) = place(&job.device_path);
+        self.submit_placed(placement, demand, job, Box::new(run));
+    }
+
+    fn submit_placed(self: &Arc<Self>, placement: Option<Placement>, demand: u64, job: Job, run: Box<dyn FnOnce(Slot) + Send>) {
+        let mut state = self.state.lock().unwrap();
+        let ticket = state.next_ticket;
+        state.next_ticket += 1;
+        let (key, domain) = domain_for(placement, &job.device_path);
+        let domain = state.domains.entry(key.clone()).or_insert(domain);
+        domain.waiting.push(Waiting { ticket, job, demand, ahead: None, run });
+        let started = self.dispatch(&key, domain);
+        drop(state);
+        for task in started {
+            self.pool.execute(task);
+        }
+    }
+
+    /// Count `job` as running in its domain right away, for writers that
+    /// have to start together (the devices of a multi-device flash). It
+    /// takes its part of the domain's bandwidth and queue depth budget, and
+    /// what is submitted later waits for it like for any other job.
+    pub fn join(self: &Arc<Self>, job: Job) -> Slot {
+        let (placement, demand) = place(&job.device_path);
+        self.join_placed(placement, demand, job)
+    }
+
+    fn join_placed(self: &Arc<Self>, placement: Option<Placement>, demand: u64, job: Job) -> Slot {
+        let mut state = self.state.lock().unwrap();
+        let ticket = state.next_ticket;
+        state.next_ticket += 1;
+        let (key, domain) = domain_for(placement, &job.device_path);
+        let domain = state.domains.entry(key.clone()).or_insert(domain);
+        domain.running.push(Running { ticket, demand, queue_depth: job.queue_depth.max(1), control: job.control });
+        let started = self.dispatch(&key, domain);
+        drop(state);
+        for task in started {
+            self.pool.execute(task);
+        }
+        Slot { scheduler: self.clone(), domain: key, ticket }
+    }
+
+    /// Run `task` on the shared pool without scheduling it
+    pub fn execute<F: FnOnce() + Send + 'static>(&self, task: F) {
+        self.pool.execute(Box::new(task));
+    }
+
+    /// Look at the waiting jobs again, after some were cancelled
+    pub fn wake(self: &Arc<Self>) {
+        let mut state = self.state.lock().unwrap();
+        let mut started = Vec::new();
+        for (key, domain) in state.domains.iter_mut() {
+            started.extend(self.dispatch(key, domain));
+        }
+        drop(state);
+        for task in started {
+            self.pool.execute(task);
+        }
+    }
+
+    fn finish(self: &Arc<Self>, key: &str, ticket: u64) {
+        let mut state = self.state.lock().unwrap();
+        let Some(domain) = state.domains.get_mut(key) else { return };
+        domain.running.retain(|running| running.ticket != ticket);
+        let started = self.dispatch(key, domain);
+        if domain.running.is_empty() && domain.waiting.is_empty() {
+            state.domains.remove(key);
+        }
+        drop(state);
+        for task in started {
+            self.pool.execute(task);
+        }
+    }
+
+    /// Start whatever fits in `domain` now, rebalance the queue depths of
+    /// its writers and tell those still waiting where they stand
+    fn dispatch(self: &Arc<Self>, key: &str, domain: &mut Domain) -> Vec<Task> {
+        domain.waiting.sort_by_key(|waiting| (waiting.job.size, waiting.ticket));
+        let mut started: Vec<Task> = Vec::new();
+        loop {
+            let used: u64 = domain.running.iter().map(|running| running.demand).sum();
+            let next = domain.waiting.iter().position(|waiting| waiting.job.control.is_cancelled())
+                .or_else(|| {
+                    let head = domain.waiting.first()?;
+                    let fits = domain.running.is_empty() || used.saturating_add(head.demand) <= domain.bandwidth;
+                    fits.then_some(0)
+                });
+            let Some(index) = next else { break };
+            let waiting = domain.waiting.remove(index);
+            domain.running.push(Running {
+                ticket: waiting.ticket,
+                demand: waiting.demand,
+                queue_depth: waiting.job.queue_depth.max(1),
+                control: waiting.job.control.clone(),
+            });
+            let slot = Slot { scheduler: self.clone(), domain: key.to_string(), ticket: waiting.ticket };
+            let run = waiting.run;
+            started.push(Box::new(move || run(slot)));
+        }
+
+        if domain.shared {
+            let share = (DOMAIN_QUEUE_DEPTH / domain.running.len().max(1) as u32).max(1);
+            for running in &domain.running {
+                running.control.set_queue_depth(share.min(running.queue_depth));
+            }
+        }
+        for (ahead, waiting) in domain.waiting.iter_mut().enumerate() {
+            if waiting.ahead != Some(ahead) {
+                waiting.ahead = Some(ahead);
+                (waiting.job.on_wait)(ahead);
+            }
+        }
+        started
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::mpsc::channel;
+
+    #[test]
+    fn test_topology_and_bandwidth_domains() {
+        // sysfs layout of a stick behind a USB 2 hub on a USB 3 root hub
+        let root = std::env::temp_dir().join(format!("fluxflasher-sysfs-{}", std::process::id()));
+        let hub = root.join("pci0000:00/0000:00:14.0/usb2/2-1");
+        let stick = hub.join("2-1.3");
+        let block = stick.join("2-1.3:1.0/host6/target6:0:0/6:0:0:0");
+        fs::create_dir_all(&block).unwrap();
+        fs::write(root.join("pci0000:00/0000:00:14.0/usb2/speed"), "5000\n").unwrap();
+        fs::write(hub.join("speed"), "480\n").unwrap();
+        fs::write(stick.join("speed"), "480\n").unwrap();
+        let placement = placement_from_sysfs(&block);
+        let _ = fs::remove_dir_all(&root);
+        assert_eq!(placement, Some(Placement {
+            domain: "0000:00:14.0/usb2".to_string(),
+            ports: vec!["2-1".to_string(), "2-1.3".to_string()],
+            bus_bandwidth: usable_bandwidth(5000),
+            link_bandwidth: usable_bandwidth(480),
+        }));
+
+        // Room for two 150 MB/s writers on the bus: the third waits, and
+        // the smallest waiting image starts once one finishes
+        let scheduler = Arc::new(Scheduler::default());
+        let placement = placement.unwrap();
+        let (tx, rx) = channel();
+        let mut slots = Vec::new();
+        let mut controls = Vec::new();
+        for (name, size) in [("a", 30), ("b", 20), ("c", 10), ("d", 5)] {
+            let control = Arc::new(Control::default());
+            controls.push(control.clone());
+            let (tx, waiting) = (tx.clone(), tx.clone());
+            let job = Job {
+                device_path: name.to_string(),
+                size,
+                queue_depth: 32,
+                control,
+                on_wait: Box::new(move |ahead| waiting.send(format!("{} waits behind {}", name, ahead)).unwrap()),
+            };
+            let started = tx.clone();
+            scheduler.submit_placed(Some(placement.clone()), 150_000_000, job, Box::new(move |slot| {
+                started.send(name.to_string()).unwrap();
+                // Keep the slot until the test lets go of it
+                std::mem::forget(slot);
+            }));
+            let started = rx.recv_timeout(Duration::from_secs(5)).unwrap();
+            slots.push(started);
+        }
+        assert_eq!(slots, ["a", "b", "c waits behind 0", "d waits behind 0"]);
+        assert_eq!(rx.recv_timeout(Duration::from_secs(5)).unwrap(), "c waits behind 1");
+        // Two writers share the bus's queue depth
+        assert_eq!(controls[0].queue_depth(), 16);
+
+        scheduler.finish("0000:00:14.0/usb2", 0);
+        assert_eq!(rx.recv_timeout(Duration::from_secs(5)).unwrap(), "c waits behind 0");
+        assert_eq!(rx.recv_timeout(Duration::from_secs(5)).unwrap(), "d");
+
+        // A cancelled job doesn't wait for bandwidth
+        controls[2].cancel();
+        scheduler.wake();
+        assert_eq!(rx.recv_timeout(Duration::from_secs(5)).unwrap(), "c");
+        assert_eq!(controls[1].queue_depth(), 10);
+
+        // A device of a multi-device flash joins without waiting and takes
+        // its part of the queue depth until it lets go
+        let control = Arc::new(Control::default());
+        let job = Job { device_path: "e".to_string(), size: 50, queue_depth: 32, control: control.clone(), on_wait: Box::new(|_| {}) };
+        let slot = scheduler.join_placed(Some(placement.clone()), 150_000_000, job);
+        assert_eq!((control.queue_depth(), controls[1].queue_depth()), (8, 8));
+        drop(slot);
+        assert_eq!(controls[1].queue_depth(), 10);
+    }
+}
@@ -0,0 +1,355 @@
+use std::ops::{Deref, DerefMut};
+use std::sync::atomic::{fence, AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, LockResult, Mutex, MutexGuard, OnceLock, PoisonError, Weak};
+use std::thread;
+use std::time::Duration;
+
+use super::scheduler::Scheduler;
+
+/// Bytes of status text a snapshot carries, including the terminating NUL
+pub const STATUS_CAPACITY: usize = 256;
+
+/// Changes closer together than this are delivered as one event
+pub const EVENT_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Everything a UI shows about an operation, as one plain value
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct Snapshot {
+    pub progress: f32,
+    pub verify_progress: f32,
+    pub bytes_written: u64,
+    pub bytes_skipped: u64,
+    pub bytes_durable: u64,
+    pub bytes_downloaded: u64,
+    pub verify_speed: u64,
+    pub running: bool,
+    pub paused: bool,
+    pub failed: bool,
+    /// NUL-terminated, cut at a character boundary if too long
+    pub status: [u8; STATUS_CAPACITY],
+}
+
+impl Snapshot {
+    pub fn set_status(&mut self, status: &str) {
+        let mut len = status.len().min(STATUS_CAPACITY - 1);
+        while !status.is_char_boundary(len) {
+            len -= 1;
+        }
+        self.status = [0; STATUS_CAPACITY];
+        self.status[..len].copy_from_slice(&status.as_bytes()[..len]);
+    }
+}
+
+impl Default for Snapshot {
+    fn default() -> Self {
+        Snapshot {
+            progress: 0.0,
+            verify_progress: 0.0,
+            bytes_written: 0,
+            bytes_skipped: 0,
+            bytes_durable: 0,
+            bytes_downloaded: 0,
+            verify_speed: 0,
+            running: false,
+            paused: false,
+            failed: false,
+            status: [0; STATUS_CAPACITY],
+        }
+    }
+}
+
+/// Snapshot as 64-bit words: two progress values, five counters, flags,
+/// then the status text
+const WORDS: usize = 7 + STATUS_CAPACITY / 8;
+
+fn to_words(s: &Snapshot) -> [u64; WORDS] {
+    let mut words = [0u64; WORDS];
+    words[0] = s.progress.to_bits() as u64 | (s.verify_progress.to_bits() as u64) << 32;
+    words[1] = s.bytes_written;
+    words[2] = s.bytes_skipped;
+    words[3] = s.bytes_durable;
+    words[4] = s.bytes_downloaded;
+    words[5] = s.verify_speed;
+    words[6] = s.running as u64 | (s.failed as u64) << 1 | (s.paused as u64) << 2;
+    for (word, bytes) in words[7..].iter_mut().zip(s.status.chunks_exact(8)) {
+        *word = u64::from_le_bytes(bytes.try_into().unwrap());
+    }
+    words
+}
+
+fn from_words(words: &[u64; WORDS]) -> Snapshot {
+    let mut s = Snapshot {
+        progress: f32::from_bits(words[0] as u32),
+        verify_progress: f32::from_bits((words[0] >> 32) as u32),
+        bytes_written: words[1],
+        bytes_skipped: words[2],
+        bytes_durable: words[3],
+        bytes_downloaded: words[4],
+        verify_speed: words[5],
+        running: words[6] & 1 != 0,
+        failed: words[6] & 2 != 0,
+        paused: words[6] & 4 != 0,
+        ..Snapshot::default()
+    };
+    for (bytes, word) in s.status.chunks_exact_mut(8).zip(&words[7..]) {
+        bytes.copy_from_slice(&word.to_le_bytes());
+    }
+    s
+}
+
+/// The latest snapshot of an operation behind a seqlock: one thread
+/// publishes, any thread reads without locking or allocating, retrying if a
+/// publish overlapped the read
+pub struct SnapshotCell {
+    /// Odd while a publish is in progress
+    seq: AtomicU64,
+    words: [AtomicU64; WORDS],
+}
+
+impl SnapshotCell {
+    pub fn new(initial: &Snapshot) -> Self {
+        let cell = SnapshotCell { seq: AtomicU64::new(0), words: std::array::from_fn(|_| AtomicU64::new(0)) };
+        cell.publish(initial);
+        cell
+    }
+
+    /// Must not be called from two threads at once
+    pub fn publish(&self, snapshot: &Snapshot) {
+        self.seq.fetch_add(1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (cell, word) in self.words.iter().zip(to_words(snapshot)) {
+            cell.store(word, Ordering::Relaxed);
+        }
+        self.seq.fetch_add(1, Ordering::Release);
+    }
+
+    /// The latest snapshot and how many have been published before it
+    pub fn read(&self) -> (u64, Snapshot) {
+        loop {
+            let before = self.seq.load(Ordering::Acquire);
+            if before % 2 == 1 {
+                std::hint::spin_loop();
+                continue;
+            }
+            let mut words = [0u64; WORDS];
+            for (word, cell) in words.iter_mut().zip(&self.words) {
+                *word = cell.load(Ordering::Relaxed);
+            }
+            fence(Ordering::Acquire);
+            if self.seq.load(Ordering::Relaxed) == before {
+                return (before / 2, from_words(&words));
+            }
+        }
+    }
+}
+
+type Listener = Box<dyn Fn(&Snapshot) + Send>;
+
+/// Where an operation's snapshots are taken from
+pub type Sampler = Box<dyn Fn() -> Snapshot + Send + Sync>;
+
+/// Published snapshots of one operation, and who to tell when they change.
+///
+/// Nothing polls: the workers' state is kept in `Watched` values that call
+/// `changed` when written. The first change after a publish schedules the
+/// next one `EVENT_INTERVAL` later on the shared pool, so however fast the
+/// workers update, readers and listeners see at most one event per interval,
+/// and an operation nothing happens to costs nothing.
+pub struct Events {
+    cell: SnapshotCell,
+    listener: Mutex<Option<Listener>>,
+    sampler: OnceLock<Sampler>,
+    /// A publish is scheduled and hasn't sampled yet
+    scheduled: AtomicBool,
+}
+
+impl Events {
+    pub fn new(initial: &Snapshot) -> Self {
+        Events {
+            cell: SnapshotCell::new(initial),
+            listener: Mutex::new(None),
+            sampler: OnceLock::new(),
+            scheduled: AtomicBool::new(false),
+        }
+    }
+
+    pub fn read(&self) -> (u64, Snapshot) {
+        self.cell.read()
+    }
+
+    /// Call `listener` after each published change, on a pool thread, and
+    /// once right away so nothing that happened before is missed. Replacing
+    /// or clearing the listener waits for a call in progress, so once this
+    /// returns the old one is never called again.
+    pub fn listen(&self, listener: Option<Listener>) {
+        let mut current = self.listener.lock().unwrap();
+        *current = listener;
+        if let Some(listener) = current.as_ref() {
+            listener(&self.cell.read().1);
+        }
+    }
+
+    /// Publish what `sampler` returns from now on, whenever `changed` is
+    /// called. Only the first sampler counts.
+    pub fn sample_with(self: &Arc<Self>, sampler: Sampler) {
+        let _ = self.sampler.set(sampler);
+        self.changed();
+    }
+
+    /// Note that something the sampler reads has changed
+    pub fn changed(self: &Arc<Self>) {
+        if self.sampler.get().is_none() || self.scheduled.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let events = self.clone();
+        Scheduler::global().execute(move || {
+            thread::sleep(EVENT_INTERVAL);
+            // Cleared before sampling, so a change the sample misses
+            // schedules another publish
+            events.scheduled.store(false, Ordering::Release);
+            let snapshot = (events.sampler.get().unwrap())();
+            events.publish(&snapshot);
+        });
+    }
+
+    /// Publish `snapshot` unless it is what readers already see. Publishes
+    /// are serialized by the listener lock.
+    fn publish(&self, snapshot: &Snapshot) {
+        let listener = self.listener.lock().unwrap();
+        if self.cell.read().1 == *snapshot {
+            return;
+        }
+        self.cell.publish(snapshot);
+        if let Some(listener) = listener.as_ref() {
+            listener(snapshot);
+        }
+    }
+}
+
+/// A value the workers of an operation update, which tells the operation's
+/// `Events` whenever it is written. Used like a `Mutex`.
+pub struct Watched<T> {
+    value: Mutex<T>,
+    events: Weak<Events>,
+}
+
+impl<T> Watched<T> {
+    /// A value nobody is told about
+    pub fn new(value: T) -> Self {
+        Watched { value: Mutex::new(value), events: Weak::new() }
+    }
+
+    /// Publish writes through `events`
+    pub fn notifying(mut self, events: &Arc<Events>) -> Self {
+        self.events = Arc::downgrade(events);
+        self
+    }
+
+    pub fn lock(&self) -> LockResult<WatchedGuard<'_, T>> {
+        let guard = |guard| WatchedGuard { guard, events: &self.events, written: false };
+        match self.value.lock() {
+            Ok(locked) => Ok(guard(locked)),
+            Err(poisoned) => Err(PoisonError::new(guard(poisoned.into_inner()))),
+        }
+    }
+}
+
+/// Access to a `Watched` value; if it was written through, the operation
+/// hears of it when this is dropped
+pub struct WatchedGuard<'a, T> {
+    guard: MutexGuard<'a, T>,
+    events: &'a Weak<Events>,
+    written: bool,
+}
+
+impl<T> Deref for WatchedGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T> DerefMut for WatchedGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        self.written = true;
+        &mut self.guard
+    }
+}
+
+impl<T> Drop for WatchedGuard<'_, T> {
+    fn drop(&mut self) {
+        if self.written {
+            if let Some(events) = self.events.upgrade() {
+                events.changed();
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn status(s: &Snapshot) -> &str {
+        let len = s.status.iter().position(|&b| b == 0).unwrap_or(STATUS_CAPACITY);
+        std::str::from_utf8(&s.status[..len]).unwrap()
+    }
+
+    #[test]
+    fn test_changes_coalesce_and_readers_see_whole_snapshots() {
+        let mut initial = Snapshot { running: true, ..Snapshot::default() };
+        initial.set_status("Initializing...");
+        let events = Arc::new(Events::new(&initial));
+        let state = Arc::new(Watched::new(initial).notifying(&events));
+        let calls = Arc::new(AtomicU64::new(0));
+        let counter = calls.clone();
+        events.listen(Some(Box::new(move |_| {
+            counter.fetch_add(1, Ordering::Relaxed);
+        })));
+
+        // A reader racing the publishes only ever sees matching fields
+        let done = Arc::new(AtomicBool::new(false));
+        let reader = {
+            let (events, done) = (events.clone(), done.clone());
+            thread::spawn(move || {
+                while !done.load(Ordering::Relaxed) {
+                    let (_, s) = events.read();
+                    assert_eq!(s.bytes_written, s.bytes_skipped);
+                    assert_eq!(status(&s), if s.bytes_written == 0 { "Initializing..." } else { "Writing" });
+                }
+            })
+        };
+
+        let sampled = state.clone();
+        events.sample_with(Box::new(move || *sampled.lock().unwrap()));
+        for i in 1..=1000u64 {
+            let mut s = state.lock().unwrap();
+            s.bytes_written = i;
+            s.bytes_skipped = i;
+            s.set_status("Writing");
+        }
+        thread::sleep(EVENT_INTERVAL * 2);
+        state.lock().unwrap().running = false;
+        while events.read().1.running {
+            thread::sleep(Duration::from_millis(10));
+        }
+        done.store(true, Ordering::Relaxed);
+        reader.join().unwrap();
+
+        let (sequence, last) = events.read();
+        assert_eq!(last.bytes_written, 1000);
+        // One call on registering, then one per publish
+        assert!(calls.load(Ordering::Relaxed) <= 4);
+
+        // Reading doesn't count as a change, and without changes nothing
+        // is published
+        let _ = *state.lock().unwrap();
+        thread::sleep(EVENT_INTERVAL * 2);
+        assert_eq!(events.read().0, sequence);
+
+        let mut long = Snapshot::default();
+        long.set_status(&"é".repeat(200));
+        assert_eq!(status(&long).len(), 254);
+    }
+}
@@ -0,0 +1,288 @@
+use anyhow::{anyhow, Result};
+use std::fs::File;
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+
+use super::pipeline::{BlockWriter, Chunk};
+
+// From <linux/fs.h>: _IO(0x12, 119) and _IO(0x12, 127)
+const BLKDISCARD: libc::c_ulong = 0x1277;
+const BLKZEROOUT: libc::c_ulong = 0x127f;
+
+/// Chunk size used when zero-skipping, so zero runs are found at a finer
+/// granularity than the default 4 MiB
+pub const SPARSE_CHUNK_SIZE: usize = 1024 * 1024;
+
+/// Discard and zero-out ranges must be whole sectors
+const SECTOR_SIZE: usize = 512;
+
+/// Check whether a buffer is entirely zero.
+///
+/// Works on 64-byte blocks OR-folded into eight u64 lanes, which the
+/// compiler turns into SSE2/AVX2 (or NEON) vector ORs, and bails out at the
+/// first non-zero block.
+pub fn is_all_zero(data: &[u8]) -> bool {
+    const BLOCK: usize = 64;
+    let (head, body, tail) = unsafe { data.align_to::<[u64; BLOCK / 8]>() };
+
+    if head.iter().any(|&b| b != 0) || tail.iter().any(|&b| b != 0) {
+        return false;
+    }
+
+    // Check a few blocks at a time so the early exit doesn't stop the
+    // compiler from vectorizing the inner loop
+    for group in body.chunks(4) {
+        let mut acc = [0u64; BLOCK / 8];
+        for block in group {
+            for (a, w) in acc.iter_mut().zip(block.iter()) {
+                *a |= *w;
+            }
+        }
+        if acc.iter().any(|&w| w != 0) {
+            return false;
+        }
+    }
+    true
+}
+
+/// How zero runs are cleared on the device
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum ClearMode {
+    /// BLKDISCARD, not yet confirmed to read back as zeros
+    DiscardUnverified,
+    /// BLKDISCARD, confirmed to read back as zeros
+    Discard,
+    /// BLKZEROOUT (device can't discard, or discarded blocks aren't zero)
+    ZeroOut,
+    /// Plain writes of zeros (not a block device)
+    Write,
+}
+
+/// Wraps another writer and replaces all-zero chunks with discards.
+///
+/// Consecutive zero chunks are merged into a single range before being
+/// cleared. Skipped chunks are marked with `Chunk::skipped` and only handed
+/// back once their range has been cleared, so nothing downstream (the
+/// journal in particular) takes them for done before they are. At most
+/// `max_held` are held at a time, leaving the pipeline buffers to read into.
+pub struct SparseWriter<'a> {
+    inner: Box<dyn BlockWriter + 'a>,
+    device: &'a File,
+    mode: ClearMode,
+    /// Zero range waiting to be cleared: (offset, length)
+    pending: Option<(u64, u64)>,
+    /// The chunks of `pending`
+    held: Vec<Chunk>,
+    max_held: usize,
+}
+
+impl<'a> SparseWriter<'a> {
+    pub fn new(inner: Box<dyn BlockWriter + 'a>, device: &'a File, max_held: usize) -> Self {
+        SparseWriter {
+            inner,
+            device,
+            mode: ClearMode::DiscardUnverified,
+            pending: None,
+            held: Vec::new(),
+            max_held: max_held.max(1),
+        }
+    }
+
+    /// Clear the pending zero range, if any, and hand back its chunks
+    fn clear_pending(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        let (offset, len) = match self.pending.take() {
+            Some(range) => range,
+            None => return Ok(()),
+        };
+        self.clear(offset, len)?;
+        done.append(&mut self.held);
+        Ok(())
+    }
+
+    fn clear(&mut self, offset: u64, len: u64) -> Result<()> {
+        if self.mode == ClearMode::Write {
+            return write_zeros(self.device, offset, len);
+        }
+
+        if self.mode != ClearMode::ZeroOut {
+            match blk_range_ioctl(self.device, BLKDISCARD, offset, len) {
+                Ok(()) => {
+                    if self.mode == ClearMode::DiscardUnverified {
+                        self.mode = if self.reads_back_zero(offset, len)? {
+                            ClearMode::Discard
+                        } else {
+                            ClearMode::ZeroOut
+                        };
+                    }
+                    if self.mode == ClearMode::Discard {
+                        return Ok(());
+                    }
+                }
+                Err(e) if is_unsupported(&e) => self.mode = ClearMode::ZeroOut,
+                Err(e) => return Err(anyhow!("Failed to discard {} bytes at offset {}: {}", len, offset, e)),
+            }
+        }
+
+        match blk_range_ioctl(self.device, BLKZEROOUT, offset, len) {
+            Ok(()) => Ok(()),
+            Err(e) if e.raw_os_error() == Some(libc::ENOTTY) => {
+                self.mode = ClearMode::Write;
+                write_zeros(self.device, offset, len)
+            }
+            Err(e) => Err(anyhow!("Failed to zero {} bytes at offset {}: {}", len, offset, e)),
+        }
+    }
+
+    /// Some sticks return stale data for discarded blocks; check one sector
+    /// the first time so verification doesn't fail later
+    fn reads_back_zero(&self, offset: u64, len: u64) -> Result<bool> {
+        let mut probe = vec![0xffu8; SECTOR_SIZE.min(len as usize)];
+        self.device.read_exact_at(&mut probe, offset)
+            .map_err(|e| anyhow!("Failed to read back discarded range: {}", e))?;
+        Ok(is_all_zero(&probe))
+    }
+}
+
+impl BlockWriter for SparseWriter<'_> {
+    fn submit(&mut self, mut chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        let len = chunk.buf.len() as u64;
+
+        if chunk.buf.len() % SECTOR_SIZE == 0 && is_all_zero(chunk.buf.as_slice()) {
+            match self.pending {
+                Some((start, pending_len)) if start + pending_len == chunk.offset => {
+                    self.pending = Some((start, pending_len + len));
+                }
+                _ => {
+                    self.clear_pending(done)?;
+                    self.pending = Some((chunk.offset, len));
+                }
+            }
+            chunk.skipped = true;
+            self.held.push(chunk);
+            if self.held.len() >= self.max_held {
+                self.clear_pending(done)?;
+            }
+            return Ok(());
+        }
+
+        self.clear_pending(done)?;
+        self.inner.submit(chunk, done)
+    }
+
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        self.clear_pending(done)?;
+        self.inner.flush(done)
+    }
+
+    fn set_queue_depth(&mut self, depth: usize) {
+        self.inner.set_queue_depth(depth)
+    }
+}
+
+/// Issue a BLKDISCARD/BLKZEROOUT style ioctl for a byte range
+fn blk_range_ioctl(device: &File, request: libc::c_ulong, offset: u64, len: u64) -> io::Result<()> {
+    let range: [u64; 2] = [offset, len];
+    let ret = unsafe { libc::ioctl(device.as_raw_fd(), request as _, range.as_ptr()) };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Write zeros over a byte range, for targets that aren't block devices
+fn write_zeros(device: &File, offset: u64, len: u64) -> Result<()> {
+    let zeros = vec![0u8; SPARSE_CHUNK_SIZE.min(len as usize)];
+    let mut pos = offset;
+    while pos < offset + len {
+        let n = (zeros.len() as u64).min(offset + len - pos) as usize;
+        device.write_all_at(&zeros[..n], pos)
+            .map_err(|e| anyhow!("Failed to zero {} bytes at offset {}: {}", n, pos, e))?;
+        pos += n as u64;
+    }
+    Ok(())
+}
+
+fn is_unsupported(e: &io::Error) -> bool {
+    matches!(e.raw_os_error(), Some(libc::EOPNOTSUPP) | Some(libc::ENOTTY) | Some(libc::EINVAL))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::buffer::AlignedBuffer;
+
+    /// Records the offsets it is given and completes them at once
+    struct Recorder<'a>(&'a mut Vec<u64>);
+
+    impl BlockWriter for Recorder<'_> {
+        fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+            self.0.push(chunk.offset);
+            done.push(chunk);
+            Ok(())
+        }
+
+        fn flush(&mut self, _done: &mut Vec<Chunk>) -> Result<()> {
+            Ok(())
+        }
+    }
+
+    fn chunk(offset: u64, fill: u8) -> Chunk {
+        let mut buf = AlignedBuffer::new(4096);
+        buf.as_mut_full().fill(fill);
+        buf.set_len(4096);
+        Chunk { offset, buf, skipped: false }
+    }
+
+    #[test]
+    fn test_zero_chunks_complete_only_once_cleared() {
+        let path = std::env::temp_dir().join(format!("fluxflasher-sparse-{}", std::process::id()));
+        std::fs::write(&path, vec![0xffu8; 5 * 4096]).unwrap();
+        let device = std::fs::OpenOptions::new().read(true).write(true).open(&path).unwrap();
+
+        let mut written = Vec::new();
+        let mut writer = SparseWriter::new(Box::new(Recorder(&mut written)), &device, 2);
+        let mut done = Vec::new();
+
+        // A zero chunk is held until its range is cleared
+        writer.submit(chunk(0, 0), &mut done).unwrap();
+        assert!(done.is_empty());
+        // Reaching `max_held` clears the merged range
+        writer.submit(chunk(4096, 0), &mut done).unwrap();
+        assert_eq!(done.iter().map(|c| (c.offset, c.skipped)).collect::<Vec<_>>(), [(0, true), (4096, true)]);
+        done.clear();
+
+        // Data clears what is pending before it is written
+        writer.submit(chunk(2 * 4096, 0), &mut done).unwrap();
+        writer.submit(chunk(3 * 4096, 7), &mut done).unwrap();
+        assert_eq!(done.iter().map(|c| (c.offset, c.skipped)).collect::<Vec<_>>(), [(2 * 4096, true), (3 * 4096, false)]);
+        done.clear();
+
+        // And so does the end of the flash
+        writer.submit(chunk(4 * 4096, 0), &mut done).unwrap();
+        assert!(done.is_empty());
+        writer.flush(&mut done).unwrap();
+        assert_eq!(done.len(), 1);
+        drop(writer);
+
+        assert_eq!(written, [3 * 4096]);
+        let data = std::fs::read(&path).unwrap();
+        assert!(data[..3 * 4096].iter().all(|&b| b == 0));
+        assert!(data[4 * 4096..].iter().all(|&b| b == 0));
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_is_all_zero() {
+        let mut data = vec![0u8; 64 * 1024 + 7];
+        assert!(is_all_zero(&data));
+        assert!(is_all_zero(&data[3..]));
+        assert!(is_all_zero(&[]));
+
+        for pos in [0, 1, 63, 64, 4095, 40_000, data.len() - 1] {
+            data[pos] = 1;
+            assert!(!is_all_zero(&data), "missed byte at {}", pos);
+            data[pos] = 0;
+        }
+    }
+}
@@ -0,0 +1,446 @@
+use anyhow::{anyhow, Context, Result};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::fs::{File, OpenOptions};
+use std::io::{self, Read};
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use super::journal::chunk_hash;
+use super::sparse::is_all_zero;
+use super::utils::cache_dir;
+
+/// Granularity of the chunk-hash manifest kept for each stored image
+pub const STORE_CHUNK_SIZE: usize = 4 * 1024 * 1024;
+
+/// Disk space the store may take up; least recently used images are evicted
+/// beyond this
+pub const STORE_BUDGET: u64 = 32 * 1024 * 1024 * 1024;
+
+/// Free space left on the cache filesystem when filling the store
+const MIN_FREE_SPACE: u64 = 4 * 1024 * 1024 * 1024;
+
+/// Tells apart the temporary files of fills running at the same time
+static FILL_SEQUENCE: AtomicU64 = AtomicU64::new(0);
+
+/// A decompressed image kept in the store
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct StoreEntry {
+    /// Content hash of the decompressed image (over its chunk hashes)
+    pub key: String,
+    /// Source file the image was last used from
+    pub source: String,
+    pub image_size: u64,
+    /// Seconds since the epoch
+    pub last_used: u64,
+    /// The decompressed image, sparse where it is all zeros
+    #[serde(skip)]
+    pub path: PathBuf,
+}
+
+/// What the store holds. Both maps give constant-time lookups: by content
+/// key, and by source file identity so a known source is never re-hashed.
+#[derive(Default, Serialize, Deserialize)]
+struct Index {
+    entries: HashMap<String, StoreEntry>,
+    /// Source identity (path, size, mtime) -> content key
+    sources: HashMap<String, String>,
+}
+
+fn now() -> u64 {
+    SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs())
+}
+
+/// Identifies one version of a source file without reading it
+fn source_identity(image_path: &Path) -> Option<(String, String)> {
+    let canonical = std::fs::canonicalize(image_path).ok()?.display().to_string();
+    let meta = std::fs::metadata(image_path).ok()?;
+    let identity = format!("{}:{}:{}.{}", canonical, meta.len(), meta.mtime(), meta.mtime_nsec());
+    Some((canonical, identity))
+}
+
+fn free_space(dir: &Path) -> Option<u64> {
+    let path = std::ffi::CString::new(dir.as_os_str().as_encoded_bytes()).ok()?;
+    let mut stat: libc::statvfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statvfs(path.as_ptr(), &mut stat) } != 0 {
+        return None;
+    }
+    Some(stat.f_bavail as u64 * stat.f_frsize as u64)
+}
+
+/// Content-addressed store of decompressed images and their chunk-hash
+/// manifests, so that flashing a known image again needs neither
+/// decompression nor hashing of the source.
+#[derive(Clone)]
+pub struct Store {
+    dir: PathBuf,
+    budget: u64,
+}
+
+impl Store {
+    /// The per-user store in the cache directory
+    pub fn open() -> Self {
+        Store::at(cache_dir().join("store"), STORE_BUDGET)
+    }
+
+    pub fn at(dir: PathBuf, budget: u64) -> Self {
+        Store { dir, budget }
+    }
+
+    fn image_path(&self, key: &str) -> PathBuf {
+        self.dir.join(format!("{}.img", key))
+    }
+
+    fn manifest_path(&self, key: &str) -> PathBuf {
+        self.dir.join(format!("{}.json", key))
+    }
+
+    /// Lock the index for a read-modify-write; operations in this and other
+    /// processes fill the store at the same time. Released when the file is
+    /// dropped. The index itself is replaced on every save, so the lock is a
+    /// file of its own.
+    fn lock_index(&self) -> Result<File> {
+        std::fs::create_dir_all(&self.dir)?;
+        let lock = OpenOptions::new()
+            .create(true)
+            .write(true)
+            .open(self.dir.join("index.lock"))
+            .context("Failed to open the image store lock")?;
+        if unsafe { libc::flock(lock.as_raw_fd(), libc::LOCK_EX) } != 0 {
+            return Err(io::Error::last_os_error()).context("Failed to lock the image store");
+        }
+        Ok(lock)
+    }
+
+    fn load_index(&self) -> Index {
+        let mut index: Index = std::fs::read(self.dir.join("index.json")).ok()
+            .and_then(|data| serde_json::from_slice(&data).ok())
+            .unwrap_or_default();
+        for (key, entry) in index.entries.iter_mut() {
+            entry.path = self.image_path(key);
+        }
+        index
+    }
+
+    fn save_index(&self, index: &Index) -> Result<()> {
+        self.write_atomic(&self.dir.join("index.json"), &serde_json::to_vec(index)?)
+    }
+
+    fn write_atomic(&self, path: &Path, data: &[u8]) -> Result<()> {
+        std::fs::create_dir_all(&self.dir)?;
+        let tmp = path.with_extension("tmp");
+        std::fs::write(&tmp, data).with_context(|| format!("Failed to write {}", tmp.display()))?;
+        std::fs::rename(&tmp, path)?;
+        Ok(())
+    }
+
+    /// The stored copy of an image, if this version of the file has been
+    /// stored before. Marks the entry as recently used.
+    pub fn lookup(&self, image_path: &Path) -> Option<StoreEntry> {
+        let (canonical, identity) = source_identity(image_path)?;
+        // Nothing stored yet; don't create the store just to look
+        if !self.dir.join("index.json").exists() {
+            return None;
+        }
+        let _lock = self.lock_index().ok()?;
+        let mut index = self.load_index();
+        let key = index.sources.get(&identity)?.clone();
+        let entry = index.entries.get_mut(&key)?;
+
+        let stored = std::fs::metadata(&entry.path).ok()?;
+        if stored.len() != entry.image_size {
+            return None;
+        }
+        entry.source = canonical;
+        entry.last_used = now();
+        let entry = entry.clone();
+        // Best effort: a stale timestamp only affects eviction order
+        let _ = self.save_index(&index);
+        Some(entry)
+    }
+
+    /// Path to read an image from: its stored decompressed copy if there is
+    /// one, otherwise the image itself
+    pub fn resolve(&self, image_path: &Path) -> PathBuf {
+        match self.lookup(image_path) {
+            Some(entry) => entry.path,
+            None => image_path.to_path_buf(),
+        }
+    }
+
+    /// Stored images, most recently used first
+    pub fn list(&self) -> Vec<StoreEntry> {
+        let mut entries: Vec<StoreEntry> = self.load_index().entries.into_values()
+            .filter(|entry| entry.path.exists())
+            .collect();
+        entries.sort_by(|a, b| b.last_used.cmp(&a.last_used));
+        entries
+    }
+
+    /// SHA256 of every `STORE_CHUNK_SIZE` chunk of a stored image, as hex
+    pub fn manifest(&self, entry: &StoreEntry) -> Option<Vec<String>> {
+        let data = std::fs::read(self.manifest_path(&entry.key)).ok()?;
+        let hashes: Vec<String> = serde_json::from_slice(&data).ok()?;
+        let chunks = (entry.image_size + STORE_CHUNK_SIZE as u64 - 1) / STORE_CHUNK_SIZE as u64;
+        (hashes.len() as u64 == chunks).then_some(hashes)
+    }
+
+    /// Start storing the decompressed stream of `image_path` as it is read.
+    /// Gives the stream back if it can't be stored (unknown source, or not
+    /// enough room for it).
+    pub fn fill<R: Read>(&self, inner: R, image_path: &Path, image_size: Option<u64>) -> std::result::Result<StoreFill<R>, R> {
+        let room = std::fs::create_dir_all(&self.dir).ok()
+            .and_then(|_| free_space(&self.dir))
+            .map_or(false, |free| free >= image_size.unwrap_or(0) + MIN_FREE_SPACE);
+        let fits = image_size.map_or(true, |size| size <= self.budget);
+        if source_identity(image_path).is_none() || !room || !fits {
+            return Err(inner);
+        }
+
+        let seq = FILL_SEQUENCE.fetch_add(1, Ordering::Relaxed);
+        let tmp = self.dir.join(format!("fill-{}-{}.tmp", std::process::id(), seq));
+        let file = match File::create(&tmp) {
+            Ok(file) => file,
+            Err(_) => return Err(inner),
+        };
+        Ok(StoreFill {
+            inner,
+            store: self.clone(),
+            source: image_path.to_path_buf(),
+            tmp,
+            file: Some(file),
+            chunk: Vec::with_capacity(STORE_CHUNK_SIZE),
+            hashes: Vec::new(),
+            offset: 0,
+        })
+    }
+
+    /// Remove least recently used images until the store fits in its
+    /// budget, never removing `keep`. Images and manifests the index
+    /// doesn't know are removed first. Call with the index locked.
+    fn evict(&self, index: &mut Index, keep: &str) {
+        let orphans = std::fs::read_dir(&self.dir).into_iter().flatten().flatten().filter(|file| {
+            let path = file.path();
+            let stored = matches!(path.extension().and_then(|e| e.to_str()), Some("img" | "json"));
+            let key = path.file_stem().and_then(|s| s.to_str()).unwrap_or("");
+            stored && key.len() == 64 && key.bytes().all(|b| b.is_ascii_hexdigit()) && !index.entries.contains_key(key)
+        });
+        for orphan in orphans {
+            let _ = std::fs::remove_file(orphan.path());
+        }
+
+        // Stored images are sparse, so count allocated blocks
+        let allocated = |entry: &StoreEntry| std::fs::metadata(&entry.path).map_or(0, |m| m.blocks() * 512);
+        let mut total: u64 = index.entries.values().map(allocated).sum();
+
+        let mut by_age: Vec<StoreEntry> = index.entries.values().cloned().collect();
+        by_age.sort_by_key(|entry| entry.last_used);
+        for entry in by_age {
+            if total <= self.budget {
+                break;
+            }
+            if entry.key == keep {
+                continue;
+            }
+            total -= allocated(&entry).min(total);
+            let _ = std::fs::remove_file(&entry.path);
+            let _ = std::fs::remove_file(self.manifest_path(&entry.key));
+            index.entries.remove(&entry.key);
+            index.sources.retain(|_, key| *key != entry.key);
+        }
+    }
+}
+
+/// Passes a decompressed image stream through unchanged while writing a
+/// sparse copy of it into the store and hashing it chunk by chunk. When the
+/// stream ends the copy is filed under its content hash; if the stream is
+/// abandoned, or the store can't keep up (disk full), the partial copy is
+/// dropped and reading carries on unaffected.
+pub struct StoreFill<R> {
+    inner: R,
+    store: Store,
+    source: PathBuf,
+    tmp: PathBuf,
+    file: Option<File>,
+    chunk: Vec<u8>,
+    hashes: Vec<String>,
+    offset: u64,
+}
+
+impl<R: Read> StoreFill<R> {
+    fn store_chunk(&mut self) -> Result<()> {
+        let file = self.file.as_ref().ok_or_else(|| anyhow!("store fill abandoned"))?;
+        // Zero chunks stay holes in the sparse copy
+        if !is_all_zero(&self.chunk) {
+            file.write_all_at(&self.chunk, self.offset)?;
+        }
+        self.hashes.push(chunk_hash(&self.chunk));
+        self.offset += self.chunk.len() as u64;
+        self.chunk.clear();
+        Ok(())
+    }
+
+    /// File the completed copy under its content hash
+    fn commit(&mut self) -> Result<()> {
+        if !self.chunk.is_empty() {
+            self.store_chunk()?;
+        }
+        self.file.as_ref().ok_or_else(|| anyhow!("store fill abandoned"))?.set_len(self.offset)?;
+
+        let mut hasher = Sha256::new();
+        hasher.update(self.offset.to_le_bytes());
+        for hash in &self.hashes {
+            hasher.update(hash.as_bytes());
+        }
+        let key: String = hasher.finalize().iter().map(|b| format!("{:02x}", b)).collect();
+
+        let (canonical, identity) = source_identity(&self.source)
+            .ok_or_else(|| anyhow!("{} disappeared", self.source.display()))?;
+        let entry = StoreEntry {
+            key: key.clone(),
+            source: canonical,
+            image_size: self.offset,
+            last_used: now(),
+            path: self.store.image_path(&key),
+        };
+        // Another fill may be filing or evicting at the same time
+        let _lock = self.store.lock_index()?;
+        // The same image from another file (or compressed differently) is
+        // only kept once
+        if entry.path.exists() {
+            std::fs::remove_file(&self.tmp)?;
+        } else {
+            self.store.write_atomic(&self.store.manifest_path(&key), &serde_json::to_vec(&self.hashes)?)?;
+            std::fs::rename(&self.tmp, &entry.path)?;
+        }
+
+        let mut index = self.store.load_index();
+        index.entries.insert(key.clone(), entry);
+        index.sources.insert(identity, key.clone());
+        self.store.evict(&mut index, &key);
+        self.store.save_index(&index)?;
+        self.file = None;
+        Ok(())
+    }
+}
+
+impl<R> StoreFill<R> {
+    /// Drop the partial copy; reads pass straight through from now on
+    fn abandon(&mut self) {
+        if self.file.take().is_some() {
+            let _ = std::fs::remove_file(&self.tmp);
+        }
+    }
+}
+
+impl<R: Read> Read for StoreFill<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        if self.file.is_none() {
+            return Ok(n);
+        }
+        if n == 0 {
+            if self.commit().is_err() {
+                self.abandon();
+            }
+            return Ok(0);
+        }
+
+        let mut data = &buf[..n];
+        while !data.is_empty() {
+            let take = data.len().min(STORE_CHUNK_SIZE - self.chunk.len());
+            self.chunk.extend_from_slice(&data[..take]);
+            data = &data[take..];
+            if self.chunk.len() == STORE_CHUNK_SIZE && self.store_chunk().is_err() {
+                self.abandon();
+                break;
+            }
+        }
+        Ok(n)
+    }
+}
+
+impl<R> Drop for StoreFill<R> {
+    fn drop(&mut self) {
+        self.abandon();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_store_fill_and_lookup() {
+        let root = std::env::temp_dir().join(format!("fluxflasher-store-{}", std::process::id()));
+        std::fs::create_dir_all(&root).unwrap();
+        let store = Store::at(root.join("store"), STORE_BUDGET);
+
+        let source = root.join("image.img.gz");
+        File::create(&source).unwrap().write_all(b"stands in for a compressed image").unwrap();
+        assert!(store.lookup(&source).is_none());
+        assert_eq!(store.resolve(&source), source);
+
+        // Zeros in the middle become a hole in the stored copy
+        let mut image: Vec<u8> = (0..3 * STORE_CHUNK_SIZE as u32 + 999).map(|i| (i % 247) as u8).collect();
+        image[STORE_CHUNK_SIZE..2 * STORE_CHUNK_SIZE].fill(0);
+        let mut fill = store.fill(io::Cursor::new(image.clone()), &source, Some(image.len() as u64))
+            .unwrap_or_else(|_| panic!("store refused the image"));
+        let mut out = Vec::new();
+        let mut buf = vec![0u8; 1024 * 1024 + 7];
+        loop {
+            let n = fill.read(&mut buf).unwrap();
+            if n == 0 {
+                break;
+            }
+            out.extend_from_slice(&buf[..n]);
+        }
+        assert!(out == image);
+
+        let entry = store.lookup(&source).unwrap();
+        assert_eq!(entry.image_size, image.len() as u64);
+        assert!(std::fs::read(&entry.path).unwrap() == image);
+        let manifest = store.manifest(&entry).unwrap();
+        assert_eq!(manifest.len(), 4);
+        assert_eq!(manifest[3], chunk_hash(&image[3 * STORE_CHUNK_SIZE..]));
+        assert_eq!(store.resolve(&source), entry.path);
+        assert_eq!(store.list().len(), 1);
+
+        // Fills finishing at the same time all end up in the index
+        let sources: Vec<PathBuf> = (0..4).map(|i| root.join(format!("other{}.img.gz", i))).collect();
+        std::thread::scope(|scope| {
+            for (i, other) in sources.iter().enumerate() {
+                let store = &store;
+                scope.spawn(move || {
+                    File::create(other).unwrap().write_all(b"another compressed image").unwrap();
+                    let data = vec![i as u8 + 1; STORE_CHUNK_SIZE / 2];
+                    let mut fill = store.fill(io::Cursor::new(data), other, None)
+                        .unwrap_or_else(|_| panic!("store refused the image"));
+                    io::copy(&mut fill, &mut io::sink()).unwrap();
+                });
+            }
+        });
+        assert!(sources.iter().all(|other| store.lookup(other).is_some()));
+        assert_eq!(store.list().len(), 5);
+
+        // Rewriting the source makes it a different version
+        std::thread::sleep(std::time::Duration::from_millis(10));
+        File::create(&source).unwrap().write_all(b"changed").unwrap();
+        assert!(store.lookup(&source).is_none());
+
+        // A copy the index lost track of is swept up; over budget, the
+        // least recently used image goes
+        let orphan = store.image_path(&"0".repeat(64));
+        std::fs::write(&orphan, b"left behind").unwrap();
+        let small = Store::at(root.join("store"), 0);
+        let mut index = small.load_index();
+        small.evict(&mut index, "");
+        assert!(index.entries.is_empty() && !entry.path.exists() && !orphan.exists());
+        std::fs::remove_dir_all(&root).unwrap();
+    }
+}
@@ -0,0 +1,257 @@
+use anyhow::{anyhow, Context, Result};
+use serde::{Deserialize, Serialize};
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::thread;
+use std::time::Instant;
+
+use super::buffer::AlignedBuffer;
+use super::device::{device_identity, DeviceIdentity};
+use super::options::FlashOptions;
+use super::utils::cache_dir;
+
+/// Bytes rewritten by each calibration trial
+const PROBE_REGION: usize = 32 * 1024 * 1024;
+
+/// Chunk sizes tried, smallest first
+const CHUNK_CANDIDATES: &[usize] = &[512 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024];
+
+/// Queue depths tried once the chunk size is settled
+const QUEUE_CANDIDATES: &[u32] = &[1, 4, 16];
+
+/// Queue depth used while comparing chunk sizes
+const PROBE_QUEUE_DEPTH: u32 = 4;
+
+/// A larger chunk or deeper queue must beat the current best by this much
+/// to be chosen, so that noise doesn't push us towards bigger buffers
+const MIN_IMPROVEMENT: f64 = 1.05;
+
+/// Write parameters that work best for a device model
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct DeviceProfile {
+    pub chunk_size: usize,
+    pub queue_depth: u32,
+    /// Write alignment the device asks for (physical block or optimal I/O size)
+    pub alignment: usize,
+    /// Write throughput measured with these settings, in bytes per second
+    pub throughput: u64,
+    /// Loaded from the profile cache rather than measured just now
+    #[serde(skip)]
+    pub cached: bool,
+}
+
+impl DeviceProfile {
+    /// Use the profile's chunk size and queue depth for a flash
+    pub fn apply(&self, options: &mut FlashOptions) {
+        options.chunk_size = self.chunk_size;
+        options.queue_depth = self.queue_depth;
+        let inflight = self.chunk_size as u64 * self.queue_depth as u64;
+        options.max_inflight_bytes = options.max_inflight_bytes.max(inflight);
+    }
+}
+
+fn profile_path(identity: &DeviceIdentity) -> PathBuf {
+    cache_dir().join("profiles").join(format!("{}.json", identity.model_key()))
+}
+
+/// The cached profile for a device's model, if it has been calibrated before
+pub fn load_profile(identity: &DeviceIdentity) -> Option<DeviceProfile> {
+    let data = std::fs::read(profile_path(identity)).ok()?;
+    let mut profile: DeviceProfile = serde_json::from_slice(&data).ok()?;
+    profile.cached = true;
+    Some(profile)
+}
+
+fn save_profile(identity: &DeviceIdentity, profile: &DeviceProfile) -> Result<()> {
+    let path = profile_path(identity);
+    std::fs::create_dir_all(path.parent().unwrap())?;
+    let tmp = path.with_extension("tmp");
+    std::fs::write(&tmp, serde_json::to_vec(profile)?)
+        .with_context(|| format!("Failed to write {}", tmp.display()))?;
+    std::fs::rename(&tmp, &path)?;
+    Ok(())
+}
+
+/// Write alignment the kernel reports for a block device (4 KiB if unknown)
+pub fn device_alignment(device_path: &str) -> usize {
+    let name = std::fs::canonicalize(device_path).ok()
+        .and_then(|p| p.file_name().map(|n| n.to_string_lossy().into_owned()));
+    let queue = match name {
+        Some(name) => std::path::Path::new("/sys/class/block").join(name).join("queue"),
+        None => return 4096,
+    };
+    let read = |file: &str| -> usize {
+        std::fs::read_to_string(queue.join(file)).ok()
+            .and_then(|s| s.trim().parse().ok())
+            .unwrap_or(0)
+    };
+    read("physical_block_size").max(read("optimal_io_size")).max(4096)
+}
+
+/// O_DIRECT on a descriptor for as long as this lives, where the device
+/// allows it
+struct DirectMode<'a> {
+    device: &'a File,
+    flags: libc::c_int,
+}
+
+impl<'a> DirectMode<'a> {
+    fn enter(device: &'a File) -> Option<Self> {
+        let fd = device.as_raw_fd();
+        let flags = unsafe { libc::fcntl(fd, libc::F_GETFL) };
+        if flags < 0 || unsafe { libc::fcntl(fd, libc::F_SETFL, flags | libc::O_DIRECT) } != 0 {
+            return None;
+        }
+        Some(DirectMode { device, flags })
+    }
+}
+
+impl Drop for DirectMode<'_> {
+    fn drop(&mut self) {
+        unsafe { libc::fcntl(self.device.as_raw_fd(), libc::F_SETFL, self.flags) };
+    }
+}
+
+/// Profile for the device at `device_path`, open as `device`: from the
+/// cache if this model has been seen before, otherwise calibrated now and
+/// cached.
+pub fn device_profile<F: FnMut(u32)>(device_path: &str, device: &File, on_progress: F) -> Result<DeviceProfile> {
+    let identity = device_identity(device_path).ok().filter(|id| id.has_model());
+    if let Some(profile) = identity.as_ref().and_then(load_profile) {
+        return Ok(profile);
+    }
+
+    let profile = calibrate(device, device_alignment(device_path), on_progress)?;
+    if let Some(identity) = &identity {
+        // Best effort: without a cache we calibrate again next time
+        let _ = save_profile(identity, &profile);
+    }
+    Ok(profile)
+}
+
+/// Measure write throughput for a few chunk sizes and queue depths and
+/// return the fastest combination. `on_progress` gets a percentage.
+///
+/// The first `PROBE_REGION` bytes of the device are read once and then
+/// written back unchanged by every trial, so calibration doesn't disturb
+/// what is on the device (a delta or resumed flash relies on that). Writes
+/// bypass the page cache where the device allows it.
+///
+/// `device` is the flash's own exclusive descriptor: a second open would be
+/// refused while it is held, and for a user who can't open the device would
+/// cost another authorization. It is switched to O_DIRECT for the trials
+/// and back afterwards.
+pub fn calibrate<F: FnMut(u32)>(device: &File, alignment: usize, mut on_progress: F) -> Result<DeviceProfile> {
+    let _direct = DirectMode::enter(device);
+
+    let mut region = AlignedBuffer::new(PROBE_REGION);
+    device.read_exact_at(region.as_mut_full(), 0)
+        .context("Device is too small to calibrate")?;
+    region.set_len(PROBE_REGION);
+
+    let chunks: Vec<usize> = CHUNK_CANDIDATES.iter().copied()
+        .filter(|size| size % alignment == 0)
+        .collect();
+    if chunks.is_empty() {
+        return Err(anyhow!("No chunk size fits the device alignment of {} bytes", alignment));
+    }
+    let trials = (chunks.len() + QUEUE_CANDIDATES.len() - 1) as u32;
+    let mut completed = 0;
+
+    // Wake the device up so the first trial isn't penalised
+    rewrite(&device, &region, chunks[0], 1, CHUNK_CANDIDATES[0])?;
+
+    let mut best = (chunks[0], PROBE_QUEUE_DEPTH, 0.0f64);
+    for &chunk_size in &chunks {
+        let rate = rewrite(&device, &region, chunk_size, PROBE_QUEUE_DEPTH, PROBE_REGION)?;
+        if rate > best.2 * MIN_IMPROVEMENT {
+            best = (chunk_size, PROBE_QUEUE_DEPTH, rate);
+        }
+        completed += 1;
+        on_progress(completed * 100 / trials);
+    }
+    for &queue_depth in QUEUE_CANDIDATES.iter().filter(|&&qd| qd != PROBE_QUEUE_DEPTH) {
+        let rate = rewrite(&device, &region, best.0, queue_depth, PROBE_REGION)?;
+        // Shallower queues win ties as well
+        let needed = if queue_depth < best.1 { 1.0 } else { MIN_IMPROVEMENT };
+        if rate > best.2 * needed {
+            best = (best.0, queue_depth, rate);
+        }
+        completed += 1;
+        on_progress(completed * 100 / trials);
+    }
+
+    Ok(DeviceProfile {
+        chunk_size: best.0,
+        queue_depth: best.1,
+        alignment,
+        throughput: best.2 as u64,
+        cached: false,
+    })
+}
+
+/// Write the first `len` bytes of `region` back to the start of the device
+/// in `chunk_size` pieces with `queue_depth` writes in flight, and return
+/// the rate in bytes per second including the final flush
+fn rewrite(device: &File, region: &AlignedBuffer, chunk_size: usize, queue_depth: u32, len: usize) -> Result<f64> {
+    let data = &region.as_slice()[..len];
+    let count = (len + chunk_size - 1) / chunk_size;
+    let next = AtomicUsize::new(0);
+    let error = Mutex::new(None);
+
+    let start = Instant::now();
+    thread::scope(|scope| {
+        for _ in 0..queue_depth {
+            scope.spawn(|| loop {
+                let index = next.fetch_add(1, Ordering::Relaxed);
+                if index >= count {
+                    break;
+                }
+                let offset = index * chunk_size;
+                let end = (offset + chunk_size).min(len);
+                if let Err(e) = device.write_all_at(&data[offset..end], offset as u64) {
+                    *error.lock().unwrap() = Some(e);
+                    break;
+                }
+            });
+        }
+    });
+    if let Some(e) = error.into_inner().unwrap() {
+        return Err(e).context("Calibration write failed");
+    }
+    device.sync_data().context("Failed to flush device")?;
+
+    Ok(len as f64 / start.elapsed().as_secs_f64().max(1e-6))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_calibration_leaves_device_unchanged() {
+        let path = std::env::temp_dir().join(format!("fluxflasher-tune-{}", std::process::id()));
+        let data: Vec<u8> = (0..PROBE_REGION as u32 + 4096).map(|i| (i % 251) as u8).collect();
+        File::create(&path).unwrap().write_all(&data).unwrap();
+
+        let mut progress = Vec::new();
+        let device = std::fs::OpenOptions::new().read(true).write(true).open(&path).unwrap();
+        let profile = calibrate(&device, 1024 * 1024, |p| progress.push(p)).unwrap();
+        assert!(CHUNK_CANDIDATES[1..].contains(&profile.chunk_size));
+        assert!(QUEUE_CANDIDATES.contains(&profile.queue_depth));
+        assert!(profile.throughput > 0);
+        assert_eq!(progress.last(), Some(&100));
+        assert!(std::fs::read(&path).unwrap() == data);
+
+        let mut options = FlashOptions::default();
+        profile.apply(&mut options);
+        assert_eq!(options.chunk_size, profile.chunk_size);
+        assert!(options.max_inflight_bytes >= (profile.chunk_size as u64) * profile.queue_depth as u64);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
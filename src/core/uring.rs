@@ -0,0 +1,218 @@
+use anyhow::{anyhow, Context, Result};
+use io_uring::{opcode, types, IoUring};
+use std::collections::HashMap;
+use std::fs::File;
+use std::io;
+use std::os::unix::io::AsRawFd;
+
+use super::buffer::AlignedBuffer;
+use super::pipeline::{BlockWriter, Chunk};
+
+/// Index of the device fd in the ring's registered file table
+const DEVICE_FD_INDEX: u32 = 0;
+
+/// A write that has been submitted but not yet fully completed
+struct Inflight {
+    chunk: Chunk,
+    written: usize,
+}
+
+/// Writes chunks through io_uring using registered buffers and a registered
+/// device fd, keeping up to `queue_depth` writes in flight.
+pub struct UringWriter {
+    ring: IoUring,
+    queue_depth: usize,
+    /// Depth the ring was set up for; `queue_depth` may be narrowed below it
+    max_queue_depth: usize,
+    max_inflight_bytes: u64,
+    /// Buffer start address -> index in the registered buffer table
+    buffer_index: HashMap<usize, u16>,
+    inflight: HashMap<u64, Inflight>,
+    inflight_bytes: u64,
+    next_id: u64,
+}
+
+impl UringWriter {
+    /// Set up a ring for `device` and register the pipeline's buffers with it.
+    /// Fails if the kernel doesn't support io_uring or refuses the registration.
+    pub fn new(
+        device: &File,
+        buffers: &[AlignedBuffer],
+        queue_depth: u32,
+        max_inflight_bytes: u64,
+    ) -> io::Result<Self> {
+        let queue_depth = queue_depth.max(1);
+        let ring = IoUring::new(queue_depth.next_power_of_two())?;
+
+        ring.submitter().register_files(&[device.as_raw_fd()])?;
+
+        let iovecs: Vec<libc::iovec> = buffers
+            .iter()
+            .map(|b| libc::iovec {
+                iov_base: b.as_ptr() as *mut libc::c_void,
+                iov_len: b.capacity(),
+            })
+            .collect();
+        // The buffers outlive the ring: they are owned by the pipeline that
+        // owns this writer, and are only freed after it is dropped.
+        unsafe { ring.submitter().register_buffers(&iovecs)? };
+
+        let buffer_index = buffers
+            .iter()
+            .enumerate()
+            .map(|(i, b)| (b.as_ptr() as usize, i as u16))
+            .collect();
+
+        Ok(UringWriter {
+            ring,
+            queue_depth: queue_depth as usize,
+            max_queue_depth: queue_depth as usize,
+            max_inflight_bytes,
+            buffer_index,
+            inflight: HashMap::new(),
+            inflight_bytes: 0,
+            next_id: 0,
+        })
+    }
+
+    /// Queue a write for whatever part of operation `id` hasn't completed yet
+    fn push(&mut self, id: u64) -> Result<()> {
+        let op = &self.inflight[&id];
+        let data = op.chunk.buf.as_slice();
+        let index = *self
+            .buffer_index
+            .get(&(data.as_ptr() as usize))
+            .ok_or_else(|| anyhow!("Buffer is not registered with io_uring"))?;
+        let remaining = &data[op.written..];
+
+        let sqe = opcode::WriteFixed::new(
+            types::Fixed(DEVICE_FD_INDEX),
+            remaining.as_ptr(),
+            remaining.len() as u32,
+            index,
+        )
+        .offset(op.chunk.offset + op.written as u64)
+        .build()
+        .user_data(id);
+
+        // The submission queue has room for queue_depth entries and we never
+        // have more than that in flight.
+        unsafe { self.ring.submission().push(&sqe) }
+            .map_err(|_| anyhow!("io_uring submission queue is full"))?;
+        Ok(())
+    }
+
+    /// Submit queued writes, wait for at least `wait_for` completions and
+    /// process every completion that is available
+    fn reap(&mut self, wait_for: usize, done: &mut Vec<Chunk>) -> Result<()> {
+        self.ring
+            .submit_and_wait(wait_for)
+            .context("io_uring submit failed")?;
+
+        let completions: Vec<(u64, i32)> = self
+            .ring
+            .completion()
+            .map(|cqe| (cqe.user_data(), cqe.result()))
+            .collect();
+
+        // Process every completion before reporting an error, so that
+        // `inflight` only ever holds writes the kernel still owns
+        let mut first_error = None;
+        for (id, result) in completions {
+            let op = match self.inflight.get_mut(&id) {
+                Some(op) => op,
+                None => continue,
+            };
+            let offset = op.chunk.offset + op.written as u64;
+
+            let error = if result < 0 {
+                Some(anyhow!("Failed to write to device at offset {}: {}",
+                    offset, io::Error::from_raw_os_error(-result)))
+            } else if result == 0 {
+                Some(anyhow!("Device accepted no data at offset {}", offset))
+            } else {
+                op.written += result as usize;
+                None
+            };
+
+            let finished = op.written >= op.chunk.buf.len();
+            if error.is_none() && !finished && first_error.is_none() {
+                // Short write: queue the rest of the chunk
+                match self.push(id) {
+                    Ok(()) => continue,
+                    Err(e) => first_error = Some(e),
+                }
+            }
+
+            let op = self.inflight.remove(&id).unwrap();
+            self.inflight_bytes -= op.chunk.buf.len() as u64;
+            match error {
+                Some(e) => { first_error.get_or_insert(e); }
+                None if finished => done.push(op.chunk),
+                None => {}
+            }
+        }
+
+        match first_error {
+            Some(e) => Err(e),
+            None => Ok(()),
+        }
+    }
+}
+
+impl BlockWriter for UringWriter {
+    fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        let len = chunk.buf.len() as u64;
+        while !self.inflight.is_empty()
+            && (self.inflight.len() >= self.queue_depth
+                || self.inflight_bytes + len > self.max_inflight_bytes)
+        {
+            self.reap(1, done)?;
+        }
+
+        let id = self.next_id;
+        self.next_id += 1;
+        self.inflight.insert(id, Inflight { chunk, written: 0 });
+        self.inflight_bytes += len;
+        if let Err(e) = self.push(id) {
+            self.inflight.remove(&id);
+            self.inflight_bytes -= len;
+            return Err(e);
+        }
+
+        // Submit without blocking and pick up anything that already finished
+        self.reap(0, done)
+    }
+
+    fn flush(&mut self, done: &mut Vec<Chunk>) -> Result<()> {
+        while !self.inflight.is_empty() {
+            self.reap(1, done)?;
+        }
+        Ok(())
+    }
+
+    /// Writes already in flight above a narrowed depth drain as they
+    /// complete
+    fn set_queue_depth(&mut self, depth: usize) {
+        self.queue_depth = match depth {
+            0 => self.max_queue_depth,
+            depth => depth.min(self.max_queue_depth),
+        };
+    }
+}
+
+impl Drop for UringWriter {
+    fn drop(&mut self) {
+        // Never let the kernel write from a buffer that's being freed: wait
+        // for anything still in flight after an error
+        while !self.inflight.is_empty() {
+            if self.ring.submit_and_wait(1).is_err() {
+                break;
+            }
+            let ids: Vec<u64> = self.ring.completion().map(|cqe| cqe.user_data()).collect();
+            for id in ids {
+                self.inflight.remove(&id);
+            }
+        }
+    }
+}
@@ -25,6 +25,15 @@ pub fn format_duration(secs: u64) -> String {
     }
 }
 
+/// Per-user cache directory for FluxFlasher ($XDG_CACHE_HOME/fluxflasher)
+pub fn cache_dir() -> std::path::PathBuf {
+    let base = match std::env::var_os("XDG_CACHE_HOME") {
+        Some(dir) if !dir.is_empty() => std::path::PathBuf::from(dir),
+        _ => std::path::PathBuf::from(std::env::var_os("HOME").unwrap_or_else(|| "/tmp".into())).join(".cache"),
+    };
+    base.join("fluxflasher")
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -1,71 +1,979 @@
-use anyhow::{Context, Result};
+use anyhow::{anyhow, Result};
 use sha2::{Sha256, Digest};
 use std::fs::File;
-use std::io::{BufReader, Read};
+use std::collections::BTreeSet;
+use std::io::{self, Write};
+use std::ops::Range;
+use std::os::unix::fs::FileExt;
 use std::path::PathBuf;
-use std::process::{Command, Stdio};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
 use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
 
-/// Verify the integrity of a flashed device by comparing SHA256 hashes
+use super::bmap::Bmap;
+use super::buffer::AlignedBuffer;
+use super::control::Control;
+use super::decompress::decode_threads;
+use super::http::is_url;
+use super::extents::{metadata_offsets, ExtentMap, StreamExtentSource};
+use super::hash::HashAlgorithm;
+use super::image::open_image;
+use super::journal::hex;
+use super::metrics::Metrics;
+use super::pipeline::{ChunkSource, StreamSource};
+use super::readback::Readback;
+use super::snapshot::Watched;
+
+/// Image and device are compared in leaves of this size. A mismatch is
+/// localized to one leaf, and leaves are hashed and read in parallel.
+pub const VERIFY_CHUNK_SIZE: u64 = 4 * 1024 * 1024;
+
+/// Positional read streams used to scan a device
+const MAX_READ_STREAMS: usize = 8;
+
+/// A sampled verification reports its chance of catching corruption of at
+/// least this share of the image
+pub const SAMPLE_DETECTION_THRESHOLD: f64 = 0.01;
+
+/// Hash of one leaf of the verification tree
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Leaf {
+    pub offset: u64,
+    pub len: u64,
+    pub hash: [u8; 32],
+}
+
+/// A byte range of the device that doesn't match the image
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Mismatch {
+    pub offset: u64,
+    pub len: u64,
+}
+
+/// What verification found, and how fast the device read back
+#[derive(Debug, Default)]
+pub struct VerifyStats {
+    /// Byte ranges of the device that don't match the image
+    pub mismatches: Mutex<Vec<Mismatch>>,
+    /// Device bytes read back so far
+    pub device_bytes: AtomicU64,
+    /// When reading the device started
+    started: Mutex<Option<Instant>>,
+    /// Confidence a sampled verification reached; `None` after a full one
+    pub confidence: Mutex<Option<f32>>,
+    /// Keep comparing past the first bad leaf, so a repair knows every
+    /// range to rewrite
+    pub exhaustive: AtomicBool,
+    /// Ranges a repair rewrote and read back correctly
+    pub repaired: Mutex<Vec<Mismatch>>,
+    /// Pauses, caps or cancels the device reads
+    pub control: Arc<Control>,
+    /// Where the device reads record their latency
+    pub metrics: Arc<Metrics>,
+}
+
+impl VerifyStats {
+    pub fn new(control: Arc<Control>, metrics: Arc<Metrics>) -> Self {
+        VerifyStats { control, metrics, ..VerifyStats::default() }
+    }
+
+    /// Open the device for a new readback, its reads going through `control`
+    /// and measured into `metrics`
+    pub fn start_readback(&self, device_path: &str) -> Result<Readback> {
+        let device = Readback::device(device_path)?
+            .controlled(self.control.clone())
+            .measured(self.metrics.clone());
+        self.start();
+        Ok(device)
+    }
+
+    /// Reset for a new readback of the device
+    fn start(&self) {
+        self.mismatches.lock().unwrap().clear();
+        self.device_bytes.store(0, Ordering::Relaxed);
+        *self.started.lock().unwrap() = Some(Instant::now());
+        *self.confidence.lock().unwrap() = None;
+        self.repaired.lock().unwrap().clear();
+    }
+
+    /// Device read speed in bytes per second (0 before the readback starts)
+    pub fn read_speed(&self) -> u64 {
+        let elapsed = match *self.started.lock().unwrap() {
+            Some(started) => started.elapsed().as_secs_f64(),
+            None => return 0,
+        };
+        (self.device_bytes.load(Ordering::Relaxed) as f64 / elapsed.max(1e-3)) as u64
+    }
+}
+
+/// Per-leaf hashes of an image, sorted by offset
+#[derive(Clone, Debug)]
+pub struct ChunkDigests {
+    algorithm: HashAlgorithm,
+    leaves: Vec<Leaf>,
+}
+
+impl ChunkDigests {
+    /// Digests of a whole image of `image_size` bytes from its leaf hashes
+    /// in order, or `None` if their number doesn't fit the size
+    pub fn whole(algorithm: HashAlgorithm, image_size: u64, hashes: Vec<[u8; 32]>) -> Option<Self> {
+        let layout = leaf_layout([(0, image_size)]);
+        if layout.len() != hashes.len() {
+            return None;
+        }
+        let leaves = layout.into_iter().zip(hashes)
+            .map(|((offset, len), hash)| Leaf { offset, len, hash })
+            .collect();
+        Some(ChunkDigests { algorithm, leaves })
+    }
+
+    /// Whether these cover a whole image of `image_size` bytes, rather than
+    /// some extents of it
+    pub fn is_whole(&self, image_size: u64) -> bool {
+        self.matches(&leaf_layout([(0, image_size)]))
+    }
+
+    pub fn algorithm(&self) -> HashAlgorithm {
+        self.algorithm
+    }
+
+    pub fn leaves(&self) -> &[Leaf] {
+        &self.leaves
+    }
+
+    /// Whether the leaves are exactly `layout`
+    pub fn matches(&self, layout: &[(u64, u64)]) -> bool {
+        self.leaves.len() == layout.len()
+            && self.leaves.iter().zip(layout).all(|(leaf, &(offset, len))| leaf.offset == offset && leaf.len == len)
+    }
+
+    /// Merkle root over the leaf hashes: pairs are hashed together level by
+    /// level, and an odd node is carried up unchanged
+    pub fn root(&self) -> [u8; 32] {
+        let mut level: Vec<[u8; 32]> = self.leaves.iter().map(|leaf| leaf.hash).collect();
+        if level.is_empty() {
+            return self.algorithm.digest(&[]);
+        }
+        while level.len() > 1 {
+            level = level.chunks(2)
+                .map(|pair| match pair {
+                    [left, right] => self.algorithm.combine(left, right),
+                    [single] => *single,
+                    _ => unreachable!(),
+                })
+                .collect();
+        }
+        level[0]
+    }
+}
+
+/// Leaves covering `ranges`: cut at every multiple of `VERIFY_CHUNK_SIZE`
+/// and wherever the ranges are discontiguous
+pub fn leaf_layout<I: IntoIterator<Item = (u64, u64)>>(ranges: I) -> Vec<(u64, u64)> {
+    let mut merged: Vec<(u64, u64)> = Vec::new();
+    for (offset, len) in ranges {
+        match merged.last_mut() {
+            Some(last) if last.0 + last.1 == offset => last.1 += len,
+            _ if len > 0 => merged.push((offset, len)),
+            _ => {}
+        }
+    }
+
+    let mut layout = Vec::new();
+    for (offset, len) in merged {
+        let end = offset + len;
+        let mut pos = offset;
+        while pos < end {
+            let n = (VERIFY_CHUNK_SIZE - pos % VERIFY_CHUNK_SIZE).min(end - pos);
+            layout.push((pos, n));
+            pos += n;
+        }
+    }
+    layout
+}
+
+/// Leaves compared when verifying: the whole image, or only `extents`
+fn verify_layout(image_size: u64, extents: Option<&ExtentMap>) -> Vec<(u64, u64)> {
+    match extents {
+        Some(map) => leaf_layout(map.extents().iter().map(|e| (e.offset, e.len))),
+        None => leaf_layout([(0, image_size)]),
+    }
+}
+
+/// Cuts data into leaves as it arrives and hashes them on a pool of
+/// threads. Data may skip ahead (extents); it must not go back.
+pub struct ChunkHasher {
+    algorithm: HashAlgorithm,
+    pending: Vec<u8>,
+    /// Device offset of `pending[0]`
+    start: u64,
+    tx: Option<SyncSender<(u64, Vec<u8>)>>,
+    leaves: Arc<Mutex<Vec<Leaf>>>,
+    workers: Vec<thread::JoinHandle<()>>,
+}
+
+impl ChunkHasher {
+    pub fn new(algorithm: HashAlgorithm) -> Self {
+        ChunkHasher::start(algorithm, None)
+    }
+
+    /// A hasher whose workers record their busy and idle time as the hash
+    /// stage of `metrics`
+    pub fn measured(algorithm: HashAlgorithm, metrics: Arc<Metrics>) -> Self {
+        ChunkHasher::start(algorithm, Some(metrics))
+    }
+
+    fn start(algorithm: HashAlgorithm, metrics: Option<Arc<Metrics>>) -> Self {
+        let threads = decode_threads();
+        let (tx, rx) = sync_channel::<(u64, Vec<u8>)>(threads);
+        let rx = Arc::new(Mutex::new(rx));
+        let leaves = Arc::new(Mutex::new(Vec::new()));
+        let workers = (0..threads)
+            .map(|_| {
+                let (rx, leaves, metrics) = (rx.clone(), leaves.clone(), metrics.clone());
+                thread::spawn(move || hash_worker(algorithm, &rx, &leaves, metrics.as_deref()))
+            })
+            .collect();
+        ChunkHasher { algorithm, pending: Vec::new(), start: 0, tx: Some(tx), leaves, workers }
+    }
+
+    /// Add `data`, which belongs at `offset`
+    pub fn update_at(&mut self, offset: u64, mut data: &[u8]) {
+        if offset != self.start + self.pending.len() as u64 {
+            self.send_pending();
+            self.start = offset;
+        }
+        while !data.is_empty() {
+            let pos = self.start + self.pending.len() as u64;
+            let room = (VERIFY_CHUNK_SIZE - pos % VERIFY_CHUNK_SIZE) as usize;
+            let n = room.min(data.len());
+            self.pending.extend_from_slice(&data[..n]);
+            data = &data[n..];
+            if n == room {
+                self.send_pending();
+                self.start = pos + n as u64;
+            }
+        }
+    }
+
+    fn send_pending(&mut self) {
+        if self.pending.is_empty() {
+            return;
+        }
+        let data = std::mem::replace(&mut self.pending, Vec::with_capacity(VERIFY_CHUNK_SIZE as usize));
+        if let Some(tx) = &self.tx {
+            let _ = tx.send((self.start, data));
+        }
+    }
+
+    fn close(&mut self) {
+        self.tx = None;
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+
+    pub fn finish(mut self) -> ChunkDigests {
+        self.send_pending();
+        self.close();
+        let mut leaves = std::mem::take(&mut *self.leaves.lock().unwrap());
+        leaves.sort_by_key(|leaf| leaf.offset);
+        ChunkDigests { algorithm: self.algorithm, leaves }
+    }
+}
+
+impl Drop for ChunkHasher {
+    fn drop(&mut self) {
+        self.close();
+    }
+}
+
+/// Appends at the current position, for hashing a stream from its start
+impl Write for ChunkHasher {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.update_at(self.start + self.pending.len() as u64, buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+fn hash_worker(algorithm: HashAlgorithm, rx: &Mutex<Receiver<(u64, Vec<u8>)>>, leaves: &Mutex<Vec<Leaf>>, metrics: Option<&Metrics>) {
+    loop {
+        let waiting = Instant::now();
+        let next = rx.lock().unwrap().recv();
+        let Ok((offset, data)) = next else { return };
+        if let Some(metrics) = metrics {
+            metrics.hash.idle(waiting);
+        }
+        let hashing = Instant::now();
+        let hash = algorithm.digest(&data);
+        if let Some(metrics) = metrics {
+            metrics.hash.busy(hashing);
+        }
+        leaves.lock().unwrap().push(Leaf { offset, len: data.len() as u64, hash });
+    }
+}
+
+/// Hashes the chunks of a source as the pipeline reads them, so the image
+/// doesn't have to be read again to verify the device
+pub struct DigestSource<S> {
+    inner: S,
+    hasher: ChunkHasher,
+}
+
+impl<S: ChunkSource> DigestSource<S> {
+    /// `hasher` may already hold data that precedes the source
+    pub fn new(inner: S, hasher: ChunkHasher) -> Self {
+        DigestSource { inner, hasher }
+    }
+
+    pub fn finish(self) -> ChunkDigests {
+        self.hasher.finish()
+    }
+}
+
+impl<S: ChunkSource> ChunkSource for DigestSource<S> {
+    fn next_chunk(&mut self, buf: &mut AlignedBuffer) -> Result<Option<u64>> {
+        let offset = self.inner.next_chunk(buf)?;
+        if let Some(offset) = offset {
+            self.hasher.update_at(offset, buf.as_slice());
+        }
+        Ok(offset)
+    }
+}
+
+/// Hash the leaves of `layout` in `file` with several parallel positional
+/// reads. `visit` gets each leaf's index and hash as it is done; once it
+/// returns false no further leaves are started.
+fn scan_leaves<P, V>(file: &Readback, layout: &[(u64, u64)], algorithm: HashAlgorithm, on_progress: P, visit: V) -> Result<()>
+where
+    P: Fn(u64) + Sync,
+    V: Fn(usize, [u8; 32]) -> bool + Sync,
+{
+    let next = AtomicUsize::new(0);
+    let stop = AtomicBool::new(false);
+    let done = AtomicU64::new(0);
+    let error = Mutex::new(None);
+    let max_len = layout.iter().map(|&(_, len)| len).max().unwrap_or(0) as usize;
+    let streams = decode_threads().min(MAX_READ_STREAMS).min(layout.len()).max(1);
+
+    thread::scope(|scope| {
+        for _ in 0..streams {
+            scope.spawn(|| {
+                let mut buffer = AlignedBuffer::new(file.buffer_size(max_len));
+                while !stop.load(Ordering::Relaxed) {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    let Some(&(offset, len)) = layout.get(index) else { break };
+                    let data = match file.read_at(&mut buffer, offset, len as usize) {
+                        Ok(data) => data,
+                        Err(e) => {
+                            *error.lock().unwrap() = Some(e);
+                            stop.store(true, Ordering::Relaxed);
+                            break;
+                        }
+                    };
+                    if !visit(index, algorithm.digest(data)) {
+                        stop.store(true, Ordering::Relaxed);
+                    }
+                    on_progress(done.fetch_add(len, Ordering::Relaxed) + len);
+                }
+            });
+        }
+    });
+
+    match error.into_inner().unwrap() {
+        Some(e) => Err(e),
+        None => Ok(()),
+    }
+}
+
+/// Compare `device` leaf by leaf, bypassing the page cache and stopping
+/// at the first leaf `good` rejects (unless `stats` asks for all of them).
+/// Returns the failing leaves, by index in offset order.
+fn compare_device<P, G>(
+    device: &Readback,
+    layout: &[(u64, u64)],
+    algorithm: HashAlgorithm,
+    stats: &VerifyStats,
+    on_progress: P,
+    good: G,
+) -> Result<Vec<usize>>
+where
+    P: Fn(u64) + Sync,
+    G: Fn(usize, &[u8; 32]) -> bool + Sync,
+{
+    let failed = Mutex::new(Vec::new());
+    let on_read = |done: u64| {
+        stats.device_bytes.fetch_max(done, Ordering::Relaxed);
+        on_progress(done);
+    };
+    scan_leaves(device, layout, algorithm, on_read, |index, hash| {
+        if good(index, &hash) {
+            return true;
+        }
+        failed.lock().unwrap().push(index);
+        stats.exhaustive.load(Ordering::Relaxed)
+    })?;
+    let mut failed = failed.into_inner().unwrap();
+    failed.sort_unstable();
+    Ok(failed)
+}
+
+/// Narrow a failing leaf to the bytes that actually differ, when the source
+/// can be read at device offsets
+fn locate(source: Option<&File>, device: &Readback, offset: u64, len: u64) -> Mismatch {
+    let narrowed = source.and_then(|source| {
+        let mut a = vec![0u8; len as usize];
+        let mut buffer = AlignedBuffer::new(device.buffer_size(len as usize));
+        source.read_exact_at(&mut a, offset).ok()?;
+        let b = device.read_at(&mut buffer, offset, len as usize).ok()?;
+        let first = a.iter().zip(b).position(|(x, y)| x != y)?;
+        let last = a.iter().zip(b).rposition(|(x, y)| x != y)?;
+        Some(Mismatch { offset: offset + first as u64, len: (last - first + 1) as u64 })
+    });
+    narrowed.unwrap_or(Mismatch { offset, len })
+}
+
+/// Sorted ranges with touching neighbours merged
+pub fn merge_ranges(found: Vec<Mismatch>) -> Vec<Mismatch> {
+    let mut merged: Vec<Mismatch> = Vec::with_capacity(found.len());
+    for m in found {
+        match merged.last_mut() {
+            Some(last) if last.offset + last.len == m.offset => last.len += m.len,
+            _ => merged.push(m),
+        }
+    }
+    merged
+}
+
+/// Record the failing ranges, merging neighbours, and describe them
+fn report(mismatches: &Mutex<Vec<Mismatch>>, found: Vec<Mismatch>) -> anyhow::Error {
+    let merged = merge_ranges(found);
+    let (first, more) = (merged[0], merged.len() - 1);
+    *mismatches.lock().unwrap() = merged;
+    anyhow!(
+        "Verification failed: Device differs at bytes {}-{}{}",
+        first.offset,
+        first.offset + first.len - 1,
+        if more > 0 { format!(" and {} more range(s)", more) } else { String::new() },
+    )
+}
+
+/// Leaf hashes of the image over `layout`. Raw images are read with
+/// parallel positional reads; compressed ones are decompressed once and
+/// hashed on the pool.
+fn hash_source<P: Fn(u64) + Sync>(
+    image_path: &PathBuf,
+    layout: &[(u64, u64)],
+    extents: Option<&ExtentMap>,
+    algorithm: HashAlgorithm,
+    on_progress: P,
+) -> Result<ChunkDigests> {
+    let (image, info) = open_image(image_path, Arc::new(AtomicU64::new(0)))?;
+    let digests = if info.is_raw() {
+        drop(image);
+        let file = Readback::cached(File::open(image_path)?);
+        let hashes = Mutex::new(vec![[0u8; 32]; layout.len()]);
+        scan_leaves(&file, layout, algorithm, on_progress, |index, hash| {
+            hashes.lock().unwrap()[index] = hash;
+            true
+        })?;
+        let leaves = layout.iter().zip(hashes.into_inner().unwrap())
+            .map(|(&(offset, len), hash)| Leaf { offset, len, hash })
+            .collect();
+        ChunkDigests { algorithm, leaves }
+    } else {
+        let mut source: Box<dyn ChunkSource> = match extents {
+            Some(map) => Box::new(StreamExtentSource::new(image, map)),
+            None => Box::new(StreamSource::new(image)),
+        };
+        let mut hasher = ChunkHasher::new(algorithm);
+        let mut buffer = AlignedBuffer::new(1024 * 1024);
+        let mut done = 0u64;
+        while let Some(offset) = source.next_chunk(&mut buffer)? {
+            hasher.update_at(offset, buffer.as_slice());
+            done += buffer.len() as u64;
+            on_progress(done);
+        }
+        hasher.finish()
+    };
+
+    if !digests.matches(layout) {
+        return Err(anyhow!("Verification failed: Image size changed since it was written"));
+    }
+    Ok(digests)
+}
+
+/// Verify the integrity of a flashed device by comparing per-leaf hashes,
+/// read in parallel on both sides. `image_size` is the decompressed
+/// length the flash phase wrote. With `extents`, only those ranges are
+/// compared.
+///
+/// `expected` holds the leaf hashes the flash phase computed while writing,
+/// if it saw the whole image; then only the device is read, with the same
+/// algorithm. Otherwise the image is read and hashed again with `algorithm`
+/// first.
+///
+/// Verification stops at the first bad leaf; the failing byte ranges are
+/// left in `stats`. On success, returns the image's leaf hashes, so they
+/// can be cached for the next flash.
+///
+/// The device is read with O_DIRECT (or with its cached pages dropped), so
+/// every byte compared comes from the media.
 pub fn verify_integrity(
     image_path: &PathBuf,
     device_path: &str,
-    progress: Arc<Mutex<f32>>,
-    status: Arc<Mutex<String>>
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: Arc<VerifyStats>,
+    image_size: u64,
+    extents: Option<&ExtentMap>,
+    algorithm: HashAlgorithm,
+    expected: Option<&ChunkDigests>,
+) -> Result<ChunkDigests> {
+    *progress.lock().unwrap() = 0.0;
+    let layout = verify_layout(image_size, extents);
+    let what = if extents.is_some() { " (used blocks)" } else { "" };
+    let total_size = layout.iter().map(|&(_, len)| len).sum::<u64>().max(1);
+
+    let hashed;
+    let rehashed = !expected.is_some_and(|digests| digests.matches(&layout));
+    let expected = match expected.filter(|_| !rehashed) {
+        Some(digests) => digests,
+        None => {
+            *status.lock().unwrap() = format!("Verifying: Hashing source image{} ({})...", what, algorithm.name());
+            hashed = hash_source(image_path, &layout, extents, algorithm, |done| {
+                *progress.lock().unwrap() = (done as f32 / total_size as f32) * 0.5;
+            })?;
+            &hashed
+        }
+    };
+    // Share of the progress bar the device read gets
+    let (device_start, device_share) = if rehashed { (0.5, 0.5) } else { (0.0, 1.0) };
+
+    let algorithm = expected.algorithm();
+    *status.lock().unwrap() = format!("Verifying: Hashing device content{} ({})...", what, algorithm.name());
+    let leaves = expected.leaves();
+    let device = stats.start_readback(device_path)?;
+    let failed = compare_device(&device, &layout, algorithm, &stats, |done| {
+        *progress.lock().unwrap() = device_start + (done as f32 / total_size as f32) * device_share;
+    }, |index, hash| *hash == leaves[index].hash)?;
+
+    if !failed.is_empty() {
+        return Err(report_leaves(image_path, &device, &stats, &layout, &failed));
+    }
+
+    *status.lock().unwrap() = format!("Verification Successful! (root {})", &hex(&expected.root())[..16]);
+    *progress.lock().unwrap() = 1.0;
+    Ok(expected.clone())
+}
+
+/// Narrow the `failed` leaves of `layout` and record them in `stats`
+fn report_leaves(image_path: &PathBuf, device: &Readback, stats: &VerifyStats, layout: &[(u64, u64)], failed: &[usize]) -> anyhow::Error {
+    let source = Some(image_path)
+        .filter(|path| !is_url(&path.to_string_lossy()))
+        .and_then(|path| open_image(path, Arc::new(AtomicU64::new(0))).ok())
+        .filter(|(_, info)| info.is_raw())
+        .and_then(|_| File::open(image_path).ok());
+    let found = failed.iter()
+        .map(|&index| locate(source.as_ref(), device, layout[index].0, layout[index].1))
+        .collect();
+    report(&stats.mismatches, found)
+}
+
+/// Chance that `samples` leaves picked at random from `total` include a bad
+/// one, if `SAMPLE_DETECTION_THRESHOLD` of them are bad
+pub fn sample_confidence(total: usize, samples: usize) -> f64 {
+    if samples >= total {
+        return 1.0;
+    }
+    let bad = ((total as f64 * SAMPLE_DETECTION_THRESHOLD).ceil() as usize).max(1);
+    // Hypergeometric: every pick misses the bad leaves
+    let mut miss = 1.0;
+    for i in 0..samples {
+        if total - bad <= i {
+            return 1.0;
+        }
+        miss *= (total - bad - i) as f64 / (total - i) as f64;
+    }
+    1.0 - miss
+}
+
+/// `count` distinct indices below `n`, in order (Floyd's algorithm over
+/// splitmix64)
+pub fn pick_random(n: usize, count: usize, mut seed: u64) -> Vec<usize> {
+    let mut next = || {
+        seed = seed.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        let mut z = seed;
+        z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        z ^ (z >> 31)
+    };
+    let mut chosen = BTreeSet::new();
+    for j in n - count.min(n)..n {
+        let t = (next() % (j as u64 + 1)) as usize;
+        if !chosen.insert(t) {
+            chosen.insert(j);
+        }
+    }
+    chosen.into_iter().collect()
+}
+
+/// Verify part of the device instead of reading all of it back: the leaves
+/// holding partition tables, boot sectors and superblocks, plus `samples`
+/// leaves placed at random, fresh for every run. They are compared with
+/// `expected` if the flash phase hashed the image; otherwise only those
+/// leaves of a raw image are hashed (a compressed one is decompressed in
+/// full).
+///
+/// The metadata locations are read from the device, as cheap as reading the
+/// image and possible for any format; if the device's partition table is
+/// damaged, its leaf fails anyway.
+///
+/// Returns the confidence reached (see `sample_confidence`), also left in
+/// `stats`.
+pub fn verify_sampled(
+    image_path: &PathBuf,
+    device_path: &str,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: Arc<VerifyStats>,
+    image_size: u64,
+    extents: Option<&ExtentMap>,
+    algorithm: HashAlgorithm,
+    expected: Option<&ChunkDigests>,
+    samples: usize,
+) -> Result<f64> {
+    *progress.lock().unwrap() = 0.0;
+    let layout = verify_layout(image_size, extents);
+    let device = stats.start_readback(device_path)?;
+    let offsets = metadata_offsets(&device, image_size);
+    let landmarks: BTreeSet<usize> = offsets.into_iter()
+        .filter_map(|offset| {
+            let index = layout.partition_point(|&(start, len)| start + len <= offset);
+            layout.get(index).filter(|&&(start, _)| start <= offset).map(|_| index)
+        })
+        .collect();
+    let others: Vec<usize> = (0..layout.len()).filter(|index| !landmarks.contains(index)).collect();
+    let seed = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |d| d.as_nanos() as u64) ^ std::process::id() as u64;
+    let random = pick_random(others.len(), samples, seed);
+    let confidence = sample_confidence(others.len(), random.len());
+
+    let mut picked: Vec<usize> = landmarks.into_iter().chain(random.iter().map(|&i| others[i])).collect();
+    picked.sort_unstable();
+    let sample_layout: Vec<(u64, u64)> = picked.iter().map(|&index| layout[index]).collect();
+    let total_size = sample_layout.iter().map(|&(_, len)| len).sum::<u64>().max(1);
+
+    let (algorithm, hashes, rehashed): (HashAlgorithm, Vec<[u8; 32]>, bool) = match expected.filter(|d| d.matches(&layout)) {
+        Some(digests) => (digests.algorithm(), picked.iter().map(|&index| digests.leaves()[index].hash).collect(), false),
+        None => {
+            *status.lock().unwrap() = format!("Verifying: Hashing sampled chunks of source image ({})...", algorithm.name());
+            let raw = !is_url(&image_path.to_string_lossy())
+                && open_image(image_path, Arc::new(AtomicU64::new(0))).is_ok_and(|(_, info)| info.is_raw());
+            let hashes = if raw {
+                hash_source(image_path, &sample_layout, extents, algorithm, |done| {
+                    *progress.lock().unwrap() = (done as f32 / total_size as f32) * 0.5;
+                })?.leaves().iter().map(|leaf| leaf.hash).collect()
+            } else {
+                let full_size = layout.iter().map(|&(_, len)| len).sum::<u64>().max(1);
+                let digests = hash_source(image_path, &layout, extents, algorithm, |done| {
+                    *progress.lock().unwrap() = (done as f32 / full_size as f32) * 0.5;
+                })?;
+                picked.iter().map(|&index| digests.leaves()[index].hash).collect()
+            };
+            (algorithm, hashes, true)
+        }
+    };
+    let (device_start, device_share) = if rehashed { (0.5, 0.5) } else { (0.0, 1.0) };
+
+    *status.lock().unwrap() = format!(
+        "Verifying: Sampling {} of {} chunks of device content ({})...",
+        picked.len(),
+        layout.len(),
+        algorithm.name(),
+    );
+    // Time the readback from here, not from hashing the source
+    stats.start();
+    let failed = compare_device(&device, &sample_layout, algorithm, &stats, |done| {
+        *progress.lock().unwrap() = device_start + (done as f32 / total_size as f32) * device_share;
+    }, |index, hash| *hash == hashes[index])?;
+
+    if !failed.is_empty() {
+        return Err(report_leaves(image_path, &device, &stats, &sample_layout, &failed));
+    }
+
+    *stats.confidence.lock().unwrap() = Some(confidence as f32);
+    *status.lock().unwrap() = format!(
+        "Verification Successful! ({} of {} chunks sampled, {:.1}% confidence)",
+        picked.len(),
+        layout.len(),
+        confidence * 100.0,
+    );
+    *progress.lock().unwrap() = 1.0;
+    Ok(confidence)
+}
+
+/// Check the device against the per-range checksums of a bmap. Only the
+/// mapped ranges of the device are read; the image isn't needed at all.
+/// Failing ranges are left in `stats`.
+pub fn verify_bmap(
+    device_path: &str,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: Arc<VerifyStats>,
+    bmap: &Bmap,
 ) -> Result<()> {
-    *status.lock().unwrap() = "Verifying: Hashing source image...".to_string();
+    let total_size = bmap.mapped_bytes().max(1);
+
+    *status.lock().unwrap() = "Verifying: Checking block map ranges...".to_string();
     *progress.lock().unwrap() = 0.0;
-    
-    let mut file = File::open(image_path)?;
-    let total_size = file.metadata()?.len();
-    let mut hasher = Sha256::new();
-    let mut buffer = [0u8; 1024 * 1024]; // 1MB buffer
-    let mut read_so_far = 0;
+    let device = stats.start_readback(device_path)?;
 
-    loop {
-        let n = file.read(&mut buffer)?;
-        if n == 0 { break; }
-        hasher.update(&buffer[..n]);
-        read_so_far += n as u64;
-         *progress.lock().unwrap() = (read_so_far as f32 / total_size as f32) * 0.5;
-    }
-    let expected_hash = hasher.finalize();
-
-    *status.lock().unwrap() = "Verifying: Hashing device content...".to_string();
-    
-    let mut child = Command::new("pkexec")
-        .arg("dd")
-        .arg(format!("if={}", device_path))
-        .arg(format!("count={}", total_size))
-        .arg("iflag=count_bytes")
-        .arg("bs=4M")
-        .arg("status=none")
-        .stdout(Stdio::piped())
-        .spawn()?;
-
-    let stdout = child.stdout.take().ok_or_else(|| anyhow::anyhow!("Failed to open device stream"))?;
-    let mut reader = BufReader::new(stdout);
-    let mut dev_hasher = Sha256::new();
-    let mut dev_read_so_far = 0;
-    
-    loop {
-        let n = reader.read(&mut buffer)?;
-        if n == 0 { break; }
-        dev_hasher.update(&buffer[..n]);
-        dev_read_so_far += n as u64;
-        // Map 0.5 -> 1.0
-        *progress.lock().unwrap() = 0.5 + ((dev_read_so_far as f32 / total_size as f32) * 0.5);
-    }
-    
-    let _ = child.wait();
-    
-    let actual_hash = dev_hasher.finalize();
-    
-    if expected_hash != actual_hash {
-        return Err(anyhow::anyhow!("Verification failed: Hash mismatch!"));
+    let chunk = 4 * 1024 * 1024;
+    let mut buffer = AlignedBuffer::new(device.buffer_size(chunk));
+    let mut done = 0u64;
+    let mut found = Vec::new();
+    for range in &bmap.ranges {
+        let expected = match &range.checksum {
+            Some(checksum) => checksum,
+            None => return Err(anyhow::anyhow!("Block map range at {} has no checksum", range.offset)),
+        };
+
+        let mut hasher = Sha256::new();
+        let mut pos = 0u64;
+        while pos < range.len {
+            let n = (chunk as u64).min(range.len - pos) as usize;
+            hasher.update(device.read_at(&mut buffer, range.offset + pos, n)?);
+            pos += n as u64;
+            done += n as u64;
+            stats.device_bytes.store(done, Ordering::Relaxed);
+            *progress.lock().unwrap() = done as f32 / total_size as f32;
+        }
+
+        if hasher.finalize().as_slice() != expected.as_slice() {
+            found.push(Mismatch { offset: range.offset, len: range.len });
+            if !stats.exhaustive.load(Ordering::Relaxed) {
+                break;
+            }
+        }
+    }
+    if !found.is_empty() {
+        return Err(report(&stats.mismatches, found));
+    }
+
+    *status.lock().unwrap() = "Verification Successful!".to_string();
+    *progress.lock().unwrap() = 1.0;
+    Ok(())
+}
+
+/// Verify a device against the chunk-hash manifest of a stored image. Only
+/// the device is read, in parallel; the source was hashed when it was
+/// stored. Failing chunks are left in `stats`.
+pub fn verify_manifest(
+    device_path: &str,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: Arc<VerifyStats>,
+    image_size: u64,
+    chunk_size: usize,
+    hashes: &[String],
+) -> Result<()> {
+    *status.lock().unwrap() = "Verifying: Checking against stored image hashes...".to_string();
+    *progress.lock().unwrap() = 0.0;
+
+    let layout: Vec<(u64, u64)> = (0..hashes.len() as u64)
+        .map(|index| {
+            let offset = index * chunk_size as u64;
+            (offset, (chunk_size as u64).min(image_size - offset))
+        })
+        .collect();
+    let device = stats.start_readback(device_path)?;
+    let failed = compare_device(&device, &layout, HashAlgorithm::Sha256, &stats, |done| {
+        *progress.lock().unwrap() = done as f32 / image_size.max(1) as f32;
+    }, |index, hash| hex(hash) == hashes[index])?;
+
+    if !failed.is_empty() {
+        let found = failed.iter().map(|&index| Mismatch { offset: layout[index].0, len: layout[index].1 }).collect();
+        return Err(report(&stats.mismatches, found));
+    }
+
+    *status.lock().unwrap() = "Verification Successful!".to_string();
+    *progress.lock().unwrap() = 1.0;
+    Ok(())
+}
+
+/// Verify a device against a published SHA-256 of the raw image (from a
+/// `.sha256` or `SHA256SUMS` file). Only the device is read; hashing runs
+/// on its own thread so it overlaps the next read.
+pub fn verify_sha256(
+    device_path: &str,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    stats: Arc<VerifyStats>,
+    image_size: u64,
+    expected: &[u8],
+) -> Result<()> {
+    *status.lock().unwrap() = "Verifying: Checking against published SHA-256...".to_string();
+    *progress.lock().unwrap() = 0.0;
+    let device = stats.start_readback(device_path)?;
+
+    let chunk = VERIFY_CHUNK_SIZE as usize;
+    let (full_tx, full_rx) = sync_channel::<(AlignedBuffer, Range<usize>)>(2);
+    let (empty_tx, empty_rx) = sync_channel::<AlignedBuffer>(3);
+    for _ in 0..3 {
+        empty_tx.send(AlignedBuffer::new(device.buffer_size(chunk))).unwrap();
+    }
+
+    let actual = thread::scope(|scope| -> Result<Vec<u8>> {
+        let hasher = scope.spawn(move || {
+            let mut hasher = Sha256::new();
+            for (buffer, range) in full_rx {
+                hasher.update(&buffer.as_slice()[range]);
+                if empty_tx.send(buffer).is_err() {
+                    break;
+                }
+            }
+            hasher.finalize().to_vec()
+        });
+
+        let mut pos = 0u64;
+        while pos < image_size {
+            let mut buffer = empty_rx.recv()?;
+            let n = (chunk as u64).min(image_size - pos) as usize;
+            let range = device.read_range(&mut buffer, pos, n)?;
+            buffer.set_len(range.end);
+            full_tx.send((buffer, range))?;
+            pos += n as u64;
+            stats.device_bytes.store(pos, Ordering::Relaxed);
+            *progress.lock().unwrap() = pos as f32 / image_size.max(1) as f32;
+        }
+        drop(full_tx);
+        Ok(hasher.join().unwrap())
+    })?;
+
+    if actual != expected {
+        return Err(anyhow!("Verification failed: Device doesn't match the published SHA-256"));
     }
 
     *status.lock().unwrap() = "Verification Successful!".to_string();
     *progress.lock().unwrap() = 1.0;
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::core::buffer::allocate_ring;
+    use crate::core::pipeline::{run_pipeline, BlockWriter, Chunk};
+    use std::io::Cursor;
+
+    struct NullWriter;
+
+    impl BlockWriter for NullWriter {
+        fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+            done.push(chunk);
+            Ok(())
+        }
+
+        fn flush(&mut self, _done: &mut Vec<Chunk>) -> Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_digest_source_hashes_what_the_pipeline_reads() {
+        let data: Vec<u8> = (0..10 * 1024 * 1024 + 321u32).map(|i| (i % 211) as u8).collect();
+        let (prefix, rest) = data.split_at(3 * 1024 * 1024);
+
+        // As after resuming a compressed image: the prefix was hashed while skipping it
+        let mut hasher = ChunkHasher::new(HashAlgorithm::Sha256);
+        hasher.write_all(prefix).unwrap();
+        let source = StreamSource::new(Cursor::new(rest.to_vec())).at_offset(prefix.len() as u64);
+        let mut source = DigestSource::new(source, hasher);
+        run_pipeline(&mut source, allocate_ring(1024 * 1024, 4), &mut NullWriter, &Metrics::default(), |_| {}).unwrap();
+
+        let digests = source.finish();
+        let layout = leaf_layout([(0, data.len() as u64)]);
+        assert_eq!(layout.len(), 3);
+        assert!(digests.matches(&layout));
+        for (leaf, &(offset, len)) in digests.leaves().iter().zip(&layout) {
+            let expected: [u8; 32] = Sha256::digest(&data[offset as usize..(offset + len) as usize]).into();
+            assert_eq!(leaf.hash, expected);
+        }
+
+        // Root of three leaves: (a, b) paired, c carried up
+        let pair: [u8; 32] = Sha256::new()
+            .chain_update(digests.leaves()[0].hash)
+            .chain_update(digests.leaves()[1].hash)
+            .finalize()
+            .into();
+        let root: [u8; 32] = Sha256::new().chain_update(pair).chain_update(digests.leaves()[2].hash).finalize().into();
+        assert_eq!(digests.root(), root);
+    }
+
+    #[test]
+    fn test_verify_reports_the_corrupted_range() {
+        let dir = std::env::temp_dir();
+        let image = dir.join(format!("fluxflasher-verify-{}.img", std::process::id()));
+        let device = dir.join(format!("fluxflasher-verify-{}.dev", std::process::id()));
+        let data: Vec<u8> = (0..9 * 1024 * 1024u32).map(|i| (i % 251) as u8).collect();
+        let mut corrupted = data.clone();
+        corrupted[5 * 1024 * 1024 + 100..5 * 1024 * 1024 + 110].fill(0xff);
+        std::fs::write(&image, &data).unwrap();
+        std::fs::write(&device, &corrupted).unwrap();
+
+        let stats = Arc::new(VerifyStats::default());
+        let result = verify_integrity(
+            &image, &device.to_string_lossy(), Arc::new(Watched::new(0.0)), Arc::new(Watched::new(String::new())),
+            stats.clone(), data.len() as u64, None, HashAlgorithm::Xxh3, None,
+        );
+        let _ = std::fs::remove_file(&image);
+        let _ = std::fs::remove_file(&device);
+
+        assert!(result.is_err());
+        assert!(stats.device_bytes.load(Ordering::Relaxed) > 0);
+        assert_eq!(*stats.mismatches.lock().unwrap(), vec![Mismatch { offset: 5 * 1024 * 1024 + 100, len: 10 }]);
+    }
+
+    #[test]
+    fn test_sampled_verify_always_checks_metadata() {
+        let dir = std::env::temp_dir();
+        let image = dir.join(format!("fluxflasher-sampled-{}.img", std::process::id()));
+        let device = dir.join(format!("fluxflasher-sampled-{}.dev", std::process::id()));
+        let data: Vec<u8> = (0..6 * VERIFY_CHUNK_SIZE as u32 + 77).map(|i| (i % 239) as u8).collect();
+        let mut corrupted = data.clone();
+        corrupted[40] ^= 0xff;
+        std::fs::write(&image, &data).unwrap();
+        std::fs::write(&device, &corrupted).unwrap();
+
+        let run = |samples| {
+            let stats = Arc::new(VerifyStats::default());
+            let result = verify_sampled(
+                &image, &device.to_string_lossy(), Arc::new(Watched::new(0.0)), Arc::new(Watched::new(String::new())),
+                stats.clone(), data.len() as u64, None, HashAlgorithm::Xxh3, None, samples,
+            );
+            let sampled = stats.confidence.lock().unwrap().is_some();
+            (result.ok(), sampled)
+        };
+        // No random samples at all: the partition table area is still read
+        let broken = run(0);
+        std::fs::write(&device, &data).unwrap();
+        let (everything, _) = run(100);
+        let _ = std::fs::remove_file(&image);
+        let _ = std::fs::remove_file(&device);
+
+        assert_eq!(broken, (None, false));
+        assert_eq!(everything, Some(1.0));
+
+        let picked = pick_random(1000, 50, 7);
+        assert_eq!(picked.len(), 50);
+        assert!(picked.windows(2).all(|w| w[0] < w[1]) && picked[49] < 1000);
+        assert_eq!(sample_confidence(1000, 0), 0.0);
+        assert!(sample_confidence(1000, 459) > 0.99 && sample_confidence(1000, 200) < 0.9);
+    }
+}
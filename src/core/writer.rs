@@ -0,0 +1,117 @@
+use anyhow::{Context, Result};
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+
+use super::buffer::AlignedBuffer;
+use super::delta::DELTA_CHUNK_SIZE;
+use super::options::{FlashOptions, IoBackend};
+use super::pipeline::{BlockWriter, Chunk, DEFAULT_CHUNK_SIZE, DEFAULT_RING_DEPTH};
+use super::sparse::{SparseWriter, SPARSE_CHUNK_SIZE};
+use super::uring::UringWriter;
+
+/// Writes each chunk synchronously with pwrite
+pub struct BlockingWriter<'a> {
+    device: &'a File,
+}
+
+impl<'a> BlockingWriter<'a> {
+    pub fn new(device: &'a File) -> Self {
+        BlockingWriter { device }
+    }
+}
+
+impl BlockWriter for BlockingWriter<'_> {
+    fn submit(&mut self, chunk: Chunk, done: &mut Vec<Chunk>) -> Result<()> {
+        self.device
+            .write_all_at(chunk.buf.as_slice(), chunk.offset)
+            .with_context(|| format!("Failed to write to device at offset {}", chunk.offset))?;
+        done.push(chunk);
+        Ok(())
+    }
+
+    fn flush(&mut self, _done: &mut Vec<Chunk>) -> Result<()> {
+        Ok(())
+    }
+}
+
+/// Pick the writer for `options`, falling back to blocking writes when
+/// io_uring is unavailable (old kernel, seccomp, memlock limit), and wrap it
+/// for zero-skipping if trimming was requested.
+///
+/// Returns the writer and a short description for status messages.
+pub fn open_writer<'a>(
+    device: &'a File,
+    buffers: &[AlignedBuffer],
+    options: &FlashOptions,
+) -> Result<(Box<dyn BlockWriter + 'a>, String)> {
+    let (writer, desc) = open_backend(device, buffers, options)?;
+    if options.trim {
+        // Zero chunks are held until their range is cleared; leave the
+        // reader a buffer beyond the ones the backend keeps in flight
+        let chunk_size = buffers.first().map_or(SPARSE_CHUNK_SIZE, AlignedBuffer::capacity);
+        let max_held = buffers.len().saturating_sub(inflight_for(options, chunk_size) + 1);
+        Ok((Box::new(SparseWriter::new(writer, device, max_held)), format!("{}, skipping zeros", desc)))
+    } else {
+        Ok((writer, desc))
+    }
+}
+
+fn open_backend<'a>(
+    device: &'a File,
+    buffers: &[AlignedBuffer],
+    options: &FlashOptions,
+) -> Result<(Box<dyn BlockWriter + 'a>, String)> {
+    match options.backend {
+        IoBackend::Blocking => Ok((Box::new(BlockingWriter::new(device)), "blocking".to_string())),
+        IoBackend::IoUring | IoBackend::Auto => {
+            match UringWriter::new(device, buffers, options.queue_depth, options.max_inflight_bytes) {
+                Ok(writer) => {
+                    let desc = format!("io_uring, QD {}", options.queue_depth);
+                    Ok((Box::new(writer), desc))
+                }
+                Err(e) => {
+                    let desc = format!("blocking, io_uring unavailable: {}", e);
+                    Ok((Box::new(BlockingWriter::new(device)), desc))
+                }
+            }
+        }
+    }
+}
+
+/// Chunk size for an operation: smaller chunks when zero-skipping or
+/// comparing against the device, so that zero runs and unchanged ranges are
+/// found at a finer granularity. Otherwise the tuned size, if there is one.
+pub fn chunk_size_for(options: &FlashOptions) -> usize {
+    if options.delta {
+        DELTA_CHUNK_SIZE
+    } else if options.trim {
+        SPARSE_CHUNK_SIZE
+    } else if options.chunk_size > 0 {
+        options.chunk_size
+    } else {
+        DEFAULT_CHUNK_SIZE
+    }
+}
+
+/// Number of ring buffers needed to keep `options.queue_depth` writes in
+/// flight while the reader fills the next ones. Never buffers less than the
+/// default ring does, whatever the chunk size.
+pub fn ring_depth_for(options: &FlashOptions, chunk_size: usize) -> usize {
+    let default_bytes = DEFAULT_CHUNK_SIZE * DEFAULT_RING_DEPTH;
+    let base_depth = (default_bytes / chunk_size).max(DEFAULT_RING_DEPTH);
+    match options.backend {
+        IoBackend::Blocking => base_depth,
+        IoBackend::IoUring | IoBackend::Auto => base_depth.max(inflight_for(options, chunk_size) + 2),
+    }
+}
+
+/// Most chunks the backend for `options` keeps in flight at once
+fn inflight_for(options: &FlashOptions, chunk_size: usize) -> usize {
+    match options.backend {
+        IoBackend::Blocking => 0,
+        IoBackend::IoUring | IoBackend::Auto => {
+            let by_bytes = (options.max_inflight_bytes / chunk_size as u64).max(1) as usize;
+            (options.queue_depth as usize).min(by_bytes)
+        }
+    }
+}
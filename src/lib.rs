@@ -1,8 +1,8 @@
 use std::ffi::{CStr, CString};
 use std::os::raw::{c_char, c_int, c_float, c_void};
 use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::sync::{Arc, Mutex};
-use std::thread;
 use std::ptr;
 
 mod core;
@@ -30,17 +30,360 @@ pub struct CDeviceList {
 
 // Operation handle for async operations (opaque pointer)
 pub struct CFlashOperation {
-    progress: Arc<Mutex<f32>>,
-    status: Arc<Mutex<String>>,
-    bytes_written: Arc<Mutex<u64>>,
-    verify_progress: Arc<Mutex<f32>>,
+    progress: Arc<Watched<f32>>,
+    status: Arc<Watched<String>>,
+    bytes_written: Arc<Watched<u64>>,
+    bytes_skipped: Arc<Watched<u64>>,
+    bytes_durable: Arc<Watched<u64>>,
+    bytes_downloaded: Arc<AtomicU64>,
+    verify_progress: Arc<Watched<f32>>,
+    verify_stats: Arc<verify::VerifyStats>,
+    is_running: Arc<Watched<bool>>,
+    error: Arc<Watched<Option<String>>>,
+    io_profile: Arc<Mutex<Option<DeviceProfile>>>,
+    events: Arc<Events>,
+    /// Snapshots of every operation sharing `control` (the devices of a
+    /// multi-device flash), which show its pause state
+    group: Vec<Arc<Events>>,
+    control: Arc<Control>,
+    metrics: Arc<Metrics>,
+}
+
+impl CFlashOperation {
+    fn new(control: Arc<Control>) -> Self {
+        let metrics = Arc::new(Metrics::default());
+        let mut initial = Snapshot { running: true, ..Snapshot::default() };
+        initial.set_status("Initializing...");
+        // What the workers write tells `events`, which publishes it
+        let events = Arc::new(Events::new(&initial));
+        let operation = CFlashOperation {
+            progress: Arc::new(Watched::new(0.0).notifying(&events)),
+            status: Arc::new(Watched::new("Initializing...".to_string()).notifying(&events)),
+            bytes_written: Arc::new(Watched::new(0).notifying(&events)),
+            bytes_skipped: Arc::new(Watched::new(0).notifying(&events)),
+            bytes_durable: Arc::new(Watched::new(0).notifying(&events)),
+            bytes_downloaded: Arc::new(AtomicU64::new(0)),
+            verify_progress: Arc::new(Watched::new(0.0).notifying(&events)),
+            verify_stats: Arc::new(verify::VerifyStats::new(control.clone(), metrics.clone())),
+            is_running: Arc::new(Watched::new(true).notifying(&events)),
+            error: Arc::new(Watched::new(None).notifying(&events)),
+            io_profile: Arc::new(Mutex::new(None)),
+            group: vec![events.clone()],
+            events,
+            control,
+            metrics,
+        };
+        operation.events.sample_with(operation.sampler());
+        operation
+    }
+
+    /// What a flash of this operation reports into
+    fn flash_context(&self) -> FlashContext {
+        FlashContext {
+            progress: self.progress.clone(),
+            status: self.status.clone(),
+            bytes_written: self.bytes_written.clone(),
+            bytes_skipped: self.bytes_skipped.clone(),
+            bytes_durable: self.bytes_durable.clone(),
+            bytes_downloaded: self.bytes_downloaded.clone(),
+            io_profile: self.io_profile.clone(),
+            control: self.control.clone(),
+            metrics: self.metrics.clone(),
+        }
+    }
+
+    /// Reads the state the worker updates, for publishing snapshots
+    fn sampler(&self) -> snapshot::Sampler {
+        let progress = self.progress.clone();
+        let status = self.status.clone();
+        let bytes_written = self.bytes_written.clone();
+        let bytes_skipped = self.bytes_skipped.clone();
+        let bytes_durable = self.bytes_durable.clone();
+        let bytes_downloaded = self.bytes_downloaded.clone();
+        let verify_progress = self.verify_progress.clone();
+        let verify_stats = self.verify_stats.clone();
+        let is_running = self.is_running.clone();
+        let error = self.error.clone();
+        let control = self.control.clone();
+        Box::new(move || {
+            let mut snapshot = Snapshot {
+                progress: *progress.lock().unwrap(),
+                verify_progress: *verify_progress.lock().unwrap(),
+                bytes_written: *bytes_written.lock().unwrap(),
+                bytes_skipped: *bytes_skipped.lock().unwrap(),
+                bytes_durable: *bytes_durable.lock().unwrap(),
+                bytes_downloaded: bytes_downloaded.load(Ordering::Relaxed),
+                verify_speed: verify_stats.read_speed(),
+                running: *is_running.lock().unwrap(),
+                paused: control.is_paused(),
+                failed: error.lock().unwrap().is_some(),
+                ..Snapshot::default()
+            };
+            snapshot.set_status(&status.lock().unwrap());
+            snapshot
+        })
+    }
+}
+
+/// Best effort: write the metrics files `options` asks for, once the
+/// operation on `device_path` has ended
+fn export_metrics(metrics: &Metrics, device_path: &str, image_path: &PathBuf, success: bool, options: &FlashOptions) {
+    if options.metrics_textfile_dir.is_none() && options.metrics_report_dir.is_none() {
+        return;
+    }
+    let run = RunInfo {
+        device: device_path.to_string(),
+        model: device_identity(device_path).map(|id| id.model).unwrap_or_default(),
+        image: image_path.display().to_string(),
+        success,
+    };
+    let _ = metrics::export(metrics, &run, options.metrics_textfile_dir.as_deref(), options.metrics_report_dir.as_deref());
+}
+
+// Handle for a multi-device flash (opaque pointer). Each device is tracked
+// by its own CFlashOperation, owned by this handle; they share one control.
+pub struct CMultiFlashOperation {
+    devices: Vec<CFlashOperation>,
     is_running: Arc<Mutex<bool>>,
-    error: Arc<Mutex<Option<String>>>,
+    control: Arc<Control>,
+}
+
+/// Let the core choose the I/O backend (io_uring if available)
+pub const FLUX_IO_BACKEND_AUTO: u32 = 0;
+/// One synchronous write per chunk
+pub const FLUX_IO_BACKEND_BLOCKING: u32 = 1;
+/// io_uring with registered buffers (falls back to blocking if unavailable)
+pub const FLUX_IO_BACKEND_IO_URING: u32 = 2;
+
+/// SHA-256 (with SHA-NI / ARMv8 crypto instructions when available)
+pub const FLUX_HASH_SHA256: u32 = 0;
+/// BLAKE3
+pub const FLUX_HASH_BLAKE3: u32 = 1;
+/// XXH3-128, a non-cryptographic integrity check
+pub const FLUX_HASH_XXH3: u32 = 2;
+
+/// Keep the I/O priority the process already has
+pub const FLUX_IO_CLASS_DEFAULT: u32 = 0;
+/// Real-time I/O class (needs CAP_SYS_ADMIN)
+pub const FLUX_IO_CLASS_REALTIME: u32 = 1;
+/// Normal I/O class, levels 0 (highest) to 7
+pub const FLUX_IO_CLASS_BEST_EFFORT: u32 = 2;
+/// Only use the disk when nothing else does
+pub const FLUX_IO_CLASS_IDLE: u32 = 3;
+
+fn io_class_from_c(class: u32) -> IoClass {
+    match class {
+        FLUX_IO_CLASS_REALTIME => IoClass::RealTime,
+        FLUX_IO_CLASS_BEST_EFFORT => IoClass::BestEffort,
+        FLUX_IO_CLASS_IDLE => IoClass::Idle,
+        _ => IoClass::Default,
+    }
+}
+
+fn hash_from_c(algorithm: u32) -> Option<HashAlgorithm> {
+    match algorithm {
+        FLUX_HASH_SHA256 => Some(HashAlgorithm::Sha256),
+        FLUX_HASH_BLAKE3 => Some(HashAlgorithm::Blake3),
+        FLUX_HASH_XXH3 => Some(HashAlgorithm::Xxh3),
+        _ => None,
+    }
+}
+
+fn hash_to_c(algorithm: HashAlgorithm) -> u32 {
+    match algorithm {
+        HashAlgorithm::Sha256 => FLUX_HASH_SHA256,
+        HashAlgorithm::Blake3 => FLUX_HASH_BLAKE3,
+        HashAlgorithm::Xxh3 => FLUX_HASH_XXH3,
+    }
+}
+
+// FFI-safe flash options (fill with flux_default_options first)
+#[repr(C)]
+pub struct CFlashOptions {
+    pub io_backend: u32,
+    pub queue_depth: u32,
+    pub max_inflight_bytes: u64,
+    /// Skip all-zero chunks and discard them on the device instead
+    pub trim_unallocated: bool,
+    /// Only write partition tables, filesystem metadata and allocated blocks
+    pub used_blocks_only: bool,
+    /// Only rewrite chunks that differ from what is already on the device
+    pub delta_reflash: bool,
+    /// Calibrate chunk size and queue depth (or reuse the cached profile for
+    /// the device model) before writing
+    pub autotune: bool,
+    /// Push data to the device in bounded windows while writing, so progress
+    /// tracks what is on the media and there is no long final sync
+    pub bounded_writeback: bool,
+    /// Copy raw images inside the kernel (copy_file_range/splice) when
+    /// neither trim nor delta mode needs to see the data
+    pub zero_copy: bool,
+    /// Keep decompressed copies of compressed images in the local image
+    /// store and flash from them next time
+    pub image_store: bool,
+    /// Digest used for verification (FLUX_HASH_*)
+    pub verify_hash: u32,
+    /// Fast verification: read back this many random chunks plus the
+    /// partition tables, boot sectors and superblocks; 0 reads back everything
+    pub verify_samples: u32,
+    /// Rewrite only the ranges that fail verification and read them back,
+    /// a few times, instead of failing the flash
+    pub repair_mismatches: bool,
+    /// I/O scheduling class for the operation's threads (FLUX_IO_CLASS_*)
+    pub io_priority_class: u32,
+    /// Level within the class, 0 (highest) to 7
+    pub io_priority_level: u32,
+    /// Bandwidth cap in bytes per second, 0 for none (see flux_set_rate_limit)
+    pub rate_limit: u64,
+    /// Directory to write Prometheus textfile metrics to when the operation
+    /// ends (one fluxflasher_<device>.prom per device), or null
+    pub metrics_textfile_dir: *const c_char,
+    /// Directory to write a JSON metrics report to when the operation ends,
+    /// or null
+    pub metrics_report_dir: *const c_char,
+}
+
+// FFI-safe entry of the local image store
+#[repr(C)]
+pub struct CCachedImage {
+    /// File the image was last flashed from (it may have been removed since)
+    pub source_path: *mut c_char,
+    /// The stored decompressed copy, itself a raw image
+    pub stored_path: *mut c_char,
+    pub name: *mut c_char,
+    pub image_size: u64,
+    /// Seconds since the epoch
+    pub last_used: u64,
+}
+
+// FFI-safe list of stored images
+#[repr(C)]
+pub struct CCachedImageList {
+    pub images: *mut CCachedImage,
+    pub count: usize,
+}
+
+// FFI-safe byte range of a device
+#[repr(C)]
+pub struct CByteRange {
+    pub offset: u64,
+    pub len: u64,
+}
+
+// FFI-safe time one stage of an operation spent working and waiting
+#[repr(C)]
+pub struct CStageTimes {
+    pub busy_ns: u64,
+    pub idle_ns: u64,
+}
+
+// FFI-safe latency distribution, in microseconds
+#[repr(C)]
+pub struct CLatencySummary {
+    pub count: u64,
+    pub mean_us: u64,
+    pub p50_us: u64,
+    pub p90_us: u64,
+    pub p99_us: u64,
+    pub p999_us: u64,
+    pub max_us: u64,
+}
+
+// FFI-safe metrics of an operation so far, filled by flux_get_metrics
+#[repr(C)]
+pub struct CFlashMetrics {
+    pub elapsed_ns: u64,
+    /// Reading (and decompressing or downloading) the image
+    pub read: CStageTimes,
+    /// Writing to the device
+    pub write: CStageTimes,
+    /// Hashing the image for verification, summed over the hash threads
+    pub hash: CStageTimes,
+    /// Reading the device back, summed over the read streams
+    pub verify: CStageTimes,
+    /// Buffers in the ring, and how many were filled and waiting for the
+    /// writer on average and at most
+    pub queue_capacity: u64,
+    pub queue_mean: f64,
+    pub queue_max: u64,
+    /// From submitting a chunk to the device until it completed
+    pub write_latency: CLatencySummary,
+    /// Reading one chunk back from the device
+    pub verify_latency: CLatencySummary,
+    pub bytes_written: u64,
+    /// Highest and latest write throughput over a whole second, in bytes
+    /// per second
+    pub throughput_peak: u64,
+    pub throughput_last: u64,
+}
+
+fn stage_to_c(times: metrics::StageTimes) -> CStageTimes {
+    CStageTimes { busy_ns: times.busy_ns, idle_ns: times.idle_ns }
+}
+
+fn latency_to_c(summary: metrics::LatencySummary) -> CLatencySummary {
+    CLatencySummary {
+        count: summary.count,
+        mean_us: summary.mean_us,
+        p50_us: summary.p50_us,
+        p90_us: summary.p90_us,
+        p99_us: summary.p99_us,
+        p999_us: summary.p999_us,
+        max_us: summary.max_us,
+    }
+}
+
+// FFI-safe write parameters for a device
+#[repr(C)]
+pub struct CDeviceProfile {
+    pub chunk_size: u64,
+    pub queue_depth: u32,
+    pub alignment: u64,
+    /// Measured write throughput in bytes per second (0 if not measured)
+    pub throughput: u64,
+    /// Taken from the profile cache rather than calibrated this time
+    pub cached: bool,
+}
+
+fn profile_to_c(profile: &DeviceProfile) -> CDeviceProfile {
+    CDeviceProfile {
+        chunk_size: profile.chunk_size as u64,
+        queue_depth: profile.queue_depth,
+        alignment: profile.alignment as u64,
+        throughput: profile.throughput,
+        cached: profile.cached,
+    }
 }
 
-// Progress callback type
+/// Called with the operation's progress when its snapshot changes (see
+/// flux_set_progress_callback)
 pub type ProgressCallback = extern "C" fn(progress: c_float, user_data: *mut c_void);
 
+/// Bytes of status text in a CFlashSnapshot, including the terminating NUL
+pub const FLUX_STATUS_CAPACITY: usize = snapshot::STATUS_CAPACITY;
+
+// FFI-safe view of an operation at one moment, filled by flux_get_snapshot
+#[repr(C)]
+pub struct CFlashSnapshot {
+    /// Increases each time the snapshot changes
+    pub sequence: u64,
+    pub progress: c_float,
+    pub verify_progress: c_float,
+    pub bytes_written: u64,
+    pub bytes_skipped: u64,
+    pub bytes_durable: u64,
+    pub bytes_downloaded: u64,
+    /// Device read speed while verifying, in bytes per second
+    pub verify_speed: u64,
+    pub is_running: bool,
+    /// Held by flux_pause
+    pub is_paused: bool,
+    /// An error message is waiting in flux_get_error
+    pub has_error: bool,
+    /// NUL-terminated status message, cut short if it doesn't fit
+    pub status: [c_char; FLUX_STATUS_CAPACITY],
+}
+
 /// Initialize the library (currently no-op, but useful for future initialization)
 #[no_mangle]
 pub extern "C" fn flux_init() -> c_int {
@@ -132,11 +475,100 @@ pub extern "C" fn flux_free_device_list(list: *mut CDeviceList) {
     }
 }
 
-/// Start a flash operation (async)
+/// Fill `options` with the default flash options
+#[no_mangle]
+pub extern "C" fn flux_default_options(options: *mut CFlashOptions) {
+    if options.is_null() {
+        return;
+    }
+
+    let defaults = FlashOptions::default();
+    unsafe {
+        *options = CFlashOptions {
+            io_backend: FLUX_IO_BACKEND_AUTO,
+            queue_depth: defaults.queue_depth,
+            max_inflight_bytes: defaults.max_inflight_bytes,
+            trim_unallocated: defaults.trim,
+            used_blocks_only: defaults.used_blocks_only,
+            delta_reflash: defaults.delta,
+            autotune: defaults.autotune,
+            bounded_writeback: defaults.bounded_writeback,
+            zero_copy: defaults.zero_copy,
+            image_store: defaults.image_store,
+            verify_hash: hash_to_c(defaults.verify_hash),
+            verify_samples: defaults.verify_samples as u32,
+            repair_mismatches: defaults.repair,
+            io_priority_class: defaults.io_priority.class as u32,
+            io_priority_level: defaults.io_priority.level as u32,
+            rate_limit: defaults.rate_limit,
+            metrics_textfile_dir: ptr::null(),
+            metrics_report_dir: ptr::null(),
+        };
+    }
+}
+
+fn options_from_c(options: &CFlashOptions) -> FlashOptions {
+    let defaults = FlashOptions::default();
+    FlashOptions {
+        backend: match options.io_backend {
+            FLUX_IO_BACKEND_BLOCKING => IoBackend::Blocking,
+            FLUX_IO_BACKEND_IO_URING => IoBackend::IoUring,
+            _ => IoBackend::Auto,
+        },
+        queue_depth: options.queue_depth.clamp(1, options::MAX_QUEUE_DEPTH),
+        max_inflight_bytes: if options.max_inflight_bytes > 0 {
+            options.max_inflight_bytes
+        } else {
+            defaults.max_inflight_bytes
+        },
+        trim: options.trim_unallocated,
+        used_blocks_only: options.used_blocks_only,
+        delta: options.delta_reflash,
+        resume: false,
+        autotune: options.autotune,
+        chunk_size: 0,
+        bounded_writeback: options.bounded_writeback,
+        zero_copy: options.zero_copy,
+        image_store: options.image_store,
+        verify_hash: hash_from_c(options.verify_hash).unwrap_or(defaults.verify_hash),
+        verify_samples: options.verify_samples as usize,
+        repair: options.repair_mismatches,
+        hash_source: true,
+        io_priority: IoPriority {
+            class: io_class_from_c(options.io_priority_class),
+            level: options.io_priority_level.min(7) as u8,
+        },
+        rate_limit: options.rate_limit,
+        metrics_textfile_dir: path_from_c(options.metrics_textfile_dir),
+        metrics_report_dir: path_from_c(options.metrics_report_dir),
+    }
+}
+
+fn path_from_c(path: *const c_char) -> Option<PathBuf> {
+    if path.is_null() {
+        return None;
+    }
+    let path = unsafe { CStr::from_ptr(path) }.to_string_lossy().into_owned();
+    (!path.is_empty()).then(|| PathBuf::from(path))
+}
+
+/// Start a flash operation (async). `image_path` may also be an http(s)
+/// URL, which is streamed straight to the device.
 #[no_mangle]
 pub extern "C" fn flux_start_flash(
     image_path: *const c_char,
     device_path: *const c_char,
+) -> *mut CFlashOperation {
+    flux_start_flash_with_options(image_path, device_path, ptr::null())
+}
+
+/// Start a flash operation with explicit options (async). `options` may be
+/// null, in which case the defaults are used.
+#[no_mangle]
+pub extern "C" fn flux_start_flash_with_options(
+    image_path: *const c_char,
+    device_path: *const c_char,
+    options: *const CFlashOptions,
 ) -> *mut CFlashOperation {
     if image_path.is_null() || device_path.is_null() {
         return ptr::null_mut();
@@ -144,69 +576,522 @@ pub extern "C" fn flux_start_flash(
     
     let image_path = unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned();
     let device_path = unsafe { CStr::from_ptr(device_path) }.to_string_lossy().into_owned();
-    
-    let operation = CFlashOperation {
-        progress: Arc::new(Mutex::new(0.0)),
-        status: Arc::new(Mutex::new("Initializing...".to_string())),
-        bytes_written: Arc::new(Mutex::new(0)),
-        verify_progress: Arc::new(Mutex::new(0.0)),
-        is_running: Arc::new(Mutex::new(true)),
-        error: Arc::new(Mutex::new(None)),
+    let options = if options.is_null() {
+        FlashOptions::default()
+    } else {
+        options_from_c(unsafe { &*options })
+    };
+    start_flash(image_path, device_path, options)
+}
+
+/// Continue an interrupted flash of the same image to the same device from
+/// its last checkpoint (async). The already-written part is spot-checked
+/// first; if it no longer matches, the flash starts over from the beginning.
+/// `options` may be null, in which case the defaults are used.
+#[no_mangle]
+pub extern "C" fn flux_resume_flash(
+    image_path: *const c_char,
+    device_path: *const c_char,
+    options: *const CFlashOptions,
+) -> *mut CFlashOperation {
+    if image_path.is_null() || device_path.is_null() {
+        return ptr::null_mut();
+    }
+
+    let image_path = unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned();
+    let device_path = unsafe { CStr::from_ptr(device_path) }.to_string_lossy().into_owned();
+    let mut options = if options.is_null() {
+        FlashOptions::default()
+    } else {
+        options_from_c(unsafe { &*options })
     };
+    options.resume = true;
+    start_flash(image_path, device_path, options)
+}
+
+/// Bytes of the image already committed to the device by an interrupted
+/// flash, or 0 if there is nothing to resume
+#[no_mangle]
+pub extern "C" fn flux_get_resume_offset(
+    image_path: *const c_char,
+    device_path: *const c_char,
+) -> u64 {
+    if image_path.is_null() || device_path.is_null() {
+        return 0;
+    }
+
+    let image_path = PathBuf::from(unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned());
+    let device_path = unsafe { CStr::from_ptr(device_path) }.to_string_lossy().into_owned();
+    // The flash may have been reading the stored copy of the image
+    let stored = Store::open().resolve(&image_path);
+    resume_offset(&image_path, &device_path).max(resume_offset(&stored, &device_path))
+}
+
+/// Run the flash and verify phases on a background thread
+fn start_flash(image_path: String, device_path: String, mut options: FlashOptions) -> *mut CFlashOperation {
+    let operation = CFlashOperation::new(Arc::new(Control::new(options.rate_limit)));
     
+    let context = operation.flash_context();
     let progress = operation.progress.clone();
     let status = operation.status.clone();
-    let bytes_written = operation.bytes_written.clone();
     let verify_progress = operation.verify_progress.clone();
+    let verify_stats = operation.verify_stats.clone();
     let is_running = operation.is_running.clone();
     let error = operation.error.clone();
+    let control = operation.control.clone();
+    let metrics = operation.metrics.clone();
     
-    thread::spawn(move || {
+    // Sticks on one USB bus share its bandwidth: the scheduler holds this
+    // flash back while the bus is full, and starts it on its thread pool
+    let waiting_status = status.clone();
+    let job = Job {
+        device_path: device_path.clone(),
+        size: std::fs::metadata(&image_path).map_or(u64::MAX, |meta| meta.len()),
+        queue_depth: options.queue_depth,
+        control: control.clone(),
+        on_wait: Box::new(move |ahead| {
+            *waiting_status.lock().unwrap() = match ahead {
+                0 => "Waiting for USB bandwidth...".to_string(),
+                n => format!("Waiting for USB bandwidth ({} ahead on this bus)...", n),
+            };
+        }),
+    };
+    Scheduler::global().submit(job, move |_slot| {
+        if control.is_cancelled() {
+            let err_msg = "Flash cancelled".to_string();
+            *status.lock().unwrap() = err_msg.clone();
+            *error.lock().unwrap() = Some(err_msg);
+            *is_running.lock().unwrap() = false;
+            return;
+        }
+        // Best effort: a real-time class is refused without CAP_SYS_ADMIN
+        let _ = set_io_priority(options.io_priority);
         let image_pb = PathBuf::from(image_path);
         
+        // A stored decompressed copy needs neither decompressing nor hashing
+        let store = Store::open();
+        let stored = if options.image_store { store.lookup(&image_pb) } else { None };
+        let source_pb = stored.as_ref().map_or_else(|| image_pb.clone(), |entry| entry.path.clone());
+        
         // Get mount points
-        let mount_points = match list_usb_devices() {
-            Ok(devices) => {
-                devices.iter()
-                    .find(|d| d.path == device_path)
-                    .map(|d| d.mount_points.clone())
-                    .unwrap_or_default()
+        let mount_points = mount_points_of(&list_usb_devices().unwrap_or_default(), &device_path);
+        
+        // A bmap next to the image says exactly which ranges hold data
+        let bmap = match find_bmap(&image_pb).map(|path| load_bmap(&path)) {
+            Some(Ok(bmap)) => Some(bmap),
+            Some(Err(e)) => {
+                let err_msg = format!("Flash Error: {:#}", e);
+                *status.lock().unwrap() = err_msg.clone();
+                *error.lock().unwrap() = Some(err_msg);
+                *is_running.lock().unwrap() = false;
+                return;
             }
-            Err(_) => Vec::new(),
+            None => None,
         };
         
+        // Otherwise work out which parts of the image hold data. Only raw
+        // images can be read at random offsets; compressed ones are written in full.
+        let is_raw = probe_image(&source_pb).map(|info| info.is_raw()).unwrap_or(false);
+        let extents = if let Some(bmap) = &bmap {
+            Some(bmap.extent_map())
+        } else if options.used_blocks_only && is_raw {
+            *status.lock().unwrap() = "Analyzing image...".to_string();
+            match map_used_blocks(&source_pb) {
+                Ok(map) => Some(map),
+                Err(e) => {
+                    let err_msg = format!("Flash Error: {}", e);
+                    *status.lock().unwrap() = err_msg.clone();
+                    *error.lock().unwrap() = Some(err_msg);
+                    *is_running.lock().unwrap() = false;
+                    return;
+                }
+            }
+        } else {
+            None
+        };
+        
+        // Hashes of the whole image from an earlier flash, or a checksum
+        // published with a raw image, save hashing it again while writing.
+        // A published checksum can't say which ranges to repair.
+        let hash_cache = HashCache::open();
+        let cached = hash_cache.lookup(&source_pb, options.verify_hash).filter(|_| extents.is_none());
+        let published = published_sha256(&image_pb)
+            .filter(|_| is_raw && source_pb == image_pb && extents.is_none() && !options.repair);
+        options.hash_source = cached.is_none() && published.is_none();
+        
         // Flash phase
-        match flash_image(&image_pb, &device_path, progress.clone(), status.clone(), bytes_written.clone(), &mount_points) {
-            Ok(_) => {
+        match flash_image(&source_pb, &device_path, &mount_points, &options, extents.as_ref(), &context) {
+            Ok(flashed) => {
+                let image_size = flashed.image_size;
                 *status.lock().unwrap() = "Starting verification...".to_string();
+                // Best effort: without the cache the next flash hashes again
+                if let Some(digests) = &flashed.digest {
+                    let _ = hash_cache.save(&source_pb, image_size, digests);
+                }
+                let published = published.filter(|_| {
+                    std::fs::metadata(&image_pb).map(|meta| meta.len() == image_size).unwrap_or(false)
+                });
                 
-                // Verification phase
-                match verify_integrity(&image_pb, &device_path, verify_progress.clone(), status.clone()) {
+                // A first flash of a compressed image has just stored it
+                let stored = match stored {
+                    None if options.image_store => store.lookup(&image_pb),
+                    stored => stored,
+                };
+                let manifest = stored.as_ref()
+                    .filter(|entry| extents.is_none() && entry.image_size == image_size)
+                    .and_then(|entry| store.manifest(entry));
+                
+                // Verification phase: bmap checksums, stored manifests and
+                // published checksums need only the device to be read. A
+                // repair needs every failing range, not just the first.
+                verify_stats.exhaustive.store(options.repair, Ordering::Relaxed);
+                let verified = match (&bmap, &manifest, &published) {
+                    _ if options.verify_samples > 0 => {
+                        let expected = flashed.digest.as_ref().or(cached.as_ref());
+                        verify_sampled(&source_pb, &device_path, verify_progress.clone(), status.clone(), verify_stats.clone(), image_size, extents.as_ref(), options.verify_hash, expected, options.verify_samples)
+                            .map(|_| ())
+                    }
+                    (Some(bmap), _, _) if bmap.has_checksums() => {
+                        verify_bmap(&device_path, verify_progress.clone(), status.clone(), verify_stats.clone(), bmap)
+                    }
+                    (_, Some(hashes), _) => {
+                        verify_manifest(&device_path, verify_progress.clone(), status.clone(), verify_stats.clone(), image_size, store::STORE_CHUNK_SIZE, hashes)
+                    }
+                    (_, _, Some((digest, _))) => {
+                        verify_sha256(&device_path, verify_progress.clone(), status.clone(), verify_stats.clone(), image_size, digest)
+                    }
+                    _ => {
+                        let expected = flashed.digest.as_ref().or(cached.as_ref());
+                        verify_integrity(&source_pb, &device_path, verify_progress.clone(), status.clone(), verify_stats.clone(), image_size, extents.as_ref(), options.verify_hash, expected)
+                            .map(|digests| {
+                                if expected.is_none() {
+                                    let _ = hash_cache.save(&source_pb, image_size, &digests);
+                                }
+                            })
+                    }
+                };
+                let verified = match verified {
+                    Err(_) if options.repair && !verify_stats.mismatches.lock().unwrap().is_empty() => {
+                        repair_device(&source_pb, &device_path, verify_progress.clone(), status.clone(), &verify_stats, image_size)
+                    }
+                    verified => verified,
+                };
+                match verified {
                     Ok(_) => {
                         *status.lock().unwrap() = "All operations completed successfully!".to_string();
                         *progress.lock().unwrap() = 1.0;
                         *verify_progress.lock().unwrap() = 1.0;
                     }
                     Err(e) => {
-                        let err_msg = format!("Verification Error: {}", e);
+                        // The device doesn't hold what the delta manifest says
+                        if options.delta {
+                            if let Ok(identity) = device_identity(&device_path) {
+                                delta::forget_manifest(&identity);
+                            }
+                        }
+                        let err_msg = if control.is_cancelled() {
+                            "Verification cancelled".to_string()
+                        } else {
+                            format!("Verification Error: {}", e)
+                        };
                         *status.lock().unwrap() = err_msg.clone();
                         *error.lock().unwrap() = Some(err_msg);
                     }
                 }
             }
             Err(e) => {
-                let err_msg = format!("Flash Error: {}", e);
+                // The journal is kept, so a cancelled flash can be resumed
+                let err_msg = if control.is_cancelled() {
+                    "Flash cancelled".to_string()
+                } else {
+                    format!("Flash Error: {}", e)
+                };
                 *status.lock().unwrap() = err_msg.clone();
                 *error.lock().unwrap() = Some(err_msg);
             }
         }
         
+        let success = error.lock().unwrap().is_none();
+        export_metrics(&metrics, &device_path, &image_pb, success, &options);
         *is_running.lock().unwrap() = false;
     });
     
     Box::into_raw(Box::new(operation))
 }
 
+/// Start flashing one image to several devices at once (async). The image
+/// is read and hashed once; each device is written and verified
+/// independently, so one failing device doesn't stop the others.
+#[no_mangle]
+pub extern "C" fn flux_start_multi_flash(
+    image_path: *const c_char,
+    device_paths: *const *const c_char,
+    device_count: usize,
+) -> *mut CMultiFlashOperation {
+    flux_start_multi_flash_with_options(image_path, device_paths, device_count, ptr::null())
+}
+
+/// Start a multi-device flash with explicit options (async). `options` may
+/// be null, in which case the defaults are used.
+#[no_mangle]
+pub extern "C" fn flux_start_multi_flash_with_options(
+    image_path: *const c_char,
+    device_paths: *const *const c_char,
+    device_count: usize,
+    options: *const CFlashOptions,
+) -> *mut CMultiFlashOperation {
+    if image_path.is_null() || device_paths.is_null() || device_count == 0 {
+        return ptr::null_mut();
+    }
+
+    let image_path = unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned();
+    let mut paths = Vec::with_capacity(device_count);
+    for i in 0..device_count {
+        let path = unsafe { *device_paths.add(i) };
+        if path.is_null() {
+            return ptr::null_mut();
+        }
+        paths.push(unsafe { CStr::from_ptr(path) }.to_string_lossy().into_owned());
+    }
+    let options = if options.is_null() {
+        FlashOptions::default()
+    } else {
+        options_from_c(unsafe { &*options })
+    };
+
+    let control = Arc::new(Control::new(options.rate_limit));
+    let mut devices: Vec<CFlashOperation> = paths.iter().map(|_| CFlashOperation::new(control.clone())).collect();
+    // They share the control, so pausing one shows on all of them
+    let group: Vec<Arc<Events>> = devices.iter().map(|op| op.events.clone()).collect();
+    for op in &mut devices {
+        op.group = group.clone();
+    }
+    let operation = CMultiFlashOperation {
+        devices,
+        is_running: Arc::new(Mutex::new(true)),
+        control,
+    };
+
+    let usb_devices = list_usb_devices().unwrap_or_default();
+    let targets: Vec<MultiTarget> = paths.iter().zip(&operation.devices).map(|(path, op)| MultiTarget {
+        device_path: path.clone(),
+        mount_points: mount_points_of(&usb_devices, path),
+        progress: op.progress.clone(),
+        status: op.status.clone(),
+        bytes_written: op.bytes_written.clone(),
+        bytes_skipped: op.bytes_skipped.clone(),
+        bytes_durable: op.bytes_durable.clone(),
+        verify_progress: op.verify_progress.clone(),
+        verify_stats: op.verify_stats.clone(),
+        is_running: op.is_running.clone(),
+        error: op.error.clone(),
+        metrics: op.metrics.clone(),
+    }).collect();
+    let is_running = operation.is_running.clone();
+    let control = operation.control.clone();
+
+    // flash_multi places each device in its bandwidth domain itself; they
+    // can't wait for the bus one by one, sharing a source reader
+    Scheduler::global().execute(move || {
+        let _ = set_io_priority(options.io_priority);
+        let image_path = PathBuf::from(image_path);
+        flash_multi(&image_path, &targets, &options, &control);
+        // Every device is done by now; their final snapshots go out from here
+        for target in &targets {
+            let success = target.error.lock().unwrap().is_none();
+            export_metrics(&target.metrics, &target.device_path, &image_path, success, &options);
+            *target.is_running.lock().unwrap() = false;
+        }
+        *is_running.lock().unwrap() = false;
+    });
+
+    Box::into_raw(Box::new(operation))
+}
+
+/// Number of devices in a multi-device flash
+#[no_mangle]
+pub extern "C" fn flux_multi_device_count(operation: *const CMultiFlashOperation) -> usize {
+    if operation.is_null() {
+        return 0;
+    }
+
+    unsafe { (&(*operation).devices).len() }
+}
+
+/// Per-device handle of a multi-device flash, for use with flux_get_progress,
+/// flux_get_status, flux_get_error etc. It is owned by `operation`: do not
+/// free it, and don't use it after flux_free_multi_operation.
+#[no_mangle]
+pub extern "C" fn flux_multi_get_device(
+    operation: *const CMultiFlashOperation,
+    index: usize,
+) -> *const CFlashOperation {
+    if operation.is_null() {
+        return ptr::null();
+    }
+
+    unsafe {
+        match (&(*operation).devices).get(index) {
+            Some(device) => device as *const CFlashOperation,
+            None => ptr::null(),
+        }
+    }
+}
+
+/// Check if any device of a multi-device flash is still being written or verified
+#[no_mangle]
+pub extern "C" fn flux_multi_is_running(operation: *const CMultiFlashOperation) -> bool {
+    if operation.is_null() {
+        return false;
+    }
+
+    unsafe {
+        *(*operation).is_running.lock().unwrap()
+    }
+}
+
+/// Free a multi-device flash handle (and its per-device handles, clearing
+/// their progress callbacks). A flash still running is cancelled.
+#[no_mangle]
+pub extern "C" fn flux_free_multi_operation(operation: *mut CMultiFlashOperation) {
+    if !operation.is_null() {
+        unsafe {
+            (*operation).control.cancel();
+            for device in &(*operation).devices {
+                device.events.listen(None);
+            }
+            let _ = Box::from_raw(operation);
+        }
+    }
+}
+
+fn mount_points_of(devices: &[UsbDevice], device_path: &str) -> Vec<String> {
+    devices.iter()
+        .find(|d| d.path == device_path)
+        .map(|d| d.mount_points.clone())
+        .unwrap_or_default()
+}
+
+fn map_used_blocks(image_path: &PathBuf) -> anyhow::Result<ExtentMap> {
+    let image = std::fs::File::open(image_path)?;
+    let size = image.metadata()?.len();
+    let (map, _description) = map_allocated_extents(&image, size)?;
+    Ok(map)
+}
+
+/// Size of an image once decompressed, in bytes. Returns 0 if the file can't
+/// be read or neither its format, a bmap nor the image store records the
+/// size (e.g. gzip).
+#[no_mangle]
+pub extern "C" fn flux_get_image_size(image_path: *const c_char) -> u64 {
+    if image_path.is_null() {
+        return 0;
+    }
+
+    let image_path = unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned();
+    let image_path = std::path::Path::new(&image_path);
+    match probe_image(image_path) {
+        Ok(info) => info.image_size
+            .or_else(|| find_bmap(image_path).and_then(|p| load_bmap(&p).ok()).map(|b| b.image_size))
+            .or_else(|| Store::open().lookup(image_path).map(|entry| entry.image_size))
+            .unwrap_or(0),
+        Err(_) => 0,
+    }
+}
+
+/// Images in the local image store, most recently used first (free with
+/// flux_free_cached_images)
+#[no_mangle]
+pub extern "C" fn flux_list_cached_images() -> *mut CCachedImageList {
+    let images: Vec<CCachedImage> = Store::open().list().into_iter().map(|entry| {
+        let name = std::path::Path::new(&entry.source).file_name()
+            .map_or_else(|| entry.source.clone(), |n| n.to_string_lossy().into_owned());
+        CCachedImage {
+            source_path: CString::new(entry.source).unwrap_or_default().into_raw(),
+            stored_path: CString::new(entry.path.to_string_lossy().into_owned()).unwrap_or_default().into_raw(),
+            name: CString::new(name).unwrap_or_default().into_raw(),
+            image_size: entry.image_size,
+            last_used: entry.last_used,
+        }
+    }).collect();
+
+    let count = images.len();
+    let mut boxed = images.into_boxed_slice();
+    let ptr = boxed.as_mut_ptr();
+    std::mem::forget(boxed);
+    Box::into_raw(Box::new(CCachedImageList { images: ptr, count }))
+}
+
+/// Free a list returned by flux_list_cached_images
+#[no_mangle]
+pub extern "C" fn flux_free_cached_images(list: *mut CCachedImageList) {
+    if list.is_null() {
+        return;
+    }
+
+    unsafe {
+        let list = Box::from_raw(list);
+        let images = Vec::from_raw_parts(list.images, list.count, list.count);
+        for image in images {
+            let _ = CString::from_raw(image.source_path);
+            let _ = CString::from_raw(image.stored_path);
+            let _ = CString::from_raw(image.name);
+        }
+    }
+}
+
+/// What the device will be verified against without hashing the image, e.g.
+/// "SHA-256 from SHA256SUMS", or null if the image has to be hashed (caller
+/// must free with flux_free_string)
+#[no_mangle]
+pub extern "C" fn flux_describe_expected_hash(image_path: *const c_char) -> *mut c_char {
+    if image_path.is_null() {
+        return ptr::null_mut();
+    }
+
+    let image_path = PathBuf::from(unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned());
+    let source = Store::open().resolve(&image_path);
+    let raw = probe_image(&source).map(|info| info.is_raw()).unwrap_or(false);
+    let description = match published_sha256(&image_path).filter(|_| raw && source == image_path) {
+        Some((_, file)) => format!("SHA-256 from {}", file),
+        None => match HashCache::open().lookup(&source, FlashOptions::default().verify_hash) {
+            Some(digests) => format!("cached {} hashes", digests.algorithm().name()),
+            None => return ptr::null_mut(),
+        },
+    };
+    CString::new(description).unwrap().into_raw()
+}
+
+/// Path of the bmap that will be used for an image, or null if there is
+/// none (caller must free with flux_free_string)
+#[no_mangle]
+pub extern "C" fn flux_find_bmap(image_path: *const c_char) -> *mut c_char {
+    if image_path.is_null() {
+        return ptr::null_mut();
+    }
+
+    let image_path = unsafe { CStr::from_ptr(image_path) }.to_string_lossy().into_owned();
+    match find_bmap(std::path::Path::new(&image_path)) {
+        Some(path) => CString::new(path.to_string_lossy().into_owned()).unwrap().into_raw(),
+        None => ptr::null_mut(),
+    }
+}
+
+/// Bytes a bmap maps (what will actually be written), or 0 if the bmap
+/// can't be read
+#[no_mangle]
+pub extern "C" fn flux_get_bmap_mapped_size(bmap_path: *const c_char) -> u64 {
+    if bmap_path.is_null() {
+        return 0;
+    }
+
+    let bmap_path = unsafe { CStr::from_ptr(bmap_path) }.to_string_lossy().into_owned();
+    match load_bmap(std::path::Path::new(&bmap_path)) {
+        Ok(bmap) => bmap.mapped_bytes(),
+        Err(_) => 0,
+    }
+}
+
 /// Get the current progress of a flash operation (0.0 to 1.0)
 #[no_mangle]
 pub extern "C" fn flux_get_progress(operation: *const CFlashOperation) -> c_float {
@@ -244,7 +1129,7 @@ pub extern "C" fn flux_get_status(operation: *const CFlashOperation) -> *mut c_c
     }
 }
 
-/// Get bytes written so far
+/// Get bytes written so far (submitted to the kernel; see flux_get_bytes_durable)
 #[no_mangle]
 pub extern "C" fn flux_get_bytes_written(operation: *const CFlashOperation) -> u64 {
     if operation.is_null() {
@@ -256,6 +1141,201 @@ pub extern "C" fn flux_get_bytes_written(operation: *const CFlashOperation) -> u
     }
 }
 
+/// Get bytes skipped so far (all-zero ranges discarded instead of written)
+#[no_mangle]
+pub extern "C" fn flux_get_bytes_skipped(operation: *const CFlashOperation) -> u64 {
+    if operation.is_null() {
+        return 0;
+    }
+    
+    unsafe {
+        *(*operation).bytes_skipped.lock().unwrap()
+    }
+}
+
+/// Get bytes known to be on the device rather than just submitted (see
+/// flux_get_bytes_written)
+#[no_mangle]
+pub extern "C" fn flux_get_bytes_durable(operation: *const CFlashOperation) -> u64 {
+    if operation.is_null() {
+        return 0;
+    }
+    
+    unsafe {
+        *(*operation).bytes_durable.lock().unwrap()
+    }
+}
+
+/// Bytes received so far when flashing from an http(s) URL (0 for local
+/// images). Downloading runs a little ahead of writing.
+#[no_mangle]
+pub extern "C" fn flux_get_bytes_downloaded(operation: *const CFlashOperation) -> u64 {
+    if operation.is_null() {
+        return 0;
+    }
+    
+    unsafe {
+        (*operation).bytes_downloaded.load(Ordering::Relaxed)
+    }
+}
+
+/// Device read speed during verification, in bytes per second. Readback
+/// bypasses the page cache, so this is what the media delivers. 0 until the
+/// device is being read.
+#[no_mangle]
+pub extern "C" fn flux_get_verify_speed(operation: *const CFlashOperation) -> u64 {
+    if operation.is_null() {
+        return 0;
+    }
+
+    unsafe {
+        (*operation).verify_stats.read_speed()
+    }
+}
+
+/// Chance that verification would have caught corruption of 1% of the
+/// image or more: below 1 after a fast (sampled) verification, 1 after a
+/// full one
+#[no_mangle]
+pub extern "C" fn flux_get_verify_confidence(operation: *const CFlashOperation) -> c_float {
+    if operation.is_null() {
+        return 0.0;
+    }
+
+    unsafe {
+        let stats = &(*operation).verify_stats;
+        stats.confidence.lock().unwrap().unwrap_or(1.0)
+    }
+}
+
+/// Copy up to `max` of `ranges` to `out` (if not null) and count them
+unsafe fn copy_ranges(ranges: &Mutex<Vec<verify::Mismatch>>, out: *mut CByteRange, max: usize) -> usize {
+    let ranges = ranges.lock().unwrap();
+    if !out.is_null() {
+        for (i, m) in ranges.iter().take(max).enumerate() {
+            *out.add(i) = CByteRange { offset: m.offset, len: m.len };
+        }
+    }
+    ranges.len()
+}
+
+/// Byte ranges of the device that failed verification. Fills up to `max`
+/// entries of `out` (which may be null to just count) and returns how many
+/// ranges there are. Verification stops at the first bad chunk, so this is
+/// usually one range; with repair, these are the ranges that still failed
+/// after every rewrite, most likely bad media.
+#[no_mangle]
+pub extern "C" fn flux_get_mismatches(operation: *const CFlashOperation, out: *mut CByteRange, max: usize) -> usize {
+    if operation.is_null() {
+        return 0;
+    }
+
+    unsafe {
+        let stats = &(*operation).verify_stats;
+        copy_ranges(&stats.mismatches, out, max)
+    }
+}
+
+/// Byte ranges a repair rewrote and read back correctly, filled in like
+/// flux_get_mismatches. Empty unless repair was enabled and needed.
+#[no_mangle]
+pub extern "C" fn flux_get_repaired(operation: *const CFlashOperation, out: *mut CByteRange, max: usize) -> usize {
+    if operation.is_null() {
+        return 0;
+    }
+
+    unsafe {
+        let stats = &(*operation).verify_stats;
+        copy_ranges(&stats.repaired, out, max)
+    }
+}
+
+/// Write parameters the operation is using (chunk size, queue depth,
+/// alignment, and measured throughput when it was calibrated). Returns false
+/// until writing has started.
+#[no_mangle]
+pub extern "C" fn flux_get_io_profile(operation: *const CFlashOperation, profile: *mut CDeviceProfile) -> bool {
+    if operation.is_null() || profile.is_null() {
+        return false;
+    }
+
+    unsafe {
+        match &*(*operation).io_profile.lock().unwrap() {
+            Some(p) => {
+                *profile = profile_to_c(p);
+                true
+            }
+            None => false,
+        }
+    }
+}
+
+/// Where the operation's time has gone so far: busy and idle time of each
+/// stage, ring occupancy, write and verify-read latency percentiles and
+/// throughput. Can be called while it runs and after it has ended.
+#[no_mangle]
+pub extern "C" fn flux_get_metrics(operation: *const CFlashOperation, out: *mut CFlashMetrics) -> bool {
+    if operation.is_null() || out.is_null() {
+        return false;
+    }
+
+    let report = unsafe { (*operation).metrics.report() };
+    unsafe {
+        *out = CFlashMetrics {
+            elapsed_ns: report.elapsed_ns,
+            read: stage_to_c(report.read),
+            write: stage_to_c(report.write),
+            hash: stage_to_c(report.hash),
+            verify: stage_to_c(report.verify),
+            queue_capacity: report.queue_capacity,
+            queue_mean: report.queue_mean,
+            queue_max: report.queue_max,
+            write_latency: latency_to_c(report.write_latency),
+            verify_latency: latency_to_c(report.verify_latency),
+            bytes_written: report.bytes_written,
+            throughput_peak: report.throughput_peak,
+            throughput_last: report.throughput_last,
+        };
+    }
+    true
+}
+
+/// Bytes written to the device in each second since the operation started.
+/// Fills up to `max` entries of `out` (which may be null to just count) and
+/// returns how many seconds there are.
+#[no_mangle]
+pub extern "C" fn flux_get_throughput(operation: *const CFlashOperation, out: *mut u64, max: usize) -> usize {
+    if operation.is_null() {
+        return 0;
+    }
+
+    let throughput = unsafe { (*operation).metrics.throughput() };
+    if !out.is_null() {
+        for (i, &bytes) in throughput.iter().take(max).enumerate() {
+            unsafe { *out.add(i) = bytes };
+        }
+    }
+    throughput.len()
+}
+
+/// Cached write parameters for a device's model, from an earlier
+/// calibration. Returns false if the model hasn't been calibrated.
+#[no_mangle]
+pub extern "C" fn flux_get_device_profile(device_path: *const c_char, profile: *mut CDeviceProfile) -> bool {
+    if device_path.is_null() || profile.is_null() {
+        return false;
+    }
+
+    let device_path = unsafe { CStr::from_ptr(device_path) }.to_string_lossy().into_owned();
+    match device_identity(&device_path).ok().and_then(|id| tune::load_profile(&id)) {
+        Some(p) => {
+            unsafe { *profile = profile_to_c(&p) };
+            true
+        }
+        None => false,
+    }
+}
+
 /// Check if operation is still running
 #[no_mangle]
 pub extern "C" fn flux_is_running(operation: *const CFlashOperation) -> bool {
@@ -284,13 +1364,151 @@ pub extern "C" fn flux_get_error(operation: *const CFlashOperation) -> *mut c_ch
     }
 }
 
-/// Free a flash operation handle
+/// Fill `snapshot` with the operation's progress, counters, state and
+/// status as of the last change, all from the same moment. Doesn't lock or
+/// allocate, so it is cheap enough to call for every device on every UI
+/// refresh. Returns false if either pointer is null.
+#[no_mangle]
+pub extern "C" fn flux_get_snapshot(operation: *const CFlashOperation, snapshot: *mut CFlashSnapshot) -> bool {
+    if operation.is_null() || snapshot.is_null() {
+        return false;
+    }
+
+    unsafe {
+        let (sequence, s) = (*operation).events.read();
+        let out = &mut *snapshot;
+        out.sequence = sequence;
+        out.progress = s.progress;
+        out.verify_progress = s.verify_progress;
+        out.bytes_written = s.bytes_written;
+        out.bytes_skipped = s.bytes_skipped;
+        out.bytes_durable = s.bytes_durable;
+        out.bytes_downloaded = s.bytes_downloaded;
+        out.verify_speed = s.verify_speed;
+        out.is_running = s.running;
+        out.is_paused = s.paused;
+        out.has_error = s.failed;
+        for (dst, &src) in out.status.iter_mut().zip(&s.status) {
+            *dst = src as c_char;
+        }
+    }
+    true
+}
+
+/// Call `callback` whenever the operation's snapshot changes, at most once
+/// per 100 ms, and a last time when it finishes; it is also called once
+/// right away. It runs on a core thread, so it should only wake the UI,
+/// which then reads flux_get_snapshot. Pass null to stop the calls; when
+/// this returns, a callback it replaced is no longer running.
+#[no_mangle]
+pub extern "C" fn flux_set_progress_callback(
+    operation: *const CFlashOperation,
+    callback: Option<ProgressCallback>,
+    user_data: *mut c_void,
+) {
+    if operation.is_null() {
+        return;
+    }
+
+    // The caller keeps user_data valid until the callback is cleared
+    struct UserData(*mut c_void);
+    unsafe impl Send for UserData {}
+
+    let user_data = UserData(user_data);
+    let listener = callback.map(|callback| {
+        Box::new(move |snapshot: &Snapshot| {
+            // Capture the Send wrapper, not the raw pointer inside it
+            let user_data = &user_data;
+            callback(snapshot.progress, user_data.0)
+        }) as Box<dyn Fn(&Snapshot) + Send>
+    });
+    unsafe { (*operation).events.listen(listener) };
+}
+
+/// Stop a running operation. Device I/O already in flight completes and
+/// the operation then ends with the error "Flash cancelled" (or
+/// "Verification cancelled"); an interrupted flash can be resumed with
+/// flux_resume_flash. On a device of a multi-device flash this cancels
+/// every device, since they share one source reader. A flash still waiting
+/// for USB bandwidth ends right away.
+#[no_mangle]
+pub extern "C" fn flux_cancel(operation: *const CFlashOperation) {
+    if !operation.is_null() {
+        unsafe { (*operation).control.cancel() };
+        // It may be waiting for bandwidth
+        Scheduler::global().wake();
+    }
+}
+
+/// Hold a running operation after the device I/O in flight, until
+/// flux_resume or flux_cancel. Like flux_cancel, this applies to every
+/// device of a multi-device flash.
+#[no_mangle]
+pub extern "C" fn flux_pause(operation: *const CFlashOperation) {
+    if !operation.is_null() {
+        unsafe {
+            (*operation).control.pause();
+            for events in &(*operation).group {
+                events.changed();
+            }
+        }
+    }
+}
+
+/// Continue an operation held by flux_pause
+#[no_mangle]
+pub extern "C" fn flux_resume(operation: *const CFlashOperation) {
+    if !operation.is_null() {
+        unsafe {
+            (*operation).control.resume();
+            for events in &(*operation).group {
+                events.changed();
+            }
+        }
+    }
+}
+
+/// Check if an operation is held by flux_pause
+#[no_mangle]
+pub extern "C" fn flux_is_paused(operation: *const CFlashOperation) -> bool {
+    if operation.is_null() {
+        return false;
+    }
+
+    unsafe { (*operation).control.is_paused() }
+}
+
+/// Cap the device bandwidth of a running operation, writes and readback
+/// alike, at `bytes_per_sec` (0 removes the cap). Takes effect from the next
+/// chunk. A multi-device flash shares one cap among its devices.
+#[no_mangle]
+pub extern "C" fn flux_set_rate_limit(operation: *const CFlashOperation, bytes_per_sec: u64) {
+    if !operation.is_null() {
+        unsafe { (*operation).control.set_limit(bytes_per_sec) };
+    }
+}
+
+/// Current bandwidth cap of an operation in bytes per second, 0 for none
+#[no_mangle]
+pub extern "C" fn flux_get_rate_limit(operation: *const CFlashOperation) -> u64 {
+    if operation.is_null() {
+        return 0;
+    }
+
+    unsafe { (*operation).control.limit() }
+}
+
+/// Free a flash operation handle. Its progress callback, if any, is
+/// cleared first, and a flash still running is cancelled.
 #[no_mangle]
 pub extern "C" fn flux_free_operation(operation: *mut CFlashOperation) {
     if !operation.is_null() {
         unsafe {
+            (*operation).control.cancel();
+            (*operation).events.listen(None);
             let _ = Box::from_raw(operation);
         }
+        Scheduler::global().wake();
     }
 }
 
@@ -304,6 +1522,31 @@ pub extern "C" fn flux_free_string(s: *mut c_char) {
     }
 }
 
+/// Name of a verification hash and the implementation this CPU will use,
+/// e.g. "SHA-256 (SHA-NI)". Null for an unknown algorithm (caller must free
+/// with flux_free_string).
+#[no_mangle]
+pub extern "C" fn flux_hash_name(algorithm: u32) -> *mut c_char {
+    match hash_from_c(algorithm) {
+        Some(algorithm) => {
+            let name = format!("{} ({})", algorithm.name(), algorithm.implementation());
+            CString::new(name).unwrap().into_raw()
+        }
+        None => ptr::null_mut(),
+    }
+}
+
+/// Single-core throughput of a verification hash on this host, in bytes
+/// per second (0 for an unknown algorithm). Hashes about `bytes` bytes, so
+/// this blocks for a moment.
+#[no_mangle]
+pub extern "C" fn flux_benchmark_hash(algorithm: u32, bytes: u64) -> u64 {
+    match hash_from_c(algorithm) {
+        Some(algorithm) => hash::benchmark(algorithm, bytes),
+        None => 0,
+    }
+}
+
 /// Format a byte count into a human-readable string (caller must free)
 #[no_mangle]
 pub extern "C" fn flux_format_size(bytes: u64) -> *mut c_char {